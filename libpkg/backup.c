@@ -38,11 +38,11 @@ pkgdb_dump(struct pkgdb *db, char *dest)
 	struct pkg *pkg = NULL;
 	struct sbuf *path = NULL;
 	struct packing *pack = NULL;
-	char *m = NULL;
 	int ret = EPKG_OK;
 	int query_flags = PKG_LOAD_DEPS | PKG_LOAD_FILES | PKG_LOAD_CATEGORIES |
 	    PKG_LOAD_DIRS | PKG_LOAD_SCRIPTS | PKG_LOAD_OPTIONS |
-	    PKG_LOAD_MTREE | PKG_LOAD_LICENSES | PKG_LOAD_SHLIBS;
+	    PKG_LOAD_MTREE | PKG_LOAD_LICENSES | PKG_LOAD_SHLIBS |
+	    PKG_LOAD_SHLIBS_PROVIDED;
 
 	packing_init(&pack, dest ? dest : "./pkgdump", TXZ);
 
@@ -56,12 +56,10 @@ pkgdb_dump(struct pkgdb *db, char *dest)
 		const char *name, *version, *mtree;
 
 		pkg_get(pkg, PKG_NAME, &name, PKG_VERSION, &version, PKG_MTREE, &mtree);
-		pkg_emit_manifest(pkg, &m);
 		sbuf_clear(path);
 		sbuf_printf(path, "%s-%s.yaml", name, version);
 		sbuf_finish(path);
-		packing_append_buffer(pack, m, sbuf_get(path), strlen(m));
-		free(m);
+		pkg_emit_manifest_packing(pkg, pack, sbuf_get(path), NULL);
 		if (mtree != NULL) {
 			sbuf_clear(path);
 			sbuf_printf(path, "%s-%s.mtree", name, version);
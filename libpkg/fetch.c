@@ -25,8 +25,10 @@
  */
 
 #include <sys/param.h>
+#include <sys/stat.h>
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
@@ -34,13 +36,89 @@
 
 #include "pkg.h"
 #include "private/event.h"
+#include "private/pkg.h"
+
+/*
+ * libfetch keeps its settings and its last error in globals, so its calls
+ * are serialized between the download threads.  Once a transfer is open,
+ * reading from it only uses its own connection, and the transfers run in
+ * parallel.
+ */
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+fetch_close(FILE *remote)
+{
+	pthread_mutex_lock(&fetch_lock);
+	fclose(remote);
+	pthread_mutex_unlock(&fetch_lock);
+}
+
+static void
+fetch_progress_add(struct fetch_progress *progress, off_t r)
+{
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&progress->lock);
+	progress->done += r;
+	/*
+	 * Only call the callback every second, the end of the transfers is
+	 * reported by the caller once all of them are done.
+	 */
+	if (now > progress->last) {
+		pkg_emit_fetching(progress->label, progress->total,
+		    MIN(progress->done, progress->total - 1),
+		    now - progress->begin);
+		progress->last = now;
+	}
+	pthread_mutex_unlock(&progress->lock);
+}
 
 int
 pkg_fetch_file(const char *url, const char *dest, time_t t)
+{
+	return (pkg_fetch_file2(url, dest, t, 0, NULL, NULL));
+}
+
+/* Restart the digest over the bytes of dest which are kept */
+static int
+fetch_digest_reset(struct pkg_digest *digest, const char *dest, off_t off)
+{
+	bool head_only = digest->head_only;
+
+	pkg_digest_free(digest);
+	pkg_digest_init(digest);
+	digest->head_only = head_only;
+
+	if (off == 0)
+		return (EPKG_OK);
+
+	return (pkg_digest_file(digest, dest, off));
+}
+
+/*
+ * With PKG_FETCH_RESUME, dest is opened without truncation and the download
+ * starts at its current size using a range request.  Dropped connections
+ * are then retried from the last byte written, and dest is kept on failure
+ * so a later call can pick up where this one stopped.
+ *
+ * A file missing on the server is not retried, EPKG_ENOENT is returned.
+ * With PKG_FETCH_MISSING the caller expects it may be and no error is
+ * emitted.
+ *
+ * If digest is not NULL, it is fed with the whole content of dest as the
+ * bytes arrive, the caller initializes it and releases it.  With
+ * digest->head_only the transfer stops as soon as the +MANIFEST is known.
+ */
+int
+pkg_fetch_file2(const char *url, const char *dest, time_t t, unsigned flags,
+    struct fetch_progress *progress, struct pkg_digest *digest)
 {
 	int fd = -1;
 	FILE *remote = NULL;
+	struct url *u = NULL;
 	struct url_stat st;
+	struct stat sb;
 	off_t done = 0;
 	off_t r;
 	int retry = 3;
@@ -49,57 +127,150 @@ pkg_fetch_file(const char *url, const char *dest, time_t t)
 	time_t last = 0;
 	char buf[10240];
 	int retcode = EPKG_OK;
+	bool resume = (flags & PKG_FETCH_RESUME) != 0;
+	bool missing = false;
 
-	fetchTimeout = 30;
-
-	if ((fd = open(dest, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL, 0600)) == -1) {
+	if (resume)
+		fd = open(dest, O_WRONLY|O_CREAT, 0600);
+	else
+		fd = open(dest, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL, 0600);
+	if (fd == -1) {
 		pkg_emit_errno("open", dest);
 		return(EPKG_FATAL);
 	}
 
-	while (remote == NULL) {
-		remote = fetchXGetURL(url, &st, "");
+	if (resume) {
+		if (fstat(fd, &sb) == -1) {
+			pkg_emit_errno("fstat", dest);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		done = sb.st_size;
+		if (digest != NULL &&
+		    fetch_digest_reset(digest, dest, done) != EPKG_OK) {
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+
+	pthread_mutex_lock(&fetch_lock);
+	fetchTimeout = 30;
+	if ((u = fetchParseURL(url)) == NULL)
+		pkg_emit_error("%s: %s", url, fetchLastErrString);
+	pthread_mutex_unlock(&fetch_lock);
+	if (u == NULL) {
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	begin_dl = time(NULL);
+	for (;;) {
+		u->offset = done;
+		pthread_mutex_lock(&fetch_lock);
+		remote = fetchXGet(u, &st, "");
+		if (remote == NULL && fetchLastErrCode == FETCH_UNAVAIL) {
+			missing = true;
+			retry = 0;
+		} else if (remote == NULL) {
+			retry--;
+		}
+		if (remote == NULL && retry == 0 &&
+		    (!missing || (flags & PKG_FETCH_MISSING) == 0))
+			pkg_emit_error("%s: %s", url, fetchLastErrString);
+		pthread_mutex_unlock(&fetch_lock);
 		if (remote == NULL) {
-			--retry;
 			if (retry == 0) {
-				pkg_emit_error("%s: %s", url, fetchLastErrString);
-				retcode = EPKG_FATAL;
+				retcode = missing ? EPKG_ENOENT : EPKG_FATAL;
 				goto cleanup;
 			}
 			sleep(1);
+			continue;
 		}
-	}
-	if (t != 0) {
-		if (st.mtime <= t) {
-			retcode = EPKG_UPTODATE;
-			goto cleanup;
-		}
-	}
 
-	begin_dl = time(NULL);
-	while (done < st.size) {
-		if ((r = fread(buf, 1, sizeof(buf), remote)) < 1)
-			break;
+		if (t != 0) {
+			if (st.mtime <= t) {
+				retcode = EPKG_UPTODATE;
+				goto cleanup;
+			}
+		}
 
-		if (write(fd, buf, r) != r) {
-			pkg_emit_errno("write", dest);
+		/*
+		 * The server may ignore the range request and send the whole
+		 * file, libfetch reports the offset it actually starts at.
+		 */
+		if (u->offset != done) {
+			if (ftruncate(fd, u->offset) == -1) {
+				pkg_emit_errno("ftruncate", dest);
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+			done = u->offset;
+			if (digest != NULL &&
+			    fetch_digest_reset(digest, dest, done) != EPKG_OK) {
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+		}
+		if (lseek(fd, done, SEEK_SET) == -1) {
+			pkg_emit_errno("lseek", dest);
 			retcode = EPKG_FATAL;
 			goto cleanup;
 		}
 
-		done += r;
-		now = time(NULL);
-		/* Only call the callback every second */
-		if (now > last || done == st.size) {
-			pkg_emit_fetching(url, st.size, done, (now - begin_dl));
-			last = now;
+		while (done < st.size) {
+			if ((r = fread(buf, 1, sizeof(buf), remote)) < 1)
+				break;
+
+			if (write(fd, buf, r) != r) {
+				pkg_emit_errno("write", dest);
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+
+			if (digest != NULL) {
+				pkg_digest_update(digest, buf, r);
+				/* the rest is fetched by a later call */
+				if (digest->head_only && digest->done) {
+					if (progress != NULL)
+						fetch_progress_add(progress, r);
+					goto cleanup;
+				}
+			}
+
+			done += r;
+			if (progress != NULL) {
+				fetch_progress_add(progress, r);
+				continue;
+			}
+
+			now = time(NULL);
+			/* Only call the callback every second */
+			if (now > last || done == st.size) {
+				pkg_emit_fetching(url, st.size, done,
+				    (now - begin_dl));
+				last = now;
+			}
 		}
-	}
 
-	if (ferror(remote)) {
-		pkg_emit_error("%s: %s", url, fetchLastErrString);
-		retcode = EPKG_FATAL;
-		goto cleanup;
+		if (!ferror(remote) && (done >= st.size || st.size == -1))
+			break;
+
+		/*
+		 * The connection dropped, reconnect from the current offset.
+		 * The error is the one of this transfer, not the last one
+		 * libfetch has seen in any thread.
+		 */
+		if (!resume || --retry == 0) {
+			if (ferror(remote))
+				pkg_emit_errno("fread", url);
+			else
+				pkg_emit_error("%s: connection closed", url);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		fetch_close(remote);
+		remote = NULL;
+		sleep(1);
 	}
 
 	cleanup:
@@ -108,10 +279,13 @@ pkg_fetch_file(const char *url, const char *dest, time_t t)
 		close(fd);
 
 	if (remote != NULL)
-		fclose(remote);
+		fetch_close(remote);
+
+	if (u != NULL)
+		fetchFreeURL(u);
 
-	/* Remove local file if fetch failed */
-	if (retcode != EPKG_OK)
+	/* Remove local file if fetch failed, partial downloads are kept */
+	if (retcode == EPKG_UPTODATE || (retcode != EPKG_OK && !resume))
 		unlink(dest);
 
 	return (retcode);
@@ -34,6 +34,7 @@
 #include <fcntl.h>
 #include <fts.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -94,10 +95,59 @@ packing_init(struct packing **pack, const char *path, pkg_formats format)
 	return (EPKG_OK);
 }
 
+/*
+ * Write the archive to fd, which is left open by packing_finish().
+ */
+int
+packing_init_fd(struct packing **pack, int fd, pkg_formats format)
+{
+	assert(pack != NULL);
+
+	if ((*pack = calloc(1, sizeof(struct packing))) == NULL) {
+		pkg_emit_errno("malloc", "packing");
+		return (EPKG_FATAL);
+	}
+
+	(*pack)->aread = archive_read_disk_new();
+	archive_read_disk_set_standard_lookup((*pack)->aread);
+	archive_read_disk_set_symlink_physical((*pack)->aread);
+
+	(*pack)->awrite = archive_write_new();
+	archive_write_set_format_pax_restricted((*pack)->awrite);
+	if (packing_set_format((*pack)->awrite, format) == NULL ||
+	    archive_write_open_fd((*pack)->awrite, fd) != ARCHIVE_OK) {
+		pkg_emit_error("archive_write_open_fd(): %s",
+		    archive_error_string((*pack)->awrite));
+		archive_read_finish((*pack)->aread);
+		archive_write_finish((*pack)->awrite);
+		free(*pack);
+		*pack = NULL;
+		return (EPKG_FATAL);
+	}
+
+	(*pack)->resolver = archive_entry_linkresolver_new();
+	archive_entry_linkresolver_set_strategy((*pack)->resolver, ARCHIVE_FORMAT_TAR_PAX_RESTRICTED);
+	return (EPKG_OK);
+}
+
 int
 packing_append_buffer(struct packing *pack, const char *buffer, const char *path, int size)
+{
+	if (packing_append_entry(pack, path, size) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	return (packing_append_data(pack, buffer, size));
+}
+
+/*
+ * Start a regular file entry of size bytes, its content is then given by
+ * packing_append_data().
+ */
+int
+packing_append_entry(struct packing *pack, const char *path, int64_t size)
 {
 	struct archive_entry *entry;
+	int ret = EPKG_OK;
 
 	entry = archive_entry_new();
 	archive_entry_clear(entry);
@@ -107,11 +157,26 @@ packing_append_buffer(struct packing *pack, const char *buffer, const char *path
 	archive_entry_set_uname(entry, "root");
 	archive_entry_set_pathname(entry, path);
 	archive_entry_set_size(entry, size);
-	archive_write_header(pack->awrite, entry);
-	archive_write_data(pack->awrite, buffer, size);
+	if (archive_write_header(pack->awrite, entry) != ARCHIVE_OK) {
+		pkg_emit_error("archive_write_header(%s): %s", path,
+		    archive_error_string(pack->awrite));
+		ret = EPKG_FATAL;
+	}
 
 	archive_entry_free(entry);
 
+	return (ret);
+}
+
+int
+packing_append_data(struct packing *pack, const void *buf, size_t len)
+{
+	if (archive_write_data(pack->awrite, buf, len) != (ssize_t)len) {
+		pkg_emit_error("archive_write_data(): %s",
+		    archive_error_string(pack->awrite));
+		return (EPKG_FATAL);
+	}
+
 	return (EPKG_OK);
 }
 
@@ -124,12 +189,28 @@ packing_append_file(struct packing *pack, const char *filepath, const char *newp
 int
 packing_append_file_attr(struct packing *pack, const char *filepath, const char *newpath,
 		const char *uname, const char *gname, mode_t perm)
+{
+	return (packing_append_file_sum(pack, filepath, newpath, uname, gname,
+	    perm, NULL));
+}
+
+/*
+ * If sum is not NULL and filepath is a regular file, its SHA256 is computed
+ * from the bytes written to the archive, so the file is read only once.
+ */
+int
+packing_append_file_sum(struct packing *pack, const char *filepath,
+    const char *newpath, const char *uname, const char *gname, mode_t perm,
+    char sum[SHA256_DIGEST_LENGTH * 2 + 1])
 {
 	int fd;
 	int len;
 	char buf[BUFSIZ];
 	int retcode = EPKG_OK;
 	int ret;
+	bool hashed = false;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	SHA256_CTX sha256;
 	struct stat st;
 	struct archive_entry *entry, *sparse_entry;
 	/* ugly hack for python and emacs */
@@ -202,17 +283,95 @@ packing_append_file_attr(struct packing *pack, const char *filepath, const char
 			goto cleanup;
 		}
 
-		while ((len = read(fd, buf, sizeof(buf))) > 0)
+		if (sum != NULL)
+			SHA256_Init(&sha256);
+		while ((len = read(fd, buf, sizeof(buf))) > 0) {
 			archive_write_data(pack->awrite, buf, len);
+			if (sum != NULL)
+				SHA256_Update(&sha256, buf, len);
+		}
+		if (len == -1) {
+			pkg_emit_errno("read", filepath);
+			retcode = EPKG_FATAL;
+		} else if (sum != NULL) {
+			SHA256_Final(hash, &sha256);
+			sha256_hash(hash, sum);
+			hashed = true;
+		}
 
 		close(fd);
 	}
 
+	/* no data written for a hardlink to a file already archived */
+	if (sum != NULL && !hashed && retcode == EPKG_OK && S_ISREG(st.st_mode))
+		retcode = sha256_file(filepath, sum);
+
 	cleanup:
 	archive_entry_free(entry);
 	return (retcode);
 }
 
+/*
+ * Copy the entries of the archive in fd, as written by another packing,
+ * after the ones already in pack.  The archive is read from the start of
+ * fd, which is left open.
+ */
+int
+packing_append_archive(struct packing *pack, int fd)
+{
+	struct archive *a;
+	struct archive_entry *ae;
+	const void *buf;
+	size_t size;
+	off_t offset;
+	int ret;
+	int retcode = EPKG_FATAL;
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		pkg_emit_errno("lseek", "packing");
+		return (EPKG_FATAL);
+	}
+
+	a = archive_read_new();
+	archive_read_support_compression_all(a);
+	archive_read_support_format_tar(a);
+
+	if (archive_read_open_fd(a, fd, 4096) != ARCHIVE_OK) {
+		pkg_emit_error("archive_read_open_fd(): %s",
+		    archive_error_string(a));
+		goto cleanup;
+	}
+
+	while ((ret = archive_read_next_header(a, &ae)) == ARCHIVE_OK) {
+		if (archive_write_header(pack->awrite, ae) != ARCHIVE_OK) {
+			pkg_emit_error("archive_write_header(%s): %s",
+			    archive_entry_pathname(ae),
+			    archive_error_string(pack->awrite));
+			goto cleanup;
+		}
+		while ((ret = archive_read_data_block(a, &buf, &size,
+		    &offset)) == ARCHIVE_OK) {
+			if (packing_append_data(pack, buf, size) != EPKG_OK)
+				goto cleanup;
+		}
+		if (ret != ARCHIVE_EOF)
+			break;
+	}
+
+	if (ret != ARCHIVE_EOF) {
+		pkg_emit_error("archive_read_next_header(): %s",
+		    archive_error_string(a));
+		goto cleanup;
+	}
+
+	retcode = EPKG_OK;
+
+	cleanup:
+	archive_read_finish(a);
+
+	return (retcode);
+}
+
 int
 packing_append_tree(struct packing *pack, const char *treepath, const char *newroot)
 {
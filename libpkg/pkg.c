@@ -79,6 +79,7 @@ pkg_new(struct pkg **pkg, pkg_t type)
 	STAILQ_INIT(&(*pkg)->users);
 	STAILQ_INIT(&(*pkg)->groups);
 	STAILQ_INIT(&(*pkg)->shlibs);
+	STAILQ_INIT(&(*pkg)->shlibs_provided);
 
 	(*pkg)->automatic = false;
 	(*pkg)->type = type;
@@ -116,6 +117,7 @@ pkg_reset(struct pkg *pkg, pkg_t type)
 	pkg_list_free(pkg, PKG_USERS);
 	pkg_list_free(pkg, PKG_GROUPS);
 	pkg_list_free(pkg, PKG_SHLIBS);
+	pkg_list_free(pkg, PKG_SHLIBS_PROVIDED);
 
 	pkg->rowid = 0;
 	pkg->type = type;
@@ -141,6 +143,7 @@ pkg_free(struct pkg *pkg)
 	pkg_list_free(pkg, PKG_USERS);
 	pkg_list_free(pkg, PKG_GROUPS);
 	pkg_list_free(pkg, PKG_SHLIBS);
+	pkg_list_free(pkg, PKG_SHLIBS_PROVIDED);
 
 	free(pkg);
 }
@@ -441,6 +444,14 @@ pkg_shlibs(struct pkg *pkg, struct pkg_shlib **s)
 	PKG_LIST_NEXT(&pkg->shlibs, *s);
 }
 
+int
+pkg_shlibs_provided(struct pkg *pkg, struct pkg_shlib **s)
+{
+	assert(pkg != NULL);
+
+	PKG_LIST_NEXT(&pkg->shlibs_provided, *s);
+}
+
 int
 pkg_addlicense(struct pkg *pkg, const char *name)
 {
@@ -848,6 +859,29 @@ pkg_addshlib(struct pkg *pkg, const char *name)
 	return (EPKG_OK);
 }
 
+int
+pkg_addshlib_provided(struct pkg *pkg, const char *name)
+{
+	struct pkg_shlib *s = NULL;
+
+	assert(pkg != NULL);
+	assert(name != NULL && name[0] != '\0');
+
+	while (pkg_shlibs_provided(pkg, &s) == EPKG_OK) {
+		/* silently ignore duplicates in case of shlibs */
+		if (strcmp(name, pkg_shlib_name(s)) == 0)
+			return (EPKG_OK);
+	}
+
+	pkg_shlib_new(&s);
+
+	sbuf_set(&s->name, name);
+
+	STAILQ_INSERT_TAIL(&pkg->shlibs_provided, s, next);
+
+	return (EPKG_OK);
+}
+
 int
 pkg_list_is_empty(struct pkg *pkg, pkg_list list) {
 	switch (list) {
@@ -873,6 +907,8 @@ pkg_list_is_empty(struct pkg *pkg, pkg_list list) {
 			return (STAILQ_EMPTY(&pkg->scripts));
 		case PKG_SHLIBS:
 			return (STAILQ_EMPTY(&pkg->shlibs));
+		case PKG_SHLIBS_PROVIDED:
+			return (STAILQ_EMPTY(&pkg->shlibs_provided));
 	}
 	
 	return (0);
@@ -936,17 +972,21 @@ pkg_list_free(struct pkg *pkg, pkg_list list)  {
 			LIST_FREE(&pkg->shlibs, sl, pkg_shlib_free);
 			pkg->flags &= ~PKG_LOAD_SHLIBS;
 			break;
+		case PKG_SHLIBS_PROVIDED:
+			LIST_FREE(&pkg->shlibs_provided, sl, pkg_shlib_free);
+			pkg->flags &= ~PKG_LOAD_SHLIBS_PROVIDED;
+			break;
 	}
 }
 
 int
-pkg_open(struct pkg **pkg_p, const char *path, struct sbuf *mbuf)
+pkg_open(struct pkg **pkg_p, const char *path, struct sbuf *mbuf, int flags)
 {
 	struct archive *a;
 	struct archive_entry *ae;
 	int ret;
 
-	ret = pkg_open2(pkg_p, &a, &ae, path, mbuf);
+	ret = pkg_open2(pkg_p, &a, &ae, path, mbuf, flags);
 
 	if (ret != EPKG_OK && ret != EPKG_END)
 		return (EPKG_FATAL);
@@ -957,7 +997,7 @@ pkg_open(struct pkg **pkg_p, const char *path, struct sbuf *mbuf)
 }
 
 int
-pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, const char *path, struct sbuf *mbuf)
+pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, const char *path, struct sbuf *mbuf, int flags)
 {
 	struct pkg *pkg;
 	pkg_error_t retcode = EPKG_OK;
@@ -1005,6 +1045,25 @@ pkg_open2(struct pkg **pkg_p, struct archive **a, struct archive_entry **ae, con
 		if (fpath[0] != '+')
 			break;
 
+		/*
+		 * It comes first, the rest of the archive is not even
+		 * decompressed.  Packages without one are read in full.
+		 */
+		if ((flags & PKG_OPEN_MANIFEST_COMPACT) &&
+		    strcmp(fpath, "+COMPACT_MANIFEST") == 0) {
+			while ((size = archive_read_data(*a, buf, sizeof(buf))) > 0)
+				sbuf_bcat(manifest, buf, size);
+			sbuf_finish(manifest);
+
+			if (pkg_parse_compact_manifest(pkg, sbuf_data(manifest),
+			    sbuf_len(manifest), NULL) != EPKG_OK) {
+				pkg_emit_error("%s is not a valid package: "
+				    "invalid +COMPACT_MANIFEST found", path);
+				retcode = EPKG_FATAL;
+			}
+			goto cleanup;
+		}
+
 		if (strcmp(fpath, "+MANIFEST") == 0) {
 			size = archive_entry_size(*ae);
 			if (size <=0) {
@@ -217,7 +217,8 @@ typedef enum {
 	PKG_USERS,
 	PKG_GROUPS,
 	PKG_SCRIPTS,
-	PKG_SHLIBS
+	PKG_SHLIBS,
+	PKG_SHLIBS_PROVIDED
 } pkg_list;
 
 /**
@@ -258,6 +259,13 @@ typedef enum _pkg_config_key {
 	PKG_CONFIG_ABI = 13,
 	PKG_CONFIG_DEVELOPER_MODE = 14,
 	PKG_CONFIG_PORTAUDIT_SITE = 15,
+	PKG_CONFIG_FETCH_CONCURRENCY = 16,
+	PKG_CONFIG_PIPELINE_INSTALL = 17,
+	PKG_CONFIG_WAL_JOURNAL = 18,
+	PKG_CONFIG_INSTALL_CONCURRENCY = 19,
+	PKG_CONFIG_SKIP_UNCHANGED = 20,
+	PKG_CONFIG_ANALYSE_CONCURRENCY = 21,
+	PKG_CONFIG_REPO_DELTAS = 22,
 } pkg_config_key;
 
 typedef enum {
@@ -312,6 +320,10 @@ typedef enum {
 	 * unkown keyword
 	 */
 	EPKG_UNKNOWN,
+	/**
+	 * the remote file does not exist
+	 */
+	EPKG_ENOENT,
 } pkg_error_t;
 
 /**
@@ -341,8 +353,13 @@ int pkg_is_valid(struct pkg *);
  * @param p A pointer to pkg allocated by pkg_new(), or if it points to a
  * NULL pointer, the function allocate a new pkg using pkg_new().
  * @param path The path to the local package archive.
+ * @param flags PKG_OPEN_MANIFEST_COMPACT to only read the metadata from the
+ * +COMPACT_MANIFEST when the package has one, without the files,
+ * directories and scripts.
  */
-int pkg_open(struct pkg **p, const char *path, struct sbuf *mbuf);
+int pkg_open(struct pkg **p, const char *path, struct sbuf *mbuf, int flags);
+
+#define PKG_OPEN_MANIFEST_COMPACT (1 << 0)
 
 /**
  * @return the type of the package.
@@ -437,6 +454,14 @@ int pkg_options(struct pkg *, struct pkg_option **option);
  */
 int pkg_shlibs(struct pkg *pkg, struct pkg_shlib **shlib);
 
+/**
+ * Iterates over the shared libraries provided by the package, the DT_SONAME
+ * of its shared objects.
+ * @param shlib must be set to NULL for the first call.
+ * @return An error code
+ */
+int pkg_shlibs_provided(struct pkg *pkg, struct pkg_shlib **shlib);
+
 /**
  * Iterate over all of the files within the package pkg, ensuring the
  * dependency list contains all applicable packages providing the
@@ -591,6 +616,12 @@ int pkg_addoption(struct pkg *pkg, const char *name, const char *value);
  */
 int pkg_addshlib(struct pkg *pkg, const char *name);
 
+/**
+ * Add a shared library provided by the package
+ * @return An error code.
+ */
+int pkg_addshlib_provided(struct pkg *pkg, const char *name);
+
 /**
  * Parse a manifest and set the attributes of pkg accordingly.
  * @param buf An NULL-terminated buffer containing the manifest data.
@@ -647,11 +678,15 @@ int pkg_is_installed(struct pkgdb *db, const char *origin);
 /**
  * Create a repository database.
  * @param path The path where the repository live.
+ * @param nthreads The number of threads used to hash and parse the
+ * packages, 1 or less means everything is done by the calling thread.
+ * @param verify Hash every package again, even those which do not look
+ * modified since the previous run.
  * @param callback A function which is called at every step of the process.
  * @param data A pointer which is passed to the callback.
  * @param sum An 65 long char array to receive the sha256 sum
  */
-int pkg_create_repo(char *path, void (*callback)(struct pkg *, void *), void *);
+int pkg_create_repo(char *path, int nthreads, bool verify, void (*callback)(struct pkg *, void *), void *);
 int pkg_finish_repo(char *path, pem_password_cb *cb, char *rsa_key_path);
 
 /**
@@ -733,6 +768,7 @@ struct pkgdb_it * pkgdb_query_shlib(struct pkgdb *db, const char *shlib);
 #define PKG_LOAD_USERS (1<<9)
 #define PKG_LOAD_GROUPS (1<<10)
 #define PKG_LOAD_SHLIBS (1<<11)
+#define PKG_LOAD_SHLIBS_PROVIDED (1<<12)
 /* Make sure new PKG_LOAD don't conflict with PKG_CONTAINS_* */
 
 /**
@@ -794,7 +830,8 @@ int pkg_jobs_add(struct pkg_jobs *jobs, struct pkg *pkg);
 int pkg_jobs_is_empty(struct pkg_jobs *jobs);
 
 /**
- * Iterates over the packages in the jobs queue.
+ * Iterates over the packages in the jobs queue, in the order they will be
+ * applied: an install comes after the installs of its dependencies.
  * @param pkg Must be set to NULL for the first call.
  * @return An error code.
  */
@@ -839,6 +876,7 @@ int64_t pkgdb_stats(struct pkgdb *db, pkg_stats_t type);
  */
 int pkg_config_string(pkg_config_key key, const char **value);
 int pkg_config_bool(pkg_config_key key, bool *value);
+int pkg_config_int64(pkg_config_key key, int64_t *value);
 int pkg_config_list(pkg_config_key key, struct pkg_config_kv **kv);
 const char *pkg_config_kv_get(struct pkg_config_kv *kv, pkg_config_kv_t type);
 
@@ -876,6 +914,7 @@ typedef enum {
 	PKG_EVENT_INTEGRITYCHECK_BEGIN,
 	PKG_EVENT_INTEGRITYCHECK_FINISHED,
 	PKG_EVENT_NEWPKGVERSION,
+	PKG_EVENT_DEBUG,
 	/* errors */
 	PKG_EVENT_ERROR,
 	PKG_EVENT_ERRNO,
@@ -900,6 +939,10 @@ struct pkg_event {
 		struct {
 			char *msg;
 		} e_pkg_error;
+		struct {
+			int level;
+			char *msg;
+		} e_debug;
 		struct {
 			const char *url;
 			off_t total;
@@ -949,6 +992,8 @@ struct pkg_event {
 /**
  * Event callback mechanism.  Events will be reported using this callback,
  * providing an event identifier and up to two event-specific pointers.
+ * The callback is not run by two threads at once, it may call libpkg
+ * functions emitting events.
  */
 typedef int(*pkg_event_cb)(void *, struct pkg_event *);
 
@@ -25,6 +25,8 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/utsname.h>
 
 #include <archive.h>
@@ -36,6 +38,10 @@
 #include <string.h>
 #include <errno.h>
 #include <fnmatch.h>
+#include <inttypes.h>
+#include <grp.h>
+#include <pwd.h>
+#include <unistd.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -58,15 +64,94 @@ dep_installed(struct pkg_dep *dep, struct pkgdb *db) {
 	return (ret);
 }
 
+/*
+ * An unchanged file still on disk with the expected size and checksum is
+ * not written again, only its owner, mode and times are set like
+ * archive_read_extract() would.  Anything unexpected, a file modified
+ * locally included, falls back to the extraction.
+ */
+static bool
+do_extract_skip(struct pkg_add_job *job, struct archive_entry *ae)
+{
+	const char *path = archive_entry_pathname(ae);
+	const char *name;
+	struct passwd pw, *pwp;
+	struct group gr, *grp;
+	struct strset_entry *e;
+	struct timeval tv[2];
+	struct stat st;
+	char sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char buf[BUFSIZ];
+	uid_t uid = archive_entry_uid(ae);
+	gid_t gid = archive_entry_gid(ae);
+
+	if ((e = strset_get(&job->unchanged, path)) == NULL)
+		return (false);
+
+	if (archive_entry_filetype(ae) != AE_IFREG ||
+	    archive_entry_hardlink(ae) != NULL)
+		return (false);
+
+	if (lstat(path, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    st.st_size != archive_entry_size(ae))
+		return (false);
+
+	if (sha256_file(path, sum) != EPKG_OK ||
+	    strcmp(pkg_file_get(e->data, PKG_FILE_SUM), sum) != 0)
+		return (false);
+
+	/* the extraction runs in several threads */
+	if ((name = archive_entry_uname(ae)) != NULL &&
+	    getpwnam_r(name, &pw, buf, sizeof(buf), &pwp) == 0 && pwp != NULL)
+		uid = pwp->pw_uid;
+	if ((name = archive_entry_gname(ae)) != NULL &&
+	    getgrnam_r(name, &gr, buf, sizeof(buf), &grp) == 0 && grp != NULL)
+		gid = grp->gr_gid;
+
+	tv[0].tv_sec = archive_entry_atime(ae);
+	tv[0].tv_usec = archive_entry_atime_nsec(ae) / 1000;
+	tv[1].tv_sec = archive_entry_mtime(ae);
+	tv[1].tv_usec = archive_entry_mtime_nsec(ae) / 1000;
+
+	if (lchown(path, uid, gid) == -1 ||
+	    chmod(path, archive_entry_perm(ae)) == -1 ||
+	    utimes(path, tv) == -1)
+		return (false);
+
+	job->nskipped++;
+	job->skipped += st.st_size;
+
+	return (true);
+}
+
+/*
+ * The extraction may run in a worker thread, its error is kept in the job
+ * and reported by pkg_add_end() from the thread of the caller.
+ */
+static void
+extract_error(struct pkg_add_job *job, const char *func)
+{
+	if (job->error == NULL)
+		asprintf(&job->error, "%s: %s", func,
+		    archive_error_string(job->a));
+}
+
 static int
-do_extract(struct archive *a, struct archive_entry *ae)
+do_extract(struct pkg_add_job *job)
 {
+	struct archive *a = job->a;
+	struct archive_entry *ae = job->ae;
 	int retcode = EPKG_OK;
 	int ret = 0;
 	char path[MAXPATHLEN + 1];
 	struct stat st;
 
 	do {
+		if (job->unchanged.len > 0 && do_extract_skip(job, ae)) {
+			archive_read_data_skip(a);
+			continue;
+		}
+
 		if (archive_read_extract(a, ae, EXTRACT_ARCHIVE_FLAGS) != ARCHIVE_OK) {
 			/*
 			 * show error except when the failure is during
@@ -77,8 +162,7 @@ do_extract(struct archive *a, struct archive_entry *ae)
 			 */
 			if (!(archive_entry_filetype(ae) == AE_IFDIR &&
 			    is_dir(archive_entry_pathname(ae)))) {
-				pkg_emit_error("archive_read_extract(): %s",
-				    archive_error_string(a));
+				extract_error(job, "archive_read_extract()");
 				retcode = EPKG_FATAL;
 				break;
 			}
@@ -96,8 +180,7 @@ do_extract(struct archive *a, struct archive_entry *ae)
 		    && lstat(path, &st) == ENOENT) {
 			archive_entry_set_pathname(ae, path);
 			if (archive_read_extract(a, ae, EXTRACT_ARCHIVE_FLAGS) != ARCHIVE_OK) {
-				pkg_emit_error("archive_read_extract(): %s",
-							   archive_error_string(a));
+				extract_error(job, "archive_read_extract()");
 				retcode = EPKG_FATAL;
 				break;
 			}
@@ -105,26 +188,27 @@ do_extract(struct archive *a, struct archive_entry *ae)
 	} while ((ret = archive_read_next_header(a, &ae)) == ARCHIVE_OK);
 
 	if (ret != ARCHIVE_EOF) {
-		pkg_emit_error("archive_read_next_header(): %s",
-					   archive_error_string(a));
+		extract_error(job, "archive_read_next_header()");
 		retcode = EPKG_FATAL;
 	}
 
 	return (retcode);
 }
 
+/*
+ * pkg_add() in three steps, so that the extraction of packages not
+ * depending on each other can run in parallel: pkg_add_begin() and
+ * pkg_add_end() use the database and run the scripts, they are called in
+ * the install order, pkg_add_extract() only writes the files on disk.
+ */
 int
-pkg_add(struct pkgdb *db, const char *path, int flags)
+pkg_add_begin(struct pkgdb *db, const char *path, int flags,
+    struct pkg_add_job *job)
 {
 	const char *arch;
 	const char *myarch;
 	const char *origin;
-	struct archive *a;
-	struct archive_entry *ae;
-	struct pkg *pkg = NULL;
 	struct pkg_dep *dep = NULL;
-	bool extract = true;
-	bool handle_rc = false;
 	char dpath[MAXPATHLEN + 1];
 	const char *basedir;
 	const char *ext;
@@ -133,35 +217,40 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 
 	assert(path != NULL);
 
+	memset(job, 0, sizeof(*job));
+	job->flags = flags;
+	job->extract = true;
+
 	/*
 	 * Open the package archive file, read all the meta files and set the
 	 * current archive_entry to the first non-meta file.
 	 * If there is no non-meta files, EPKG_END is returned.
 	 */
-	ret = pkg_open2(&pkg, &a, &ae, path, NULL);
+	ret = pkg_open2(&job->pkg, &job->a, &job->ae, path, NULL, 0);
 	if (ret == EPKG_END)
-		extract = false;
+		job->extract = false;
 	else if (ret != EPKG_OK) {
 		retcode = ret;
 		goto cleanup;
 	}
 	if ((flags & PKG_ADD_UPGRADE) == 0)
-		pkg_emit_install_begin(pkg);
+		pkg_emit_install_begin(job->pkg);
 
-	if (pkg_is_valid(pkg) != EPKG_OK) {
+	if (pkg_is_valid(job->pkg) != EPKG_OK) {
 		pkg_emit_error("the package is not valid");
-		return (EPKG_FATAL);
+		retcode = EPKG_FATAL;
+		goto cleanup;
 	}
 
 	if (flags & PKG_ADD_AUTOMATIC)
-		pkg_set(pkg, PKG_AUTOMATIC, true);
+		pkg_set(job->pkg, PKG_AUTOMATIC, true);
 
 	/*
 	 * Check the architecture
 	 */
 
 	pkg_config_string(PKG_CONFIG_ABI, &myarch);
-	pkg_get(pkg, PKG_ARCH, &arch, PKG_ORIGIN, &origin);
+	pkg_get(job->pkg, PKG_ARCH, &arch, PKG_ORIGIN, &origin);
 
 	if (fnmatch(myarch, arch, FNM_CASEFOLD) == FNM_NOMATCH) {
 		pkg_emit_error("wrong architecture: %s instead of %s",
@@ -179,7 +268,7 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 	ret = pkg_is_installed(db, origin);
 
 	if (ret == EPKG_OK) {
-		pkg_emit_already_installed(pkg);
+		pkg_emit_already_installed(job->pkg);
 		retcode = EPKG_INSTALLED;
 		goto cleanup;
 	} else if (ret != EPKG_END) {
@@ -198,7 +287,7 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 		goto cleanup;
 	}
 
-	while (pkg_deps(pkg, &dep) == EPKG_OK) {
+	while (pkg_deps(job->pkg, &dep) == EPKG_OK) {
 		if (dep_installed(dep, db) != EPKG_OK) {
 			snprintf(dpath, sizeof(dpath), "%s/%s-%s%s", basedir,
 					 pkg_dep_get(dep, PKG_DEP_NAME), pkg_dep_get(dep, PKG_DEP_VERSION),
@@ -211,7 +300,7 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 				}
 			} else {
 				retcode = EPKG_FATAL;
-				pkg_emit_missing_dep(pkg, dep);
+				pkg_emit_missing_dep(job->pkg, dep);
 				goto cleanup;
 			}
 		}
@@ -220,9 +309,9 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 	/* register the package before installing it in case there are
 	 * problems that could be caught here. */
 	if ((flags & PKG_ADD_UPGRADE) == 0)
-		retcode = pkgdb_register_pkg(db, pkg, 0);
+		retcode = pkgdb_register_pkg(db, job->pkg, 0);
 	else
-		retcode = pkgdb_register_pkg(db, pkg, 1);
+		retcode = pkgdb_register_pkg(db, job->pkg, 1);
 
 	if (retcode != EPKG_OK)
 		goto cleanup;
@@ -231,15 +320,97 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 	 * Execute pre-install scripts
 	 */
 	if ((flags & PKG_ADD_UPGRADE_NEW) == 0)
-		pkg_script_run(pkg, PKG_SCRIPT_PRE_INSTALL);
+		pkg_script_run(job->pkg, PKG_SCRIPT_PRE_INSTALL);
 
 	/* add the user and group if necessary */
 	/* pkg_add_user_group(pkg); */
 
-	/*
-	 * Extract the files on disk.
-	 */
-	if (extract == true && (retcode = do_extract(a, ae)) != EPKG_OK) {
+	return (EPKG_OK);
+
+	cleanup:
+	if (job->a != NULL)
+		archive_read_finish(job->a);
+	pkg_free(job->pkg);
+	job->a = NULL;
+	job->pkg = NULL;
+
+	return (retcode);
+}
+
+/*
+ * Record the files of an upgrade which have the same checksum in the
+ * installed version old, pkg_add_extract() does not write them again if
+ * the file on disk still has it.
+ */
+int
+pkg_add_unchanged(struct pkg_add_job *job, struct pkg *old)
+{
+	struct strset oldfiles = { NULL, 0, 0, NULL, 0 };
+	struct strset_entry *e;
+	struct pkg_file *file = NULL;
+	const char *path, *sum;
+	int ret = EPKG_OK;
+
+	while (pkg_files(old, &file) == EPKG_OK) {
+		if (strset_add(&oldfiles, pkg_file_get(file, PKG_FILE_PATH),
+		    file, NULL) == EPKG_FATAL) {
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+
+	file = NULL;
+	while (pkg_files(job->pkg, &file) == EPKG_OK) {
+		path = pkg_file_get(file, PKG_FILE_PATH);
+		sum = pkg_file_get(file, PKG_FILE_SUM);
+		if (sum == NULL || sum[0] == '\0')
+			continue;
+		if ((e = strset_get(&oldfiles, path)) == NULL ||
+		    strcmp(pkg_file_get(e->data, PKG_FILE_SUM), sum) != 0)
+			continue;
+		if (strset_add(&job->unchanged, path, file, NULL) ==
+		    EPKG_FATAL) {
+			ret = EPKG_FATAL;
+			break;
+		}
+	}
+
+	cleanup:
+	strset_free(&oldfiles);
+	if (ret != EPKG_OK)
+		strset_free(&job->unchanged);
+
+	return (ret);
+}
+
+/*
+ * Extract the files on disk, without touching the database: it can run in
+ * any thread, the result is handled by pkg_add_end().  The package is left
+ * in job->pkg for the caller to free.
+ */
+int
+pkg_add_extract(struct pkg_add_job *job)
+{
+	if (job->extract)
+		job->retcode = do_extract(job);
+
+	return (job->retcode);
+}
+
+int
+pkg_add_end(struct pkgdb *db, struct pkg_add_job *job)
+{
+	struct pkg *pkg = job->pkg;
+	bool handle_rc = false;
+	int retcode = job->retcode;
+
+	if (job->error != NULL) {
+		pkg_emit_error("%s", job->error);
+		free(job->error);
+		job->error = NULL;
+	}
+
+	if (retcode != EPKG_OK) {
 		/* If the add failed, clean up */
 		pkg_delete_files(pkg, 1);
 		pkg_delete_dirs(db, pkg, 1);
@@ -249,7 +420,7 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 	/*
 	 * Execute post install scripts
 	 */
-	if (flags & PKG_ADD_UPGRADE_NEW)
+	if (job->flags & PKG_ADD_UPGRADE_NEW)
 		pkg_script_run(pkg, PKG_SCRIPT_POST_UPGRADE);
 	else
 		pkg_script_run(pkg, PKG_SCRIPT_POST_INSTALL);
@@ -264,17 +435,36 @@ pkg_add(struct pkgdb *db, const char *path, int flags)
 		pkg_start_stop_rc_scripts(pkg, PKG_RC_START);
 
 	cleanup_reg:
-	if ((flags & PKG_ADD_UPGRADE) == 0)
+	if ((job->flags & PKG_ADD_UPGRADE) == 0)
 		pkgdb_register_finale(db, retcode);
 
-	if (retcode == EPKG_OK && (flags & PKG_ADD_UPGRADE) == 0)
+	if (retcode == EPKG_OK && (job->flags & PKG_ADD_UPGRADE) == 0)
 		pkg_emit_install_finished(pkg);
 
-	cleanup:
-	if (a != NULL)
-		archive_read_finish(a);
+	if (job->nskipped > 0)
+		pkg_emit_debug(1, "pkg_add: %" PRId64 " unchanged files, %"
+		    PRId64 " bytes not written", job->nskipped, job->skipped);
 
-	pkg_free(pkg);
+	if (job->a != NULL)
+		archive_read_finish(job->a);
+	job->a = NULL;
+	strset_free(&job->unchanged);
 
 	return (retcode);
 }
+
+int
+pkg_add(struct pkgdb *db, const char *path, int flags)
+{
+	struct pkg_add_job job;
+	int ret;
+
+	if ((ret = pkg_add_begin(db, path, flags, &job)) != EPKG_OK)
+		return (ret);
+
+	pkg_add_extract(&job);
+	ret = pkg_add_end(db, &job);
+	pkg_free(job.pkg);
+
+	return (ret);
+}
@@ -42,6 +42,7 @@
 #define STRING 0
 #define BOOL 1
 #define LIST 2
+#define INTEGER 3
 
 struct pkg_config_kv {
 	char *key;
@@ -158,6 +159,48 @@ static struct config_entry c[] = {
 		"http://portaudit.FreeBSD.org/auditfile.tbz",
 		{ NULL }
 	},
+	[PKG_CONFIG_FETCH_CONCURRENCY] = {
+		INTEGER,
+		"FETCH_CONCURRENCY",
+		"1",
+		{ NULL }
+	},
+	[PKG_CONFIG_PIPELINE_INSTALL] = {
+		BOOL,
+		"PIPELINE_INSTALL",
+		"NO",
+		{ NULL }
+	},
+	[PKG_CONFIG_WAL_JOURNAL] = {
+		BOOL,
+		"WAL_JOURNAL",
+		"NO",
+		{ NULL }
+	},
+	[PKG_CONFIG_INSTALL_CONCURRENCY] = {
+		INTEGER,
+		"INSTALL_CONCURRENCY",
+		"1",
+		{ NULL }
+	},
+	[PKG_CONFIG_SKIP_UNCHANGED] = {
+		BOOL,
+		"SKIP_UNCHANGED",
+		"NO",
+		{ NULL }
+	},
+	[PKG_CONFIG_ANALYSE_CONCURRENCY] = {
+		INTEGER,
+		"ANALYSE_CONCURRENCY",
+		"1",
+		{ NULL }
+	},
+	[PKG_CONFIG_REPO_DELTAS] = {
+		INTEGER,
+		"REPO_DELTAS",
+		"30",
+		{ NULL }
+	},
 };
 
 static bool parsed = false;
@@ -276,6 +319,38 @@ pkg_config_bool(pkg_config_key key, bool *val)
 	return (EPKG_OK);
 }
 
+int
+pkg_config_int64(pkg_config_key key, int64_t *val)
+{
+	const char *errstr = NULL;
+	const char *str;
+
+	*val = 0;
+
+	if (parsed != true) {
+		pkg_emit_error("pkg_init() must be called before pkg_config_int64()");
+		return (EPKG_FATAL);
+	}
+
+	if (c[key].type != INTEGER) {
+		pkg_emit_error("this config entry is not an integer");
+		return (EPKG_FATAL);
+	}
+
+	str = (c[key].val != NULL) ? c[key].val : c[key].def;
+	if (str == NULL)
+		return (EPKG_OK);
+
+	*val = strtonum(str, INT64_MIN, INT64_MAX, &errstr);
+	if (errstr != NULL) {
+		pkg_emit_error("Invalid value for %s: %s (%s)", c[key].key, str,
+		    errstr);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
 int
 pkg_config_list(pkg_config_key key, struct pkg_config_kv **kv)
 {
@@ -386,6 +461,7 @@ pkg_shutdown(void)
 			switch (c[i].type) {
 			case STRING:
 			case BOOL:
+			case INTEGER:
 				free(c[i].val);
 				break;
 			case LIST:
@@ -33,6 +33,7 @@
 #include <regex.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "pkg.h"
 #include "private/event.h"
@@ -40,46 +41,22 @@
 
 static int pkg_create_from_dir(struct pkg *, const char *, struct packing *);
 
+/*
+ * Add the files and directories of the package to the archive.  If sums is
+ * set, the checksum of the files which have none is computed from the bytes
+ * archived.
+ */
 static int
-pkg_create_from_dir(struct pkg *pkg, const char *root, struct packing *pkg_archive)
+pkg_create_payload(struct pkg *pkg, const char *root, struct packing *pack,
+    bool sums)
 {
 	char fpath[MAXPATHLEN + 1];
 	struct pkg_file *file = NULL;
 	struct pkg_dir *dir = NULL;
-	char *m;
 	int ret;
-	const char *mtree;
 	bool developer;
-	struct stat st;
-	char sha256[SHA256_DIGEST_LENGTH * 2 + 1];
-
-	if (pkg_is_valid(pkg) != EPKG_OK) {
-		pkg_emit_error("the package is not valid");
-		return (EPKG_FATAL);
-	}
-	/*
-	 * if the checksum is not provided in the manifest recompute it
-	 */
-	while (pkg_files(pkg, &file) == EPKG_OK) {
-		if (root != NULL)
-			snprintf(fpath, sizeof(fpath), "%s%s", root, pkg_file_get(file, PKG_FILE_PATH));
-		else
-			strlcpy(fpath, pkg_file_get(file, PKG_FILE_PATH), sizeof(fpath));
-
-		if ((pkg_file_get(file, PKG_FILE_SUM) == NULL || pkg_file_get(file, PKG_FILE_SUM)[0] == '\0') && lstat(fpath, &st) == 0 && !S_ISLNK(st.st_mode)) {
-			if (sha256_file(fpath, sha256) != EPKG_OK)
-				return (EPKG_FATAL);
-			strlcpy(file->sum, sha256, sizeof(file->sum));
-		}
-	}
 
-	pkg_emit_manifest(pkg, &m);
-	packing_append_buffer(pkg_archive, m, "+MANIFEST", strlen(m));
-	free(m);
-
-	pkg_get(pkg, PKG_MTREE, &mtree);
-	if (mtree != NULL)
-		packing_append_buffer(pkg_archive, mtree, "+MTREE_DIRS", strlen(mtree));
+	pkg_config_bool(PKG_CONFIG_DEVELOPER_MODE, &developer);
 
 	while (pkg_files(pkg, &file) == EPKG_OK) {
 		if (root != NULL)
@@ -87,8 +64,9 @@ pkg_create_from_dir(struct pkg *pkg, const char *root, struct packing *pkg_archi
 		else
 			strlcpy(fpath, pkg_file_get(file, PKG_FILE_PATH), sizeof(fpath));
 
-		ret = packing_append_file_attr(pkg_archive, fpath, pkg_file_get(file, PKG_FILE_PATH), file->uname, file->gname, file->perm);
-		pkg_config_bool(PKG_CONFIG_DEVELOPER_MODE, &developer);
+		ret = packing_append_file_sum(pack, fpath,
+		    pkg_file_get(file, PKG_FILE_PATH), file->uname, file->gname,
+		    file->perm, sums && file->sum[0] == '\0' ? file->sum : NULL);
 		if (developer && ret != EPKG_OK)
 			return (ret);
 	}
@@ -99,8 +77,7 @@ pkg_create_from_dir(struct pkg *pkg, const char *root, struct packing *pkg_archi
 		else
 			strlcpy(fpath, pkg_dir_path(dir), sizeof(fpath));
 
-		ret = packing_append_file_attr(pkg_archive, fpath, pkg_dir_path(dir), dir->uname, dir->gname, dir->perm);
-		pkg_config_bool(PKG_CONFIG_DEVELOPER_MODE, &developer);
+		ret = packing_append_file_attr(pack, fpath, pkg_dir_path(dir), dir->uname, dir->gname, dir->perm);
 		if (developer && ret != EPKG_OK)
 			return (ret);
 	}
@@ -108,6 +85,88 @@ pkg_create_from_dir(struct pkg *pkg, const char *root, struct packing *pkg_archi
 	return (EPKG_OK);
 }
 
+/*
+ * The manifest comes first in the package but holds the checksums of the
+ * files.  When some are missing, the files are archived in a spool while
+ * they are hashed, then the manifest is written and the spool is copied
+ * after it: the files are read only once.  The spool is an unlinked file of
+ * TMPDIR, nothing is left behind whatever happens to the process.
+ */
+static int
+pkg_create_from_dir(struct pkg *pkg, const char *root,
+    struct packing *pkg_archive)
+{
+	char fpath[MAXPATHLEN + 1];
+	char spool[MAXPATHLEN + 1];
+	struct pkg_file *file = NULL;
+	struct packing *spool_archive = NULL;
+	int ret = EPKG_OK;
+	int fd = -1;
+	const char *mtree, *tmpdir;
+	bool nosum = false;
+	struct stat st;
+
+	if (pkg_is_valid(pkg) != EPKG_OK) {
+		pkg_emit_error("the package is not valid");
+		return (EPKG_FATAL);
+	}
+
+	while (pkg_files(pkg, &file) == EPKG_OK) {
+		if (file->sum[0] != '\0')
+			continue;
+		if (root != NULL)
+			snprintf(fpath, sizeof(fpath), "%s%s", root, pkg_file_get(file, PKG_FILE_PATH));
+		else
+			strlcpy(fpath, pkg_file_get(file, PKG_FILE_PATH), sizeof(fpath));
+
+		if (lstat(fpath, &st) == 0 && !S_ISLNK(st.st_mode)) {
+			nosum = true;
+			break;
+		}
+	}
+
+	if (nosum) {
+		if ((tmpdir = getenv("TMPDIR")) == NULL || tmpdir[0] == '\0')
+			tmpdir = "/tmp";
+		snprintf(spool, sizeof(spool), "%s/pkg.XXXXXX", tmpdir);
+		if ((fd = mkstemp(spool)) == -1) {
+			pkg_emit_errno("mkstemp", spool);
+			return (EPKG_FATAL);
+		}
+		unlink(spool);
+		if (packing_init_fd(&spool_archive, fd, TAR) != EPKG_OK) {
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+
+		ret = pkg_create_payload(pkg, root, spool_archive, true);
+		packing_finish(spool_archive);
+		if (ret != EPKG_OK)
+			goto cleanup;
+	}
+
+	if (pkg_emit_manifest_packing(pkg, pkg_archive, "+MANIFEST",
+	    "+COMPACT_MANIFEST") != EPKG_OK) {
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	pkg_get(pkg, PKG_MTREE, &mtree);
+	if (mtree != NULL)
+		packing_append_buffer(pkg_archive, mtree, "+MTREE_DIRS", strlen(mtree));
+
+	if (nosum)
+		ret = packing_append_archive(pkg_archive, fd);
+	else
+		ret = pkg_create_payload(pkg, root, pkg_archive, false);
+
+cleanup:
+	if (fd != -1)
+		close(fd);
+
+	return (ret);
+}
+
 static struct packing *
 pkg_create_archive(const char *outdir, struct pkg *pkg, pkg_formats format, int required_flags)
 {
@@ -233,7 +292,9 @@ pkg_create_staged(const char *outdir, pkg_formats format, const char *rootdir, c
 			pkg_addscript_file(pkg, path);
 	}
 
-	if (plist != NULL && ports_parse_plist(pkg, plist, rootdir) != EPKG_OK) {
+	/* the files are hashed while they are archived */
+	if (plist != NULL && ports_parse_plist2(pkg, plist, rootdir, false) !=
+	    EPKG_OK) {
 		ret = EPKG_FATAL;
 		goto cleanup;
 	}
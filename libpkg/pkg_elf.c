@@ -24,6 +24,7 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/param.h>
 #include <sys/endian.h>
 #include <sys/types.h>
 #include <sys/elf_common.h>
@@ -31,11 +32,15 @@
 
 #include <ctype.h>
 #include <assert.h>
+#include <elf-hints.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <dlfcn.h>
 #include <gelf.h>
-#include <link.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -43,82 +48,460 @@
 #include "private/pkg.h"
 #include "private/event.h"
 #include "private/elf_tables.h"
+#include "private/utils.h"
+
+#define STANDARD_LIBRARY_PATH "/lib:/usr/lib"
+
+/* A list of directories to look for shared libraries in */
+struct elf_path {
+	char **dirs;
+	size_t len;
+};
+
+/* A shared library and the objects it can be loaded in */
+struct elf_lib {
+	char *path;
+	int class;
+	int machine;
+};
+
+/* The installed package a shared library belongs to */
+struct elf_owner {
+	char *origin;
+	char *name;
+	char *version;
+};
 
-static int
-test_depends(struct pkgdb *db, struct pkg *pkg, const char *name)
+/*
+ * The shared libraries are looked for the way rtld(1) does, but only their
+ * ELF header is read: they are never loaded in pkg.  What is found is kept
+ * for the whole analysis of the package.
+ */
+struct elf_resolver {
+	struct pkgdb *db;
+	struct elf_path env;	/* LD_LIBRARY_PATH */
+	struct elf_path std;	/* ldconfig(8) hints and the standard path */
+	struct strset files;	/* path -> struct elf_lib, NULL if none */
+	struct strset libs;	/* class:machine:name -> lib found in std */
+	struct strset owners;	/* path -> struct elf_owner, NULL if none */
+	bool shlibs;
+	bool autodeps;
+	bool developer;
+};
+
+static void
+elf_path_add(struct elf_path *p, const char *list)
 {
-	struct pkg_dep *dep = NULL;
-	struct pkgdb_it *it = NULL;
-	struct pkg *d;
-	Link_map *map;
+	char *dirs, *dir, *next;
+
+	if (list == NULL || (dirs = strdup(list)) == NULL)
+		return;
+
+	next = dirs;
+	while ((dir = strsep(&next, ":;")) != NULL) {
+		if (*dir == '\0')
+			continue;
+		if ((p->dirs = reallocf(p->dirs,
+		    (p->len + 1) * sizeof(char *))) == NULL) {
+			p->len = 0;
+			break;
+		}
+		if ((p->dirs[p->len] = strdup(dir)) != NULL)
+			p->len++;
+	}
+	free(dirs);
+}
+
+static void
+elf_path_free(struct elf_path *p)
+{
+	size_t i;
+
+	for (i = 0; i < p->len; i++)
+		free(p->dirs[i]);
+	free(p->dirs);
+	p->dirs = NULL;
+	p->len = 0;
+}
+
+/* Add the directories ldconfig(8) stored in the hints file */
+static void
+elf_path_add_hints(struct elf_path *p)
+{
+	struct elfhints_hdr hdr;
+	char *dirlist;
+	int fd;
+
+	if ((fd = open(_PATH_ELF_HINTS, O_RDONLY)) == -1)
+		return;
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.magic != ELFHINTS_MAGIC || hdr.version != 1 ||
+	    (dirlist = malloc(hdr.dirlistlen + 1)) == NULL) {
+		close(fd);
+		return;
+	}
+
+	if (pread(fd, dirlist, hdr.dirlistlen, hdr.strtab + hdr.dirlist) ==
+	    (ssize_t)hdr.dirlistlen) {
+		dirlist[hdr.dirlistlen] = '\0';
+		elf_path_add(p, dirlist);
+	}
+	free(dirlist);
+	close(fd);
+}
+
+static void
+elf_lib_free(struct elf_lib *lib)
+{
+	if (lib == NULL)
+		return;
+
+	free(lib->path);
+	free(lib);
+}
+
+static void
+elf_owner_free(struct elf_owner *owner)
+{
+	if (owner == NULL)
+		return;
+
+	free(owner->origin);
+	free(owner->name);
+	free(owner->version);
+	free(owner);
+}
+
+static void
+elf_resolver_init(struct elf_resolver *r, struct pkgdb *db)
+{
+	memset(r, 0, sizeof(*r));
+	r->db = db;
+
+	pkg_config_bool(PKG_CONFIG_SHLIBS, &r->shlibs);
+	pkg_config_bool(PKG_CONFIG_AUTODEPS, &r->autodeps);
+	pkg_config_bool(PKG_CONFIG_DEVELOPER_MODE, &r->developer);
+
+	/* rtld(1) ignores LD_LIBRARY_PATH for setuid programs */
+	if (!issetugid())
+		elf_path_add(&r->env, getenv("LD_LIBRARY_PATH"));
+	elf_path_add_hints(&r->std);
+	elf_path_add(&r->std, STANDARD_LIBRARY_PATH);
+}
+
+static void
+elf_resolver_free(struct elf_resolver *r)
+{
+	size_t i;
+
+	elf_path_free(&r->env);
+	elf_path_free(&r->std);
+
+	/* the data of libs is owned by files */
+	for (i = 0; i < r->files.len; i++) {
+		elf_lib_free(r->files.entries[i].data);
+		free(__DECONST(char *, r->files.entries[i].key));
+	}
+	for (i = 0; i < r->libs.len; i++)
+		free(__DECONST(char *, r->libs.entries[i].key));
+	for (i = 0; i < r->owners.len; i++) {
+		elf_owner_free(r->owners.entries[i].data);
+		free(__DECONST(char *, r->owners.entries[i].key));
+	}
+	strset_free(&r->files);
+	strset_free(&r->libs);
+	strset_free(&r->owners);
+}
+
+/*
+ * The shared library at path if it is an ELF object of the given class and
+ * machine, NULL otherwise.
+ */
+static struct elf_lib *
+elf_resolver_file(struct elf_resolver *r, const char *path, int class,
+    int machine)
+{
+	struct strset_entry *e;
+	struct elf_lib *lib = NULL;
+	struct stat sb;
+	unsigned char hdr[EI_NIDENT + 4];
+	char *key;
+	int fd;
+
+	if ((e = strset_get(&r->files, path)) != NULL) {
+		lib = e->data;
+		goto match;
+	}
+
+	if ((fd = open(path, O_RDONLY)) != -1) {
+		if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+		    read(fd, hdr, sizeof(hdr)) == sizeof(hdr) &&
+		    memcmp(hdr, ELFMAG, SELFMAG) == 0 &&
+		    (lib = malloc(sizeof(*lib))) != NULL) {
+			lib->path = strdup(path);
+			lib->class = hdr[EI_CLASS];
+			/* e_machine follows e_ident and e_type */
+			if (hdr[EI_DATA] == ELFDATA2MSB)
+				lib->machine = be16dec(hdr + EI_NIDENT + 2);
+			else
+				lib->machine = le16dec(hdr + EI_NIDENT + 2);
+		}
+		close(fd);
+	}
+
+	if ((key = strdup(path)) == NULL ||
+	    strset_add(&r->files, key, lib, NULL) != EPKG_OK) {
+		free(key);
+		elf_lib_free(lib);
+		return (NULL);
+	}
+
+match:
+	if (lib == NULL || lib->path == NULL || lib->class != class ||
+	    lib->machine != machine)
+		return (NULL);
+
+	return (lib);
+}
+
+/* Look for name in the directories of p, $ORIGIN is replaced by origin */
+static struct elf_lib *
+elf_resolver_search(struct elf_resolver *r, struct elf_path *p,
+    const char *name, const char *origin, int class, int machine)
+{
+	struct elf_lib *lib = NULL;
+	struct sbuf *path = NULL;
+	const char *dir;
+	size_t i;
+
+	sbuf_init(&path);
+	for (i = 0; i < p->len && lib == NULL; i++) {
+		sbuf_clear(path);
+		for (dir = p->dirs[i]; *dir != '\0'; dir++) {
+			if (strncmp(dir, "$ORIGIN", 7) == 0) {
+				sbuf_cat(path, origin);
+				dir += 6;
+			} else if (strncmp(dir, "${ORIGIN}", 9) == 0) {
+				sbuf_cat(path, origin);
+				dir += 8;
+			} else {
+				sbuf_putc(path, *dir);
+			}
+		}
+		sbuf_printf(path, "/%s", name);
+		sbuf_finish(path);
+		lib = elf_resolver_file(r, sbuf_data(path), class, machine);
+	}
+	sbuf_free(path);
+
+	return (lib);
+}
+
+/*
+ * Same search order as rtld(1): the DT_RPATH of the object if it has no
+ * DT_RUNPATH, LD_LIBRARY_PATH, the DT_RUNPATH, the ldconfig(8) hints and
+ * the standard directories.
+ */
+static struct elf_lib *
+elf_resolve(struct elf_resolver *r, const char *name, struct elf_path *rpath,
+    struct elf_path *runpath, const char *origin, int class, int machine)
+{
+	struct strset_entry *e;
+	struct elf_lib *lib = NULL;
+	char *key;
+
+	if (strchr(name, '/') != NULL)
+		return (elf_resolver_file(r, name, class, machine));
+
+	if (runpath->len == 0)
+		lib = elf_resolver_search(r, rpath, name, origin, class,
+		    machine);
+	if (lib == NULL)
+		lib = elf_resolver_search(r, &r->env, name, origin, class,
+		    machine);
+	if (lib == NULL)
+		lib = elf_resolver_search(r, runpath, name, origin, class,
+		    machine);
+	if (lib != NULL)
+		return (lib);
+
+	/* the rest of the search is the same for all the objects */
+	if (asprintf(&key, "%d:%d:%s", class, machine, name) == -1)
+		return (NULL);
+	if ((e = strset_get(&r->libs, key)) != NULL) {
+		free(key);
+		return (e->data);
+	}
+	lib = elf_resolver_search(r, &r->std, name, origin, class, machine);
+	if (strset_add(&r->libs, key, lib, NULL) != EPKG_OK)
+		free(key);
+
+	return (lib);
+}
+
+/* The installed package path belongs to, NULL if none */
+static struct elf_owner *
+elf_resolver_owner(struct elf_resolver *r, const char *path)
+{
+	struct strset_entry *e;
+	struct elf_owner *owner = NULL;
+	struct pkgdb_it *it;
+	struct pkg *d = NULL;
 	const char *deporigin, *depname, *depversion;
-	bool found;
-	void *handle;
-	bool shlibs = false;
-	bool autodeps = false;
+	char *key;
+
+	if ((e = strset_get(&r->owners, path)) != NULL)
+		return (e->data);
+
+	if ((it = pkgdb_query_which(r->db, path)) == NULL)
+		return (NULL);
+	if (pkgdb_it_next(it, &d, PKG_LOAD_BASIC) == EPKG_OK &&
+	    (owner = calloc(1, sizeof(*owner))) != NULL) {
+		pkg_get(d, PKG_ORIGIN, &deporigin, PKG_NAME, &depname,
+		    PKG_VERSION, &depversion);
+		owner->origin = strdup(deporigin);
+		owner->name = strdup(depname);
+		owner->version = strdup(depversion);
+	}
+	pkg_free(d);
+	pkgdb_it_free(it);
 
-#ifdef STATIC_LINKAGE
-	/* If we're compiled using static linkage, ie. as pkg-static,
-	   calls to dlopen(3) will fail, so bail out immediately. */
-	return (EPKG_OK);
-#endif
+	if ((key = strdup(path)) == NULL ||
+	    strset_add(&r->owners, key, owner, NULL) != EPKG_OK) {
+		free(key);
+		elf_owner_free(owner);
+		return (NULL);
+	}
 
-	pkg_config_bool(PKG_CONFIG_AUTODEPS, &autodeps);
-	pkg_config_bool(PKG_CONFIG_SHLIBS, &shlibs);
+	return (owner);
+}
 
-	if ((handle = dlopen(name, RTLD_LAZY)) == NULL) {
-		pkg_emit_error("accessing shared library %s failed -- %s", name, dlerror());
+static int
+test_depends(struct elf_resolver *r, struct pkg *pkg, const char *name,
+    struct elf_lib *lib)
+{
+	struct pkg_dep *dep = NULL;
+	struct elf_owner *owner;
+	bool found;
+
+	if (lib == NULL) {
+		pkg_emit_error("accessing shared library %s failed -- not found",
+		    name);
 		return (EPKG_FATAL);
 	}
 
-	dlinfo(handle, RTLD_DI_LINKMAP, &map);
-
 	/* match /lib, /lib32, /usr/lib and /usr/lib32 */
-	if (strncmp(map->l_name, "/lib", 4) == 0 || strncmp(map->l_name, "/usr/lib", 7) == 0) {
+	if (strncmp(lib->path, "/lib", 4) == 0 ||
+	    strncmp(lib->path, "/usr/lib", 7) == 0) {
 		/* ignore libs from base */
-		dlclose(handle);
 		return (EPKG_OK);
 	}
 
-	if (shlibs)
+	if (r->shlibs)
 		pkg_addshlib(pkg, name);
 
-	if (!autodeps) {
-		dlclose(handle);
+	if (!r->autodeps)
 		return (EPKG_OK);
-	}
 
-	if ((it = pkgdb_query_which(db, map->l_name)) == NULL) {
-		dlclose(handle);
+	if ((owner = elf_resolver_owner(r, lib->path)) == NULL)
 		return (EPKG_OK);
-	}
-	d = NULL;
-	if (pkgdb_it_next(it, &d, PKG_LOAD_BASIC) == EPKG_OK) {
-		found = false;
-		pkg_get(d, PKG_ORIGIN, &deporigin, PKG_NAME, &depname, PKG_VERSION, &depversion);
 
-		dep = NULL;
-		found = false;
-		while (pkg_deps(pkg, &dep) == EPKG_OK) {
-			if (strcmp(pkg_dep_get(dep, PKG_DEP_ORIGIN), deporigin) == 0) {
-				found = true;
-				break;
-			}
-		}
-		if (!found) {
-			pkg_emit_error("adding forgotten depends (%s): %s-%s",
-					map->l_name, depname, depversion);
-			pkg_adddep(pkg, depname, deporigin, depversion);
+	found = false;
+	while (pkg_deps(pkg, &dep) == EPKG_OK) {
+		if (strcmp(pkg_dep_get(dep, PKG_DEP_ORIGIN), owner->origin) == 0) {
+			found = true;
+			break;
 		}
-		pkg_free(d);
 	}
-	dlclose(handle);
-	pkgdb_it_free(it);
+	if (!found) {
+		pkg_emit_error("adding forgotten depends (%s): %s-%s",
+				lib->path, owner->name, owner->version);
+		pkg_adddep(pkg, owner->name, owner->origin, owner->version);
+	}
+
 	return (EPKG_OK);
 }
 
+/*
+ * What analyse_elf() found in a file.  The files are analysed by several
+ * threads, so nothing is added to the package nor emitted there: it is done
+ * afterwards in the order of the files.
+ */
+struct elf_object {
+	const char *fpath;
+	int ret;
+	char *error;		/* emitted after the analysis */
+	bool elf;		/* an ELF object of any kind */
+	int class;
+	int machine;
+	char **needed;		/* DT_NEEDED entries */
+	size_t nneeded;
+	char *soname;		/* DT_SONAME */
+	struct elf_path rpath;
+	struct elf_path runpath;
+	char *origin;		/* directory of the object, for $ORIGIN */
+};
+
+/* The files of a package shared by the analysis threads */
+struct elf_queue {
+	struct elf_resolver *r;
+	struct elf_object *objs;
+	size_t nobjs;
+	size_t next;
+	pthread_mutex_t lock;
+};
+
+static void
+elf_object_free(struct elf_object *o)
+{
+	size_t i;
+
+	for (i = 0; i < o->nneeded; i++)
+		free(o->needed[i]);
+	free(o->needed);
+	free(o->soname);
+	free(o->error);
+	free(o->origin);
+	elf_path_free(&o->rpath);
+	elf_path_free(&o->runpath);
+}
+
 static int
-analyse_elf(struct pkgdb *db, struct pkg *pkg, const char *fpath)
+elf_object_error(struct elf_object *o, const char *fmt, ...)
+{
+	va_list ap;
+
+	free(o->error);
+	va_start(ap, fmt);
+	if (vasprintf(&o->error, fmt, ap) == -1)
+		o->error = NULL;
+	va_end(ap);
+
+	return (EPKG_FATAL);
+}
+
+/*
+ * libelf keeps its last error and the message it formats in globals, the
+ * message is copied while no other analysis thread can read it.
+ */
+static pthread_mutex_t elf_errmsg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+elf_object_elferror(struct elf_object *o, const char *func)
+{
+	int ret;
+
+	pthread_mutex_lock(&elf_errmsg_lock);
+	ret = elf_object_error(o, "%s() for %s failed: %s", func, o->fpath,
+	    elf_errmsg(-1));
+	pthread_mutex_unlock(&elf_errmsg_lock);
+
+	return (ret);
+}
+
+static int
+analyse_elf(struct elf_resolver *r, struct elf_object *o)
 {
 	Elf *e = NULL;
 	GElf_Ehdr elfhdr;
@@ -129,6 +512,10 @@ analyse_elf(struct pkgdb *db, struct pkg *pkg, const char *fpath)
 	Elf_Data *data;
 	GElf_Dyn *dyn, dyn_mem;
 	struct stat sb;
+	const char *fpath = o->fpath;
+	char errbuf[128];
+	char **needed;
+	char *slash;
 	int ret = EPKG_OK;
 
 	size_t numdyn;
@@ -136,21 +523,16 @@ analyse_elf(struct pkgdb *db, struct pkg *pkg, const char *fpath)
 	size_t dynidx;
 	const char *osname;
 
-	bool shlibs = false;
-	bool autodeps = false;
-	bool developer = false;
-
-	pkg_config_bool(PKG_CONFIG_AUTODEPS, &autodeps);
-	pkg_config_bool(PKG_CONFIG_SHLIBS, &shlibs);
-	pkg_config_bool(PKG_CONFIG_DEVELOPER_MODE, &developer);
-
 	int fd;
 
 	if ((fd = open(fpath, O_RDONLY, 0)) < 0) {
 		return (EPKG_FATAL);
 	}
-	if (fstat(fd, &sb) != 0)
-		pkg_emit_errno("fstat() failed for %s", fpath);
+	if (fstat(fd, &sb) != 0) {
+		strerror_r(errno, errbuf, sizeof(errbuf));
+		ret = elf_object_error(o, "fstat(%s): %s", fpath, errbuf);
+		goto cleanup;
+	}
 	/* ignore empty files and non regular files */
 	if (sb.st_size == 0 || !S_ISREG(sb.st_mode)) {
 		ret = EPKG_END; /* Empty file: no results */
@@ -158,34 +540,30 @@ analyse_elf(struct pkgdb *db, struct pkg *pkg, const char *fpath)
 	}
 
 	if ((e = elf_begin(fd, ELF_C_READ, NULL)) == NULL) {
-		ret = EPKG_FATAL;
-		pkg_emit_error("elf_begin() for %s failed: %s", fpath, elf_errmsg(-1)); 
+		ret = elf_object_elferror(o, "elf_begin");
 		goto cleanup;
 	}
 
 	if (elf_kind(e) != ELF_K_ELF) {
-		close(fd);
-		return (EPKG_END); /* Not an elf file: no results */
+		ret = EPKG_END; /* Not an elf file: no results */
+		goto cleanup;
 	}
 
-	if (developer)
-		pkg->flags |= PKG_CONTAINS_ELF_OBJECTS;
+	o->elf = true;
 
-	if (!autodeps && !shlibs) {
+	if (!r->autodeps && !r->shlibs) {
 	   ret = EPKG_OK;
 	   goto cleanup;
 	}
 
 	if (gelf_getehdr(e, &elfhdr) == NULL) {
-		ret = EPKG_FATAL;
-		pkg_emit_error("getehdr() failed: %s.", elf_errmsg(-1));
+		ret = elf_object_elferror(o, "getehdr");
 		goto cleanup;
 	}
 
 	while ((scn = elf_nextscn(e, scn)) != NULL) {
 		if (gelf_getshdr(scn, &shdr) != &shdr) {
-			ret = EPKG_FATAL;
-			pkg_emit_error("getshdr() for %s failed: %s", fpath, elf_errmsg(-1));
+			ret = elf_object_elferror(o, "getshdr");
 			goto cleanup;
 		}
 		switch (shdr.sh_type) {
@@ -225,19 +603,54 @@ analyse_elf(struct pkgdb *db, struct pkg *pkg, const char *fpath)
 		}
 	}
 
+	o->class = elfhdr.e_ident[EI_CLASS];
+	o->machine = elfhdr.e_machine;
+
+	/* $ORIGIN is the directory of the object */
+	if ((o->origin = strdup(fpath)) == NULL) {
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+	if ((slash = strrchr(o->origin, '/')) != NULL)
+		*slash = '\0';
+	else
+		strcpy(o->origin, ".");
+
 	data = elf_getdata(dynamic, NULL);
 
 	for (dynidx = 0; dynidx < numdyn; dynidx++) {
 		if ((dyn = gelf_getdyn(data, dynidx, &dyn_mem)) == NULL) {
-			ret = EPKG_FATAL;
-			pkg_emit_error("getdyn() failed for %s: %s", fpath, elf_errmsg(-1)); 
+			ret = elf_object_elferror(o, "getdyn");
 			goto cleanup;
 		}
 
-		if (dyn->d_tag != DT_NEEDED)
-			continue;
-
-		test_depends(db, pkg, elf_strptr(e, sh_link, dyn->d_un.d_val));
+		switch (dyn->d_tag) {
+		case DT_RPATH:
+			elf_path_add(&o->rpath,
+			    elf_strptr(e, sh_link, dyn->d_un.d_val));
+			break;
+		case DT_RUNPATH:
+			elf_path_add(&o->runpath,
+			    elf_strptr(e, sh_link, dyn->d_un.d_val));
+			break;
+		case DT_SONAME:
+			free(o->soname);
+			o->soname = strdup(elf_strptr(e, sh_link,
+			    dyn->d_un.d_val));
+			break;
+		case DT_NEEDED:
+			needed = reallocf(o->needed,
+			    (o->nneeded + 1) * sizeof(char *));
+			if ((o->needed = needed) == NULL) {
+				o->nneeded = 0;
+				ret = EPKG_FATAL;
+				goto cleanup;
+			}
+			if ((needed[o->nneeded] = strdup(elf_strptr(e, sh_link,
+			    dyn->d_un.d_val))) != NULL)
+				o->nneeded++;
+			break;
+		}
 	}
 
 cleanup:
@@ -248,6 +661,59 @@ cleanup:
 	return (ret);
 }
 
+static void *
+analyse_elf_worker(void *arg)
+{
+	struct elf_queue *q = arg;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		i = q->next++;
+		pthread_mutex_unlock(&q->lock);
+
+		if (i >= q->nobjs)
+			break;
+		q->objs[i].ret = analyse_elf(q->r, &q->objs[i]);
+	}
+
+	return (NULL);
+}
+
+/* Run analyse_elf() on all the objects with up to nthreads threads */
+static void
+analyse_elf_all(struct elf_resolver *r, struct elf_object *objs,
+    size_t nobjs, int64_t nthreads)
+{
+	struct elf_queue q;
+	pthread_t *threads = NULL;
+	int64_t nstarted = 0;
+	int64_t i;
+
+	q.r = r;
+	q.objs = objs;
+	q.nobjs = nobjs;
+	q.next = 0;
+	pthread_mutex_init(&q.lock, NULL);
+
+	nthreads = MIN(nthreads, (int64_t)nobjs);
+	if (nthreads > 1 &&
+	    (threads = calloc(nthreads, sizeof(pthread_t))) != NULL) {
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(&threads[i], NULL,
+			    analyse_elf_worker, &q) != 0)
+				break;
+			nstarted++;
+		}
+	}
+	/* the remaining files are analysed here if threads are missing */
+	analyse_elf_worker(&q);
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&q.lock);
+}
+
 static int
 analyse_fpath(struct pkg *pkg, const char *fpath)
 {
@@ -268,43 +734,81 @@ analyse_fpath(struct pkg *pkg, const char *fpath)
 	return (EPKG_OK);
 }
 
+/*
+ * The ELF objects are read by up to ANALYSE_CONCURRENCY threads, then their
+ * libraries are looked for and added to the package in the order of the
+ * files, so the result does not depend on the number of threads.
+ */
 int
 pkg_analyse_files(struct pkgdb *db, struct pkg *pkg)
 {
 	struct pkg_file *file = NULL;
+	struct elf_resolver r;
+	struct elf_object *objs = NULL, *o;
+	size_t nobjs = 0;
+	size_t i, j;
+	int64_t nthreads = 1;
 	int ret = EPKG_OK;
-	const char *fpath;
-	bool shlibs = false;
-	bool autodeps = false;
-	bool developer = false;
 
-	pkg_config_bool(PKG_CONFIG_SHLIBS, &shlibs);
-	pkg_config_bool(PKG_CONFIG_AUTODEPS, &autodeps);
-	pkg_config_bool(PKG_CONFIG_DEVELOPER_MODE, &developer);
+	elf_resolver_init(&r, db);
 
-	if (!autodeps && !shlibs && !developer)
-		return (EPKG_OK);
+	if (!r.autodeps && !r.shlibs && !r.developer)
+		goto cleanup;
 
-	if (elf_version(EV_CURRENT) == EV_NONE)
-		return (EPKG_FATAL);
+	if (elf_version(EV_CURRENT) == EV_NONE) {
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
 
 	/* Assume no architecture dependence, for contradiction */
-	if (developer)
+	if (r.developer)
 		pkg->flags &= ~(PKG_CONTAINS_ELF_OBJECTS |
 				PKG_CONTAINS_STATIC_LIBS |
 				PKG_CONTAINS_H_OR_LA);
 
-	while (pkg_files(pkg, &file) == EPKG_OK) {
-		fpath = pkg_file_get(file, PKG_FILE_PATH);
-		ret = analyse_elf(db, pkg, fpath);
-		if (developer) {
-			if (ret != EPKG_OK && ret != EPKG_END)
-				return (ret);
-			analyse_fpath(pkg, fpath);
+	while (pkg_files(pkg, &file) == EPKG_OK)
+		nobjs++;
+	if (nobjs == 0)
+		goto cleanup;
+	if ((objs = calloc(nobjs, sizeof(struct elf_object))) == NULL) {
+		pkg_emit_errno("calloc", "elf_object");
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+	for (i = 0; pkg_files(pkg, &file) == EPKG_OK; i++)
+		objs[i].fpath = pkg_file_get(file, PKG_FILE_PATH);
+
+	pkg_config_int64(PKG_CONFIG_ANALYSE_CONCURRENCY, &nthreads);
+	analyse_elf_all(&r, objs, nobjs, nthreads);
+
+	for (i = 0; i < nobjs; i++) {
+		o = &objs[i];
+		if (o->error != NULL)
+			pkg_emit_error("%s", o->error);
+		if (o->elf && r.developer)
+			pkg->flags |= PKG_CONTAINS_ELF_OBJECTS;
+		if (o->soname != NULL && r.shlibs)
+			pkg_addshlib_provided(pkg, o->soname);
+		for (j = 0; j < o->nneeded; j++)
+			test_depends(&r, pkg, o->needed[j],
+			    elf_resolve(&r, o->needed[j], &o->rpath,
+			    &o->runpath, o->origin, o->class, o->machine));
+		if (r.developer) {
+			if (o->ret != EPKG_OK && o->ret != EPKG_END) {
+				ret = o->ret;
+				goto cleanup;
+			}
+			analyse_fpath(pkg, o->fpath);
 		}
 	}
 
-	return (EPKG_OK);
+cleanup:
+	for (i = 0; objs != NULL && i < nobjs; i++)
+		elf_object_free(&objs[i]);
+	free(objs);
+	elf_resolver_free(&r);
+
+	return (ret);
 }
 
 static const char *
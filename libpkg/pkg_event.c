@@ -25,6 +25,7 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <pthread.h>
 #include <syslog.h>
 
 #include "pkg.h"
@@ -33,6 +34,14 @@
 static pkg_event_cb _cb = NULL;
 static void *_data = NULL;
 
+/*
+ * Events are also emitted by the worker threads of libpkg, the callback is
+ * never entered by two of them at once.  The lock is recursive so that the
+ * callback can itself call libpkg functions emitting events.
+ */
+static pthread_mutex_t _cb_lock;
+static pthread_once_t _cb_once = PTHREAD_ONCE_INIT;
+
 void
 pkg_event_register(pkg_event_cb cb, void *data)
 {
@@ -40,11 +49,27 @@ pkg_event_register(pkg_event_cb cb, void *data)
 	_data = data;
 }
 
+static void
+pkg_event_lock_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&_cb_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
 static void
 pkg_emit_event(struct pkg_event *ev)
 {
-	if (_cb != NULL)
-		_cb(_data, ev);
+	if (_cb == NULL)
+		return;
+
+	pthread_once(&_cb_once, pkg_event_lock_init);
+	pthread_mutex_lock(&_cb_lock);
+	_cb(_data, ev);
+	pthread_mutex_unlock(&_cb_lock);
 }
 
 void
@@ -282,3 +307,20 @@ pkg_emit_file_mismatch(struct pkg *pkg, struct pkg_file *f, const char *newsum)
 
 	pkg_emit_event(&ev);
 }
+
+void
+pkg_emit_debug(int level, const char *fmt, ...)
+{
+	struct pkg_event ev;
+	va_list ap;
+
+	ev.type = PKG_EVENT_DEBUG;
+	ev.e_debug.level = level;
+
+	va_start(ap, fmt);
+	vasprintf(&ev.e_debug.msg, fmt, ap);
+	va_end(ap);
+
+	pkg_emit_event(&ev);
+	free(ev.e_debug.msg);
+}
@@ -31,7 +31,9 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <libutil.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -41,7 +43,44 @@
 #include "private/pkg.h"
 #include "private/pkgdb.h"
 
+#define FETCH_PENDING	0
+#define FETCH_DONE	1
+#define FETCH_FAILED	2
+
+/* packages shared by the download threads */
+struct fetch_queue {
+	struct pkg **pkgs;
+	struct sbuf **manifests;
+	int *state;		/* FETCH_* of each package */
+	int npkgs;
+	int next;
+	int ret;
+	bool manifest_only;	/* only fetch what is needed for the manifest */
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	int nthreads;
+	struct fetch_progress *progress;
+};
+
+/* downloads running in the background of pkg_jobs_install() */
+struct fetch_pipeline {
+	struct fetch_queue q;
+	struct fetch_progress progress;
+	struct pkg **pkgs;
+	struct sbuf **manifests;
+	struct sbuf **verified;
+	int npkgs;
+	char label[32];
+};
+
 static int pkg_jobs_fetch(struct pkg_jobs *j);
+static int pkg_jobs_fetch_pipeline(struct pkg_jobs *j, struct fetch_pipeline *fp);
+static int pkg_jobs_fetch_pipeline_end(struct fetch_pipeline *fp, bool stop);
+static int pkg_jobs_fetch_pipeline_open(struct fetch_pipeline *fp, int i,
+    const char *path, struct pkg **pkg);
+static int fetch_queue_wait(struct fetch_queue *q, int i);
 
 int
 pkg_jobs_new(struct pkg_jobs **j, pkg_jobs_t t, struct pkgdb *db)
@@ -64,6 +103,21 @@ pkg_jobs_new(struct pkg_jobs **j, pkg_jobs_t t, struct pkgdb *db)
 	return (EPKG_OK);
 }
 
+static void
+pkg_jobs_nodes_free(struct pkg_jobs *j)
+{
+	size_t i;
+
+	for (i = 0; i < j->nnodes; i++)
+		free(j->nodes[i].parents);
+	free(j->nodes);
+	free(j->level_size);
+	j->nodes = NULL;
+	j->level_size = NULL;
+	j->nnodes = 0;
+	j->nlevels = 0;
+}
+
 void
 pkg_jobs_free(struct pkg_jobs *j)
 {
@@ -73,6 +127,7 @@ pkg_jobs_free(struct pkg_jobs *j)
 		return;
 
 	pkgdb_unlock(j->db);
+	pkg_jobs_nodes_free(j);
 
 	while (!STAILQ_EMPTY(&j->jobs)) {
 		p = STAILQ_FIRST(&j->jobs);
@@ -89,6 +144,7 @@ pkg_jobs_add(struct pkg_jobs *j, struct pkg *pkg)
 	assert(pkg != NULL);
 
 	STAILQ_INSERT_TAIL(&j->jobs, pkg, next);
+	j->resolved = false;
 
 	return (EPKG_OK);
 }
@@ -106,6 +162,14 @@ pkg_jobs(struct pkg_jobs *j, struct pkg **pkg)
 {
 	assert(j != NULL);
 
+	/*
+	 * Installs are listed in the order they will be done, the summary
+	 * shown before applying them included.  On failure the requested
+	 * order is kept, pkg_jobs_install() will try again.
+	 */
+	if (*pkg == NULL && j->type == PKG_JOBS_INSTALL && !j->resolved)
+		pkg_jobs_resolv(j);
+
 	if (*pkg == NULL)
 		*pkg = STAILQ_FIRST(&j->jobs);
 	else
@@ -118,37 +182,435 @@ pkg_jobs(struct pkg_jobs *j, struct pkg **pkg)
 }
 
 static int
-pkg_jobs_keep_files_to_del(struct pkg *p1, struct pkg *p2)
+pkg_jobs_node_cmp(const void *a, const void *b)
 {
-	struct pkg_file *f1 = NULL, *f2 = NULL;
-	struct pkg_dir *d1 = NULL, *d2 = NULL;
+	struct pkg_jobs_node *na = *(struct pkg_jobs_node * const *)a;
+	struct pkg_jobs_node *nb = *(struct pkg_jobs_node * const *)b;
+	const char *oa, *ob;
 
-	while (pkg_files(p1, &f1) == EPKG_OK) {
-		if (f1->keep == 1)
+	pkg_get(na->pkg, PKG_ORIGIN, &oa);
+	pkg_get(nb->pkg, PKG_ORIGIN, &ob);
+
+	return (strcmp(oa, ob));
+}
+
+static struct pkg_jobs_node *
+pkg_jobs_node_find(struct pkg_jobs_node **byorigin, size_t n,
+    const char *origin)
+{
+	struct pkg_jobs_node **np;
+	size_t lo = 0, hi = n, mid;
+	const char *o;
+	int cmp;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		np = &byorigin[mid];
+		pkg_get((*np)->pkg, PKG_ORIGIN, &o);
+		if ((cmp = strcmp(origin, o)) == 0)
+			return (*np);
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return (NULL);
+}
+
+/* dep has to be installed before node */
+static int
+pkg_jobs_node_link(struct pkg_jobs_node *node, struct pkg_jobs_node *dep)
+{
+	struct pkg_jobs_node **parents;
+
+	if (dep->parents_len == dep->parents_cap) {
+		dep->parents_cap = MAX(dep->parents_cap * 2, 4);
+		parents = realloc(dep->parents,
+		    dep->parents_cap * sizeof(struct pkg_jobs_node *));
+		if (parents == NULL) {
+			pkg_emit_errno("realloc", "pkg_jobs_node");
+			return (EPKG_FATAL);
+		}
+		dep->parents = parents;
+	}
+	dep->parents[dep->parents_len++] = node;
+	node->nrefs++;
+
+	return (EPKG_OK);
+}
+
+/*
+ * Add the edges between the jobs coming from one repository.  The whole
+ * deps table is read once, the edges leaving the jobs are dropped.
+ */
+static int
+pkg_jobs_graph_repo(struct pkg_jobs *j, const char *reponame,
+    struct pkg_jobs_node **byorigin, size_t *nedges)
+{
+	sqlite3_stmt *stmt;
+	struct pkg_jobs_node *node, *dep;
+	struct sbuf *sql;
+	const char *repo;
+	int ret;
+
+	sql = sbuf_new_auto();
+	sbuf_printf(sql, "SELECT p.origin, d.origin FROM '%s'.deps AS d, "
+	    "'%s'.packages AS p WHERE p.id = d.package_id;", reponame,
+	    reponame);
+	sbuf_finish(sql);
+
+	ret = sqlite3_prepare_v2(j->db->sqlite, sbuf_data(sql), -1, &stmt,
+	    NULL);
+	sbuf_delete(sql);
+	if (ret != SQLITE_OK) {
+		ERROR_SQLITE(j->db->sqlite);
+		return (EPKG_FATAL);
+	}
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		node = pkg_jobs_node_find(byorigin, j->nnodes,
+		    sqlite3_column_text(stmt, 0));
+		if (node == NULL)
 			continue;
+		pkg_get(node->pkg, PKG_REPONAME, &repo);
+		if (repo == NULL || strcmp(repo, reponame) != 0)
+			continue;
+		dep = pkg_jobs_node_find(byorigin, j->nnodes,
+		    sqlite3_column_text(stmt, 1));
+		if (dep == NULL || dep == node)
+			continue;
+		if (pkg_jobs_node_link(node, dep) != EPKG_OK) {
+			sqlite3_finalize(stmt);
+			return (EPKG_FATAL);
+		}
+		(*nedges)++;
+	}
+	sqlite3_finalize(stmt);
+
+	if (ret != SQLITE_DONE) {
+		ERROR_SQLITE(j->db->sqlite);
+		return (EPKG_FATAL);
+	}
 
-		f2 = NULL;
-		while (pkg_files(p2, &f2) == EPKG_OK) {
-			if (strcmp(pkg_file_get(f1, PKG_FILE_PATH), pkg_file_get(f2, PKG_FILE_PATH)) == 0) {
-				f1->keep = 1;
+	return (EPKG_OK);
+}
+
+static void
+pkg_jobs_report_cycle(struct pkg_jobs *j)
+{
+	struct sbuf *msg;
+	const char *origin;
+	size_t i;
+
+	msg = sbuf_new_auto();
+	for (i = 0; i < j->nnodes; i++) {
+		if (j->nodes[i].nrefs == 0)
+			continue;
+		pkg_get(j->nodes[i].pkg, PKG_ORIGIN, &origin);
+		sbuf_printf(msg, " %s", origin);
+	}
+	sbuf_finish(msg);
+	pkg_emit_error("dependency cycle between:%s, installing them in the "
+	    "requested order", sbuf_data(msg));
+	sbuf_delete(msg);
+}
+
+/*
+ * Order the jobs so that every package comes after its dependencies.  The
+ * dependency graph of the jobs is built from the deps table of the
+ * repositories, then sorted level by level (Kahn): the packages of a level
+ * only depend on packages of the previous levels.  Packages caught in a
+ * dependency cycle are reported and placed last, one per level.
+ */
+int
+pkg_jobs_resolv(struct pkg_jobs *j)
+{
+	struct pkg_jobs_node **byorigin = NULL;
+	struct pkg_jobs_node **queue = NULL;
+	struct pkg_jobs_node *node, *parent;
+	struct pkg **sorted = NULL;
+	struct pkg *p = NULL;
+	const char *repo, *other;
+	size_t *first = NULL;
+	size_t head = 0, tail = 0;
+	size_t nedges = 0;
+	size_t i, k;
+	int level;
+	int ret = EPKG_FATAL;
+
+	assert(j != NULL);
+
+	pkg_jobs_nodes_free(j);
+	j->resolved = false;
+
+	STAILQ_FOREACH(p, &j->jobs, next)
+		j->nnodes++;
+	if (j->nnodes == 0) {
+		j->resolved = true;
+		return (EPKG_OK);
+	}
+
+	j->nodes = calloc(j->nnodes, sizeof(struct pkg_jobs_node));
+	byorigin = calloc(j->nnodes, sizeof(struct pkg_jobs_node *));
+	queue = calloc(j->nnodes, sizeof(struct pkg_jobs_node *));
+	if (j->nodes == NULL || byorigin == NULL || queue == NULL) {
+		pkg_emit_errno("calloc", "pkg_jobs_node");
+		goto cleanup;
+	}
+
+	i = 0;
+	STAILQ_FOREACH(p, &j->jobs, next) {
+		j->nodes[i].pkg = p;
+		byorigin[i] = &j->nodes[i];
+		i++;
+	}
+	qsort(byorigin, j->nnodes, sizeof(struct pkg_jobs_node *),
+	    pkg_jobs_node_cmp);
+
+	/* one pass over the deps of each repository the jobs come from */
+	for (i = 0; i < j->nnodes; i++) {
+		pkg_get(j->nodes[i].pkg, PKG_REPONAME, &repo);
+		if (repo == NULL || repo[0] == '\0')
+			continue;
+		for (k = 0; k < i; k++) {
+			pkg_get(j->nodes[k].pkg, PKG_REPONAME, &other);
+			if (other != NULL && strcmp(other, repo) == 0)
 				break;
-			}
+		}
+		if (k < i)
+			continue;
+		if (pkg_jobs_graph_repo(j, repo, byorigin, &nedges) != EPKG_OK)
+			goto cleanup;
+	}
+
+	/* pkg itself is always upgraded first */
+	node = pkg_jobs_node_find(byorigin, j->nnodes, "ports-mgmt/pkg");
+	if (node != NULL && node->nrefs == 0)
+		queue[tail++] = node;
+	for (i = 0; i < j->nnodes; i++) {
+		if (j->nodes[i].nrefs == 0 && &j->nodes[i] != node)
+			queue[tail++] = &j->nodes[i];
+	}
+
+	while (head < tail) {
+		node = queue[head++];
+		for (k = 0; k < node->parents_len; k++) {
+			parent = node->parents[k];
+			parent->level = MAX(parent->level, node->level + 1);
+			if (--parent->nrefs == 0)
+				queue[tail++] = parent;
+		}
+		j->nlevels = MAX(j->nlevels, node->level + 1);
+	}
+
+	if (tail < j->nnodes) {
+		pkg_jobs_report_cycle(j);
+		for (i = 0; i < j->nnodes; i++) {
+			if (j->nodes[i].nrefs == 0)
+				continue;
+			j->nodes[i].level = j->nlevels++;
+			queue[tail++] = &j->nodes[i];
 		}
 	}
 
+	/* rebuild the jobs level by level, in the order they were queued */
+	if ((first = calloc(j->nlevels + 1, sizeof(size_t))) == NULL ||
+	    (sorted = calloc(j->nnodes, sizeof(struct pkg *))) == NULL ||
+	    (j->level_size = calloc(j->nlevels, sizeof(size_t))) == NULL) {
+		pkg_emit_errno("calloc", "pkg_jobs_resolv");
+		goto cleanup;
+	}
+	for (i = 0; i < j->nnodes; i++) {
+		first[queue[i]->level + 1]++;
+		j->level_size[queue[i]->level]++;
+	}
+	for (level = 0; level < j->nlevels; level++)
+		first[level + 1] += first[level];
+	for (i = 0; i < j->nnodes; i++)
+		sorted[first[queue[i]->level]++] = queue[i]->pkg;
+
+	STAILQ_INIT(&j->jobs);
+	for (i = 0; i < j->nnodes; i++)
+		STAILQ_INSERT_TAIL(&j->jobs, sorted[i], next);
+
+	pkg_emit_debug(1, "jobs: %zu packages, %zu dependencies, %d levels",
+	    j->nnodes, nedges, j->nlevels);
+
+	j->resolved = true;
+	ret = EPKG_OK;
+
+	cleanup:
+	free(byorigin);
+	free(queue);
+	free(first);
+	free(sorted);
+	if (ret != EPKG_OK)
+		pkg_jobs_nodes_free(j);
+
+	return (ret);
+}
+
+/*
+ * Index the files and directories of the package being installed, the
+ * index is used for every package in the queue.  The paths are not
+ * copied, pkg must not be modified before pkg_jobs_paths_free().
+ */
+int
+pkg_jobs_paths_index(struct pkg_jobs_paths *paths, struct pkg *pkg)
+{
+	struct pkg_file *f = NULL;
+	struct pkg_dir *d = NULL;
+
+	pkg_jobs_paths_free(paths);
+
+	while (pkg_files(pkg, &f) == EPKG_OK) {
+		if (strset_add(&paths->files, pkg_file_get(f, PKG_FILE_PATH),
+		    f, NULL) == EPKG_FATAL)
+			goto error;
+	}
+
+	while (pkg_dirs(pkg, &d) == EPKG_OK) {
+		if (strset_add(&paths->dirs, pkg_dir_path(d), d, NULL) ==
+		    EPKG_FATAL)
+			goto error;
+	}
+
+	return (EPKG_OK);
+
+	error:
+	pkg_jobs_paths_free(paths);
+	return (EPKG_FATAL);
+}
+
+void
+pkg_jobs_paths_free(struct pkg_jobs_paths *paths)
+{
+	strset_free(&paths->files);
+	strset_free(&paths->dirs);
+}
+
+/* Flag the files and directories of p1 also in the indexed package */
+int
+pkg_jobs_keep_files_to_del(struct pkg *p1, struct pkg_jobs_paths *paths)
+{
+	struct pkg_file *f1 = NULL;
+	struct pkg_dir *d1 = NULL;
+
+	while (pkg_files(p1, &f1) == EPKG_OK) {
+		if (f1->keep == 1)
+			continue;
+		if (strset_get(&paths->files,
+		    pkg_file_get(f1, PKG_FILE_PATH)) != NULL)
+			f1->keep = 1;
+	}
+
 	while (pkg_dirs(p1, &d1) == EPKG_OK) {
 		if (d1->keep == 1)
 			continue;
-		d2 = NULL;
-		while (pkg_dirs(p2, &d2) == EPKG_OK) {
-			if (strcmp(pkg_dir_path(d1), pkg_dir_path(d2)) == 0) {
-				d1->keep = 1;
+		if (strset_get(&paths->dirs, pkg_dir_path(d1)) != NULL)
+			d1->keep = 1;
+	}
+
+	return (EPKG_OK);
+}
+
+/* a package of the batch being installed by pkg_jobs_install() */
+struct install_step {
+	struct pkg *p;
+	struct pkg_add_job job;
+};
+
+/* packages of a batch shared by the extraction threads */
+struct extract_queue {
+	struct install_step *steps;
+	int nsteps;
+	int next;
+	pthread_mutex_t lock;
+};
+
+static void *
+pkg_jobs_extract_worker(void *arg)
+{
+	struct extract_queue *q = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		i = q->next++;
+		pthread_mutex_unlock(&q->lock);
+
+		if (i >= q->nsteps)
+			break;
+		pkg_add_extract(&q->steps[i].job);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Finish the installation of a batch of packages already registered.  The
+ * files of the batch are extracted by up to nthreads threads, which is
+ * only done for packages not depending on each other, then the post
+ * install scripts run in the install order.  The packages following a
+ * failure are removed again as a serial run would not have installed them.
+ */
+static int
+pkg_jobs_install_batch(struct pkg_jobs *j, struct install_step *steps,
+    int nsteps, int64_t nthreads)
+{
+	struct extract_queue q;
+	pthread_t *threads = NULL;
+	const char *newversion;
+	int nstarted = 0;
+	int i;
+	int retcode = EPKG_OK;
+
+	if (nsteps == 0)
+		return (EPKG_OK);
+
+	q.steps = steps;
+	q.nsteps = nsteps;
+	q.next = 0;
+	pthread_mutex_init(&q.lock, NULL);
+
+	nthreads = MIN(nthreads, nsteps);
+	if (nthreads > 1 &&
+	    (threads = calloc(nthreads, sizeof(pthread_t))) != NULL) {
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(&threads[i], NULL,
+			    pkg_jobs_extract_worker, &q) != 0)
 				break;
-			}
+			nstarted++;
 		}
 	}
+	/* the remaining packages are extracted here if threads are missing */
+	pkg_jobs_extract_worker(&q);
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&q.lock);
 
-	return (EPKG_OK);
+	for (i = 0; i < nsteps; i++) {
+		if (retcode != EPKG_OK)
+			steps[i].job.retcode = EPKG_FATAL;
+		if (pkg_add_end(j->db, &steps[i].job) != EPKG_OK)
+			retcode = EPKG_FATAL;
+		j->nskipped += steps[i].job.nskipped;
+		j->skipped += steps[i].job.skipped;
+
+		if (retcode == EPKG_OK) {
+			pkg_get(steps[i].p, PKG_NEWVERSION, &newversion);
+			if (newversion != NULL)
+				pkg_emit_upgrade_finished(steps[i].p);
+			else
+				pkg_emit_install_finished(steps[i].job.pkg);
+		}
+		pkg_free(steps[i].job.pkg);
+		steps[i].job.pkg = NULL;
+	}
+
+	return (retcode);
 }
 
 static int
@@ -158,23 +620,52 @@ pkg_jobs_install(struct pkg_jobs *j, bool force)
 	struct pkg *pkg = NULL;
 	struct pkg *newpkg = NULL;
 	struct pkg *pkg_temp = NULL;
+	struct pkg *old = NULL;
+	struct pkg_jobs_paths paths;
 	struct pkgdb_it *it = NULL;
 	STAILQ_HEAD(,pkg) pkg_queue;
 	char path[MAXPATHLEN + 1];
 	const char *cachedir = NULL;
+	struct fetch_pipeline fp;
+	struct install_step *steps = NULL;
+	int64_t nthreads = 1;
+	size_t batch = 1;
+	int nsteps = 0;
+	int level = 0;
 	int flags = 0;
+	int i = 0;
+	int ret;
 	int retcode = EPKG_FATAL;
 
 	bool handle_rc = false;
+	bool pipeline = false;
+	bool skip_unchanged = false;
 
 	STAILQ_INIT(&pkg_queue);
+	memset(&paths, 0, sizeof(paths));
 
-	/* Fetch */
-	if (pkg_jobs_fetch(j) != EPKG_OK)
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
 		return (EPKG_FATAL);
 
-	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+	if (!j->resolved && pkg_jobs_resolv(j) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	/* Fetch */
+	pkg_config_bool(PKG_CONFIG_PIPELINE_INSTALL, &pipeline);
+	if (pipeline) {
+		if (pkg_jobs_fetch_pipeline(j, &fp) != EPKG_OK)
+			return (EPKG_FATAL);
+	} else if (pkg_jobs_fetch(j) != EPKG_OK) {
 		return (EPKG_FATAL);
+	}
+
+	pkg_config_int64(PKG_CONFIG_INSTALL_CONCURRENCY, &nthreads);
+	pkg_config_bool(PKG_CONFIG_SKIP_UNCHANGED, &skip_unchanged);
+	if ((steps = calloc(MAX(j->nnodes, 1), sizeof(struct install_step))) ==
+	    NULL) {
+		pkg_emit_errno("calloc", "pkg_jobs_install");
+		goto cleanup;
+	}
 	
 	p = NULL;
 	/* Install */
@@ -184,8 +675,29 @@ pkg_jobs_install(struct pkg_jobs *j, bool force)
 		bool automatic;
 		flags = 0;
 
+		/*
+		 * The packages are installed one by one, or a whole level of
+		 * the dependency graph at a time when they can be extracted
+		 * in parallel.
+		 */
+		if (nsteps == 0)
+			batch = nthreads > 1 ? j->level_size[level++] : 1;
+
 		pkg_get(p, PKG_ORIGIN, &pkgorigin, PKG_REPOPATH, &pkgrepopath,
 		    PKG_NEWVERSION, &newversion, PKG_AUTOMATIC, &automatic);
+		snprintf(path, sizeof(path), "%s/%s", cachedir, pkgrepopath);
+
+		if (pipeline)
+			ret = fetch_queue_wait(&fp.q, i) != EPKG_OK ? EPKG_FATAL :
+			    pkg_jobs_fetch_pipeline_open(&fp, i, path, &newpkg);
+		else
+			ret = pkg_open(&newpkg, path, NULL, 0);
+		i++;
+		if (ret != EPKG_OK) {
+			pkg_jobs_install_batch(j, steps, nsteps, nthreads);
+			sql_exec(j->db->sqlite, "ROLLBACK TO upgrade;");
+			goto cleanup;
+		}
 
 		if (newversion != NULL) {
 			pkg = NULL;
@@ -229,16 +741,23 @@ pkg_jobs_install(struct pkg_jobs *j, bool force)
 			}
 			pkgdb_it_free(it);
 		}
-		snprintf(path, sizeof(path), "%s/%s", cachedir, pkgrepopath);
 
-		pkg_open(&newpkg, path, NULL);
 		if (newversion != NULL) {
 			pkg_emit_upgrade_begin(p);
 		} else {
 			pkg_emit_install_begin(newpkg);
 		}
-		STAILQ_FOREACH(pkg, &pkg_queue, next)
-			pkg_jobs_keep_files_to_del(pkg, newpkg);
+		if (!STAILQ_EMPTY(&pkg_queue)) {
+			if (pkg_jobs_paths_index(&paths, newpkg) != EPKG_OK) {
+				pkg_jobs_install_batch(j, steps, nsteps,
+				    nthreads);
+				sql_exec(j->db->sqlite, "ROLLBACK TO upgrade;");
+				goto cleanup;
+			}
+			STAILQ_FOREACH(pkg, &pkg_queue, next)
+				pkg_jobs_keep_files_to_del(pkg, &paths);
+			pkg_jobs_paths_free(&paths);
+		}
 
 		STAILQ_FOREACH_SAFE(pkg, &pkg_queue, next, pkg_temp) {
 			pkg_get(pkg, PKG_ORIGIN, &origin);
@@ -247,7 +766,7 @@ pkg_jobs_install(struct pkg_jobs *j, bool force)
 				pkg_delete_files(pkg, 1);
 				pkg_script_run(pkg, PKG_SCRIPT_POST_DEINSTALL);
 				pkg_delete_dirs(j->db, pkg, 0);
-				pkg_free(pkg);
+				old = pkg;
 				break;
 			}
 		}
@@ -258,18 +777,33 @@ pkg_jobs_install(struct pkg_jobs *j, bool force)
 		if (automatic)
 			flags |= PKG_ADD_AUTOMATIC;
 
-		if (pkg_add(j->db, path, flags) != EPKG_OK) {
+		steps[nsteps].p = p;
+		if (pkg_add_begin(j->db, path, flags, &steps[nsteps].job) !=
+		    EPKG_OK) {
+			pkg_jobs_install_batch(j, steps, nsteps, nthreads);
 			sql_exec(j->db->sqlite, "ROLLBACK TO upgrade;");
 			goto cleanup;
 		}
+		/* the files kept from the old version are not written again */
+		if (old != NULL) {
+			if (skip_unchanged)
+				pkg_add_unchanged(&steps[nsteps].job, old);
+			pkg_free(old);
+			old = NULL;
+		}
+		if (++nsteps < (int)batch)
+			continue;
 
-		if (newversion != NULL)
-			pkg_emit_upgrade_finished(p);
-		else
-			pkg_emit_install_finished(newpkg);
+		ret = pkg_jobs_install_batch(j, steps, nsteps, nthreads);
+		nsteps = 0;
+		if (ret != EPKG_OK) {
+			sql_exec(j->db->sqlite, "ROLLBACK TO upgrade;");
+			goto cleanup;
+		}
 
 		if (STAILQ_EMPTY(&pkg_queue)) {
 			sql_exec(j->db->sqlite, "RELEASE upgrade;");
+			pkgdb_checkpoint(j->db);
 			sql_exec(j->db->sqlite, "SAVEPOINT upgrade;");
 		}
 	}
@@ -278,7 +812,17 @@ pkg_jobs_install(struct pkg_jobs *j, bool force)
 
 	cleanup:
 	sql_exec(j->db->sqlite, "RELEASE upgrade;");
+	pkgdb_checkpoint(j->db);
+	if (j->nskipped > 0)
+		pkg_emit_debug(1, "pkg_jobs: %" PRId64 " unchanged files, %"
+		    PRId64 " bytes not written", j->nskipped, j->skipped);
+	pkg_free(old);
 	pkg_free(newpkg);
+	free(steps);
+
+	if (pipeline && pkg_jobs_fetch_pipeline_end(&fp, retcode != EPKG_OK) !=
+	    EPKG_OK)
+		retcode = EPKG_FATAL;
 
 	return (retcode);
 }
@@ -325,22 +869,227 @@ pkg_jobs_apply(struct pkg_jobs *j, int force)
 }
 
 static int
-pkg_jobs_fetch(struct pkg_jobs *j)
+pkg_jobs_cmp_pkgsize(const void *a, const void *b)
+{
+	struct pkg *pa = *(struct pkg * const *)a;
+	struct pkg *pb = *(struct pkg * const *)b;
+	int64_t sa, sb;
+
+	pkg_get(pa, PKG_NEW_PKGSIZE, &sa);
+	pkg_get(pb, PKG_NEW_PKGSIZE, &sb);
+
+	if (sa > sb)
+		return (-1);
+	if (sa < sb)
+		return (1);
+	return (0);
+}
+
+static void *
+pkg_jobs_fetch_worker(void *arg)
+{
+	struct fetch_queue *q = arg;
+	struct pkg *p;
+	struct sbuf **manifest;
+	int i;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		/* stop handing out packages as soon as one failed */
+		if (q->next >= q->npkgs || q->ret != EPKG_OK || q->stop) {
+			pthread_mutex_unlock(&q->lock);
+			break;
+		}
+		i = q->next++;
+		p = q->pkgs[i];
+		pthread_mutex_unlock(&q->lock);
+
+		manifest = (q->manifests != NULL) ? &q->manifests[i] : NULL;
+		if (q->manifest_only)
+			ret = pkg_repo_fetch_manifest(p, q->progress, manifest);
+		else
+			ret = pkg_repo_fetch(p, q->progress, manifest);
+
+		pthread_mutex_lock(&q->lock);
+		if (ret == EPKG_OK) {
+			q->state[i] = FETCH_DONE;
+		} else {
+			q->state[i] = FETCH_FAILED;
+			q->ret = EPKG_FATAL;
+		}
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	return (NULL);
+}
+
+static int
+fetch_queue_init(struct fetch_queue *q, struct pkg **pkgs,
+    struct sbuf **manifests, int npkgs, struct fetch_progress *progress)
+{
+	memset(q, 0, sizeof(*q));
+
+	if (npkgs > 0 && (q->state = calloc(npkgs, sizeof(int))) == NULL) {
+		pkg_emit_errno("calloc", "fetch_queue");
+		return (EPKG_FATAL);
+	}
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->pkgs = pkgs;
+	q->manifests = manifests;
+	q->npkgs = npkgs;
+	q->ret = EPKG_OK;
+	q->progress = progress;
+
+	return (EPKG_OK);
+}
+
+/* Run the downloads in nthreads background threads */
+static void
+fetch_queue_start(struct fetch_queue *q, int nthreads)
+{
+	if (nthreads < 1 ||
+	    (q->threads = calloc(nthreads, sizeof(pthread_t))) == NULL)
+		return;
+
+	for (; q->nthreads < nthreads; q->nthreads++) {
+		if (pthread_create(&q->threads[q->nthreads], NULL,
+		    pkg_jobs_fetch_worker, q) != 0)
+			break;
+	}
+}
+
+/* Wait for the i-th package to be downloaded and verified */
+static int
+fetch_queue_wait(struct fetch_queue *q, int i)
+{
+	int ret;
+
+	/* no thread could be started, do the work here */
+	if (q->nthreads == 0)
+		pkg_jobs_fetch_worker(q);
+
+	pthread_mutex_lock(&q->lock);
+	while (q->state[i] == FETCH_PENDING &&
+	    (q->ret == EPKG_OK || i < q->next))
+		pthread_cond_wait(&q->cond, &q->lock);
+	ret = (q->state[i] == FETCH_DONE) ? EPKG_OK : EPKG_FATAL;
+	pthread_mutex_unlock(&q->lock);
+
+	return (ret);
+}
+
+/* Stop handing out downloads if asked to, and wait for the running ones */
+static int
+fetch_queue_finish(struct fetch_queue *q, bool stop)
+{
+	if (stop) {
+		pthread_mutex_lock(&q->lock);
+		q->stop = true;
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	while (q->nthreads > 0)
+		pthread_join(q->threads[--q->nthreads], NULL);
+	free(q->threads);
+	free(q->state);
+
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+
+	return (q->ret);
+}
+
+static void
+fetch_progress_begin(struct fetch_progress *progress, const char *label,
+    int64_t dlsize)
+{
+	memset(progress, 0, sizeof(*progress));
+	pthread_mutex_init(&progress->lock, NULL);
+	progress->label = label;
+	progress->total = (dlsize > 0) ? dlsize : 1;
+	progress->begin = time(NULL);
+}
+
+static void
+fetch_progress_end(struct fetch_progress *progress)
+{
+	/* something has been downloaded, report the end of the transfers */
+	if (progress->last != 0)
+		pkg_emit_fetching(progress->label, progress->total,
+		    progress->total, time(NULL) - progress->begin);
+
+	pthread_mutex_destroy(&progress->lock);
+}
+
+static int
+pkg_jobs_fetch_concurrency(int npkgs)
+{
+	int64_t concurrency = 1;
+
+	pkg_config_int64(PKG_CONFIG_FETCH_CONCURRENCY, &concurrency);
+
+	if (concurrency > npkgs)
+		concurrency = npkgs;
+	if (concurrency < 1)
+		concurrency = 1;
+
+	return (concurrency);
+}
+
+/*
+ * Download the packages using up to FETCH_CONCURRENCY transfers at the
+ * same time, the biggest ones first so that a large package does not end
+ * up being fetched alone at the end.
+ */
+static int
+pkg_jobs_fetch_all(struct pkg **pkgs, struct sbuf **manifests, int npkgs,
+    int64_t dlsize)
+{
+	struct fetch_queue q;
+	struct fetch_progress progress;
+	char label[32];
+	int ret;
+
+	qsort(pkgs, npkgs, sizeof(struct pkg *), pkg_jobs_cmp_pkgsize);
+
+	snprintf(label, sizeof(label), "%d packages", npkgs);
+	fetch_progress_begin(&progress, label, dlsize);
+
+	if (fetch_queue_init(&q, pkgs, manifests, npkgs, &progress) != EPKG_OK) {
+		fetch_progress_end(&progress);
+		return (EPKG_FATAL);
+	}
+
+	/* the calling thread is one of the workers */
+	fetch_queue_start(&q, pkg_jobs_fetch_concurrency(npkgs) - 1);
+	pkg_jobs_fetch_worker(&q);
+	ret = fetch_queue_finish(&q, false);
+
+	fetch_progress_end(&progress);
+
+	return (ret);
+}
+
+/* Compute what is left to download and check it fits in the cache */
+static int
+pkg_jobs_fetch_size(struct pkg_jobs *j, int *npkgs, int64_t *dlsize)
 {
 	struct pkg *p = NULL;
-	struct pkg *pkg = NULL;
-	struct sbuf *buf = NULL;
 	struct statfs fs;
 	struct stat st;
-	char path[MAXPATHLEN + 1];
-	int64_t dlsize = 0;
 	const char *cachedir = NULL;
 	const char *repopath = NULL;
 	char cachedpath[MAXPATHLEN];
 	char dlsz[7];
 	char fsz[7];
-	int ret = EPKG_OK;
-	
+
+	*npkgs = 0;
+	*dlsize = 0;
+
 	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
 		return (EPKG_FATAL);
 
@@ -349,10 +1098,17 @@ pkg_jobs_fetch(struct pkg_jobs *j)
 		int64_t pkgsize;
 		pkg_get(p, PKG_NEW_PKGSIZE, &pkgsize, PKG_REPOPATH, &repopath);
 		snprintf(cachedpath, MAXPATHLEN, "%s/%s", cachedir, repopath);
-		if (stat(cachedpath, &st) == -1)
-			dlsize += pkgsize;
-		else
-			dlsize += pkgsize - st.st_size;
+		if (stat(cachedpath, &st) == 0) {
+			*dlsize += pkgsize - st.st_size;
+		} else {
+			/* an interrupted download is resumed, not restarted */
+			strlcat(cachedpath, ".part", MAXPATHLEN);
+			if (stat(cachedpath, &st) == 0 && st.st_size <= pkgsize)
+				*dlsize += pkgsize - st.st_size;
+			else
+				*dlsize += pkgsize;
+		}
+		(*npkgs)++;
 	}
 
 	while (statfs(cachedir, &fs) == -1) {
@@ -365,47 +1121,256 @@ pkg_jobs_fetch(struct pkg_jobs *j)
 		}
 	}
 
-	if (dlsize > ((int64_t)fs.f_bsize * (int64_t)fs.f_bfree)) {
-		humanize_number(dlsz, sizeof(dlsz), dlsize, "B", HN_AUTOSCALE, 0);
+	if (*dlsize > ((int64_t)fs.f_bsize * (int64_t)fs.f_bfree)) {
+		humanize_number(dlsz, sizeof(dlsz), *dlsize, "B", HN_AUTOSCALE, 0);
 		humanize_number(fsz, sizeof(fsz), (int64_t)fs.f_bsize * (int64_t)fs.f_bfree, "B", HN_AUTOSCALE, 0);
 		pkg_emit_error("Not enough space in %s, needed %s available %s", cachedir, dlsz, fsz);
 		return (EPKG_FATAL);
 	}
-		
-	/* Fetch */
-	p = NULL;
-	while (pkg_jobs(j, &p) == EPKG_OK) {
-		if (pkg_repo_fetch(p) != EPKG_OK)
-			return (EPKG_FATAL);
+
+	return (EPKG_OK);
+}
+
+/* The packages of the job, in order, and room for their manifests */
+static int
+pkg_jobs_fetch_list(struct pkg_jobs *j, int npkgs, struct pkg ***pkgs,
+    struct sbuf ***manifests)
+{
+	struct pkg *p = NULL;
+	int i = 0;
+
+	*pkgs = NULL;
+	*manifests = NULL;
+
+	if (npkgs == 0)
+		return (EPKG_OK);
+
+	*pkgs = calloc(npkgs, sizeof(struct pkg *));
+	*manifests = calloc(npkgs, sizeof(struct sbuf *));
+	if (*pkgs == NULL || *manifests == NULL) {
+		pkg_emit_errno("calloc", "pkg_jobs_fetch");
+		free(*pkgs);
+		free(*manifests);
+		return (EPKG_FATAL);
 	}
 
-	p = NULL;
-	/* integrity checking */
+	while (pkg_jobs(j, &p) == EPKG_OK && i < npkgs)
+		(*pkgs)[i++] = p;
+
+	return (EPKG_OK);
+}
+
+static void
+pkg_jobs_fetch_free(struct pkg **pkgs, struct sbuf **manifests, int npkgs)
+{
+	int i;
+
+	if (manifests != NULL) {
+		for (i = 0; i < npkgs; i++)
+			if (manifests[i] != NULL)
+				sbuf_delete(manifests[i]);
+	}
+	free(manifests);
+	free(pkgs);
+}
+
+/*
+ * integrity checking, the manifests have been extracted while the
+ * archives were hashed, they are only opened again if it failed.
+ */
+static int
+pkg_jobs_integrity(struct pkg_jobs *j, struct pkg **pkgs,
+    struct sbuf **manifests, int npkgs)
+{
+	struct pkg *pkg = NULL;
+	struct sbuf *buf = NULL;
+	char path[MAXPATHLEN + 1];
+	const char *cachedir = NULL;
+	const char *repopath = NULL;
+	int i;
+	int ret = EPKG_OK;
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+		return (EPKG_FATAL);
+
 	pkg_emit_integritycheck_begin();
 
 	buf = sbuf_new_auto();
-	while (pkg_jobs(j, &p) == EPKG_OK) {
-		const char *pkgrepopath;
-
-		pkg_get(p, PKG_REPOPATH, &pkgrepopath);
-		snprintf(path, sizeof(path), "%s/%s", cachedir,
-		    pkgrepopath);
-		if (pkg_open(&pkg, path, buf) != EPKG_OK) {
-			sbuf_delete(buf);
-			return (EPKG_FATAL);
+	for (i = 0; i < npkgs; i++) {
+		if (manifests[i] != NULL) {
+			if (pkg == NULL)
+				pkg_new(&pkg, PKG_FILE);
+			else
+				pkg_reset(pkg, PKG_FILE);
+			if (pkg_parse_manifest(pkg, sbuf_data(manifests[i])) !=
+			    EPKG_OK) {
+				ret = EPKG_FATAL;
+				goto cleanup;
+			}
+		} else {
+			pkg_get(pkgs[i], PKG_REPOPATH, &repopath);
+			snprintf(path, sizeof(path), "%s/%s", cachedir,
+			    repopath);
+			if (pkg_open(&pkg, path, buf, 0) != EPKG_OK) {
+				ret = EPKG_FATAL;
+				goto cleanup;
+			}
 		}
 
 		if (pkgdb_integrity_append(j->db, pkg) != EPKG_OK)
 			ret = EPKG_FATAL;
 	}
 
-	pkg_free(pkg);
+	if (pkgdb_integrity_check(j->db) != EPKG_OK || ret != EPKG_OK) {
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+
+	pkg_emit_integritycheck_finished();
+
+	cleanup:
 	sbuf_delete(buf);
+	pkg_free(pkg);
+
+	return (ret);
+}
+
+static int
+pkg_jobs_fetch(struct pkg_jobs *j)
+{
+	struct pkg **pkgs = NULL;
+	struct sbuf **manifests = NULL;
+	int64_t dlsize = 0;
+	int npkgs = 0;
+	int ret = EPKG_OK;
 
-	if (pkgdb_integrity_check(j->db) != EPKG_OK || ret != EPKG_OK)
+	if (pkg_jobs_fetch_size(j, &npkgs, &dlsize) != EPKG_OK)
 		return (EPKG_FATAL);
 
-	pkg_emit_integritycheck_finished();
+	if (pkg_jobs_fetch_list(j, npkgs, &pkgs, &manifests) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	/* Fetch */
+	if (npkgs > 0 && pkg_jobs_fetch_all(pkgs, manifests, npkgs, dlsize) !=
+	    EPKG_OK)
+		ret = EPKG_FATAL;
+
+	if (ret == EPKG_OK)
+		ret = pkg_jobs_integrity(j, pkgs, manifests, npkgs);
+
+	pkg_jobs_fetch_free(pkgs, manifests, npkgs);
+
+	return (ret);
+}
+
+/*
+ * Pipelined download for the install.  Only the head of each archive is
+ * fetched first, which is enough to know all the manifests and to check
+ * the whole job for conflicts before anything is written.  The rest of
+ * the archives is then downloaded in the background, in the order of the
+ * job, while the install waits for each package in turn: as dependencies
+ * come first in the job, they are always installed before.
+ */
+static int
+pkg_jobs_fetch_pipeline(struct pkg_jobs *j, struct fetch_pipeline *fp)
+{
+	struct fetch_queue q;
+	int64_t dlsize = 0;
+	int concurrency;
+
+	memset(fp, 0, sizeof(*fp));
+
+	if (pkg_jobs_fetch_size(j, &fp->npkgs, &dlsize) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (pkg_jobs_fetch_list(j, fp->npkgs, &fp->pkgs, &fp->manifests) !=
+	    EPKG_OK)
+		return (EPKG_FATAL);
+
+	concurrency = pkg_jobs_fetch_concurrency(fp->npkgs);
+	snprintf(fp->label, sizeof(fp->label), "%d packages", fp->npkgs);
+	fetch_progress_begin(&fp->progress, fp->label, dlsize);
+
+	/* the heads of the archives */
+	if (fetch_queue_init(&q, fp->pkgs, fp->manifests, fp->npkgs,
+	    &fp->progress) != EPKG_OK)
+		goto error;
+	q.manifest_only = true;
+	fetch_queue_start(&q, concurrency - 1);
+	pkg_jobs_fetch_worker(&q);
+	if (fetch_queue_finish(&q, false) != EPKG_OK)
+		goto error;
+
+	if (pkg_jobs_integrity(j, fp->pkgs, fp->manifests, fp->npkgs) !=
+	    EPKG_OK)
+		goto error;
+
+	/*
+	 * the rest of them, consumed by pkg_jobs_install(), which keeps the
+	 * manifests seen once the checksums have passed
+	 */
+	if (fp->npkgs > 0 &&
+	    (fp->verified = calloc(fp->npkgs, sizeof(struct sbuf *))) == NULL) {
+		pkg_emit_errno("calloc", "pkg_jobs_fetch_pipeline");
+		goto error;
+	}
+	if (fetch_queue_init(&fp->q, fp->pkgs, fp->verified, fp->npkgs,
+	    &fp->progress) != EPKG_OK)
+		goto error;
+	fetch_queue_start(&fp->q, concurrency);
 
 	return (EPKG_OK);
+
+	error:
+	fetch_progress_end(&fp->progress);
+	pkg_jobs_fetch_free(NULL, fp->verified, fp->npkgs);
+	pkg_jobs_fetch_free(fp->pkgs, fp->manifests, fp->npkgs);
+
+	return (EPKG_FATAL);
+}
+
+static int
+pkg_jobs_fetch_pipeline_end(struct fetch_pipeline *fp, bool stop)
+{
+	int ret;
+
+	ret = fetch_queue_finish(&fp->q, stop);
+	fetch_progress_end(&fp->progress);
+	pkg_jobs_fetch_free(NULL, fp->verified, fp->npkgs);
+	pkg_jobs_fetch_free(fp->pkgs, fp->manifests, fp->npkgs);
+
+	return (ret);
+}
+
+/*
+ * The package to install, from the manifest read while its archive was
+ * checksummed.  The conflicts were checked against the head of the
+ * archive before it was verified, it must have been the same manifest.
+ */
+static int
+pkg_jobs_fetch_pipeline_open(struct fetch_pipeline *fp, int i,
+    const char *path, struct pkg **pkg)
+{
+	struct sbuf *head = fp->manifests[i];
+	struct sbuf *verified = fp->verified[i];
+	const char *name, *version;
+
+	if (head != NULL && (verified == NULL ||
+	    strcmp(sbuf_data(head), sbuf_data(verified)) != 0)) {
+		pkg_get(fp->pkgs[i], PKG_NAME, &name, PKG_VERSION, &version);
+		pkg_emit_error("%s-%s changed while it was downloaded, "
+		    "please try again", name, version);
+		return (EPKG_FATAL);
+	}
+
+	if (verified != NULL) {
+		if (*pkg == NULL)
+			pkg_new(pkg, PKG_FILE);
+		else
+			pkg_reset(*pkg, PKG_FILE);
+		if (pkg_parse_manifest(*pkg, sbuf_data(verified)) == EPKG_OK)
+			return (EPKG_OK);
+	}
+
+	return (pkg_open(pkg, path, NULL, 0));
 }
@@ -31,7 +31,9 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <yaml.h>
@@ -53,48 +55,62 @@
 #define PKG_GROUPS -10
 #define PKG_DIRECTORIES -11
 #define PKG_SHLIBS -12
+#define PKG_SHLIBS_PROVIDED -13
 
-static int pkg_set_from_node(struct pkg *, yaml_node_t *, yaml_document_t *, int);
-static int pkg_set_flatsize_from_node(struct pkg *, yaml_node_t *, yaml_document_t *, int);
-static int pkg_set_licenselogic_from_node(struct pkg *, yaml_node_t *, yaml_document_t *, int);
-static int pkg_set_deps_from_node(struct pkg *, yaml_node_t *, yaml_document_t *, const char *);
-static int pkg_set_files_from_node(struct pkg *, yaml_node_t *, yaml_document_t *, const char *);
-static int pkg_set_dirs_from_node(struct pkg *, yaml_node_t *, yaml_document_t *, const char *);
-static int parse_sequence(struct pkg *, yaml_node_t *, yaml_document_t *, int);
-static int parse_mapping(struct pkg *, yaml_node_t *, yaml_document_t *, int);
+#define SCALAR(ev) ((char *)(ev)->data.scalar.value)
+
+/*
+ * State of pkg_parse_manifest().  The manifest is parsed from the libyaml
+ * events as they come, no document tree is built.
+ */
+struct manifest_parser {
+	yaml_parser_t parser;
+	struct strset files;	/* paths of the files already added */
+	bool error;		/* the YAML stream is not valid */
+};
+
+static int pkg_set_from_node(struct pkg *, struct manifest_parser *, yaml_event_t *, int);
+static int pkg_set_flatsize_from_node(struct pkg *, struct manifest_parser *, yaml_event_t *, int);
+static int pkg_set_licenselogic_from_node(struct pkg *, struct manifest_parser *, yaml_event_t *, int);
+static int pkg_set_deps_from_node(struct pkg *, struct manifest_parser *, const char *);
+static int pkg_set_files_from_node(struct pkg *, struct manifest_parser *, const char *);
+static int pkg_set_dirs_from_node(struct pkg *, struct manifest_parser *, const char *);
+static int parse_sequence(struct pkg *, struct manifest_parser *, yaml_event_t *, int);
+static int parse_mapping(struct pkg *, struct manifest_parser *, yaml_event_t *, int);
 
 static struct manifest_key {
 	const char *key;
 	int type;
-	yaml_node_type_t valid_type;
-	int (*parse_data)(struct pkg *, yaml_node_t *, yaml_document_t *, int);
+	yaml_event_type_t valid_type;
+	int (*parse_data)(struct pkg *, struct manifest_parser *, yaml_event_t *, int);
 } manifest_key[] = {
-	{ "name", PKG_NAME, YAML_SCALAR_NODE, pkg_set_from_node},
-	{ "origin", PKG_ORIGIN, YAML_SCALAR_NODE, pkg_set_from_node},
-	{ "version", PKG_VERSION, YAML_SCALAR_NODE, pkg_set_from_node},
-	{ "arch", PKG_ARCH, YAML_SCALAR_NODE, pkg_set_from_node},
-	{ "www", PKG_WWW, YAML_SCALAR_NODE, pkg_set_from_node},
-	{ "comment", PKG_COMMENT, YAML_SCALAR_NODE, pkg_set_from_node},
-	{ "maintainer", PKG_MAINTAINER, YAML_SCALAR_NODE, pkg_set_from_node},
-	{ "prefix", PKG_PREFIX, YAML_SCALAR_NODE, pkg_set_from_node},
-	{ "deps", PKG_DEPS, YAML_MAPPING_NODE, parse_mapping},
-	{ "files", PKG_FILES, YAML_MAPPING_NODE, parse_mapping},
-	{ "dirs", PKG_DIRS, YAML_SEQUENCE_NODE, parse_sequence},
-	{ "directories", PKG_DIRECTORIES, YAML_MAPPING_NODE, parse_mapping},
-	{ "flatsize", -1, YAML_SCALAR_NODE, pkg_set_flatsize_from_node},
-	{ "licenselogic", -1, YAML_SCALAR_NODE, pkg_set_licenselogic_from_node},
-	{ "licenses", PKG_LICENSES, YAML_SEQUENCE_NODE, parse_sequence},
-	{ "desc", PKG_DESC, YAML_SCALAR_NODE, pkg_set_from_node},
-	{ "scripts", PKG_SCRIPTS, YAML_MAPPING_NODE, parse_mapping},
-	{ "message", PKG_MESSAGE, YAML_SCALAR_NODE, pkg_set_from_node},
-	{ "infos", PKG_INFOS, YAML_SCALAR_NODE, pkg_set_from_node},
-	{ "categories", PKG_CATEGORIES, YAML_SEQUENCE_NODE, parse_sequence},
-	{ "options", PKG_OPTIONS, YAML_MAPPING_NODE, parse_mapping},
-	{ "users", PKG_USERS, YAML_SEQUENCE_NODE, parse_sequence}, /* compatibility with old format */
-	{ "users", PKG_USERS, YAML_MAPPING_NODE, parse_mapping},
-	{ "groups", PKG_GROUPS, YAML_SEQUENCE_NODE, parse_sequence},
-	{ "groups", PKG_GROUPS, YAML_MAPPING_NODE, parse_mapping}, /* compatibility with old format */
-	{ "shlibs", PKG_SHLIBS, YAML_SEQUENCE_NODE, parse_sequence},
+	{ "name", PKG_NAME, YAML_SCALAR_EVENT, pkg_set_from_node},
+	{ "origin", PKG_ORIGIN, YAML_SCALAR_EVENT, pkg_set_from_node},
+	{ "version", PKG_VERSION, YAML_SCALAR_EVENT, pkg_set_from_node},
+	{ "arch", PKG_ARCH, YAML_SCALAR_EVENT, pkg_set_from_node},
+	{ "www", PKG_WWW, YAML_SCALAR_EVENT, pkg_set_from_node},
+	{ "comment", PKG_COMMENT, YAML_SCALAR_EVENT, pkg_set_from_node},
+	{ "maintainer", PKG_MAINTAINER, YAML_SCALAR_EVENT, pkg_set_from_node},
+	{ "prefix", PKG_PREFIX, YAML_SCALAR_EVENT, pkg_set_from_node},
+	{ "deps", PKG_DEPS, YAML_MAPPING_START_EVENT, parse_mapping},
+	{ "files", PKG_FILES, YAML_MAPPING_START_EVENT, parse_mapping},
+	{ "dirs", PKG_DIRS, YAML_SEQUENCE_START_EVENT, parse_sequence},
+	{ "directories", PKG_DIRECTORIES, YAML_MAPPING_START_EVENT, parse_mapping},
+	{ "flatsize", -1, YAML_SCALAR_EVENT, pkg_set_flatsize_from_node},
+	{ "licenselogic", -1, YAML_SCALAR_EVENT, pkg_set_licenselogic_from_node},
+	{ "licenses", PKG_LICENSES, YAML_SEQUENCE_START_EVENT, parse_sequence},
+	{ "desc", PKG_DESC, YAML_SCALAR_EVENT, pkg_set_from_node},
+	{ "scripts", PKG_SCRIPTS, YAML_MAPPING_START_EVENT, parse_mapping},
+	{ "message", PKG_MESSAGE, YAML_SCALAR_EVENT, pkg_set_from_node},
+	{ "infos", PKG_INFOS, YAML_SCALAR_EVENT, pkg_set_from_node},
+	{ "categories", PKG_CATEGORIES, YAML_SEQUENCE_START_EVENT, parse_sequence},
+	{ "options", PKG_OPTIONS, YAML_MAPPING_START_EVENT, parse_mapping},
+	{ "users", PKG_USERS, YAML_SEQUENCE_START_EVENT, parse_sequence}, /* compatibility with old format */
+	{ "users", PKG_USERS, YAML_MAPPING_START_EVENT, parse_mapping},
+	{ "groups", PKG_GROUPS, YAML_SEQUENCE_START_EVENT, parse_sequence},
+	{ "groups", PKG_GROUPS, YAML_MAPPING_START_EVENT, parse_mapping}, /* compatibility with old format */
+	{ "shlibs", PKG_SHLIBS, YAML_SEQUENCE_START_EVENT, parse_sequence},
+	{ "shlibs_provided", PKG_SHLIBS_PROVIDED, YAML_SEQUENCE_START_EVENT, parse_sequence},
 	{ NULL, -99, -99, NULL}
 };
 
@@ -176,7 +192,111 @@ pkg_load_manifest_file(struct pkg *pkg, const char *fpath)
 }
 
 static int
-pkg_set_from_node(struct pkg *pkg, yaml_node_t *val, __unused yaml_document_t *doc, int attr)
+manifest_next(struct manifest_parser *mp, yaml_event_t *ev)
+{
+	if (yaml_parser_parse(&mp->parser, ev))
+		return (EPKG_OK);
+
+	if (!mp->error)
+		pkg_emit_error("Invalid manifest format");
+	mp->error = true;
+	memset(ev, 0, sizeof(yaml_event_t));
+
+	return (EPKG_FATAL);
+}
+
+/* Consume the events of the node which starts with ev */
+static int
+manifest_skip(struct manifest_parser *mp, yaml_event_t *ev)
+{
+	yaml_event_t e;
+	int depth = 1;
+
+	if (ev->type != YAML_MAPPING_START_EVENT &&
+	    ev->type != YAML_SEQUENCE_START_EVENT)
+		return (EPKG_OK);
+
+	while (depth > 0) {
+		if (manifest_next(mp, &e) != EPKG_OK)
+			return (EPKG_FATAL);
+		if (e.type == YAML_MAPPING_START_EVENT ||
+		    e.type == YAML_SEQUENCE_START_EVENT)
+			depth++;
+		else if (e.type == YAML_MAPPING_END_EVENT ||
+		    e.type == YAML_SEQUENCE_END_EVENT)
+			depth--;
+		yaml_event_delete(&e);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Read the next pair of the mapping being parsed, EPKG_END once it is
+ * over.  The key is a scalar, other keys are skipped along with their
+ * value.  The value is the first event of its node, the caller consumes
+ * the rest of it and deletes both events.
+ */
+static int
+manifest_next_pair(struct manifest_parser *mp, yaml_event_t *key,
+    yaml_event_t *val)
+{
+	int ret;
+
+	for (;;) {
+		if (manifest_next(mp, key) != EPKG_OK)
+			return (EPKG_FATAL);
+
+		if (key->type == YAML_MAPPING_END_EVENT) {
+			yaml_event_delete(key);
+			return (EPKG_END);
+		}
+
+		if (key->type == YAML_SCALAR_EVENT)
+			break;
+
+		ret = manifest_skip(mp, key);
+		yaml_event_delete(key);
+		if (ret != EPKG_OK || manifest_next(mp, val) != EPKG_OK)
+			return (EPKG_FATAL);
+		ret = manifest_skip(mp, val);
+		yaml_event_delete(val);
+		if (ret != EPKG_OK)
+			return (EPKG_FATAL);
+	}
+
+	if (manifest_next(mp, val) != EPKG_OK) {
+		yaml_event_delete(key);
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * pkg_addfile() looks for duplicates in the whole list, the paths are
+ * looked up in a hash set instead.
+ */
+static void
+manifest_addfile(struct pkg *pkg, struct manifest_parser *mp,
+    const char *path, const char *sum, const char *uname, const char *gname,
+    mode_t perm)
+{
+	struct pkg_file *f;
+
+	if (strset_get(&mp->files, path) != NULL) {
+		pkg_emit_error("duplicate file listing: %s, ignoring", path);
+		return;
+	}
+
+	pkg_addfile_attr(pkg, path, sum, uname, gname, perm, false);
+	f = STAILQ_LAST(&pkg->files, pkg_file, next);
+	strset_add(&mp->files, f->path, f, NULL);
+}
+
+static int
+pkg_set_from_node(struct pkg *pkg, __unused struct manifest_parser *mp,
+    yaml_event_t *val, int attr)
 {
 	int ret = EPKG_OK;
 
@@ -186,448 +306,523 @@ pkg_set_from_node(struct pkg *pkg, yaml_node_t *val, __unused yaml_document_t *d
 		val->data.scalar.length--;
 	}
 
-	ret = urldecode(val->data.scalar.value, &pkg->fields[attr]);
+	ret = urldecode(SCALAR(val), &pkg->fields[attr]);
 
 	return (ret);
 }
 
 static int
-pkg_set_flatsize_from_node(struct pkg *pkg, yaml_node_t *val, __unused yaml_document_t *doc, __unused int attr)
+pkg_set_flatsize_from_node(struct pkg *pkg, __unused struct manifest_parser *mp,
+    yaml_event_t *val, __unused int attr)
 {
 	int64_t flatsize;
 	const char *errstr = NULL;
-	flatsize = strtonum(val->data.scalar.value, 0, INT64_MAX, &errstr);
+	flatsize = strtonum(SCALAR(val), 0, INT64_MAX, &errstr);
 	if (errstr) {
 		pkg_emit_error("Unable to convert %s to int64: %s",
-					   val->data.scalar.value, errstr);
+					   SCALAR(val), errstr);
 		return (EPKG_FATAL);
 	}
 
 	return (pkg_set(pkg, PKG_FLATSIZE, flatsize));
 }
 static int
-pkg_set_licenselogic_from_node(struct pkg *pkg, yaml_node_t *val, __unused yaml_document_t *doc, __unused int attr)
+pkg_set_licenselogic_from_node(struct pkg *pkg,
+    __unused struct manifest_parser *mp, yaml_event_t *val, __unused int attr)
 {
-	if (!strcmp(val->data.scalar.value, "single"))
+	if (!strcmp(SCALAR(val), "single"))
 		pkg_set(pkg, PKG_LICENSE_LOGIC, (int64_t) LICENSE_SINGLE);
-	else if (!strcmp(val->data.scalar.value, "and") || !strcmp(val->data.scalar.value, "dual"))
+	else if (!strcmp(SCALAR(val), "and") || !strcmp(SCALAR(val), "dual"))
 		pkg_set(pkg, PKG_LICENSE_LOGIC, (int64_t)LICENSE_AND);
-	else if (!strcmp(val->data.scalar.value, "or") || !strcmp(val->data.scalar.value, "multi"))
+	else if (!strcmp(SCALAR(val), "or") || !strcmp(SCALAR(val), "multi"))
 		pkg_set(pkg, PKG_LICENSE_LOGIC, (int64_t)LICENSE_OR);
 	else {
-		pkg_emit_error("Unknown license logic: %s", val->data.scalar.value);
+		pkg_emit_error("Unknown license logic: %s", SCALAR(val));
 		return (EPKG_FATAL);
 	}
 	return (EPKG_OK);
 }
 
 static int
-parse_sequence(struct pkg * pkg, yaml_node_t *node, yaml_document_t *doc, int attr)
+parse_sequence(struct pkg * pkg, struct manifest_parser *mp,
+    __unused yaml_event_t *node, int attr)
 {
-	yaml_node_item_t *item;
-	yaml_node_t *val;
+	yaml_event_t val;
+	bool scalar;
+	bool consumed;
+	int ret = EPKG_OK;
+
+	for (;;) {
+		if (manifest_next(mp, &val) != EPKG_OK)
+			return (EPKG_FATAL);
+		if (val.type == YAML_SEQUENCE_END_EVENT)
+			break;
 
-	item = node->data.sequence.items.start;
-	while (item < node->data.sequence.items.top) {
-		val = yaml_document_get_node(doc, *item);
+		scalar = (val.type == YAML_SCALAR_EVENT &&
+		    val.data.scalar.length > 0);
+		consumed = false;
 		switch (attr) {
 			case PKG_CATEGORIES:
-				if (val->type != YAML_SCALAR_NODE || val->data.scalar.length <= 0)
+				if (!scalar)
 					pkg_emit_error("Skipping malformed category");
 				else
-					pkg_addcategory(pkg, val->data.scalar.value);
+					pkg_addcategory(pkg, SCALAR(&val));
 				break;
 			case PKG_LICENSES:
-				if (val->type != YAML_SCALAR_NODE || val->data.scalar.length <= 0)
+				if (!scalar)
 					pkg_emit_error("Skipping malformed license");
 				else
-					pkg_addlicense(pkg, val->data.scalar.value);
+					pkg_addlicense(pkg, SCALAR(&val));
 				break;
 			case PKG_USERS:
-				if (val->type == YAML_SCALAR_NODE && val->data.scalar.length > 0)
-					pkg_adduser(pkg, val->data.scalar.value);
-				else if (val->type == YAML_MAPPING_NODE)
-					parse_mapping(pkg, val, doc, attr);
-				else
+				if (scalar)
+					pkg_adduser(pkg, SCALAR(&val));
+				else if (val.type == YAML_MAPPING_START_EVENT) {
+					ret = parse_mapping(pkg, mp, &val, attr);
+					consumed = true;
+				} else
 					pkg_emit_error("Skipping malformed license");
 				break;
 			case PKG_GROUPS:
-				if (val->type == YAML_SCALAR_NODE && val->data.scalar.length > 0)
-					pkg_addgroup(pkg, val->data.scalar.value);
-				else if (val->type == YAML_MAPPING_NODE)
-					parse_mapping(pkg, val, doc, attr);
-				else
+				if (scalar)
+					pkg_addgroup(pkg, SCALAR(&val));
+				else if (val.type == YAML_MAPPING_START_EVENT) {
+					ret = parse_mapping(pkg, mp, &val, attr);
+					consumed = true;
+				} else
 					pkg_emit_error("Skipping malformed license");
 				break;
 			case PKG_DIRS:
-				if (val->type == YAML_SCALAR_NODE && val->data.scalar.length > 0)
-					pkg_adddir(pkg, val->data.scalar.value, 1);
-				else if (val->type == YAML_MAPPING_NODE)
-					parse_mapping(pkg, val, doc, attr);
-				else
+				if (scalar)
+					pkg_adddir(pkg, SCALAR(&val), 1);
+				else if (val.type == YAML_MAPPING_START_EVENT) {
+					ret = parse_mapping(pkg, mp, &val, attr);
+					consumed = true;
+				} else
 					pkg_emit_error("Skipping malformed dirs");
 				break;
 			case PKG_SHLIBS:
-				if (val->type != YAML_SCALAR_NODE || val->data.scalar.length <= 0)
+				if (!scalar)
 					pkg_emit_error("Skipping malformed shared library");
 				else 
-					pkg_addshlib(pkg, val->data.scalar.value);
+					pkg_addshlib(pkg, SCALAR(&val));
+				break;
+			case PKG_SHLIBS_PROVIDED:
+				if (!scalar)
+					pkg_emit_error("Skipping malformed shared library");
+				else
+					pkg_addshlib_provided(pkg, SCALAR(&val));
 		}
-		++item;
+		if (!consumed)
+			ret = manifest_skip(mp, &val);
+		yaml_event_delete(&val);
+		if (ret != EPKG_OK)
+			return (EPKG_FATAL);
 	}
+	yaml_event_delete(&val);
+
 	return (EPKG_OK);
 }
 
 static int
-parse_mapping(struct pkg *pkg, yaml_node_t *item, yaml_document_t *doc, int attr)
+parse_mapping(struct pkg *pkg, struct manifest_parser *mp,
+    __unused yaml_event_t *item, int attr)
 {
 	struct sbuf *tmp = NULL;
-	yaml_node_pair_t *pair;
-	yaml_node_t *key;
-	yaml_node_t *val;
+	yaml_event_t key;
+	yaml_event_t val;
 	pkg_script_t script_type;
+	bool scalar;
+	bool consumed;
+	int ret;
 
-	pair = item->data.mapping.pairs.start;
-
-	while (pair < item->data.mapping.pairs.top) {
-		key = yaml_document_get_node(doc, pair->key);
-		val = yaml_document_get_node(doc, pair->value);
+	while ((ret = manifest_next_pair(mp, &key, &val)) == EPKG_OK) {
+		scalar = (val.type == YAML_SCALAR_EVENT &&
+		    val.data.scalar.length > 0);
+		consumed = false;
 
-		if (key->data.scalar.length <= 0) {
+		if (key.data.scalar.length <= 0) {
 			pkg_emit_error("Skipping empty dependency name");
-			++pair;
-			continue;
+			goto next;
 		}
 
 		switch (attr) {
 			case PKG_DEPS:
-				if (val->type != YAML_MAPPING_NODE)
+				if (val.type != YAML_MAPPING_START_EVENT)
 					pkg_emit_error("Skipping malformed depencency %s",
-								   key->data.scalar.value);
-				else
-					pkg_set_deps_from_node(pkg, val, doc, key->data.scalar.value);
+								   SCALAR(&key));
+				else {
+					ret = pkg_set_deps_from_node(pkg, mp, SCALAR(&key));
+					consumed = true;
+				}
 				break;
 			case PKG_DIRS:
-				if (val->type != YAML_MAPPING_NODE)
+				if (val.type != YAML_MAPPING_START_EVENT)
 					pkg_emit_error("Skipping malformed dirs %s",
-								   key->data.scalar.value);
-				else
-					pkg_set_dirs_from_node(pkg, val, doc, key->data.scalar.value);
+								   SCALAR(&key));
+				else {
+					ret = pkg_set_dirs_from_node(pkg, mp, SCALAR(&key));
+					consumed = true;
+				}
 				break;
 			case PKG_USERS:
-				if (val->type == YAML_SCALAR_NODE && val->data.scalar.length > 0)
-					pkg_adduid(pkg, key->data.scalar.value, val->data.scalar.value);
+				if (scalar)
+					pkg_adduid(pkg, SCALAR(&key), SCALAR(&val));
 				else
 					pkg_emit_error("Skipping malformed users %s",
-							key->data.scalar.value);
+							SCALAR(&key));
 				break;
 			case PKG_GROUPS:
-				if (val->type == YAML_SCALAR_NODE && val->data.scalar.length > 0)
-					pkg_addgid(pkg, key->data.scalar.value, val->data.scalar.value);
+				if (scalar)
+					pkg_addgid(pkg, SCALAR(&key), SCALAR(&val));
 				else
 					pkg_emit_error("Skipping malformed groups %s",
-							key->data.scalar.value);
+							SCALAR(&key));
 				break;
 			case PKG_DIRECTORIES:
-				if (val->type == YAML_SCALAR_NODE && val->data.scalar.length > 0) {
-					urldecode(key->data.scalar.value, &tmp);
-					if (val->data.scalar.value[0] == 'y')
+				if (scalar) {
+					urldecode(SCALAR(&key), &tmp);
+					if (SCALAR(&val)[0] == 'y')
 						pkg_adddir(pkg, sbuf_get(tmp), 1);
 					else
 						pkg_adddir(pkg, sbuf_get(tmp), 0);
-				} else if (val->type == YAML_MAPPING_NODE) {
-					pkg_set_dirs_from_node(pkg, val, doc, key->data.scalar.value);
+				} else if (val.type == YAML_MAPPING_START_EVENT) {
+					ret = pkg_set_dirs_from_node(pkg, mp, SCALAR(&key));
+					consumed = true;
 				} else {
 					pkg_emit_error("Skipping malformed directories %s",
-								   key->data.scalar.value);
+								   SCALAR(&key));
 				}
 				break;
 			case PKG_FILES:
-				if (val->type == YAML_SCALAR_NODE && val->data.scalar.length > 0) {
-					urldecode(key->data.scalar.value, &tmp);
-					pkg_addfile(pkg, sbuf_get(tmp), val->data.scalar.length == 64 ? val->data.scalar.value : NULL, true);
-				} else if (val->type == YAML_MAPPING_NODE)
-					pkg_set_files_from_node(pkg, val, doc, key->data.scalar.value);
-				else
+				if (scalar) {
+					urldecode(SCALAR(&key), &tmp);
+					manifest_addfile(pkg, mp, sbuf_get(tmp),
+					    val.data.scalar.length == 64 ? SCALAR(&val) : NULL,
+					    NULL, NULL, 0);
+				} else if (val.type == YAML_MAPPING_START_EVENT) {
+					ret = pkg_set_files_from_node(pkg, mp, SCALAR(&key));
+					consumed = true;
+				} else
 					pkg_emit_error("Skipping malformed files %s",
-								   key->data.scalar.value);
+								   SCALAR(&key));
 				break;
 			case PKG_OPTIONS:
-				if (val->type != YAML_SCALAR_NODE)
+				if (val.type != YAML_SCALAR_EVENT)
 					pkg_emit_error("Skipping malformed option %s",
-								   key->data.scalar.value);
+								   SCALAR(&key));
 				else
-					pkg_addoption(pkg, key->data.scalar.value, val->data.scalar.value);
+					pkg_addoption(pkg, SCALAR(&key), SCALAR(&val));
 				break;
 			case PKG_SCRIPTS:
-				if (val->type != YAML_SCALAR_NODE)
+				if (val.type != YAML_SCALAR_EVENT) {
 					pkg_emit_error("Skipping malformed scripts %s",
-								   key->data.scalar.value);
-				if (strcmp(key->data.scalar.value, "pre-install") == 0) {
+								   SCALAR(&key));
+					break;
+				}
+				if (strcmp(SCALAR(&key), "pre-install") == 0) {
 					script_type = PKG_SCRIPT_PRE_INSTALL;
-				} else if (strcmp(key->data.scalar.value, "install") == 0) {
+				} else if (strcmp(SCALAR(&key), "install") == 0) {
 					script_type = PKG_SCRIPT_INSTALL;
-				} else if (strcmp(key->data.scalar.value, "post-install") == 0) {
+				} else if (strcmp(SCALAR(&key), "post-install") == 0) {
 					script_type = PKG_SCRIPT_POST_INSTALL;
-				} else if (strcmp(key->data.scalar.value, "pre-upgrade") == 0) {
+				} else if (strcmp(SCALAR(&key), "pre-upgrade") == 0) {
 					script_type = PKG_SCRIPT_PRE_UPGRADE;
-				} else if (strcmp(key->data.scalar.value, "upgrade") == 0) {
+				} else if (strcmp(SCALAR(&key), "upgrade") == 0) {
 					script_type = PKG_SCRIPT_UPGRADE;
-				} else if (strcmp(key->data.scalar.value, "post-upgrade") == 0) {
+				} else if (strcmp(SCALAR(&key), "post-upgrade") == 0) {
 					script_type = PKG_SCRIPT_POST_UPGRADE;
-				} else if (strcmp(key->data.scalar.value, "pre-deinstall") == 0) {
+				} else if (strcmp(SCALAR(&key), "pre-deinstall") == 0) {
 					script_type = PKG_SCRIPT_PRE_DEINSTALL;
-				} else if (strcmp(key->data.scalar.value, "deinstall") == 0) {
+				} else if (strcmp(SCALAR(&key), "deinstall") == 0) {
 					script_type = PKG_SCRIPT_DEINSTALL;
-				} else if (strcmp(key->data.scalar.value, "post-deinstall") == 0) {
+				} else if (strcmp(SCALAR(&key), "post-deinstall") == 0) {
 					script_type = PKG_SCRIPT_POST_DEINSTALL;
 				} else {
 					pkg_emit_error("Skipping unknown script type: %s",
-								   key->data.scalar.value);
+								   SCALAR(&key));
 					break;
 				}
 
-				urldecode(val->data.scalar.value, &tmp);
+				urldecode(SCALAR(&val), &tmp);
 				pkg_addscript(pkg, sbuf_get(tmp), script_type);
 				break;
 		}
 
-		++pair;
+		next:
+		if (!consumed)
+			ret = manifest_skip(mp, &val);
+		yaml_event_delete(&key);
+		yaml_event_delete(&val);
+		if (ret != EPKG_OK)
+			break;
 	}
 
 	sbuf_free(tmp);
-	return (EPKG_OK);
+	return (mp->error ? EPKG_FATAL : EPKG_OK);
+}
+
+/* Keep a copy of a scalar value, the event is deleted right after */
+static void
+manifest_strdup(char **dest, yaml_event_t *val)
+{
+	free(*dest);
+	*dest = strdup(SCALAR(val));
 }
 
 static int
-pkg_set_files_from_node(struct pkg *pkg, yaml_node_t *item, yaml_document_t *doc, const char *filename) {
-	yaml_node_pair_t *pair = NULL;
-	yaml_node_t *key = NULL;
-	yaml_node_t *val = NULL;
-	const char *sum = NULL;
-	const char *uname = NULL;
-	const char *gname = NULL;
+pkg_set_files_from_node(struct pkg *pkg, struct manifest_parser *mp,
+    const char *filename)
+{
+	yaml_event_t key;
+	yaml_event_t val;
+	char *sum = NULL;
+	char *uname = NULL;
+	char *gname = NULL;
 	void *set = NULL;
 	mode_t perm = 0;
+	bool empty = true;
+	int ret;
 
-	pair = item->data.mapping.pairs.start;
-	while (pair < item->data.mapping.pairs.top) {
-		key = yaml_document_get_node(doc, pair->key);
-		val = yaml_document_get_node(doc, pair->value);
-		if (key->data.scalar.length <= 0) {
-			pkg_emit_error("Skipping malformed file entry for %s", filename);
-			++pair;
-			continue;
-		}
-
-		if (val->type != YAML_SCALAR_NODE || val->data.scalar.length <= 0) {
+	while ((ret = manifest_next_pair(mp, &key, &val)) == EPKG_OK) {
+		empty = false;
+		if (key.data.scalar.length <= 0 ||
+		    val.type != YAML_SCALAR_EVENT || val.data.scalar.length <= 0) {
 			pkg_emit_error("Skipping malformed file entry for %s", filename);
-			++pair;
-			continue;
-		}
-
-		if (!strcasecmp(key->data.scalar.value, "uname"))
-			uname = val->data.scalar.value;
-		else if (!strcasecmp(key->data.scalar.value, "gname"))
-			gname = val->data.scalar.value;
-		else if (!strcasecmp(key->data.scalar.value, "sum") && val->data.scalar.length == 64)
-			sum = val->data.scalar.value;
-		else if (!strcasecmp(key->data.scalar.value, "perm")) {
-			if ((set = setmode(val->data.scalar.value)) == NULL)
-				pkg_emit_error("Not a valide mode: %s", val->data.scalar.value);
+			ret = manifest_skip(mp, &val);
+		} else if (!strcasecmp(SCALAR(&key), "uname"))
+			manifest_strdup(&uname, &val);
+		else if (!strcasecmp(SCALAR(&key), "gname"))
+			manifest_strdup(&gname, &val);
+		else if (!strcasecmp(SCALAR(&key), "sum") && val.data.scalar.length == 64)
+			manifest_strdup(&sum, &val);
+		else if (!strcasecmp(SCALAR(&key), "perm")) {
+			if ((set = setmode(SCALAR(&val))) == NULL)
+				pkg_emit_error("Not a valide mode: %s", SCALAR(&val));
 			else
 				perm = getmode(set, 0);
+			free(set);
 		} else {
 			pkg_emit_error("Skipping unknown key for file(%s): %s", filename,
-						   key->data.scalar.value);
+						   SCALAR(&key));
 		}
 
-		++pair;
+		yaml_event_delete(&key);
+		yaml_event_delete(&val);
+		if (ret != EPKG_OK)
+			break;
 	}
 
-	if (key != NULL)
-	    pkg_addfile_attr(pkg, key->data.scalar.value, sum, uname, gname, perm, true);
+	if (!mp->error && !empty)
+		manifest_addfile(pkg, mp, filename, sum, uname, gname, perm);
 
-	return (EPKG_OK);
+	free(sum);
+	free(uname);
+	free(gname);
+
+	return (mp->error ? EPKG_FATAL : EPKG_OK);
 }
 
 static int
-pkg_set_dirs_from_node(struct pkg *pkg, yaml_node_t *item, yaml_document_t *doc, const char *dirname) {
-	yaml_node_pair_t *pair;
-	yaml_node_t *key;
-	yaml_node_t *val;
-	const char *uname = NULL;
-	const char *gname = NULL;
+pkg_set_dirs_from_node(struct pkg *pkg, struct manifest_parser *mp,
+    const char *dirname)
+{
+	yaml_event_t key;
+	yaml_event_t val;
+	char *uname = NULL;
+	char *gname = NULL;
 	void *set;
 	mode_t perm = 0;
 	bool try = false;
+	int ret;
 
-	pair = item->data.mapping.pairs.start;
-	while (pair < item->data.mapping.pairs.top) {
-		key = yaml_document_get_node(doc, pair->key);
-		val = yaml_document_get_node(doc, pair->value);
-		if (key->data.scalar.length <= 0) {
-			pkg_emit_error("Skipping malformed file entry for %s", dirname);
-			++pair;
-			continue;
-		}
-
-		if (val->type != YAML_SCALAR_NODE || val->data.scalar.length <= 0) {
+	while ((ret = manifest_next_pair(mp, &key, &val)) == EPKG_OK) {
+		if (key.data.scalar.length <= 0 ||
+		    val.type != YAML_SCALAR_EVENT || val.data.scalar.length <= 0) {
 			pkg_emit_error("Skipping malformed file entry for %s", dirname);
-			++pair;
-			continue;
-		}
-
-		if (!strcasecmp(key->data.scalar.value, "uname"))
-			uname = val->data.scalar.value;
-		else if (!strcasecmp(key->data.scalar.value, "gname"))
-			gname = val->data.scalar.value;
-		else if (!strcasecmp(key->data.scalar.value, "perm")) {
-			if ((set = setmode(val->data.scalar.value)) == NULL)
-				pkg_emit_error("Not a valide mode: %s", val->data.scalar.value);
+			ret = manifest_skip(mp, &val);
+		} else if (!strcasecmp(SCALAR(&key), "uname"))
+			manifest_strdup(&uname, &val);
+		else if (!strcasecmp(SCALAR(&key), "gname"))
+			manifest_strdup(&gname, &val);
+		else if (!strcasecmp(SCALAR(&key), "perm")) {
+			if ((set = setmode(SCALAR(&val))) == NULL)
+				pkg_emit_error("Not a valide mode: %s", SCALAR(&val));
 			else
 				perm = getmode(set, 0);
-		} else if (!strcasecmp(key->data.scalar.value, "try")) {
-			if (val->data.scalar.value[0] == 'n')
+			free(set);
+		} else if (!strcasecmp(SCALAR(&key), "try")) {
+			if (SCALAR(&val)[0] == 'n')
 				try = false;
-			else if (val->data.scalar.value[0] == 'y')
+			else if (SCALAR(&val)[0] == 'y')
 				try = true;
 			else
-				pkg_emit_error("Wrong value for try: %s, expected 'y' or 'n'", val->data.scalar.value);
+				pkg_emit_error("Wrong value for try: %s, expected 'y' or 'n'", SCALAR(&val));
 		} else {
 			pkg_emit_error("Skipping unknown key for dir(%s): %s", dirname,
-						   key->data.scalar.value);
+						   SCALAR(&key));
 		}
 
-		++pair;
+		yaml_event_delete(&key);
+		yaml_event_delete(&val);
+		if (ret != EPKG_OK)
+			break;
 	}
 
-	pkg_adddir_attr(pkg, dirname, uname, gname, perm, try);
+	if (!mp->error)
+		pkg_adddir_attr(pkg, dirname, uname, gname, perm, try);
 
-	return (EPKG_OK);
+	free(uname);
+	free(gname);
+
+	return (mp->error ? EPKG_FATAL : EPKG_OK);
 }
 
 static int
-pkg_set_deps_from_node(struct pkg *pkg, yaml_node_t *item, yaml_document_t *doc, const char *depname) {
-	yaml_node_pair_t *pair;
-	yaml_node_t *key;
-	yaml_node_t *val;
-	const char *origin = NULL;
-	const char *version = NULL;
-
-	pair = item->data.mapping.pairs.start;
-	while (pair < item->data.mapping.pairs.top) {
-		key = yaml_document_get_node(doc, pair->key);
-		val = yaml_document_get_node(doc, pair->value);
-		if (key->data.scalar.length <= 0) {
-			pkg_emit_error("Skipping malformed dependency entry for %s",
-						   depname);
-			++pair;
-			continue;
-		}
-
-		if (val->type != YAML_SCALAR_NODE || val->data.scalar.length <= 0) {
+pkg_set_deps_from_node(struct pkg *pkg, struct manifest_parser *mp,
+    const char *depname)
+{
+	yaml_event_t key;
+	yaml_event_t val;
+	char *origin = NULL;
+	char *version = NULL;
+	int ret;
+
+	while ((ret = manifest_next_pair(mp, &key, &val)) == EPKG_OK) {
+		if (key.data.scalar.length <= 0 ||
+		    val.type != YAML_SCALAR_EVENT || val.data.scalar.length <= 0) {
 			pkg_emit_error("Skipping malformed dependency entry for %s",
 						   depname);
-			++pair;
-			continue;
-		}
-
-		if (!strcasecmp(key->data.scalar.value, "origin"))
-			origin = val->data.scalar.value;
-
-		if (!strcasecmp(key->data.scalar.value, "version"))
-			version = val->data.scalar.value;
-
-		++pair;
+			ret = manifest_skip(mp, &val);
+		} else if (!strcasecmp(SCALAR(&key), "origin"))
+			manifest_strdup(&origin, &val);
+		else if (!strcasecmp(SCALAR(&key), "version"))
+			manifest_strdup(&version, &val);
+
+		yaml_event_delete(&key);
+		yaml_event_delete(&val);
+		if (ret != EPKG_OK)
+			break;
 	}
 
-	if (origin != NULL && version != NULL)
+	if (mp->error)
+		;
+	else if (origin != NULL && version != NULL)
 		pkg_adddep(pkg, depname, origin, version);
 	else
 		pkg_emit_error("Skipping malformed dependency %s", depname);
 
-	return (EPKG_OK);
+	free(origin);
+	free(version);
+
+	return (mp->error ? EPKG_FATAL : EPKG_OK);
 }
 
 static int
-parse_root_node(struct pkg *pkg, yaml_node_t *node, yaml_document_t *doc) {
-	yaml_node_pair_t *pair;
-	yaml_node_t *key;
-	yaml_node_t *val;
+parse_root_node(struct pkg *pkg, struct manifest_parser *mp)
+{
+	yaml_event_t key;
+	yaml_event_t val;
 	int i = 0;
+	int ret;
 	int retcode = EPKG_OK;
 
-	pair = node->data.mapping.pairs.start;
-	while (pair < node->data.mapping.pairs.top) {
-		if (retcode == EPKG_FATAL)
-			break;
-
-		key = yaml_document_get_node(doc, pair->key);
-		val = yaml_document_get_node(doc, pair->value);
-		if (key->data.scalar.length <= 0) {
+	while ((ret = manifest_next_pair(mp, &key, &val)) == EPKG_OK) {
+		if (key.data.scalar.length <= 0) {
 			pkg_emit_error("Skipping empty key");
-			++pair;
-			continue;
-		}
-
-		if (val->type == YAML_NO_NODE || (val->type == YAML_SCALAR_NODE && val->data.scalar.length <= 0)) {
+			ret = manifest_skip(mp, &val);
+		} else if (val.type == YAML_SCALAR_EVENT && val.data.scalar.length <= 0) {
 			/* silently skip on purpose */
-			++pair;
-			continue;
-		}
-
-		for (i = 0; manifest_key[i].key != NULL; i++) {
-			if (!strcasecmp(key->data.scalar.value, manifest_key[i].key)) {
-				if (val->type == manifest_key[i].valid_type) {
-					retcode = manifest_key[i].parse_data(pkg, val, doc, manifest_key[i].type);
+		} else {
+			for (i = 0; manifest_key[i].key != NULL; i++) {
+				if (!strcasecmp(SCALAR(&key), manifest_key[i].key) &&
+				    val.type == manifest_key[i].valid_type)
 					break;
-				}
 			}
 
+			/* unknown keys are ignored */
 			if (manifest_key[i].key == NULL)
-				pkg_emit_error("Skipping unknown manifest key: %s",
-							   key->data.scalar.value);
+				ret = manifest_skip(mp, &val);
+			else
+				retcode = manifest_key[i].parse_data(pkg, mp, &val,
+				    manifest_key[i].type);
 		}
-		++pair;
+
+		yaml_event_delete(&key);
+		yaml_event_delete(&val);
+		if (ret != EPKG_OK || retcode != EPKG_OK)
+			break;
 	}
 
-	return (retcode);
+	return (mp->error ? EPKG_FATAL : retcode);
 }
 
 int
 pkg_parse_manifest(struct pkg *pkg, char *buf)
 {
-	yaml_parser_t parser;
-	yaml_document_t doc;
-	yaml_node_t *node;
+	struct manifest_parser mp;
+	struct pkg_file *file = NULL;
+	yaml_event_t ev;
 	int retcode = EPKG_FATAL;
 
 	assert(pkg != NULL);
 	assert(buf != NULL);
 
-	yaml_parser_initialize(&parser);
-	yaml_parser_set_input_string(&parser, buf, strlen(buf));
-	yaml_parser_load(&parser, &doc);
+	memset(&mp, 0, sizeof(mp));
+	yaml_parser_initialize(&mp.parser);
+	yaml_parser_set_input_string(&mp.parser, buf, strlen(buf));
 
-	node = yaml_document_get_root_node(&doc);
-	if (node != NULL) {
-		if (node->type != YAML_MAPPING_NODE) {
-			pkg_emit_error("Invalid manifest format");
-		} else {
-			parse_root_node(pkg, node, &doc);
-			retcode = EPKG_OK;
-		}
-	} else {
+	while (pkg_files(pkg, &file) == EPKG_OK)
+		strset_add(&mp.files, file->path, file, NULL);
+
+	/* the stream and document starts, then the root node */
+	do {
+		if (manifest_next(&mp, &ev) != EPKG_OK)
+			goto cleanup;
+		if (ev.type == YAML_STREAM_START_EVENT ||
+		    ev.type == YAML_DOCUMENT_START_EVENT)
+			yaml_event_delete(&ev);
+		else
+			break;
+	} while (1);
+
+	if (ev.type != YAML_MAPPING_START_EVENT) {
 		pkg_emit_error("Invalid manifest format");
+		yaml_event_delete(&ev);
+		goto cleanup;
 	}
+	yaml_event_delete(&ev);
+
+	parse_root_node(pkg, &mp);
+
+	if (!mp.error)
+		retcode = EPKG_OK;
 
-	yaml_document_delete(&doc);
-	yaml_parser_delete(&parser);
+	cleanup:
+	strset_free(&mp.files);
+	yaml_parser_delete(&mp.parser);
 
 	return retcode;
 }
 
+/*
+ * State of pkg_emit_manifest().  The events are handed to the emitter as the
+ * package is walked, no document tree is built.
+ */
+struct manifest_emitter {
+	yaml_emitter_t emitter;
+	yaml_write_handler_t *handler;
+	void *data;
+	int64_t written;	/* bytes handed to handler so far */
+	bool error;		/* an event could not be emitted */
+};
+
+/* The bytes of a manifest emitted into a packing entry */
+struct manifest_sink {
+	struct packing *pack;	/* NULL to only count them */
+	int64_t size;
+};
+
 static int
 yaml_write_buf(void *data, unsigned char *buffer, size_t size)
 {
@@ -636,23 +831,162 @@ yaml_write_buf(void *data, unsigned char *buffer, size_t size)
 	return (1);
 }
 
+static int
+yaml_write_packing(void *data, unsigned char *buffer, size_t size)
+{
+	struct manifest_sink *sink = (struct manifest_sink *)data;
+
+	if (sink->pack != NULL &&
+	    packing_append_data(sink->pack, buffer, size) != EPKG_OK)
+		return (0);
+	sink->size += size;
+
+	return (1);
+}
+
+static int
+manifest_write(void *data, unsigned char *buffer, size_t size)
+{
+	struct manifest_emitter *me = (struct manifest_emitter *)data;
+
+	if (!me->handler(me->data, buffer, size))
+		return (0);
+	me->written += size;
+
+	return (1);
+}
+
 static void
-manifest_append_seqval(yaml_document_t *doc, int parent, int *seq, const char *title, const char *value)
+manifest_emit(struct manifest_emitter *me, yaml_event_t *ev)
 {
-	if (*seq == -1) {
-		*seq = yaml_document_add_sequence(doc, NULL, YAML_FLOW_SEQUENCE_STYLE);
-		yaml_document_append_mapping_pair(doc, parent,
-				yaml_document_add_scalar(doc, NULL, __DECONST(yaml_char_t*, title), strlen(title), YAML_PLAIN_SCALAR_STYLE), *seq);
+	/* the emitter owns ev from now on, even on failure */
+	if (!yaml_emitter_emit(&me->emitter, ev))
+		me->error = true;
+}
+
+static void
+manifest_scalar(struct manifest_emitter *me, const char *value,
+    yaml_scalar_style_t style)
+{
+	yaml_event_t ev;
+
+	if (me->error)
+		return;
+
+	if (!yaml_scalar_event_initialize(&ev, NULL, NULL,
+	    __DECONST(yaml_char_t *, value), strlen(value), 1, 1, style)) {
+		me->error = true;
+		return;
 	}
-	yaml_document_append_sequence_item(doc, *seq,
-			yaml_document_add_scalar(doc, NULL, __DECONST(yaml_char_t*, value), strlen(value), YAML_PLAIN_SCALAR_STYLE));
+	manifest_emit(me, &ev);
 }
 
-int
-pkg_emit_manifest(struct pkg *pkg, char **dest)
+static void
+manifest_kv(struct manifest_emitter *me, const char *key, const char *value,
+    yaml_scalar_style_t style)
 {
-	yaml_emitter_t emitter;
-	yaml_document_t doc;
+	manifest_scalar(me, key, YAML_PLAIN_SCALAR_STYLE);
+	manifest_scalar(me, value, style);
+}
+
+/*
+ * Open the mapping or the sequence of key, the sections are only emitted
+ * when they have an item so they are opened on the first one.
+ */
+static void
+manifest_open(struct manifest_emitter *me, const char *key,
+    yaml_event_type_t type, int style, bool *open)
+{
+	yaml_event_t ev;
+	int ret;
+
+	if (*open)
+		return;
+	*open = true;
+
+	manifest_scalar(me, key, YAML_PLAIN_SCALAR_STYLE);
+	if (me->error)
+		return;
+
+	if (type == YAML_MAPPING_START_EVENT)
+		ret = yaml_mapping_start_event_initialize(&ev, NULL, NULL, 1,
+		    (yaml_mapping_style_t)style);
+	else
+		ret = yaml_sequence_start_event_initialize(&ev, NULL, NULL, 1,
+		    (yaml_sequence_style_t)style);
+	if (!ret) {
+		me->error = true;
+		return;
+	}
+	manifest_emit(me, &ev);
+}
+
+static void
+manifest_close(struct manifest_emitter *me, yaml_event_type_t type,
+    bool *open)
+{
+	yaml_event_t ev;
+
+	if (!*open)
+		return;
+	*open = false;
+
+	if (me->error)
+		return;
+
+	if (type == YAML_MAPPING_START_EVENT)
+		yaml_mapping_end_event_initialize(&ev);
+	else
+		yaml_sequence_end_event_initialize(&ev);
+	manifest_emit(me, &ev);
+}
+
+static void
+manifest_urlencode_kv(struct manifest_emitter *me, const char *key,
+    const char *value, yaml_scalar_style_t style, struct sbuf **tmpsbuf)
+{
+	urlencode(value, tmpsbuf);
+	manifest_kv(me, key, sbuf_get(*tmpsbuf), style);
+}
+
+static const char *
+manifest_script_type(pkg_script_t type)
+{
+	switch (type) {
+		case PKG_SCRIPT_PRE_INSTALL:
+			return ("pre-install");
+		case PKG_SCRIPT_INSTALL:
+			return ("install");
+		case PKG_SCRIPT_POST_INSTALL:
+			return ("post-install");
+		case PKG_SCRIPT_PRE_UPGRADE:
+			return ("pre-upgrade");
+		case PKG_SCRIPT_UPGRADE:
+			return ("upgrade");
+		case PKG_SCRIPT_POST_UPGRADE:
+			return ("post-upgrade");
+		case PKG_SCRIPT_PRE_DEINSTALL:
+			return ("pre-deinstall");
+		case PKG_SCRIPT_DEINSTALL:
+			return ("deinstall");
+		case PKG_SCRIPT_POST_DEINSTALL:
+			return ("post-deinstall");
+		default:
+			return (NULL);
+	}
+}
+
+/*
+ * Emit the manifest of pkg through handler, with nothing kept in memory.
+ * If files_offset is not NULL, it is set to where the files section starts
+ * in the output, -1 if there is none.
+ */
+static int
+emit_manifest(struct pkg *pkg, yaml_write_handler_t *handler, void *data,
+    int64_t *files_offset)
+{
+	struct manifest_emitter me;
+	yaml_event_t ev;
 	char tmpbuf[BUFSIZ];
 	struct pkg_dep *dep = NULL;
 	struct pkg_option *option = NULL;
@@ -665,36 +999,32 @@ pkg_emit_manifest(struct pkg *pkg, char **dest)
 	struct pkg_group *group = NULL;
 	struct pkg_shlib *shlib = NULL;
 	struct sbuf *tmpsbuf = NULL;
-	int rc = EPKG_OK;
-	int mapping;
-	int seq = -1;
-	int map = -1;
-	int depkv;
-/*	int users = -1;
-	int groups = -1;*/
+	bool open = false;
+	bool depopen = false;
 	const char *script_types = NULL;
-	struct sbuf *destbuf = sbuf_new_auto();
 	const char *name, *version, *pkgorigin, *comment, *pkgarch, *www, *pkgmaintainer, *prefix;
-	const char *desc, *message, *infos;
+	const char *desc, *message, *infos, *sum;
 	lic_t licenselogic;
 	int64_t flatsize;
 
-	yaml_emitter_initialize(&emitter);
-	yaml_emitter_set_unicode(&emitter, 1);
-	yaml_emitter_set_output(&emitter, yaml_write_buf, destbuf);
-
-#define manifest_append_kv(map, key, val, style) yaml_document_append_mapping_pair(&doc, map, \
-		yaml_document_add_scalar(&doc, NULL, __DECONST(yaml_char_t*, key), strlen(key), YAML_PLAIN_SCALAR_STYLE), \
-		yaml_document_add_scalar(&doc, NULL, __DECONST(yaml_char_t*, val), strlen(val), YAML_##style##_SCALAR_STYLE));
-
-#define manifest_append_map(id, map, key, block) do { \
-	id = yaml_document_add_mapping(&doc, NULL, YAML_##block##_MAPPING_STYLE); \
-	yaml_document_append_mapping_pair(&doc, map, \
-		yaml_document_add_scalar(&doc, NULL, __DECONST(yaml_char_t*, key), strlen(key), YAML_PLAIN_SCALAR_STYLE), id); \
-	} while (0)
-
-	yaml_document_initialize(&doc, NULL, NULL, NULL, 0, 1);
-	mapping = yaml_document_add_mapping(&doc, NULL, YAML_BLOCK_MAPPING_STYLE);
+	memset(&me, 0, sizeof(me));
+	me.handler = handler;
+	me.data = data;
+	yaml_emitter_initialize(&me.emitter);
+	yaml_emitter_set_unicode(&me.emitter, 1);
+	yaml_emitter_set_output(&me.emitter, manifest_write, &me);
+
+	yaml_stream_start_event_initialize(&ev, YAML_ANY_ENCODING);
+	manifest_emit(&me, &ev);
+	if (!me.error) {
+		yaml_document_start_event_initialize(&ev, NULL, NULL, NULL, 0);
+		manifest_emit(&me, &ev);
+	}
+	if (!me.error) {
+		yaml_mapping_start_event_initialize(&ev, NULL, NULL, 1,
+		    YAML_BLOCK_MAPPING_STYLE);
+		manifest_emit(&me, &ev);
+	}
 
 	pkg_get(pkg, PKG_NAME, &name, PKG_ORIGIN, &pkgorigin, PKG_COMMENT, &comment,
 	    PKG_ARCH, &pkgarch, PKG_WWW, &www,
@@ -702,159 +1032,521 @@ pkg_emit_manifest(struct pkg *pkg, char **dest)
 	    PKG_LICENSE_LOGIC, &licenselogic, PKG_DESC, &desc,
 	    PKG_FLATSIZE, &flatsize, PKG_MESSAGE, &message, PKG_VERSION, &version,
 	    PKG_INFOS, &infos);
-	manifest_append_kv(mapping, "name", name, PLAIN);
-	manifest_append_kv(mapping, "version", version, PLAIN);
-	manifest_append_kv(mapping, "origin", pkgorigin, PLAIN);
-	manifest_append_kv(mapping, "comment", comment, PLAIN);
-	manifest_append_kv(mapping, "arch", pkgarch, PLAIN);
-	manifest_append_kv(mapping, "www", www, PLAIN);
-	manifest_append_kv(mapping, "maintainer", pkgmaintainer, PLAIN);
-	manifest_append_kv(mapping, "prefix", prefix, PLAIN);
+	manifest_kv(&me, "name", name, YAML_PLAIN_SCALAR_STYLE);
+	manifest_kv(&me, "version", version, YAML_PLAIN_SCALAR_STYLE);
+	manifest_kv(&me, "origin", pkgorigin, YAML_PLAIN_SCALAR_STYLE);
+	manifest_kv(&me, "comment", comment, YAML_PLAIN_SCALAR_STYLE);
+	manifest_kv(&me, "arch", pkgarch, YAML_PLAIN_SCALAR_STYLE);
+	manifest_kv(&me, "www", www, YAML_PLAIN_SCALAR_STYLE);
+	manifest_kv(&me, "maintainer", pkgmaintainer, YAML_PLAIN_SCALAR_STYLE);
+	manifest_kv(&me, "prefix", prefix, YAML_PLAIN_SCALAR_STYLE);
 	switch (licenselogic) {
 		case LICENSE_SINGLE:
-			manifest_append_kv(mapping, "licenselogic", "single", PLAIN);
+			manifest_kv(&me, "licenselogic", "single", YAML_PLAIN_SCALAR_STYLE);
 			break;
 		case LICENSE_AND:
-			manifest_append_kv(mapping, "licenselogic", "and", PLAIN);
+			manifest_kv(&me, "licenselogic", "and", YAML_PLAIN_SCALAR_STYLE);
 			break;
 		case LICENSE_OR:
-			manifest_append_kv(mapping, "licenselogic", "or", PLAIN);
+			manifest_kv(&me, "licenselogic", "or", YAML_PLAIN_SCALAR_STYLE);
 			break;
 	}
 
-	seq = -1;
-	while (pkg_licenses(pkg, &license) == EPKG_OK)
-		manifest_append_seqval(&doc, mapping, &seq, "licenses", pkg_license_name(license));
+	while (pkg_licenses(pkg, &license) == EPKG_OK) {
+		manifest_open(&me, "licenses", YAML_SEQUENCE_START_EVENT,
+		    YAML_FLOW_SEQUENCE_STYLE, &open);
+		manifest_scalar(&me, pkg_license_name(license), YAML_PLAIN_SCALAR_STYLE);
+	}
+	manifest_close(&me, YAML_SEQUENCE_START_EVENT, &open);
 
 	snprintf(tmpbuf, BUFSIZ, "%" PRId64, flatsize);
-	manifest_append_kv(mapping, "flatsize", tmpbuf, PLAIN);
-	urlencode(desc, &tmpsbuf);
-	manifest_append_kv(mapping, "desc", sbuf_get(tmpsbuf), LITERAL);
+	manifest_kv(&me, "flatsize", tmpbuf, YAML_PLAIN_SCALAR_STYLE);
+	manifest_urlencode_kv(&me, "desc", desc, YAML_LITERAL_SCALAR_STYLE, &tmpsbuf);
 
-	map = -1;
 	while (pkg_deps(pkg, &dep) == EPKG_OK) {
-		if (map == -1)
-			manifest_append_map(map, mapping, "deps", BLOCK);
+		manifest_open(&me, "deps", YAML_MAPPING_START_EVENT,
+		    YAML_BLOCK_MAPPING_STYLE, &open);
+
+		manifest_open(&me, pkg_dep_get(dep, PKG_DEP_NAME),
+		    YAML_MAPPING_START_EVENT, YAML_FLOW_MAPPING_STYLE, &depopen);
+		manifest_kv(&me, "origin", pkg_dep_get(dep, PKG_DEP_ORIGIN), YAML_PLAIN_SCALAR_STYLE);
+		manifest_kv(&me, "version", pkg_dep_get(dep, PKG_DEP_VERSION), YAML_PLAIN_SCALAR_STYLE);
+		manifest_close(&me, YAML_MAPPING_START_EVENT, &depopen);
+	}
+	manifest_close(&me, YAML_MAPPING_START_EVENT, &open);
 
-		manifest_append_map(depkv, map, pkg_dep_get(dep, PKG_DEP_NAME), FLOW);
-		manifest_append_kv(depkv, "origin", pkg_dep_get(dep, PKG_DEP_ORIGIN), PLAIN);
-		manifest_append_kv(depkv, "version", pkg_dep_get(dep, PKG_DEP_VERSION), PLAIN);
+	while (pkg_categories(pkg, &category) == EPKG_OK) {
+		manifest_open(&me, "categories", YAML_SEQUENCE_START_EVENT,
+		    YAML_FLOW_SEQUENCE_STYLE, &open);
+		manifest_scalar(&me, pkg_category_name(category), YAML_PLAIN_SCALAR_STYLE);
 	}
+	manifest_close(&me, YAML_SEQUENCE_START_EVENT, &open);
 
-	seq = -1;
-	while (pkg_categories(pkg, &category) == EPKG_OK)
-		manifest_append_seqval(&doc, mapping, &seq, "categories", pkg_category_name(category));
+	while (pkg_users(pkg, &user) == EPKG_OK) {
+		manifest_open(&me, "users", YAML_SEQUENCE_START_EVENT,
+		    YAML_FLOW_SEQUENCE_STYLE, &open);
+		manifest_scalar(&me, pkg_user_name(user), YAML_PLAIN_SCALAR_STYLE);
+	}
+	manifest_close(&me, YAML_SEQUENCE_START_EVENT, &open);
 
-	seq = -1;
-	while (pkg_users(pkg, &user) == EPKG_OK)
-		manifest_append_seqval(&doc, mapping, &seq, "users", pkg_user_name(user));
+	while (pkg_groups(pkg, &group) == EPKG_OK) {
+		manifest_open(&me, "groups", YAML_SEQUENCE_START_EVENT,
+		    YAML_FLOW_SEQUENCE_STYLE, &open);
+		manifest_scalar(&me, pkg_group_name(group), YAML_PLAIN_SCALAR_STYLE);
+	}
+	manifest_close(&me, YAML_SEQUENCE_START_EVENT, &open);
 
-	seq = -1;
-	while (pkg_groups(pkg, &group) == EPKG_OK)
-		manifest_append_seqval(&doc, mapping, &seq, "groups", pkg_group_name(group));
-/*	while (pkg_users(pkg, &user) == EPKG_OK) {
-		if (users == -1) {
-			users = yaml_document_add_mapping(&doc, NULL, YAML_BLOCK_MAPPING_STYLE);
-			yaml_document_append_mapping_pair(&doc, mapping,
-					yaml_document_add_scalar(&doc, NULL, __DECONST(yaml_char_t*, "users"), 5, YAML_PLAIN_SCALAR_STYLE),
-					users);
-		}
-		manifest_append_kv(users, pkg_user_name(user), user->uidstr);
+	while (pkg_shlibs(pkg, &shlib) == EPKG_OK) {
+		manifest_open(&me, "shlibs", YAML_SEQUENCE_START_EVENT,
+		    YAML_FLOW_SEQUENCE_STYLE, &open);
+		manifest_scalar(&me, pkg_shlib_name(shlib), YAML_PLAIN_SCALAR_STYLE);
 	}
+	manifest_close(&me, YAML_SEQUENCE_START_EVENT, &open);
 
-	while (pkg_groups(pkg, &group) == EPKG_OK) {
-		if (groups == -1) {
-			groups = yaml_document_add_mapping(&doc, NULL, YAML_BLOCK_MAPPING_STYLE);
-			yaml_document_append_mapping_pair(&doc, mapping,
-					yaml_document_add_scalar(&doc, NULL, __DECONST(yaml_char_t*, "groups"), 6, YAML_PLAIN_SCALAR_STYLE),
-					groups);
-		}
-		manifest_append_kv(groups, pkg_group_name(group), group->gidstr);
-	}*/
+	while (pkg_shlibs_provided(pkg, &shlib) == EPKG_OK) {
+		manifest_open(&me, "shlibs_provided", YAML_SEQUENCE_START_EVENT,
+		    YAML_FLOW_SEQUENCE_STYLE, &open);
+		manifest_scalar(&me, pkg_shlib_name(shlib), YAML_PLAIN_SCALAR_STYLE);
+	}
+	manifest_close(&me, YAML_SEQUENCE_START_EVENT, &open);
 
-	seq = -1;
-	while (pkg_shlibs(pkg, &shlib) == EPKG_OK)
-		manifest_append_seqval(&doc, mapping, &seq, "shlibs", pkg_shlib_name(shlib));
- 
-	map = -1;
 	while (pkg_options(pkg, &option) == EPKG_OK) {
-		if (map == -1)
-			manifest_append_map(map, mapping, "options", FLOW);
-		manifest_append_kv(map, pkg_option_opt(option), pkg_option_value(option), PLAIN);
+		manifest_open(&me, "options", YAML_MAPPING_START_EVENT,
+		    YAML_FLOW_MAPPING_STYLE, &open);
+		manifest_kv(&me, pkg_option_opt(option), pkg_option_value(option), YAML_PLAIN_SCALAR_STYLE);
+	}
+	manifest_close(&me, YAML_MAPPING_START_EVENT, &open);
+
+	/*
+	 * Nothing is left pending in the emitter after the previous section,
+	 * once flushed everything before the files has been written.
+	 */
+	if (files_offset != NULL) {
+		*files_offset = -1;
+		if (!STAILQ_EMPTY(&pkg->files) && !me.error) {
+			if (yaml_emitter_flush(&me.emitter))
+				*files_offset = me.written;
+			else
+				me.error = true;
+		}
 	}
 
-	map = -1;
 	while (pkg_files(pkg, &file) == EPKG_OK) {
-		if (map == -1)
-			manifest_append_map(map, mapping, "files", BLOCK);
+		manifest_open(&me, "files", YAML_MAPPING_START_EVENT,
+		    YAML_BLOCK_MAPPING_STYLE, &open);
 		urlencode(pkg_file_get(file, PKG_FILE_PATH), &tmpsbuf);
-		manifest_append_kv(map, sbuf_get(tmpsbuf), pkg_file_get(file, PKG_FILE_SUM) && strlen(pkg_file_get(file, PKG_FILE_SUM)) > 0 ? pkg_file_get(file, PKG_FILE_SUM) : "-", PLAIN);
+		sum = pkg_file_get(file, PKG_FILE_SUM);
+		manifest_kv(&me, sbuf_get(tmpsbuf), sum != NULL && sum[0] != '\0' ? sum : "-", YAML_PLAIN_SCALAR_STYLE);
 	}
+	manifest_close(&me, YAML_MAPPING_START_EVENT, &open);
 
-	seq = -1;
-	map = -1;
 	while (pkg_dirs(pkg, &dir) == EPKG_OK) {
-		if (map == -1)
-			manifest_append_map(map, mapping, "directories", BLOCK);
+		manifest_open(&me, "directories", YAML_MAPPING_START_EVENT,
+		    YAML_BLOCK_MAPPING_STYLE, &open);
 		urlencode(pkg_dir_path(dir), &tmpsbuf);
-		manifest_append_kv(map, sbuf_get(tmpsbuf), pkg_dir_try(dir) ? "y" : "n", PLAIN);
+		manifest_kv(&me, sbuf_get(tmpsbuf), pkg_dir_try(dir) ? "y" : "n", YAML_PLAIN_SCALAR_STYLE);
 	}
+	manifest_close(&me, YAML_MAPPING_START_EVENT, &open);
 
-	map = -1;
 	while (pkg_scripts(pkg, &script) == EPKG_OK) {
-		if (map == -1)
-			manifest_append_map(map, mapping, "scripts", BLOCK);
+		if ((script_types = manifest_script_type(pkg_script_type(script))) == NULL)
+			continue;
+		manifest_open(&me, "scripts", YAML_MAPPING_START_EVENT,
+		    YAML_BLOCK_MAPPING_STYLE, &open);
+		manifest_urlencode_kv(&me, script_types, pkg_script_data(script),
+		    YAML_LITERAL_SCALAR_STYLE, &tmpsbuf);
+	}
+	manifest_close(&me, YAML_MAPPING_START_EVENT, &open);
 
-		switch (pkg_script_type(script)) {
-			case PKG_SCRIPT_PRE_INSTALL:
-				script_types = "pre-install";
-				break;
-			case PKG_SCRIPT_INSTALL:
-				script_types = "install";
-				break;
-			case PKG_SCRIPT_POST_INSTALL:
-				script_types = "post-install";
-				break;
-			case PKG_SCRIPT_PRE_UPGRADE:
-				script_types = "pre-upgrade";
-				break;
-			case PKG_SCRIPT_UPGRADE:
-				script_types = "upgrade";
-				break;
-			case PKG_SCRIPT_POST_UPGRADE:
-				script_types = "post-upgrade";
-				break;
-			case PKG_SCRIPT_PRE_DEINSTALL:
-				script_types = "pre-deinstall";
-				break;
-			case PKG_SCRIPT_DEINSTALL:
-				script_types = "deinstall";
-				break;
-			case PKG_SCRIPT_POST_DEINSTALL:
-				script_types = "post-deinstall";
-				break;
-		}
-		urlencode(pkg_script_data(script), &tmpsbuf);
-		manifest_append_kv(map, script_types, sbuf_get(tmpsbuf), LITERAL);
+	if (infos != NULL && *infos != '\0')
+		manifest_urlencode_kv(&me, "message", infos, YAML_LITERAL_SCALAR_STYLE, &tmpsbuf);
+
+	if (message != NULL && *message != '\0')
+		manifest_urlencode_kv(&me, "message", message, YAML_LITERAL_SCALAR_STYLE, &tmpsbuf);
+
+	if (!me.error) {
+		yaml_mapping_end_event_initialize(&ev);
+		manifest_emit(&me, &ev);
 	}
-	if (infos != NULL && *infos != '\0') {
-		urlencode(infos, &tmpsbuf);
-		manifest_append_kv(mapping, "message", sbuf_get(tmpsbuf), LITERAL);
+	if (!me.error) {
+		yaml_document_end_event_initialize(&ev, 1);
+		manifest_emit(&me, &ev);
 	}
-
-	if (message != NULL && *message != '\0') {
-		urlencode(message, &tmpsbuf);
-		manifest_append_kv(mapping, "message", sbuf_get(tmpsbuf), LITERAL);
+	if (!me.error) {
+		yaml_stream_end_event_initialize(&ev);
+		manifest_emit(&me, &ev);
 	}
 
-	if (!yaml_emitter_dump(&emitter, &doc))
-		rc = EPKG_FATAL;
-
 	sbuf_free(tmpsbuf);
+	yaml_emitter_delete(&me.emitter);
+
+	return (me.error ? EPKG_FATAL : EPKG_OK);
+}
+
+int
+pkg_emit_manifest(struct pkg *pkg, char **dest)
+{
+	struct sbuf *destbuf = sbuf_new_auto();
+	int rc;
+
+	rc = emit_manifest(pkg, yaml_write_buf, destbuf, NULL);
+
 	sbuf_finish(destbuf);
 	*dest = strdup(sbuf_get(destbuf));
 	sbuf_delete(destbuf);
 
-	yaml_emitter_delete(&emitter);
 	return (rc);
 }
+
+/*
+ * The +COMPACT_MANIFEST holds the metadata of the +MANIFEST but the files,
+ * directories and scripts, in a binary form which is read without parsing:
+ *
+ *	header:	"PKGCM\0" | version (2 bytes) | files offset (8 bytes)
+ *	record:	type (1 byte) | length (4 bytes) | payload
+ *
+ * The integers are big endian.  The files offset is where the files section
+ * starts in the +MANIFEST, -1 if it has none.  The payload of the string
+ * attributes and of the list items is a sequence of strings, each one
+ * preceded by its length; the type of the string attributes is their
+ * pkg_attr.  Unknown records are skipped, the last one is COMPACT_END.
+ */
+#define COMPACT_MAGIC "PKGCM"
+#define COMPACT_VERSION 1
+#define COMPACT_HEADER_SIZE 16
+
+enum {
+	COMPACT_END = 0,
+	COMPACT_FLATSIZE = 0x40,
+	COMPACT_LICENSELOGIC,
+	COMPACT_DEP = 0x80,
+	COMPACT_CATEGORY,
+	COMPACT_LICENSE,
+	COMPACT_OPTION,
+	COMPACT_USER,
+	COMPACT_GROUP,
+	COMPACT_SHLIB,
+	COMPACT_SHLIB_PROVIDED,
+};
+
+static const pkg_attr compact_attrs[] = {
+	PKG_NAME,
+	PKG_VERSION,
+	PKG_ORIGIN,
+	PKG_COMMENT,
+	PKG_ARCH,
+	PKG_WWW,
+	PKG_MAINTAINER,
+	PKG_PREFIX,
+	PKG_DESC,
+	PKG_MESSAGE,
+	PKG_INFOS,
+	0
+};
+
+static void
+compact_int(struct sbuf *dest, uint64_t val, int size)
+{
+	unsigned char buf[8];
+	int i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = (val >> (8 * (size - 1 - i))) & 0xff;
+	sbuf_bcat(dest, buf, size);
+}
+
+/* A record made of the n strings given with their lengths */
+static void
+compact_strings(struct sbuf *dest, int type, int n, ...)
+{
+	va_list ap;
+	const char *str;
+	size_t len = 0;
+	int i;
+
+	va_start(ap, n);
+	for (i = 0; i < n; i++) {
+		va_arg(ap, const char *);
+		len += 4 + va_arg(ap, size_t);
+	}
+	va_end(ap);
+
+	compact_int(dest, type, 1);
+	compact_int(dest, len, 4);
+
+	va_start(ap, n);
+	for (i = 0; i < n; i++) {
+		str = va_arg(ap, const char *);
+		len = va_arg(ap, size_t);
+		compact_int(dest, len, 4);
+		sbuf_bcat(dest, str, len);
+	}
+	va_end(ap);
+}
+
+#define COMPACT_STR(s) ((s) != NULL ? (s) : ""), ((s) != NULL ? strlen(s) : 0)
+
+static int
+pkg_emit_compact_manifest(struct pkg *pkg, int64_t files_offset,
+    struct sbuf *dest)
+{
+	struct pkg_dep *dep = NULL;
+	struct pkg_category *category = NULL;
+	struct pkg_license *license = NULL;
+	struct pkg_option *option = NULL;
+	struct pkg_user *user = NULL;
+	struct pkg_group *group = NULL;
+	struct pkg_shlib *shlib = NULL;
+	const char *str;
+	size_t len;
+	lic_t licenselogic;
+	int64_t flatsize;
+	int i;
+
+	sbuf_clear(dest);
+	sbuf_bcat(dest, COMPACT_MAGIC, sizeof(COMPACT_MAGIC));
+	compact_int(dest, COMPACT_VERSION, 2);
+	compact_int(dest, files_offset, 8);
+
+	/* as pkg_parse_manifest() would read them back */
+	for (i = 0; compact_attrs[i] != 0; i++) {
+		pkg_get(pkg, compact_attrs[i], &str);
+		if (str == NULL)
+			continue;
+		len = strlen(str);
+		while (len > 0 && str[len - 1] == '\n')
+			len--;
+		if (len > 0)
+			compact_strings(dest, compact_attrs[i], 1, str, len);
+	}
+
+	pkg_get(pkg, PKG_FLATSIZE, &flatsize, PKG_LICENSE_LOGIC, &licenselogic);
+	compact_int(dest, COMPACT_FLATSIZE, 1);
+	compact_int(dest, 8, 4);
+	compact_int(dest, flatsize, 8);
+	compact_int(dest, COMPACT_LICENSELOGIC, 1);
+	compact_int(dest, 8, 4);
+	compact_int(dest, licenselogic, 8);
+
+	while (pkg_deps(pkg, &dep) == EPKG_OK)
+		compact_strings(dest, COMPACT_DEP, 3,
+		    COMPACT_STR(pkg_dep_get(dep, PKG_DEP_NAME)),
+		    COMPACT_STR(pkg_dep_get(dep, PKG_DEP_ORIGIN)),
+		    COMPACT_STR(pkg_dep_get(dep, PKG_DEP_VERSION)));
+	while (pkg_categories(pkg, &category) == EPKG_OK)
+		compact_strings(dest, COMPACT_CATEGORY, 1,
+		    COMPACT_STR(pkg_category_name(category)));
+	while (pkg_licenses(pkg, &license) == EPKG_OK)
+		compact_strings(dest, COMPACT_LICENSE, 1,
+		    COMPACT_STR(pkg_license_name(license)));
+	while (pkg_options(pkg, &option) == EPKG_OK)
+		compact_strings(dest, COMPACT_OPTION, 2,
+		    COMPACT_STR(pkg_option_opt(option)),
+		    COMPACT_STR(pkg_option_value(option)));
+	while (pkg_users(pkg, &user) == EPKG_OK)
+		compact_strings(dest, COMPACT_USER, 1,
+		    COMPACT_STR(pkg_user_name(user)));
+	while (pkg_groups(pkg, &group) == EPKG_OK)
+		compact_strings(dest, COMPACT_GROUP, 1,
+		    COMPACT_STR(pkg_group_name(group)));
+	while (pkg_shlibs(pkg, &shlib) == EPKG_OK)
+		compact_strings(dest, COMPACT_SHLIB, 1,
+		    COMPACT_STR(pkg_shlib_name(shlib)));
+	while (pkg_shlibs_provided(pkg, &shlib) == EPKG_OK)
+		compact_strings(dest, COMPACT_SHLIB_PROVIDED, 1,
+		    COMPACT_STR(pkg_shlib_name(shlib)));
+
+	compact_int(dest, COMPACT_END, 1);
+	compact_int(dest, 0, 4);
+	sbuf_finish(dest);
+
+	return (EPKG_OK);
+}
+
+static uint64_t
+compact_read_int(const unsigned char *buf, int size)
+{
+	uint64_t val = 0;
+	int i;
+
+	for (i = 0; i < size; i++)
+		val = (val << 8) | buf[i];
+
+	return (val);
+}
+
+/* Read n strings from the payload of a record into strs */
+static int
+compact_read_strings(const unsigned char *buf, size_t len, int n,
+    struct sbuf **strs)
+{
+	size_t slen;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (len < 4)
+			return (EPKG_FATAL);
+		slen = compact_read_int(buf, 4);
+		buf += 4;
+		len -= 4;
+		if (slen > len)
+			return (EPKG_FATAL);
+		sbuf_init(&strs[i]);
+		sbuf_bcat(strs[i], buf, slen);
+		sbuf_finish(strs[i]);
+		buf += slen;
+		len -= slen;
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Set the attributes of pkg from a +COMPACT_MANIFEST of len bytes.
+ * files_offset, if not NULL, is set to where the files start in the
+ * +MANIFEST of the same package.
+ */
+int
+pkg_parse_compact_manifest(struct pkg *pkg, const char *buf, size_t len,
+    int64_t *files_offset)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	const unsigned char *end = p + len;
+	struct sbuf *strs[3] = { NULL, NULL, NULL };
+	size_t rlen;
+	int type;
+	int i;
+	int ret = EPKG_FATAL;
+
+	if (len < COMPACT_HEADER_SIZE ||
+	    memcmp(p, COMPACT_MAGIC, sizeof(COMPACT_MAGIC)) != 0 ||
+	    compact_read_int(p + 6, 2) != COMPACT_VERSION) {
+		pkg_emit_error("Invalid compact manifest");
+		return (EPKG_FATAL);
+	}
+	if (files_offset != NULL)
+		*files_offset = (int64_t)compact_read_int(p + 8, 8);
+	p += COMPACT_HEADER_SIZE;
+
+	for (;;) {
+		if (end - p < 5)
+			break;
+		type = p[0];
+		rlen = compact_read_int(p + 1, 4);
+		p += 5;
+		if (rlen > (size_t)(end - p))
+			break;
+
+		if (type == COMPACT_END) {
+			ret = EPKG_OK;
+			break;
+		}
+
+		switch (type) {
+		case COMPACT_FLATSIZE:
+		case COMPACT_LICENSELOGIC:
+			if (rlen < 8)
+				goto cleanup;
+			pkg_set(pkg, type == COMPACT_FLATSIZE ? PKG_FLATSIZE :
+			    PKG_LICENSE_LOGIC, (int64_t)compact_read_int(p, 8));
+			break;
+		case COMPACT_DEP:
+			if (compact_read_strings(p, rlen, 3, strs) != EPKG_OK)
+				goto cleanup;
+			pkg_adddep(pkg, sbuf_get(strs[0]), sbuf_get(strs[1]),
+			    sbuf_get(strs[2]));
+			break;
+		case COMPACT_OPTION:
+			if (compact_read_strings(p, rlen, 2, strs) != EPKG_OK)
+				goto cleanup;
+			pkg_addoption(pkg, sbuf_get(strs[0]), sbuf_get(strs[1]));
+			break;
+		case COMPACT_CATEGORY:
+		case COMPACT_LICENSE:
+		case COMPACT_USER:
+		case COMPACT_GROUP:
+		case COMPACT_SHLIB:
+		case COMPACT_SHLIB_PROVIDED:
+			if (compact_read_strings(p, rlen, 1, strs) != EPKG_OK)
+				goto cleanup;
+			if (type == COMPACT_CATEGORY)
+				pkg_addcategory(pkg, sbuf_get(strs[0]));
+			else if (type == COMPACT_LICENSE)
+				pkg_addlicense(pkg, sbuf_get(strs[0]));
+			else if (type == COMPACT_USER)
+				pkg_adduser(pkg, sbuf_get(strs[0]));
+			else if (type == COMPACT_GROUP)
+				pkg_addgroup(pkg, sbuf_get(strs[0]));
+			else if (type == COMPACT_SHLIB)
+				pkg_addshlib(pkg, sbuf_get(strs[0]));
+			else
+				pkg_addshlib_provided(pkg, sbuf_get(strs[0]));
+			break;
+		default:
+			for (i = 0; compact_attrs[i] != 0; i++)
+				if ((int)compact_attrs[i] == type)
+					break;
+			if (compact_attrs[i] == 0)
+				break;
+			if (compact_read_strings(p, rlen, 1, strs) != EPKG_OK)
+				goto cleanup;
+			pkg_set(pkg, compact_attrs[i], sbuf_get(strs[0]));
+			break;
+		}
+		p += rlen;
+	}
+
+	cleanup:
+	if (ret != EPKG_OK)
+		pkg_emit_error("Invalid compact manifest");
+	for (i = 0; i < 3; i++)
+		sbuf_free(strs[i]);
+
+	return (ret);
+}
+
+/*
+ * Write the manifest of pkg as the entry path of pack, preceded by its
+ * compact form as the entry compact unless it is NULL.  The header of an
+ * entry holds its size, so the manifest is emitted a first time to count
+ * its bytes and a second time into the archive, it is never held in memory.
+ */
+int
+pkg_emit_manifest_packing(struct pkg *pkg, struct packing *pack,
+    const char *path, const char *compact)
+{
+	struct manifest_sink sink;
+	struct sbuf *cbuf;
+	int64_t files_offset;
+	int ret;
+
+	sink.pack = NULL;
+	sink.size = 0;
+	if (emit_manifest(pkg, yaml_write_packing, &sink, &files_offset) !=
+	    EPKG_OK) {
+		pkg_emit_error("Unable to emit the manifest");
+		return (EPKG_FATAL);
+	}
+
+	if (compact != NULL) {
+		cbuf = sbuf_new_auto();
+		pkg_emit_compact_manifest(pkg, files_offset, cbuf);
+		ret = packing_append_buffer(pack, sbuf_data(cbuf), compact,
+		    sbuf_len(cbuf));
+		sbuf_delete(cbuf);
+		if (ret != EPKG_OK)
+			return (EPKG_FATAL);
+	}
+
+	if (packing_append_entry(pack, path, sink.size) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	sink.pack = pack;
+	sink.size = 0;
+	if (emit_manifest(pkg, yaml_write_packing, &sink, NULL) != EPKG_OK) {
+		pkg_emit_error("Unable to emit the manifest");
+		return (EPKG_FATAL);
+	}
+
+	return (EPKG_OK);
+}
@@ -67,6 +67,7 @@ struct plist {
 	int64_t flatsize;
 	struct hardlinks *hardlinks;
 	mode_t perm;
+	bool checksum;		/* compute the SHA256 of the files */
 	STAILQ_HEAD(keywords, keyword) keywords;
 };
 
@@ -221,8 +222,10 @@ file(struct plist *p, char *line)
 
 		if (regular) {
 			p->flatsize += st.st_size;
-			sha256_file(testpath, sha256);
-			buf = sha256;
+			if (p->checksum) {
+				sha256_file(testpath, sha256);
+				buf = sha256;
+			}
 		}
 		return (pkg_addfile_attr(p->pkg, path, buf, p->uname, p->gname, p->perm, true));
 	}
@@ -711,6 +714,17 @@ flush_script_buffer(struct sbuf *buf, struct pkg *p, int type)
 
 int
 ports_parse_plist(struct pkg *pkg, char *plist, const char *stage)
+{
+	return (ports_parse_plist2(pkg, plist, stage, true));
+}
+
+/*
+ * Without checksum, the files are only stat'ed: pkg create hashes them
+ * while they are archived.
+ */
+int
+ports_parse_plist2(struct pkg *pkg, char *plist, const char *stage,
+    bool checksum)
 {
 	char *plist_p, *buf, *plist_buf;
 	int nbel, i;
@@ -742,6 +756,7 @@ ports_parse_plist(struct pkg *pkg, char *plist, const char *stage)
 	pplist.ignore_next = false;
 	pplist.hardlinks = &hardlinks;
 	pplist.flatsize = 0;
+	pplist.checksum = checksum;
 	STAILQ_INIT(&pplist.keywords);
 
 	populate_keywords(&pplist);
@@ -30,11 +30,16 @@
 
 #include <archive_entry.h>
 #include <assert.h>
+#include <dirent.h>
 #include <fts.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "pkg.h"
@@ -42,97 +47,583 @@
 #include "private/utils.h"
 #include "private/pkg.h"
 
+/* Build the URL of the package from PACKAGESITE or from its repository */
+static int
+pkg_repo_url(struct pkg *pkg, char *url, size_t len)
+{
+	const char *packagesite = NULL;
+	const char *repopath, *repourl;
+	bool multirepos_enabled = false;
+
+	pkg_get(pkg, PKG_REPOPATH, &repopath, PKG_REPOURL, &repourl);
+
+	/* 
+	 * In multi-repos the remote URL is stored in pkg[PKG_REPOURL]
+	 * For a single attached database the repository URL should be
+	 * defined by PACKAGESITE.
+	 */
+	pkg_config_bool(PKG_CONFIG_MULTIREPOS, &multirepos_enabled);
+
+	if (multirepos_enabled) {
+		packagesite = repourl;
+	} else {
+		pkg_config_string(PKG_CONFIG_REPO, &packagesite);
+	}
+
+	if (packagesite == NULL || packagesite[0] == '\0') {
+		pkg_emit_error("PACKAGESITE is not defined");
+		return (EPKG_FATAL);
+	}
+
+	if (packagesite[strlen(packagesite) - 1] == '/')
+		snprintf(url, len, "%s%s", packagesite, repopath);
+	else
+		snprintf(url, len, "%s/%s", packagesite, repopath);
+
+	return (EPKG_OK);
+}
+
+/*
+ * Create the dirs in cachedir, dirname(3) is not used as several
+ * packages can be fetched at the same time.
+ */
+static int
+pkg_repo_mkdirs(const char *dest)
+{
+	char path[MAXPATHLEN + 1];
+	char *slash;
+
+	strlcpy(path, dest, sizeof(path));
+	if ((slash = strrchr(path, '/')) != NULL)
+		*slash = '\0';
+
+	return (mkdirs(path));
+}
+
+/*
+ * Fetch the package to the cache if needed and check it against the
+ * repository checksum.  The archive is hashed while it is downloaded, or
+ * read once if it is already cached, and if manifest is not NULL it is set
+ * to the +MANIFEST found on the way, or to NULL if there was none.
+ */
 int
-pkg_repo_fetch(struct pkg *pkg)
+pkg_repo_fetch(struct pkg *pkg, struct fetch_progress *progress,
+    struct sbuf **manifest)
 {
 	char dest[MAXPATHLEN + 1];
+	char partial[MAXPATHLEN + 1];
 	char url[MAXPATHLEN + 1];
-	int fetched = 0;
+	bool resumed = false;
+	bool cached = false;
 	char cksum[SHA256_DIGEST_LENGTH * 2 +1];
-	char *path = NULL;
-	const char *packagesite = NULL;
+	struct stat st;
+	struct pkg_digest digest;
 	const char *cachedir = NULL;
-	bool multirepos_enabled = false;
 	int retcode = EPKG_OK;
-	const char *repopath, *repourl, *sum, *name, *version;
+	const char *repopath, *sum, *name, *version;
+	int64_t pkgsize;
 
 	assert((pkg->type & PKG_REMOTE) == PKG_REMOTE);
 
+	if (manifest != NULL)
+		*manifest = NULL;
+
 	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
 		return (EPKG_FATAL);
 
-	pkg_get(pkg, PKG_REPOPATH, &repopath, PKG_REPOURL, &repourl,
-	    PKG_CKSUM, &sum, PKG_NAME, &name, PKG_VERSION, &version);
+	pkg_get(pkg, PKG_REPOPATH, &repopath, PKG_CKSUM, &sum,
+	    PKG_NAME, &name, PKG_VERSION, &version, PKG_NEW_PKGSIZE, &pkgsize);
 
 	snprintf(dest, sizeof(dest), "%s/%s", cachedir, repopath);
+	snprintf(partial, sizeof(partial), "%s.part", dest);
+
+	pkg_digest_init(&digest);
 
 	/* If it is already in the local cachedir, dont bother to download it */
-	if (access(dest, F_OK) == 0)
+	if (access(dest, F_OK) == 0) {
+		cached = true;
+		if ((retcode = pkg_digest_file(&digest, dest, -1)) != EPKG_OK)
+			goto cleanup;
 		goto checksum;
+	}
 
-	/* Create the dirs in cachedir */
-	if ((path = dirname(dest)) == NULL) {
-		pkg_emit_errno("dirname", dest);
-		retcode = EPKG_FATAL;
+	if ((retcode = pkg_repo_mkdirs(dest)) != EPKG_OK)
 		goto cleanup;
-	}
 
-	if ((retcode = mkdirs(path)) != EPKG_OK)
+	if ((retcode = pkg_repo_url(pkg, url, sizeof(url))) != EPKG_OK)
 		goto cleanup;
 
-	/* 
-	 * In multi-repos the remote URL is stored in pkg[PKG_REPOURL]
-	 * For a single attached database the repository URL should be
-	 * defined by PACKAGESITE.
+	/*
+	 * The package is downloaded to a .part file which is left behind on
+	 * failure, the next run resumes it from where it stopped.  It is only
+	 * moved in place once it matches the checksum from the repository.
+	 * There is nothing left to fetch of a complete one, and one bigger
+	 * than the package cannot be right.
 	 */
-	pkg_config_bool(PKG_CONFIG_MULTIREPOS, &multirepos_enabled);
+	if (stat(partial, &st) == 0 && st.st_size > 0) {
+		resumed = true;
+		if (st.st_size == pkgsize) {
+			if ((retcode = pkg_digest_file(&digest, partial, -1)) !=
+			    EPKG_OK)
+				goto cleanup;
+			goto checksum;
+		}
+		if (pkgsize > 0 && st.st_size > pkgsize) {
+			unlink(partial);
+			resumed = false;
+		}
+	}
 
-	if (multirepos_enabled) {
-		packagesite = repourl;
-	} else {
-		pkg_config_string(PKG_CONFIG_REPO, &packagesite);
+	retcode = pkg_fetch_file2(url, partial, 0, PKG_FETCH_RESUME, progress,
+	    &digest);
+	if (retcode != EPKG_OK)
+		goto cleanup;
+
+	checksum:
+	pkg_digest_final(&digest, cksum);
+	if (strcmp(cksum, sum) != 0) {
+		if (cached) {
+			pkg_emit_error("cached package %s-%s: checksum mismatch, fetching from remote",
+			    name, version);
+			unlink(dest);
+		} else if (resumed) {
+			pkg_emit_error("partial download of %s-%s: checksum "
+			    "mismatch, fetching from the beginning", name,
+			    version);
+			unlink(partial);
+		} else {
+			pkg_emit_error("%s-%s failed checksum from repository",
+			    name, version);
+			unlink(partial);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		pkg_digest_free(&digest);
+		return (pkg_repo_fetch(pkg, progress, manifest));
 	}
 
-	if (packagesite == NULL || packagesite[0] == '\0') {
-		pkg_emit_error("PACKAGESITE is not defined");
-		retcode = 1;
+	if (!cached && rename(partial, dest) == -1) {
+		pkg_emit_errno("rename", dest);
+		unlink(partial);
+		retcode = EPKG_FATAL;
 		goto cleanup;
 	}
 
-	if (packagesite[strlen(packagesite) - 1] == '/')
-		snprintf(url, sizeof(url), "%s%s", packagesite, repopath);
-	else
-		snprintf(url, sizeof(url), "%s/%s", packagesite, repopath);
+	if (manifest != NULL) {
+		*manifest = digest.manifest;
+		digest.manifest = NULL;
+	}
 
-	retcode = pkg_fetch_file(url, dest, 0);
-	fetched = 1;
+	cleanup:
+	pkg_digest_free(&digest);
 
-	if (retcode != EPKG_OK)
+	return (retcode);
+}
+
+/*
+ * Get the +MANIFEST of a package while downloading as little as possible
+ * of it: only the head of the archive is fetched, to the .part file which
+ * pkg_repo_fetch() resumes later.  If the manifest is not in the head the
+ * whole package is fetched and verified.  *manifest is left NULL if the
+ * manifest could not be extracted, the caller then has to pkg_open() the
+ * cached package.  A manifest from the head is not verified yet: it is
+ * only good for a preview, until pkg_repo_fetch() returns the same one.
+ */
+int
+pkg_repo_fetch_manifest(struct pkg *pkg, struct fetch_progress *progress,
+    struct sbuf **manifest)
+{
+	char dest[MAXPATHLEN + 1];
+	char partial[MAXPATHLEN + 1];
+	char url[MAXPATHLEN + 1];
+	char cksum[SHA256_DIGEST_LENGTH * 2 +1];
+	struct pkg_digest digest;
+	const char *cachedir = NULL;
+	struct stat st;
+	const char *repopath;
+	int64_t pkgsize;
+	int retcode = EPKG_OK;
+
+	*manifest = NULL;
+
+	if (pkg_config_string(PKG_CONFIG_CACHEDIR, &cachedir) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	pkg_get(pkg, PKG_REPOPATH, &repopath, PKG_NEW_PKGSIZE, &pkgsize);
+	snprintf(dest, sizeof(dest), "%s/%s", cachedir, repopath);
+	snprintf(partial, sizeof(partial), "%s.part", dest);
+
+	pkg_digest_init(&digest);
+	digest.head_only = true;
+
+	if (access(dest, F_OK) == 0) {
+		retcode = pkg_digest_file(&digest, dest, -1);
 		goto cleanup;
+	}
 
-	checksum:
-	retcode = sha256_file(dest, cksum);
-	if (retcode == EPKG_OK)
-		if (strcmp(cksum, sum)) {
-			if (fetched == 1) {
-				pkg_emit_error("%s-%s failed checksum from repository",
-				    name, version);
-				retcode = EPKG_FATAL;
-			} else {
-				pkg_emit_error("cached package %s-%s: checksum mismatch, fetching from remote",
-				    name, version);
-				unlink(dest);
-				return (pkg_repo_fetch(pkg));
-			}
+	/* a complete .part is left to pkg_repo_fetch() to check */
+	if (stat(partial, &st) == 0) {
+		if (pkgsize > 0 && st.st_size > pkgsize) {
+			unlink(partial);
+		} else {
+			if ((retcode = pkg_digest_file(&digest, partial, -1)) !=
+			    EPKG_OK)
+				goto cleanup;
+			if (digest.done || st.st_size == pkgsize)
+				goto cleanup;
 		}
+	}
+
+	if ((retcode = pkg_repo_mkdirs(dest)) != EPKG_OK)
+		goto cleanup;
+
+	if ((retcode = pkg_repo_url(pkg, url, sizeof(url))) != EPKG_OK)
+		goto cleanup;
+
+	retcode = pkg_fetch_file2(url, partial, 0, PKG_FETCH_RESUME, progress,
+	    &digest);
 
 	cleanup:
-	if (retcode != EPKG_OK)
-		unlink(dest);
+	if (retcode == EPKG_OK) {
+		/* the whole archive has been read, try what is there */
+		if (!digest.done)
+			pkg_digest_final(&digest, cksum);
+		*manifest = digest.manifest;
+		digest.manifest = NULL;
+	}
+	pkg_digest_free(&digest);
+
+	if (retcode == EPKG_OK && *manifest == NULL)
+		return (pkg_repo_fetch(pkg, progress, manifest));
 
 	return (retcode);
 }
 
+/*
+ * A package found while walking the repository.  The hashing and the
+ * parsing of the archive are done by the workers, the result is then
+ * consumed, in the fts order, by the thread owning the sqlite handle.
+ */
+struct pkg_repo_job {
+	char *path;
+	const char *relpath;
+	int64_t pkgsize;
+	int64_t mtime;
+	int64_t inode;
+	char cksum[SHA256_DIGEST_LENGTH * 2 + 1];
+	bool indb;
+	char oldsum[SHA256_DIGEST_LENGTH * 2 + 1];
+	struct pkg *pkg;
+	int ret;
+	bool done;
+};
+
+struct pkg_repo_pool {
+	struct pkg_repo_job *jobs;
+	size_t njobs;
+	size_t cap;
+	size_t next;		/* next job to hand out to a worker */
+	size_t written;		/* jobs already consumed by the writer */
+	size_t window;		/* how far the workers may run ahead */
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t worker_cond;
+	pthread_cond_t writer_cond;
+};
+
+static void
+pkg_repo_job_run(struct pkg_repo_job *job, struct sbuf *manifest)
+{
+	sha256_file(job->path, job->cksum);
+
+	/* the archive has only been touched, no need to read it again */
+	if (job->indb && strcmp(job->cksum, job->oldsum) == 0)
+		return;
+
+	job->ret = pkg_open(&job->pkg, job->path, manifest,
+	    PKG_OPEN_MANIFEST_COMPACT);
+}
+
+static void *
+pkg_repo_worker(void *arg)
+{
+	struct pkg_repo_pool *pool = arg;
+	struct pkg_repo_job *job;
+	struct sbuf *manifest = sbuf_new_auto();
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		/* do not keep too many parsed packages in memory */
+		while (!pool->stop && pool->next < pool->njobs &&
+		    pool->next >= pool->written + pool->window)
+			pthread_cond_wait(&pool->worker_cond, &pool->lock);
+
+		if (pool->stop || pool->next >= pool->njobs)
+			break;
+
+		job = &pool->jobs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		pkg_repo_job_run(job, manifest);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = true;
+		pthread_cond_broadcast(&pool->writer_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	sbuf_free(manifest);
+
+	return (NULL);
+}
+
+static void
+pkg_repo_job_wait(struct pkg_repo_pool *pool, struct pkg_repo_job *job)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (!job->done)
+		pthread_cond_wait(&pool->writer_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void
+pkg_repo_job_release(struct pkg_repo_pool *pool, struct pkg_repo_job *job)
+{
+	if (job->pkg != NULL) {
+		pkg_free(job->pkg);
+		job->pkg = NULL;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->written++;
+	pthread_cond_broadcast(&pool->worker_cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static int
+pkg_repo_add_job(struct pkg_repo_pool *pool, FTSENT *ent, const char *root,
+    struct pkg_repo_job **job_p)
+{
+	struct pkg_repo_job *jobs, *job;
+	size_t cap;
+
+	if (pool->njobs == pool->cap) {
+		cap = (pool->cap == 0) ? 64 : pool->cap * 2;
+		jobs = realloc(pool->jobs, cap * sizeof(struct pkg_repo_job));
+		if (jobs == NULL) {
+			pkg_emit_errno("realloc", "pkg_repo_add_job");
+			return (EPKG_FATAL);
+		}
+		pool->jobs = jobs;
+		pool->cap = cap;
+	}
+
+	job = &pool->jobs[pool->njobs];
+	memset(job, 0, sizeof(struct pkg_repo_job));
+	if ((job->path = strdup(ent->fts_path)) == NULL) {
+		pkg_emit_errno("strdup", ent->fts_path);
+		return (EPKG_FATAL);
+	}
+
+	job->relpath = job->path + strlen(root);
+	while (job->relpath[0] == '/')
+		job->relpath++;
+	job->pkgsize = ent->fts_statp->st_size;
+	job->mtime = ent->fts_statp->st_mtime;
+	job->inode = ent->fts_statp->st_ino;
+	pool->njobs++;
+	*job_p = job;
+
+	return (EPKG_OK);
+}
+
+/*
+ * Look for the package in the previous version of the database.
+ * Return EPKG_UPTODATE if the archive has not been modified since it was
+ * indexed, judging by its size, mtime and inode.
+ */
+static int
+pkg_repo_job_lookup(sqlite3 *sqlite, sqlite3_stmt *stmt, struct pkg_repo_job *job)
+{
+	int ret;
+	int retcode = EPKG_OK;
+
+	sqlite3_bind_text(stmt, 1, job->relpath, -1, SQLITE_STATIC);
+
+	ret = sqlite3_step(stmt);
+	if (ret == SQLITE_ROW) {
+		job->indb = true;
+		strlcpy(job->oldsum, sqlite3_column_text(stmt, 0), sizeof(job->oldsum));
+		if (sqlite3_column_type(stmt, 2) != SQLITE_NULL &&
+		    sqlite3_column_int64(stmt, 1) == job->pkgsize &&
+		    sqlite3_column_int64(stmt, 2) == job->mtime &&
+		    sqlite3_column_int64(stmt, 3) == job->inode)
+			retcode = EPKG_UPTODATE;
+	} else if (ret != SQLITE_DONE) {
+		ERROR_SQLITE(sqlite);
+		retcode = EPKG_FATAL;
+	}
+
+	sqlite3_reset(stmt);
+
+	return (retcode);
+}
+
+static int
+pkg_repo_upgrade_schema(sqlite3 *sqlite)
+{
+	int64_t version = 0;
+
+	if (get_pragma(sqlite, "PRAGMA user_version;", &version) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (version < 3 && sql_exec(sqlite, ""
+	    "ALTER TABLE packages ADD COLUMN mtime INTEGER;"
+	    "ALTER TABLE packages ADD COLUMN inode INTEGER;"
+	    "PRAGMA user_version=3;") != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (version < 4 && sql_exec(sqlite, ""
+	    "CREATE TABLE repo_generation ("
+		"epoch INTEGER NOT NULL,"
+		"generation INTEGER NOT NULL"
+	    ");"
+	    "INSERT INTO repo_generation VALUES (%" PRId64 ", 1);"
+	    "PRAGMA user_version=4;", (int64_t)time(NULL)) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (version < 5 && sql_exec(sqlite, ""
+	    "CREATE TABLE pkg_shlibs_provided ("
+		"package_id INTEGER REFERENCES packages(id), "
+		"shlib_id INTEGER REFERENCES shlibs(id), "
+		"UNIQUE(package_id, shlib_id)"
+	    ");"
+	    "CREATE INDEX pkg_shlibs_provided_shlib_id "
+		"ON pkg_shlibs_provided (shlib_id);"
+	    "PRAGMA user_version=5;") != EPKG_OK)
+		return (EPKG_FATAL);
+
+	return (EPKG_OK);
+}
+
+/*
+ * Write the rows added and removed by this run in
+ * <repo>/delta/<generation>.sqlite, the clients at the previous generation
+ * only need this file to be up to date.  <repo>/generation tells the
+ * clients which generation the repository is at.
+ */
+static int
+pkg_repo_write_delta(sqlite3 *sqlite, const char *path, bool delta)
+{
+	char deltapath[MAXPATHLEN + 1];
+	int64_t epoch, generation;
+	FILE *fp;
+	int retcode = EPKG_OK;
+
+	const char deltasql[] = ""
+		"BEGIN;"
+		"CREATE TABLE delta.info AS SELECT epoch, generation FROM main.repo_generation;"
+		"CREATE TABLE delta.removed AS SELECT DISTINCT id FROM temp.delta_removed;"
+		"CREATE TABLE delta.packages AS SELECT * FROM main.packages "
+			"WHERE id IN (SELECT id FROM temp.delta_added);"
+		"CREATE TABLE delta.deps AS SELECT * FROM main.deps "
+			"WHERE package_id IN (SELECT id FROM temp.delta_added);"
+		"CREATE TABLE delta.options AS SELECT * FROM main.options "
+			"WHERE package_id IN (SELECT id FROM temp.delta_added);"
+		"CREATE TABLE delta.pkg_categories AS SELECT package_id, name "
+			"FROM main.pkg_categories, main.categories "
+			"WHERE category_id = id "
+			"AND package_id IN (SELECT id FROM temp.delta_added);"
+		"CREATE TABLE delta.pkg_licenses AS SELECT package_id, name "
+			"FROM main.pkg_licenses, main.licenses "
+			"WHERE license_id = id "
+			"AND package_id IN (SELECT id FROM temp.delta_added);"
+		"CREATE TABLE delta.pkg_shlibs AS SELECT package_id, name "
+			"FROM main.pkg_shlibs, main.shlibs "
+			"WHERE shlib_id = id "
+			"AND package_id IN (SELECT id FROM temp.delta_added);"
+		"CREATE TABLE delta.pkg_shlibs_provided AS SELECT package_id, name "
+			"FROM main.pkg_shlibs_provided, main.shlibs "
+			"WHERE shlib_id = id "
+			"AND package_id IN (SELECT id FROM temp.delta_added);"
+		"COMMIT;";
+
+	if (get_pragma(sqlite, "SELECT epoch FROM repo_generation;", &epoch) != EPKG_OK ||
+	    get_pragma(sqlite, "SELECT generation FROM repo_generation;", &generation) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if (delta) {
+		snprintf(deltapath, sizeof(deltapath), "%s/delta", path);
+		if (mkdirs(deltapath) != EPKG_OK)
+			return (EPKG_FATAL);
+
+		snprintf(deltapath, sizeof(deltapath), "%s/delta/%" PRId64 ".sqlite",
+		    path, generation);
+		unlink(deltapath);
+
+		if (sql_exec(sqlite, "ATTACH '%q' AS delta;", deltapath) != EPKG_OK)
+			return (EPKG_FATAL);
+
+		retcode = sql_exec(sqlite, deltasql);
+		sql_exec(sqlite, "DETACH delta;");
+
+		if (retcode != EPKG_OK) {
+			unlink(deltapath);
+			return (retcode);
+		}
+	}
+
+	snprintf(deltapath, sizeof(deltapath), "%s/generation", path);
+	if ((fp = fopen(deltapath, "w")) == NULL) {
+		pkg_emit_errno("fopen", deltapath);
+		return (EPKG_FATAL);
+	}
+	fprintf(fp, "%" PRId64 " %" PRId64 "\n", epoch, generation);
+	fclose(fp);
+
+	return (EPKG_OK);
+}
+
+/*
+ * Remove the deltas no client can use anymore: the ones of a previous
+ * epoch and the ones older than the last REPO_DELTAS generations, a client
+ * that far behind downloads the whole repository again.
+ */
+static void
+pkg_repo_prune_deltas(sqlite3 *sqlite, const char *path, bool incremental)
+{
+	char deltapath[MAXPATHLEN + 1];
+	int64_t generation, keep = 0;
+	intmax_t g;
+	DIR *d;
+	struct dirent *dp;
+	char *end;
+
+	if (get_pragma(sqlite, "SELECT generation FROM repo_generation;",
+	    &generation) != EPKG_OK)
+		return;
+	if (incremental)
+		pkg_config_int64(PKG_CONFIG_REPO_DELTAS, &keep);
+
+	snprintf(deltapath, sizeof(deltapath), "%s/delta", path);
+	if ((d = opendir(deltapath)) == NULL)
+		return;
+
+	while ((dp = readdir(d)) != NULL) {
+		g = strtoimax(dp->d_name, &end, 10);
+		if (end == dp->d_name || (strcmp(end, ".sqlite") != 0 &&
+		    strcmp(end, ".txz") != 0))
+			continue;
+		if (g > generation - keep && g <= generation)
+			continue;
+
+		snprintf(deltapath, sizeof(deltapath), "%s/delta/%s", path,
+		    dp->d_name);
+		unlink(deltapath);
+	}
+	closedir(d);
+}
+
 static void
 file_exists(sqlite3_context *ctx, int argc, __unused sqlite3_value **argv)
 {
@@ -153,11 +644,17 @@ file_exists(sqlite3_context *ctx, int argc, __unused sqlite3_value **argv)
 }
 
 int
-pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *data)
+pkg_create_repo(char *path, int nthreads, bool verify, void (progress)(struct pkg *pkg, void *data), void *data)
 {
 	FTS *fts = NULL;
 	FTSENT *ent = NULL;
 
+	struct pkg_repo_pool pool;
+	struct pkg_repo_job *job;
+	pthread_t *workers = NULL;
+	int nworkers = 0;
+	size_t i;
+
 	struct pkg *pkg = NULL;
 	struct pkg_dep *dep = NULL;
 	struct pkg_category *category = NULL;
@@ -177,12 +674,15 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 	sqlite3_stmt *stmt_opts = NULL;
 	sqlite3_stmt *stmt_shlib1 = NULL;
 	sqlite3_stmt *stmt_shlib2 = NULL;
+	sqlite3_stmt *stmt_shlib3 = NULL;
+	sqlite3_stmt *stmt_stat = NULL;
+	sqlite3_stmt *stmt_touch = NULL;
+	sqlite3_stmt *stmt_del = NULL;
 
 	int64_t package_id;
+	int64_t nchanges = 0;
 	char *errmsg = NULL;
 	int retcode = EPKG_OK;
-	char *pkg_path;
-	char cksum[SHA256_DIGEST_LENGTH * 2 +1];
 	bool incremental = false;
 	int ret;
 
@@ -211,7 +711,13 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 			"licenselogic INTEGER NOT NULL,"
 			"cksum TEXT NOT NULL,"
 			"path TEXT NOT NULL," /* relative path to the package in the repository */
-			"pkg_format_version INTEGER"
+			"pkg_format_version INTEGER,"
+			"mtime INTEGER," /* used to detect modified archives */
+			"inode INTEGER"
+		");"
+		"CREATE TABLE repo_generation ("
+			"epoch INTEGER NOT NULL,"
+			"generation INTEGER NOT NULL"
 		");"
 		"CREATE TABLE deps ("
 			"origin TEXT,"
@@ -253,14 +759,24 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 			"shlib_id INTEGER REFERENCES shlibs(id), "
 			"UNIQUE(package_id, shlib_id)"
 		");"
-		"PRAGMA user_version=2;"
+		"CREATE TABLE pkg_shlibs_provided ("
+			"package_id INTEGER REFERENCES packages(id), "
+			"shlib_id INTEGER REFERENCES shlibs(id), "
+			"UNIQUE(package_id, shlib_id)"
+		");"
+		/* looked up by soname when checking upgrades */
+		"CREATE INDEX pkg_shlibs_provided_shlib_id "
+			"ON pkg_shlibs_provided (shlib_id);"
+		"PRAGMA user_version=5;"
 		;
 	const char pkgsql[] = ""
 		"INSERT INTO packages ("
 				"origin, name, version, comment, desc, arch, "
-				"maintainer, www, prefix, pkgsize, flatsize, licenselogic, cksum, path"
+				"maintainer, www, prefix, pkgsize, flatsize, licenselogic, cksum, "
+				"path, mtime, inode"
 		")"
-		"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14);";
+		"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, "
+		"?15, ?16);";
 	const char depssql[] = ""
 		"INSERT INTO deps (origin, name, version, package_id) "
 		"VALUES (?1, ?2, ?3, ?4);";
@@ -275,6 +791,13 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 	const char shlibsql[] = "INSERT OR IGNORE INTO shlibs(name) VALUES(?1);";
 	const char addshlibsql[] = "INSERT OR ROLLBACK INTO pkg_shlibs(package_id, shlib_id) "
 		"VALUES (?1, (SELECT id FROM shlibs WHERE name = ?2))";
+	const char addshlibprovsql[] = "INSERT OR ROLLBACK INTO pkg_shlibs_provided(package_id, shlib_id) "
+		"VALUES (?1, (SELECT id FROM shlibs WHERE name = ?2))";
+	const char statsql[] = "SELECT cksum, pkgsize, mtime, inode FROM packages "
+		"WHERE path = ?1;";
+	const char touchsql[] = "UPDATE packages SET mtime = ?1, inode = ?2 "
+		"WHERE path = ?3;";
+	const char delsql[] = "DELETE FROM packages WHERE path = ?1;";
 
 	if (!is_dir(path)) {
 		pkg_emit_error("%s is not a directory", path);
@@ -284,6 +807,11 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 	repopath[0] = path;
 	repopath[1] = NULL;
 
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.worker_cond, NULL);
+	pthread_cond_init(&pool.writer_cond, NULL);
+
 	snprintf(repodb, sizeof(repodb), "%s/repo.sqlite", path);
 	snprintf(repopack, sizeof(repopack), "%s/repo.txz", path);
 
@@ -312,8 +840,8 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 
 	sqlite3_initialize();
 	if (sqlite3_open(repodb, &sqlite) != SQLITE_OK) {
-		sqlite3_shutdown();
-		return (EPKG_FATAL);
+		retcode = EPKG_FATAL;
+		goto cleanup;
 	}
 
 	sqlite3_create_function(sqlite, "file_exists", 1, SQLITE_ANY, NULL, file_exists, NULL, NULL);
@@ -323,23 +851,45 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 	if ((retcode = sql_exec(sqlite, "PRAGMA journal_mode=memory")) != EPKG_OK)
 		goto cleanup;
 
-	if (!incremental && (retcode = sql_exec(sqlite, initsql)) != EPKG_OK)
+	if (!incremental) {
+		if ((retcode = sql_exec(sqlite, initsql)) != EPKG_OK)
+			goto cleanup;
+		if ((retcode = sql_exec(sqlite, "INSERT INTO repo_generation "
+		    "VALUES (%" PRId64 ", 1);", (int64_t)time(NULL))) != EPKG_OK)
+			goto cleanup;
+	}
+
+	if (incremental && (retcode = pkg_repo_upgrade_schema(sqlite)) != EPKG_OK)
+		goto cleanup;
+
+	/*
+	 * Keep track of the rows the delta will have to carry, and drop what
+	 * belongs to a package as soon as it is removed: its id can be
+	 * given again to the next inserted package.
+	 */
+	if (incremental && (retcode = sql_exec(sqlite, ""
+	    "CREATE TEMP TABLE delta_added (id INTEGER);"
+	    "CREATE TEMP TABLE delta_removed (id INTEGER);"
+	    "CREATE TEMP TRIGGER delta_add AFTER INSERT ON main.packages BEGIN "
+		"INSERT INTO delta_added VALUES (new.id); "
+	    "END;"
+	    "CREATE TEMP TRIGGER delta_remove AFTER DELETE ON main.packages BEGIN "
+		"INSERT INTO delta_removed VALUES (old.id); "
+		"DELETE FROM deps WHERE package_id = old.id; "
+		"DELETE FROM pkg_categories WHERE package_id = old.id; "
+		"DELETE FROM pkg_licenses WHERE package_id = old.id; "
+		"DELETE FROM options WHERE package_id = old.id; "
+		"DELETE FROM pkg_shlibs WHERE package_id = old.id; "
+		"DELETE FROM pkg_shlibs_provided WHERE package_id = old.id; "
+	    "END;")) != EPKG_OK)
 		goto cleanup;
 
 	if ((retcode = sql_exec(sqlite, "BEGIN TRANSACTION;")) != EPKG_OK)
 		goto cleanup;
 
 	/* remove everything that is not anymore in the repository */
-	if (incremental) {
+	if (incremental)
 		sql_exec(sqlite, "DELETE FROM packages WHERE NOT FILE_EXISTS(path);");
-		sql_exec(sqlite, "DELETE FROM deps WHERE package_id NOT IN (SELECT package_id FROM packages);");
-		sql_exec(sqlite, "DELETE FROM pkg_categories WHERE package_id NOT IN (SELECT package_id FROM packages);");
-		sql_exec(sqlite, "DELETE FROM categories WHERE id NOT IN (SELECT category_id FROM pkg_categories);");
-		sql_exec(sqlite, "DELETE FROM pkg_licenses WHERE package_id NOT IN (SELECT package_id FROM packages);");
-		sql_exec(sqlite, "DELETE FROM licenses WHERE id NOT IN (SELECT license_id FROM pkg_licenses);");
-		sql_exec(sqlite, "DELETE FROM options WHERE package_id NOT IN (SELECT package_id FROM packages);");
-		sql_exec(sqlite, "DELETE FROM pkg_shlibs WHERE package_id NOT IN (SELECT package_id FROM packages);");
-	}
 
 	if (sqlite3_prepare_v2(sqlite, pkgsql, -1, &stmt_pkg, NULL) != SQLITE_OK) {
 		ERROR_SQLITE(sqlite);
@@ -371,7 +921,27 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 		goto cleanup;
 	}
 
-	if ((fts = fts_open(repopath, FTS_PHYSICAL, NULL)) == NULL) {
+	if (incremental) {
+		if (sqlite3_prepare_v2(sqlite, statsql, -1, &stmt_stat, NULL) != SQLITE_OK) {
+			ERROR_SQLITE(sqlite);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+
+		if (sqlite3_prepare_v2(sqlite, touchsql, -1, &stmt_touch, NULL) != SQLITE_OK) {
+			ERROR_SQLITE(sqlite);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+
+		if (sqlite3_prepare_v2(sqlite, delsql, -1, &stmt_del, NULL) != SQLITE_OK) {
+			ERROR_SQLITE(sqlite);
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+	}
+
+	if ((fts = fts_open(repopath, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) == NULL) {
 		pkg_emit_errno("fts_open", path);
 		retcode = EPKG_FATAL;
 		goto cleanup;
@@ -401,14 +971,13 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 		goto cleanup;
 	}
 
-	manifest = sbuf_new_auto();
-	while ((ent = fts_read(fts)) != NULL) {
-		const char *name, *version, *origin, *comment, *desc;
-		const char *arch, *maintainer, *www, *prefix;
-		int64_t flatsize;
-		lic_t licenselogic;
+	if (sqlite3_prepare_v2(sqlite, addshlibprovsql, -1, &stmt_shlib3, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(sqlite);
+		retcode = EPKG_FATAL;
+		goto cleanup;
+	}
 
-		cksum[0] = '\0';
+	while ((ent = fts_read(fts)) != NULL) {
 		/* skip everything that is not a file */
 		if (ent->fts_info != FTS_F)
 			continue;
@@ -427,48 +996,90 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 		if (strcmp(ent->fts_name, "repo.txz") == 0)
 			continue;
 
-		pkg_path = ent->fts_path;
-		pkg_path += strlen(path);
-		while (pkg_path[0] == '/')
-			pkg_path++;
+		if ((retcode = pkg_repo_add_job(&pool, ent, path, &job)) != EPKG_OK)
+			goto cleanup;
 
-		sha256_file(ent->fts_accpath, cksum);
-		/* do not add if package if already in base */
+		/* do not even read the archive if it has not been modified */
 		if (incremental) {
-			sqlite3_stmt *stmt;
-			if (sqlite3_prepare_v2(sqlite, "select count(*), cksum from packages where path=?1;",
-			        -1, &stmt, NULL) != SQLITE_OK) {
+			ret = pkg_repo_job_lookup(sqlite, stmt_stat, job);
+			if (ret == EPKG_FATAL) {
+				retcode = EPKG_FATAL;
 				goto cleanup;
 			}
-			sqlite3_bind_text(stmt, 1, pkg_path, -1, SQLITE_STATIC);
+			if (ret == EPKG_UPTODATE && !verify) {
+				free(job->path);
+				pool.njobs--;
+			}
+		}
+	}
 
-			if (sqlite3_step(stmt) != SQLITE_ROW) {
-				ERROR_SQLITE(sqlite);
-				goto cleanup;
+	/*
+	 * Hash and parse the packages in parallel, the results are still
+	 * inserted one after the other in the fts order so that the
+	 * database is the same whatever the number of threads is.
+	 */
+	pool.window = (nthreads > 1) ? (size_t)nthreads * 4 : 1;
+	if (nthreads > 1 && pool.njobs > 1) {
+		if ((size_t)nthreads > pool.njobs)
+			nthreads = pool.njobs;
+		if ((workers = calloc(nthreads, sizeof(pthread_t))) == NULL) {
+			pkg_emit_errno("calloc", "pkg_create_repo");
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+		for (nworkers = 0; nworkers < nthreads; nworkers++) {
+			if (pthread_create(&workers[nworkers], NULL,
+			    pkg_repo_worker, &pool) != 0) {
+				pkg_emit_errno("pthread_create", "pkg_create_repo");
+				break;
 			}
-			if (sqlite3_column_int(stmt, 0) > 0) {
-				if (strcmp(sqlite3_column_text(stmt, 1), cksum) == 0) {
-					sqlite3_finalize(stmt);
-					continue;
-				}
+		}
+	}
 
-				sqlite3_finalize(stmt);
-				if (sqlite3_prepare_v2(sqlite, "delete from packages where path=?1;",
-							-1, &stmt, NULL) != SQLITE_OK) {
+	manifest = sbuf_new_auto();
+	for (i = 0; i < pool.njobs; i++) {
+		const char *name, *version, *origin, *comment, *desc;
+		const char *arch, *maintainer, *www, *prefix;
+		int64_t flatsize;
+		lic_t licenselogic;
+
+		job = &pool.jobs[i];
+		if (nworkers > 0)
+			pkg_repo_job_wait(&pool, job);
+		else
+			pkg_repo_job_run(job, manifest);
+
+		if (job->indb) {
+			/* same content, only remember the new stat informations */
+			if (strcmp(job->cksum, job->oldsum) == 0) {
+				sqlite3_bind_int64(stmt_touch, 1, job->mtime);
+				sqlite3_bind_int64(stmt_touch, 2, job->inode);
+				sqlite3_bind_text(stmt_touch, 3, job->relpath, -1, SQLITE_STATIC);
+				if (sqlite3_step(stmt_touch) != SQLITE_DONE) {
+					ERROR_SQLITE(sqlite);
+					retcode = EPKG_FATAL;
 					goto cleanup;
 				}
-
-				sqlite3_bind_text(stmt, 1, pkg_path, -1, SQLITE_STATIC);
-				sqlite3_step(stmt);
+				sqlite3_reset(stmt_touch);
+				pkg_repo_job_release(&pool, job);
+				continue;
 			}
 
-			sqlite3_finalize(stmt);
+			sqlite3_bind_text(stmt_del, 1, job->relpath, -1, SQLITE_STATIC);
+			if (sqlite3_step(stmt_del) != SQLITE_DONE) {
+				ERROR_SQLITE(sqlite);
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+			sqlite3_reset(stmt_del);
 		}
 
-		if (pkg_open(&pkg, ent->fts_accpath, manifest) != EPKG_OK) {
+		if (job->ret != EPKG_OK) {
 			retcode = EPKG_WARN;
+			pkg_repo_job_release(&pool, job);
 			continue;
 		}
+		pkg = job->pkg;
 
 		if (progress != NULL)
 			progress(pkg, data);
@@ -487,11 +1098,13 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 		sqlite3_bind_text(stmt_pkg, 7, maintainer, -1, SQLITE_STATIC);
 		sqlite3_bind_text(stmt_pkg, 8, www, -1, SQLITE_STATIC);
 		sqlite3_bind_text(stmt_pkg, 9, prefix, -1, SQLITE_STATIC);
-		sqlite3_bind_int64(stmt_pkg, 10, ent->fts_statp->st_size);
+		sqlite3_bind_int64(stmt_pkg, 10, job->pkgsize);
 		sqlite3_bind_int64(stmt_pkg, 11, flatsize);
 		sqlite3_bind_int64(stmt_pkg, 12, licenselogic);
-		sqlite3_bind_text(stmt_pkg, 13, cksum, -1, SQLITE_STATIC);
-		sqlite3_bind_text(stmt_pkg, 14, pkg_path, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt_pkg, 13, job->cksum, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt_pkg, 14, job->relpath, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt_pkg, 15, job->mtime);
+		sqlite3_bind_int64(stmt_pkg, 16, job->inode);
 
 		if ((ret = sqlite3_step(stmt_pkg)) != SQLITE_DONE) {
 			if (ret == SQLITE_CONSTRAINT) {
@@ -596,20 +1209,88 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 			sqlite3_reset(stmt_shlib1);
 			sqlite3_reset(stmt_shlib2);
 		}
+
+		shlib = NULL;
+		while (pkg_shlibs_provided(pkg, &shlib) == EPKG_OK) {
+			sqlite3_bind_text(stmt_shlib1, 1, pkg_shlib_name(shlib), -1, SQLITE_STATIC);
+			sqlite3_bind_int64(stmt_shlib3, 1, package_id);
+			sqlite3_bind_text(stmt_shlib3, 2, pkg_shlib_name(shlib), -1, SQLITE_STATIC);
+
+			if (sqlite3_step(stmt_shlib1) != SQLITE_DONE) {
+				ERROR_SQLITE(sqlite);
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+
+			if (sqlite3_step(stmt_shlib3) != SQLITE_DONE) {
+				ERROR_SQLITE(sqlite);
+				retcode = EPKG_FATAL;
+				goto cleanup;
+			}
+			sqlite3_reset(stmt_shlib1);
+			sqlite3_reset(stmt_shlib3);
+		}
+
+		pkg_repo_job_release(&pool, job);
+	}
+
+	/* remove what is not used anymore by any package */
+	if (incremental) {
+		sql_exec(sqlite, "DELETE FROM categories WHERE id NOT IN (SELECT category_id FROM pkg_categories);");
+		sql_exec(sqlite, "DELETE FROM licenses WHERE id NOT IN (SELECT license_id FROM pkg_licenses);");
+		sql_exec(sqlite, "DELETE FROM shlibs WHERE id NOT IN "
+		    "(SELECT shlib_id FROM pkg_shlibs UNION "
+		    "SELECT shlib_id FROM pkg_shlibs_provided);");
+
+		if (get_pragma(sqlite, "SELECT (SELECT count(*) FROM delta_added) + "
+		    "(SELECT count(*) FROM delta_removed);", &nchanges) != EPKG_OK) {
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
+
+		if (nchanges > 0 && sql_exec(sqlite, "UPDATE repo_generation "
+		    "SET generation = generation + 1;") != EPKG_OK) {
+			retcode = EPKG_FATAL;
+			goto cleanup;
+		}
 	}
 
 	if (sqlite3_exec(sqlite, "COMMIT;", NULL, NULL, &errmsg) != SQLITE_OK) {
 		pkg_emit_error("sqlite: %s", errmsg);
 		retcode = EPKG_FATAL;
+		goto cleanup;
 	}
 
+	if (pkg_repo_write_delta(sqlite, path, nchanges > 0) != EPKG_OK)
+		retcode = EPKG_FATAL;
+	else
+		pkg_repo_prune_deltas(sqlite, path, incremental);
+
 	cleanup:
+	if (nworkers > 0) {
+		pthread_mutex_lock(&pool.lock);
+		pool.stop = true;
+		pthread_cond_broadcast(&pool.worker_cond);
+		pthread_mutex_unlock(&pool.lock);
+		while (nworkers > 0)
+			pthread_join(workers[--nworkers], NULL);
+	}
+	free(workers);
+
+	for (i = 0; i < pool.njobs; i++) {
+		if (pool.jobs[i].pkg != NULL)
+			pkg_free(pool.jobs[i].pkg);
+		free(pool.jobs[i].path);
+	}
+	free(pool.jobs);
+
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.worker_cond);
+	pthread_cond_destroy(&pool.writer_cond);
+
 	if (fts != NULL)
 		fts_close(fts);
 
-	if (pkg != NULL)
-		pkg_free(pkg);
-
 	if (stmt_pkg != NULL)
 		sqlite3_finalize(stmt_pkg);
 
@@ -637,6 +1318,18 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 	if (stmt_shlib2 != NULL)
 		sqlite3_finalize(stmt_shlib2);
 
+	if (stmt_shlib3 != NULL)
+		sqlite3_finalize(stmt_shlib3);
+
+	if (stmt_stat != NULL)
+		sqlite3_finalize(stmt_stat);
+
+	if (stmt_touch != NULL)
+		sqlite3_finalize(stmt_touch);
+
+	if (stmt_del != NULL)
+		sqlite3_finalize(stmt_del);
+
 	if (sqlite != NULL)
 		sqlite3_close(sqlite);
 
@@ -650,15 +1343,37 @@ pkg_create_repo(char *path, void (progress)(struct pkg *pkg, void *data), void *
 	return (retcode);
 }
 
+static void
+pkg_repo_pack_db(const char *dbpath, const char *archive, const char *name,
+    pem_password_cb *password_cb, char *rsa_key_path)
+{
+	struct packing *pack;
+	unsigned char *sigret = NULL;
+	unsigned int siglen = 0;
+
+	packing_init(&pack, archive, TXZ);
+	if (rsa_key_path != NULL) {
+		rsa_sign(dbpath, password_cb, rsa_key_path, &sigret,
+				&siglen);
+
+		packing_append_buffer(pack, sigret, "signature", siglen + 1);
+
+		free(sigret);
+	}
+	packing_append_file_attr(pack, dbpath, name, "root", "wheel", 0644);
+	unlink(dbpath);
+	packing_finish(pack);
+}
+
 int
 pkg_finish_repo(char *path, pem_password_cb *password_cb, char *rsa_key_path)
 {
 	char repo_path[MAXPATHLEN + 1];
 	char repo_archive[MAXPATHLEN + 1];
-	struct packing *pack;
-	unsigned char *sigret = NULL;
-	unsigned int siglen = 0;
-	
+	DIR *d;
+	struct dirent *dp;
+	char *ext;
+
 	if (!is_dir(path)) {
 	    pkg_emit_error("%s is not a directory", path);
 	    return EPKG_FATAL;
@@ -667,18 +1382,27 @@ pkg_finish_repo(char *path, pem_password_cb *password_cb, char *rsa_key_path)
 	snprintf(repo_path, sizeof(repo_path), "%s/repo.sqlite", path);
 	snprintf(repo_archive, sizeof(repo_archive), "%s/repo", path);
 
-	packing_init(&pack, repo_archive, TXZ);
-	if (rsa_key_path != NULL) {
-		rsa_sign(repo_path, password_cb, rsa_key_path, &sigret,
-				&siglen);
+	pkg_repo_pack_db(repo_path, repo_archive, "repo.sqlite", password_cb,
+	    rsa_key_path);
 
-		packing_append_buffer(pack, sigret, "signature", siglen + 1);
+	/* the deltas written by pkg_create_repo() are signed the same way */
+	snprintf(repo_path, sizeof(repo_path), "%s/delta", path);
+	if ((d = opendir(repo_path)) == NULL)
+		return (EPKG_OK);
 
-		free(sigret);
+	while ((dp = readdir(d)) != NULL) {
+		if ((ext = strrchr(dp->d_name, '.')) == NULL ||
+		    strcmp(ext, ".sqlite") != 0)
+			continue;
+
+		snprintf(repo_path, sizeof(repo_path), "%s/delta/%s", path,
+		    dp->d_name);
+		snprintf(repo_archive, sizeof(repo_archive), "%s/delta/%.*s",
+		    path, (int)(ext - dp->d_name), dp->d_name);
+		pkg_repo_pack_db(repo_path, repo_archive, "delta.sqlite",
+		    password_cb, rsa_key_path);
 	}
-	packing_append_file_attr(pack, repo_path, "repo.sqlite", "root", "wheel", 0644);
-	unlink(repo_path);
-	packing_finish(pack);
+	closedir(d);
 
 	return (EPKG_OK);
 }
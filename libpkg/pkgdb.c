@@ -29,16 +29,21 @@
  */
 
 #include <sys/param.h>
+#include <sys/file.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <regex.h>
 #include <grp.h>
+#include <inttypes.h>
 #include <libutil.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <sqlite3.h>
 
@@ -49,7 +54,7 @@
 #include "private/utils.h"
 
 #include "private/db_upgrades.h"
-#define DBVERSION 12
+#define DBVERSION 13
 
 #define PKGGT	0<<1
 #define PKGLT	0<<2
@@ -64,10 +69,14 @@ static void pkgdb_pkglt(sqlite3_context *, int, sqlite3_value **);
 static void pkgdb_pkggt(sqlite3_context *, int, sqlite3_value **);
 static void pkgdb_pkgle(sqlite3_context *, int, sqlite3_value **);
 static void pkgdb_pkgge(sqlite3_context *, int, sqlite3_value **);
-static int get_pragma(sqlite3 *, const char *, int64_t *);
 static int pkgdb_upgrade(struct pkgdb *);
-static void populate_pkg(sqlite3_stmt *stmt, struct pkg *pkg);
+static void pkgdb_integrity_free(struct pkgdb *);
+static int pkgdb_journal(struct pkgdb *, bool, bool);
+static void pkgdb_set_gidstr(struct pkg *);
+static void populate_pkg(struct pkgdb_it *it, struct pkg *pkg);
 static int create_temporary_pkgjobs(sqlite3 *);
+static int pkgdb_closure(struct pkgdb *, const char *, const char *,
+    const char *);
 static void pkgdb_detach_remotes(sqlite3 *);
 static bool is_attached(sqlite3 *, const char *);
 static void report_already_installed(sqlite3 *);
@@ -106,8 +115,85 @@ static struct column_mapping {
 	{ NULL, -1 }
 };
 
+/*
+ * The statements used to load the data of the packages are the same for
+ * every package, they are kept prepared in db->stmts and only reset and
+ * bound again on the next call.  The cache is flushed whenever the schema
+ * may change: databases attached or detached, upgrades.
+ */
+sqlite3_stmt *
+pkgdb_stmt_get(struct pkgdb *db, const char *sql)
+{
+	struct pkgdb_stmt *st;
+	sqlite3_stmt *stmt;
+
+	LIST_FOREACH(st, &db->stmts, next) {
+		if (strcmp(st->sql, sql) == 0)
+			break;
+	}
+
+	if (st != NULL && !st->busy) {
+		sqlite3_reset(st->stmt);
+		sqlite3_clear_bindings(st->stmt);
+		st->busy = true;
+		db->stmt_reused++;
+		return (st->stmt);
+	}
+
+	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		return (NULL);
+	}
+	db->stmt_prepared++;
+
+	/* already in use, this one is finalized once released */
+	if (st != NULL)
+		return (stmt);
+
+	if ((st = calloc(1, sizeof(struct pkgdb_stmt))) == NULL ||
+	    (st->sql = strdup(sql)) == NULL) {
+		free(st);
+		return (stmt);
+	}
+	st->stmt = stmt;
+	st->busy = true;
+	LIST_INSERT_HEAD(&db->stmts, st, next);
+
+	return (stmt);
+}
+
+void
+pkgdb_stmt_release(struct pkgdb *db, sqlite3_stmt *stmt)
+{
+	struct pkgdb_stmt *st;
+
+	LIST_FOREACH(st, &db->stmts, next) {
+		if (st->stmt == stmt) {
+			sqlite3_reset(stmt);
+			st->busy = false;
+			return;
+		}
+	}
+
+	sqlite3_finalize(stmt);
+}
+
+void
+pkgdb_stmt_flush(struct pkgdb *db)
+{
+	struct pkgdb_stmt *st;
+
+	while (!LIST_EMPTY(&db->stmts)) {
+		st = LIST_FIRST(&db->stmts);
+		LIST_REMOVE(st, next);
+		sqlite3_finalize(st->stmt);
+		free(st->sql);
+		free(st);
+	}
+}
+
 static int
-load_val(sqlite3 *db, struct pkg *pkg, const char *sql, int flags, int (*pkg_adddata)(struct pkg *pkg, const char *data), int list)
+load_val(struct pkgdb *db, struct pkg *pkg, const char *sql, int flags, int (*pkg_adddata)(struct pkg *pkg, const char *data), int list)
 {
 	sqlite3_stmt *stmt;
 	int ret;
@@ -117,10 +203,8 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, int flags, int (*pkg_add
 	if (pkg->flags & flags)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -128,12 +212,12 @@ load_val(sqlite3 *db, struct pkg *pkg, const char *sql, int flags, int (*pkg_add
 		pkg_adddata(pkg, sqlite3_column_text(stmt, 0));
 	}
 
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		if (list != -1)
 			pkg_list_free(pkg, list);
-		ERROR_SQLITE(db);
+		ERROR_SQLITE(db->sqlite);
 		return (EPKG_FATAL);
 	}
 
@@ -176,39 +260,65 @@ pkgdb_get_reponame(struct pkgdb *db, const char *repo)
 	return (reponame);
 }
 
+/*
+ * Resolve the columns of the statement to entries of columns[] once, the
+ * rows are then populated without looking at the column names.
+ */
+static int
+pkgdb_it_map_columns(struct pkgdb_it *it)
+{
+	const char *colname;
+	int icol, i;
+
+	it->ncols = sqlite3_column_count(it->stmt);
+	if (it->ncols == 0)
+		return (EPKG_OK);
+
+	if ((it->colmap = calloc(it->ncols, sizeof(int))) == NULL) {
+		pkg_emit_errno("calloc", "pkgdb_it");
+		return (EPKG_FATAL);
+	}
+
+	for (icol = 0; icol < it->ncols; icol++) {
+		colname = sqlite3_column_name(it->stmt, icol);
+		for (i = 0; columns[i].name != NULL; i++) {
+			if (!strcmp(columns[i].name, colname))
+				break;
+		}
+		it->colmap[icol] = columns[i].name != NULL ? i : -1;
+	}
+
+	return (EPKG_OK);
+}
+
 static void
-populate_pkg(sqlite3_stmt *stmt, struct pkg *pkg) {
+populate_pkg(struct pkgdb_it *it, struct pkg *pkg) {
+	sqlite3_stmt *stmt = it->stmt;
 	int i, icol = 0;
-	const char *colname;
 
 	assert(stmt != NULL);
 
-	for (icol = 0; icol < sqlite3_column_count(stmt); icol++) {
-		colname = sqlite3_column_name(stmt, icol);
+	for (icol = 0; icol < it->ncols; icol++) {
+		i = it->colmap[icol];
 		switch (sqlite3_column_type(stmt, icol)) {
 			case SQLITE_TEXT:
-				for (i = 0; columns[i].name != NULL; i++) {
-					if (!strcmp(columns[i].name, colname)) {
-						pkg_set(pkg, columns[i].type, sqlite3_column_text(stmt, icol));
-						break;
-					}
-				}
-				if (columns[i].name == NULL)
-					pkg_emit_error("Unknown column %s", colname);
+				if (i == -1)
+					pkg_emit_error("Unknown column %s",
+					    sqlite3_column_name(stmt, icol));
+				else
+					pkg_set(pkg, columns[i].type, sqlite3_column_text(stmt, icol));
 				break;
 			case SQLITE_INTEGER:
-				for (i = 0; columns[i].name != NULL; i++) {
-					if (!strcmp(columns[i].name, colname)) {
-						pkg_set(pkg, columns[i].type, sqlite3_column_int64(stmt, icol));
-						break;
-					}
-				}
-				if (columns[i].name == NULL)
-					pkg_emit_error("Unknown column %s", colname);
+				if (i == -1)
+					pkg_emit_error("Unknown column %s",
+					    sqlite3_column_name(stmt, icol));
+				else
+					pkg_set(pkg, columns[i].type, sqlite3_column_int64(stmt, icol));
 				break;
 			case SQLITE_BLOB:
 			case SQLITE_FLOAT:
-				pkg_emit_error("Wrong type for column: %s", colname);
+				pkg_emit_error("Wrong type for column: %s",
+				    sqlite3_column_name(stmt, icol));
 				/* just ignore currently */
 				break;
 			case SQLITE_NULL:
@@ -555,6 +665,13 @@ pkgdb_init(sqlite3 *sdb)
 			" ON UPDATE RESTRICT,"
 		"PRIMARY KEY (package_id, shlib_id)"
 	");"
+	"CREATE TABLE pkg_shlibs_provided ("
+		"package_id INTEGER REFERENCES packages(id) ON DELETE CASCADE"
+			" ON UPDATE CASCADE,"
+		"shlib_id INTEGER REFERENCES shlibs(id) ON DELETE RESTRICT"
+			" ON UPDATE RESTRICT,"
+		"PRIMARY KEY (package_id, shlib_id)"
+	");"
 
 	/* Mark the end of the array */
 
@@ -570,8 +687,10 @@ pkgdb_init(sqlite3 *sdb)
 	"CREATE INDEX pkg_groups_package_id ON pkg_groups (package_id);"
 	"CREATE INDEX pkg_shlibs_package_id ON pkg_shlibs (package_id);"
 	"CREATE INDEX pkg_directories_directory_id ON pkg_directories (directory_id);"
+	"CREATE INDEX pkg_shlibs_shlib_id ON pkg_shlibs (shlib_id);"
+	"CREATE INDEX pkg_shlibs_provided_shlib_id ON pkg_shlibs_provided (shlib_id);"
 
-	"PRAGMA user_version = 12;"
+	"PRAGMA user_version = 13;"
 	"COMMIT;"
 	;
 
@@ -616,6 +735,7 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 	const char *repo_name = NULL;
 	bool multirepos_enabled = false;
 	bool create = false;
+	bool wal = false;
 	struct pkg_config_kv *repokv = NULL;
 
 	if (*db_p != NULL) {
@@ -636,6 +756,9 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 	db->type = type;
 
 	if (!reopen) {
+		LIST_INIT(&db->stmts);
+		db->lockfd = -1;
+
 		snprintf(localpath, sizeof(localpath), "%s/local.sqlite", dbdir);
 
 		if (eaccess(localpath, R_OK) != 0) {
@@ -677,6 +800,7 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 			pkgdb_close(db);
 			return (EPKG_FATAL);
 		}
+		pkgdb_stmt_flush(db);
 
 		/*
 		 * allow foreign key option which will allow to have clean support for
@@ -686,9 +810,19 @@ pkgdb_open(struct pkgdb **db_p, pkgdb_t type)
 			pkgdb_close(db);
 			return (EPKG_FATAL);
 		}
+
+		pkg_config_bool(PKG_CONFIG_WAL_JOURNAL, &wal);
+		if (pkgdb_journal(db, wal, eaccess(dbdir, W_OK) == 0) !=
+		    EPKG_OK) {
+			pkgdb_close(db);
+			return (EPKG_FATAL);
+		}
 	}
 
 	if (type == PKGDB_REMOTE) {
+		/* the statements are prepared again against the new schema */
+		pkgdb_stmt_flush(db);
+
 		pkg_config_bool(PKG_CONFIG_MULTIREPOS, &multirepos_enabled);
 
 		if (multirepos_enabled) {
@@ -765,6 +899,10 @@ pkgdb_close(struct pkgdb *db)
 		return;
 
 	if (db->sqlite != NULL) {
+		pkg_emit_debug(1, "pkgdb: %" PRId64 " statements prepared, %"
+		    PRId64 " reused", db->stmt_prepared, db->stmt_reused);
+		pkgdb_stmt_flush(db);
+
 		if (db->type == PKGDB_REMOTE) {
 			pkgdb_detach_remotes(db->sqlite);
 		}
@@ -772,6 +910,10 @@ pkgdb_close(struct pkgdb *db)
 		sqlite3_close(db->sqlite);
 	}
 
+	if (db->lockfd != -1)
+		close(db->lockfd);
+
+	pkgdb_integrity_free(db);
 	sqlite3_shutdown();
 	free(db);
 }
@@ -783,7 +925,7 @@ pkgdb_it_new(struct pkgdb *db, sqlite3_stmt *s, int type)
 
 	assert(db != NULL && s != NULL);
 
-	if ((it = malloc(sizeof(struct pkgdb_it))) == NULL) {
+	if ((it = calloc(1, sizeof(struct pkgdb_it))) == NULL) {
 		pkg_emit_errno("malloc", "pkgdb_it");
 		sqlite3_finalize(s);
 		return (NULL);
@@ -792,6 +934,13 @@ pkgdb_it_new(struct pkgdb *db, sqlite3_stmt *s, int type)
 	it->db = db;
 	it->stmt = s;
 	it->type = type;
+
+	if (pkgdb_it_map_columns(it) != EPKG_OK) {
+		sqlite3_finalize(s);
+		free(it);
+		return (NULL);
+	}
+
 	return (it);
 }
 
@@ -811,9 +960,316 @@ static struct load_on_flag {
 	{ PKG_LOAD_USERS, pkgdb_load_user },
 	{ PKG_LOAD_GROUPS, pkgdb_load_group },
 	{ PKG_LOAD_SHLIBS, pkgdb_load_shlib },
+	{ PKG_LOAD_SHLIBS_PROVIDED, pkgdb_load_shlib_provided },
 	{ -1, NULL }
 };
 
+static void
+batch_add_dep(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_adddep(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_text(stmt, 2), sqlite3_column_text(stmt, 3));
+}
+
+static void
+batch_add_rdep(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_addrdep(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_text(stmt, 2), sqlite3_column_text(stmt, 3));
+}
+
+static void
+batch_add_file(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_addfile(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_text(stmt, 2), false);
+}
+
+static void
+batch_add_dir(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_adddir(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_int(stmt, 2));
+}
+
+static void
+batch_add_script(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_addscript(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_int(stmt, 2));
+}
+
+static void
+batch_add_option(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_addoption(pkg, sqlite3_column_text(stmt, 1),
+	    sqlite3_column_text(stmt, 2));
+}
+
+static void
+batch_add_mtree(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_set_mtree(pkg, sqlite3_column_text(stmt, 1));
+}
+
+static void
+batch_add_category(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_addcategory(pkg, sqlite3_column_text(stmt, 1));
+}
+
+static void
+batch_add_license(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_addlicense(pkg, sqlite3_column_text(stmt, 1));
+}
+
+static void
+batch_add_user(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_adduser(pkg, sqlite3_column_text(stmt, 1));
+}
+
+static void
+batch_add_group(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_addgroup(pkg, sqlite3_column_text(stmt, 1));
+}
+
+static void
+batch_add_shlib(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_addshlib(pkg, sqlite3_column_text(stmt, 1));
+}
+
+static void
+batch_add_shlib_provided(struct pkg *pkg, sqlite3_stmt *stmt)
+{
+	pkg_addshlib_provided(pkg, sqlite3_column_text(stmt, 1));
+}
+
+/*
+ * The same relations as load_on_flag, loaded for a whole window of
+ * installed packages with one query.  The first column is the id of the
+ * package the row belongs to, or its origin for the reverse dependencies,
+ * and the rows of a package come in the order pkgdb_load_*() gives them.
+ * %s is replaced by the placeholders of the window.
+ */
+static struct load_batch {
+	int flag;
+	int list;
+	bool by_origin;
+	const char *sql;
+	void (*add)(struct pkg *, sqlite3_stmt *);
+} load_batch[] = {
+	{ PKG_LOAD_DEPS, PKG_DEPS, false,
+	    "SELECT package_id, name, origin, version FROM deps "
+	    "WHERE package_id IN (%s) ORDER BY package_id, origin",
+	    batch_add_dep },
+	{ PKG_LOAD_RDEPS, PKG_RDEPS, true,
+	    "SELECT d.origin, p.name, p.origin, p.version "
+	    "FROM packages AS p, deps AS d "
+	    "WHERE p.id = d.package_id AND d.origin IN (%s) "
+	    "ORDER BY d.origin, p.id",
+	    batch_add_rdep },
+	{ PKG_LOAD_FILES, PKG_FILES, false,
+	    "SELECT package_id, path, sha256 FROM files "
+	    "WHERE package_id IN (%s) ORDER BY package_id, path ASC",
+	    batch_add_file },
+	{ PKG_LOAD_DIRS, PKG_DIRS, false,
+	    "SELECT package_id, path, try FROM pkg_directories, directories "
+	    "WHERE package_id IN (%s) AND directory_id = directories.id "
+	    "ORDER BY package_id, path DESC",
+	    batch_add_dir },
+	{ PKG_LOAD_SCRIPTS, PKG_SCRIPTS, false,
+	    "SELECT package_id, script, type FROM scripts "
+	    "WHERE package_id IN (%s) ORDER BY package_id, type",
+	    batch_add_script },
+	{ PKG_LOAD_OPTIONS, PKG_OPTIONS, false,
+	    "SELECT package_id, option, value FROM options "
+	    "WHERE package_id IN (%s) ORDER BY package_id, option",
+	    batch_add_option },
+	{ PKG_LOAD_MTREE, -1, false,
+	    "SELECT p.id, m.content FROM mtree AS m, packages AS p "
+	    "WHERE m.id = p.mtree_id AND p.id IN (%s)",
+	    batch_add_mtree },
+	{ PKG_LOAD_CATEGORIES, PKG_CATEGORIES, false,
+	    "SELECT package_id, name FROM pkg_categories, categories AS c "
+	    "WHERE package_id IN (%s) AND category_id = c.id "
+	    "ORDER BY package_id, name DESC",
+	    batch_add_category },
+	{ PKG_LOAD_LICENSES, PKG_LICENSES, false,
+	    "SELECT package_id, name FROM pkg_licenses, licenses AS l "
+	    "WHERE package_id IN (%s) AND license_id = l.id "
+	    "ORDER BY package_id, name DESC",
+	    batch_add_license },
+	{ PKG_LOAD_USERS, PKG_USERS, false,
+	    "SELECT package_id, users.name FROM pkg_users, users "
+	    "WHERE package_id IN (%s) AND user_id = users.id "
+	    "ORDER BY package_id, users.name DESC",
+	    batch_add_user },
+	{ PKG_LOAD_GROUPS, PKG_GROUPS, false,
+	    "SELECT package_id, groups.name FROM pkg_groups, groups "
+	    "WHERE package_id IN (%s) AND group_id = groups.id "
+	    "ORDER BY package_id, groups.name DESC",
+	    batch_add_group },
+	{ PKG_LOAD_SHLIBS, PKG_SHLIBS, false,
+	    "SELECT package_id, name FROM pkg_shlibs, shlibs AS s "
+	    "WHERE package_id IN (%s) AND shlib_id = s.id "
+	    "ORDER BY package_id, name DESC",
+	    batch_add_shlib },
+	{ PKG_LOAD_SHLIBS_PROVIDED, PKG_SHLIBS_PROVIDED, false,
+	    "SELECT package_id, name FROM pkg_shlibs_provided, shlibs AS s "
+	    "WHERE package_id IN (%s) AND shlib_id = s.id "
+	    "ORDER BY package_id, name DESC",
+	    batch_add_shlib_provided },
+	{ -1, -1, false, NULL, NULL }
+};
+
+/* Find the package of the window a row belongs to, starting from cur */
+static struct pkg *
+pkgdb_it_window_find(struct pkgdb_it *it, sqlite3_stmt *stmt, bool by_origin,
+    int *cur)
+{
+	struct pkg *pkg;
+	const char *origin;
+	const char *key = NULL;
+	int64_t id = 0;
+	int i, n;
+
+	if (by_origin)
+		key = sqlite3_column_text(stmt, 0);
+	else
+		id = sqlite3_column_int64(stmt, 0);
+
+	for (n = 0; n < it->nwindow; n++) {
+		i = (*cur + n) % it->nwindow;
+		pkg = it->window[i];
+		if (by_origin) {
+			pkg_get(pkg, PKG_ORIGIN, &origin);
+			if (key == NULL || strcmp(origin, key) != 0)
+				continue;
+		} else if (pkg->rowid != id) {
+			continue;
+		}
+		*cur = i;
+		return (pkg);
+	}
+
+	return (NULL);
+}
+
+static int
+pkgdb_it_load_batch(struct pkgdb_it *it, struct load_batch *lb)
+{
+	struct sbuf *in, *sql;
+	sqlite3_stmt *stmt;
+	struct pkg *pkg;
+	const char *origin;
+	int cur = 0;
+	int i;
+	int ret;
+
+	in = sbuf_new_auto();
+	for (i = 0; i < it->nwindow; i++)
+		sbuf_cat(in, i == 0 ? "?" : ",?");
+	sbuf_finish(in);
+
+	sql = sbuf_new_auto();
+	sbuf_printf(sql, lb->sql, sbuf_data(in));
+	sbuf_finish(sql);
+
+	/* full windows always use the same statement */
+	stmt = pkgdb_stmt_get(it->db, sbuf_data(sql));
+	sbuf_delete(in);
+	sbuf_delete(sql);
+	if (stmt == NULL)
+		return (EPKG_FATAL);
+
+	for (i = 0; i < it->nwindow; i++) {
+		if (lb->by_origin) {
+			pkg_get(it->window[i], PKG_ORIGIN, &origin);
+			sqlite3_bind_text(stmt, i + 1, origin, -1,
+			    SQLITE_STATIC);
+		} else {
+			sqlite3_bind_int64(stmt, i + 1, it->window[i]->rowid);
+		}
+	}
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		pkg = pkgdb_it_window_find(it, stmt, lb->by_origin, &cur);
+		if (pkg != NULL)
+			lb->add(pkg, stmt);
+	}
+
+	pkgdb_stmt_release(it->db, stmt);
+
+	if (ret != SQLITE_DONE) {
+		for (i = 0; i < it->nwindow; i++)
+			if (lb->list != -1)
+				pkg_list_free(it->window[i], lb->list);
+		ERROR_SQLITE(it->db->sqlite);
+		return (EPKG_FATAL);
+	}
+
+	for (i = 0; i < it->nwindow; i++) {
+		it->window[i]->flags |= lb->flag;
+		if (lb->flag == PKG_LOAD_GROUPS)
+			pkgdb_set_gidstr(it->window[i]);
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Read the next rows of the statement ahead into the window and load the
+ * requested relations for all of them at once, instead of running one
+ * query per package and per relation.
+ */
+static int
+pkgdb_it_fill(struct pkgdb_it *it, int flags)
+{
+	struct pkg *pkg;
+	int i;
+	int ret;
+
+	it->nwindow = 0;
+	it->next = 0;
+
+	while (it->nwindow < PKGDB_IT_WINDOW) {
+		ret = sqlite3_step(it->stmt);
+		if (ret == SQLITE_DONE)
+			break;
+		if (ret != SQLITE_ROW) {
+			ERROR_SQLITE(it->db->sqlite);
+			return (EPKG_FATAL);
+		}
+
+		if (it->window[it->nwindow] == NULL)
+			pkg_new(&it->window[it->nwindow], it->type);
+		else
+			pkg_reset(it->window[it->nwindow], it->type);
+		pkg = it->window[it->nwindow++];
+
+		populate_pkg(it, pkg);
+	}
+
+	if (it->nwindow == 0)
+		return (EPKG_END);
+
+	for (i = 0; load_batch[i].sql != NULL; i++) {
+		if ((flags & load_batch[i].flag) == 0)
+			continue;
+		if ((ret = pkgdb_it_load_batch(it, &load_batch[i])) != EPKG_OK) {
+			it->nwindow = 0;
+			return (ret);
+		}
+	}
+	it->wflags = flags;
+
+	return (EPKG_OK);
+}
+
 int
 pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, int flags)
 {
@@ -823,6 +1279,33 @@ pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, int flags)
 
 	assert(it != NULL);
 
+	/*
+	 * Installed packages are read by windows when relations are
+	 * requested.  The caller gets the package of the window, its own
+	 * struct pkg takes that place to be reused by the next window.  The
+	 * relations requested since the window was filled are loaded for
+	 * this package only.
+	 */
+	if (it->next < it->nwindow ||
+	    (it->type == PKG_INSTALLED && (flags & ~PKG_LOAD_BASIC) != 0)) {
+		if (it->next >= it->nwindow &&
+		    (ret = pkgdb_it_fill(it, flags)) != EPKG_OK)
+			return (ret);
+
+		pkg = it->window[it->next];
+		it->window[it->next++] = *pkg_p;
+		*pkg_p = pkg;
+
+		for (i = 0; load_on_flag[i].load != NULL; i++) {
+			if ((flags & ~it->wflags & load_on_flag[i].flag) == 0)
+				continue;
+			if ((ret = load_on_flag[i].load(it->db, pkg)) != EPKG_OK)
+				return (ret);
+		}
+
+		return (EPKG_OK);
+	}
+
 	switch (sqlite3_step(it->stmt)) {
 	case SQLITE_ROW:
 		if (*pkg_p == NULL)
@@ -831,7 +1314,7 @@ pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, int flags)
 			pkg_reset(*pkg_p, it->type);
 		pkg = *pkg_p;
 
-		populate_pkg(it->stmt, pkg);
+		populate_pkg(it, pkg);
 
 		for (i = 0; load_on_flag[i].load != NULL; i++) {
 			if (flags & load_on_flag[i].flag)
@@ -851,6 +1334,8 @@ pkgdb_it_next(struct pkgdb_it *it, struct pkg **pkg_p, int flags)
 void
 pkgdb_it_free(struct pkgdb_it *it)
 {
+	int i;
+
 	if (it == NULL)
 		return;
 
@@ -860,7 +1345,11 @@ pkgdb_it_free(struct pkgdb_it *it)
 			"DROP TABLE IF EXISTS pkgjobs");
 	}
 
+	for (i = 0; i < PKGDB_IT_WINDOW; i++)
+		pkg_free(it->window[i]);
+
 	sqlite3_finalize(it->stmt);
+	free(it->colmap);
 	free(it);
 }
 
@@ -1035,10 +1524,8 @@ pkgdb_is_dir_used(struct pkgdb *db, const char *dir, int64_t *res)
 
 	assert(db != NULL);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_text(stmt, 1, dir, -1, SQLITE_TRANSIENT);
 
@@ -1047,7 +1534,7 @@ pkgdb_is_dir_used(struct pkgdb *db, const char *dir, int64_t *res)
 	if (ret == SQLITE_ROW)
 		*res = sqlite3_column_int64(stmt, 0);
 
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_ROW) {
 		ERROR_SQLITE(db->sqlite);
@@ -1083,10 +1570,8 @@ pkgdb_load_deps(struct pkgdb *db, struct pkg *pkg)
 	} else
 		snprintf(sql, sizeof(sql), basesql, "main");
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -1094,7 +1579,7 @@ pkgdb_load_deps(struct pkgdb *db, struct pkg *pkg)
 		pkg_adddep(pkg, sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1),
 				   sqlite3_column_text(stmt, 2));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_DEPS);
@@ -1132,10 +1617,8 @@ pkgdb_load_rdeps(struct pkgdb *db, struct pkg *pkg)
 	} else
 		snprintf(sql, sizeof(sql), basesql, "main", "main");
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	pkg_get(pkg, PKG_ORIGIN, &origin);
 	sqlite3_bind_text(stmt, 1, origin, -1, SQLITE_STATIC);
@@ -1144,7 +1627,7 @@ pkgdb_load_rdeps(struct pkgdb *db, struct pkg *pkg)
 		pkg_addrdep(pkg, sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1),
 				   sqlite3_column_text(stmt, 2));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_RDEPS);
@@ -1173,17 +1656,15 @@ pkgdb_load_files(struct pkgdb *db, struct pkg *pkg)
 	if (pkg->flags & PKG_LOAD_FILES)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
 	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
 		pkg_addfile(pkg, sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1), false);
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_FILES);
@@ -1213,10 +1694,8 @@ pkgdb_load_dirs(struct pkgdb *db, struct pkg *pkg)
 	if (pkg->flags & PKG_LOAD_DIRS)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -1224,7 +1703,7 @@ pkgdb_load_dirs(struct pkgdb *db, struct pkg *pkg)
 		pkg_adddir(pkg, sqlite3_column_text(stmt, 0), sqlite3_column_int(stmt, 1));
 	}
 
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_DIRS);
 		ERROR_SQLITE(db->sqlite);
@@ -1257,7 +1736,7 @@ pkgdb_load_license(struct pkgdb *db, struct pkg *pkg)
 	} else
 		snprintf(sql, sizeof(sql), basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_LICENSES, pkg_addlicense, PKG_LICENSES));
+	return (load_val(db, pkg, sql, PKG_LOAD_LICENSES, pkg_addlicense, PKG_LICENSES));
 }
 
 int
@@ -1281,7 +1760,7 @@ pkgdb_load_category(struct pkgdb *db, struct pkg *pkg)
 	} else
 		snprintf(sql, sizeof(sql), basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_CATEGORIES, pkg_addcategory, PKG_CATEGORIES));
+	return (load_val(db, pkg, sql, PKG_LOAD_CATEGORIES, pkg_addcategory, PKG_CATEGORIES));
 }
 
 int
@@ -1301,7 +1780,7 @@ pkgdb_load_user(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	ret = load_val(db->sqlite, pkg, sql, PKG_LOAD_USERS, pkg_adduser, PKG_USERS);
+	ret = load_val(db, pkg, sql, PKG_LOAD_USERS, pkg_adduser, PKG_USERS);
 
 	/* TODO get user uidstr from local database */
 /*	while (pkg_users(pkg, &u) == EPKG_OK) {
@@ -1314,11 +1793,23 @@ pkgdb_load_user(struct pkgdb *db, struct pkg *pkg)
 	return (ret);
 }
 
-int
-pkgdb_load_group(struct pkgdb *db, struct pkg *pkg)
+static void
+pkgdb_set_gidstr(struct pkg *pkg)
 {
 	struct pkg_group *g = NULL;
 	struct group * grp = NULL;
+
+	while (pkg_groups(pkg, &g) == EPKG_OK) {
+		grp = getgrnam(pkg_group_name(g));
+		if (grp == NULL)
+			continue;
+		strlcpy(g->gidstr, gr_make(grp), sizeof(g->gidstr));
+	}
+}
+
+int
+pkgdb_load_group(struct pkgdb *db, struct pkg *pkg)
+{
 	int ret;
 
 	const char sql[] = ""
@@ -1331,14 +1822,9 @@ pkgdb_load_group(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	ret = load_val(db->sqlite, pkg, sql, PKG_LOAD_GROUPS, pkg_addgroup, PKG_GROUPS);
+	ret = load_val(db, pkg, sql, PKG_LOAD_GROUPS, pkg_addgroup, PKG_GROUPS);
 
-	while (pkg_groups(pkg, &g) == EPKG_OK) {
-		grp = getgrnam(pkg_group_name(g));
-		if (grp == NULL)
-			continue;
-		strlcpy(g->gidstr, gr_make(grp), sizeof(g->gidstr));
-	}
+	pkgdb_set_gidstr(pkg);
 
 	return (ret);
 }
@@ -1364,7 +1850,32 @@ pkgdb_load_shlib(struct pkgdb *db, struct pkg *pkg)
 	} else
 		snprintf(sql, sizeof(sql), basesql, "main", "main");
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_SHLIBS, pkg_addshlib, PKG_SHLIBS));
+	return (load_val(db, pkg, sql, PKG_LOAD_SHLIBS, pkg_addshlib, PKG_SHLIBS));
+}
+
+int
+pkgdb_load_shlib_provided(struct pkgdb *db, struct pkg *pkg)
+{
+	char sql[BUFSIZ];
+	const char *reponame = NULL;
+	const char *basesql = ""
+			"SELECT name "
+			"FROM '%s'.pkg_shlibs_provided, '%s'.shlibs AS s "
+			"WHERE package_id = ?1 "
+			"AND shlib_id = s.id "
+			"ORDER by name DESC";
+
+	assert(db != NULL && pkg != NULL);
+
+	if (pkg->type == PKG_REMOTE) {
+		assert(db->type == PKGDB_REMOTE);
+		pkg_get(pkg, PKG_REPONAME, &reponame);
+		snprintf(sql, sizeof(sql), basesql, reponame, reponame);
+	} else
+		snprintf(sql, sizeof(sql), basesql, "main", "main");
+
+	return (load_val(db, pkg, sql, PKG_LOAD_SHLIBS_PROVIDED,
+	    pkg_addshlib_provided, PKG_SHLIBS_PROVIDED));
 }
 
 int
@@ -1383,17 +1894,15 @@ pkgdb_load_scripts(struct pkgdb *db, struct pkg *pkg)
 	if (pkg->flags & PKG_LOAD_SCRIPTS)
 		return (EPKG_OK);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
 	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
 		pkg_addscript(pkg, sqlite3_column_text(stmt, 0), sqlite3_column_int(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_SCRIPTS);
@@ -1430,10 +1939,8 @@ pkgdb_load_options(struct pkgdb *db, struct pkg *pkg)
 		snprintf(sql, sizeof(sql), basesql, "main");
 	}
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		ERROR_SQLITE(db->sqlite);
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
 		return (EPKG_FATAL);
-	}
 
 	sqlite3_bind_int64(stmt, 1, pkg->rowid);
 
@@ -1441,7 +1948,7 @@ pkgdb_load_options(struct pkgdb *db, struct pkg *pkg)
 		pkg_addoption(pkg, sqlite3_column_text(stmt, 0),
 					  sqlite3_column_text(stmt, 1));
 	}
-	sqlite3_finalize(stmt);
+	pkgdb_stmt_release(db, stmt);
 
 	if (ret != SQLITE_DONE) {
 		pkg_list_free(pkg, PKG_OPTIONS);
@@ -1465,7 +1972,7 @@ pkgdb_load_mtree(struct pkgdb *db, struct pkg *pkg)
 	assert(db != NULL && pkg != NULL);
 	assert(pkg->type == PKG_INSTALLED);
 
-	return (load_val(db->sqlite, pkg, sql, PKG_LOAD_MTREE, pkg_set_mtree, -1));
+	return (load_val(db, pkg, sql, PKG_LOAD_MTREE, pkg_set_mtree, -1));
 }
 
 int
@@ -1537,6 +2044,9 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 	const char sql_shlibs[] = ""
 		"INSERT INTO pkg_shlibs(package_id, shlib_id) "
 		"VALUES (?1, (SELECT id FROM shlibs WHERE name = ?2))";
+	const char sql_shlibs_provided[] = ""
+		"INSERT INTO pkg_shlibs_provided(package_id, shlib_id) "
+		"VALUES (?1, (SELECT id FROM shlibs WHERE name = ?2))";
 	const char sql_deps_update[] = ""
 		"UPDATE deps SET NAME=?1 , VERSION=?2 WHERE ORIGIN=?3;";
 
@@ -1965,6 +2475,38 @@ pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete)
 		sqlite3_reset(stmt);
 		sqlite3_reset(stmt2);
 	}
+	sqlite3_finalize(stmt2);
+	stmt2 = NULL;
+
+	/*
+	 * Insert the provided shlibs, sharing the names with the required ones
+	 */
+
+	if (sqlite3_prepare_v2(s, sql_shlibs_provided, -1, &stmt2, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(s);
+		goto cleanup;
+	}
+
+	while (pkg_shlibs_provided(pkg, &shlib) == EPKG_OK) {
+		sqlite3_bind_text(stmt, 1, pkg_shlib_name(shlib), -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt2, 1, package_id);
+		sqlite3_bind_text(stmt2, 2, pkg_shlib_name(shlib), -1, SQLITE_STATIC);
+
+		if ((ret = sqlite3_step(stmt)) != SQLITE_DONE) {
+			if (ret == SQLITE_CONSTRAINT) {
+				pkg_emit_error("sqlite: constraint violation on shlibs.name: %s",
+						pkg_shlib_name(shlib));
+			} else
+				ERROR_SQLITE(s);
+			goto cleanup;
+		}
+		if ((ret = sqlite3_step(stmt2)) != SQLITE_DONE) {
+			ERROR_SQLITE(s);
+			goto cleanup;
+		}
+		sqlite3_reset(stmt);
+		sqlite3_reset(stmt2);
+	}
 	sqlite3_finalize(stmt);
 	sqlite3_finalize(stmt2);
 	stmt = NULL;
@@ -1993,6 +2535,9 @@ pkgdb_register_finale(struct pkgdb *db, int retcode)
 	cmd = (retcode == EPKG_OK) ? "COMMIT;" : "ROLLBACK;";
 	ret = sql_exec(db->sqlite, cmd);
 
+	if (ret == EPKG_OK && retcode == EPKG_OK)
+		pkgdb_checkpoint(db);
+
 	return (ret);
 }
 
@@ -2056,7 +2601,8 @@ pkgdb_unregister_pkg(struct pkgdb *db, const char *origin)
 	if (sql_exec(db->sqlite, "DELETE FROM groups WHERE id NOT IN (SELECT DISTINCT group_id FROM pkg_groups);") != EPKG_OK)
 		return (EPKG_FATAL);
 
-	if (sql_exec(db->sqlite, "DELETE FROM shlibs WHERE id NOT IN (SELECT DISTINCT shlib_id FROM pkg_shlibs);") != EPKG_OK)
+	if (sql_exec(db->sqlite, "DELETE FROM shlibs WHERE id NOT IN (SELECT DISTINCT shlib_id FROM pkg_shlibs) "
+	    "AND id NOT IN (SELECT DISTINCT shlib_id FROM pkg_shlibs_provided);") != EPKG_OK)
 		return (EPKG_FATAL);
 
 	return (EPKG_OK);
@@ -2215,7 +2761,7 @@ pkgdb_detach_remotes(sqlite3 *s)
 	sbuf_delete(sql);
 }
 
-static int
+int
 get_pragma(sqlite3 *s, const char *sql, int64_t *res)
 {
 	sqlite3_stmt *stmt;
@@ -2267,6 +2813,270 @@ pkgdb_compact(struct pkgdb *db)
 	return (sql_exec(db->sqlite, "VACUUM;"));
 }
 
+/* origin-indexed adjacency of the packages, for pkgdb_closure() */
+struct closure_graph {
+	char **origins;		/* sorted, unique */
+	size_t norigins;
+	size_t *first;		/* edges of i are to[first[i]..first[i + 1]) */
+	size_t *to;
+};
+
+static int
+closure_strcmp(const void *a, const void *b)
+{
+	return (strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+static ssize_t
+closure_find(struct closure_graph *g, const char *origin)
+{
+	char **found;
+
+	found = bsearch(&origin, g->origins, g->norigins, sizeof(char *),
+	    closure_strcmp);
+	if (found == NULL)
+		return (-1);
+
+	return (found - g->origins);
+}
+
+static void
+closure_graph_free(struct closure_graph *g)
+{
+	size_t i;
+
+	for (i = 0; i < g->norigins; i++)
+		free(g->origins[i]);
+	free(g->origins);
+	free(g->first);
+	free(g->to);
+}
+
+/* Build the graph from the (origin, origin) rows of edges_sql */
+static int
+closure_graph_load(struct pkgdb *db, const char *edges_sql,
+    struct closure_graph *g)
+{
+	sqlite3_stmt *stmt;
+	char **ends = NULL, **tmp;
+	size_t nends = 0, cap = 0;
+	size_t i, k, from;
+	int ret = EPKG_FATAL;
+
+	memset(g, 0, sizeof(*g));
+
+	if (sqlite3_prepare_v2(db->sqlite, edges_sql, -1, &stmt, NULL) !=
+	    SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		return (EPKG_FATAL);
+	}
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (nends + 2 > cap) {
+			cap = MAX(cap * 2, 1024);
+			if ((tmp = realloc(ends, cap * sizeof(char *))) == NULL) {
+				pkg_emit_errno("realloc", "pkgdb_closure");
+				ret = EPKG_FATAL;
+				goto cleanup;
+			}
+			ends = tmp;
+		}
+		ends[nends] = strdup(sqlite3_column_text(stmt, 0));
+		ends[nends + 1] = strdup(sqlite3_column_text(stmt, 1));
+		if (ends[nends] == NULL || ends[nends + 1] == NULL) {
+			free(ends[nends]);
+			free(ends[nends + 1]);
+			pkg_emit_errno("strdup", "pkgdb_closure");
+			ret = EPKG_FATAL;
+			goto cleanup;
+		}
+		nends += 2;
+	}
+	if (ret != SQLITE_DONE) {
+		ERROR_SQLITE(db->sqlite);
+		ret = EPKG_FATAL;
+		goto cleanup;
+	}
+	ret = EPKG_FATAL;
+
+	/* the origins are indexed once, the edges then only use indexes */
+	if ((g->origins = malloc(MAX(nends, 1) * sizeof(char *))) == NULL ||
+	    (g->to = malloc(MAX(nends / 2, 1) * sizeof(size_t))) == NULL) {
+		pkg_emit_errno("malloc", "pkgdb_closure");
+		goto cleanup;
+	}
+	memcpy(g->origins, ends, nends * sizeof(char *));
+	qsort(g->origins, nends, sizeof(char *), closure_strcmp);
+	for (i = 0; i < nends; i++) {
+		if (g->norigins > 0 &&
+		    strcmp(g->origins[g->norigins - 1], g->origins[i]) == 0)
+			continue;
+		g->origins[g->norigins++] = g->origins[i];
+	}
+
+	if ((g->first = calloc(g->norigins + 1, sizeof(size_t))) == NULL) {
+		pkg_emit_errno("calloc", "pkgdb_closure");
+		goto cleanup;
+	}
+	for (i = 0; i < nends; i += 2)
+		g->first[closure_find(g, ends[i]) + 1]++;
+	for (i = 0; i < g->norigins; i++)
+		g->first[i + 1] += g->first[i];
+	for (i = 0; i < nends; i += 2) {
+		from = closure_find(g, ends[i]);
+		k = g->first[from]++;
+		g->to[k] = closure_find(g, ends[i + 1]);
+	}
+	/* first[i] now points to the end of the edges of i */
+	memmove(g->first + 1, g->first, g->norigins * sizeof(size_t));
+	g->first[0] = 0;
+
+	ret = EPKG_OK;
+
+	cleanup:
+	sqlite3_finalize(stmt);
+	/* only the strings kept in origins survive */
+	for (i = 0; i < nends; i++) {
+		if (ret == EPKG_OK &&
+		    g->origins[closure_find(g, ends[i])] == ends[i])
+			continue;
+		free(ends[i]);
+	}
+	free(ends);
+	if (ret != EPKG_OK) {
+		free(g->origins);
+		free(g->first);
+		free(g->to);
+		memset(g, 0, sizeof(*g));
+	}
+
+	return (ret);
+}
+
+/*
+ * The dependency closure used by the install, upgrade, fetch and delete
+ * queries.  edges_sql returns the (origin, origin) edges to follow,
+ * seed_sql the origins the closure starts from, and insert_sql adds one
+ * origin, bound to ?1, to the jobs.  The graph is read once and walked
+ * breadth first: an origin is only followed further when insert_sql did
+ * add it, as the former INSERT loops only followed the rows they inserted.
+ */
+static int
+pkgdb_closure(struct pkgdb *db, const char *edges_sql, const char *seed_sql,
+    const char *insert_sql)
+{
+	struct closure_graph g;
+	struct timespec begin, end;
+	sqlite3_stmt *seed = NULL, *insert = NULL;
+	size_t *queue = NULL;
+	char *seen = NULL;
+	size_t head = 0, tail = 0;
+	size_t e, n;
+	ssize_t i;
+	int nadded = 0;
+	int ret;
+	int retcode = EPKG_FATAL;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	if (closure_graph_load(db, edges_sql, &g) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	if ((queue = calloc(MAX(g.norigins, 1), sizeof(size_t))) == NULL ||
+	    (seen = calloc(MAX(g.norigins, 1), 1)) == NULL) {
+		pkg_emit_errno("calloc", "pkgdb_closure");
+		goto cleanup;
+	}
+
+	if (sqlite3_prepare_v2(db->sqlite, seed_sql, -1, &seed, NULL) !=
+	    SQLITE_OK ||
+	    sqlite3_prepare_v2(db->sqlite, insert_sql, -1, &insert, NULL) !=
+	    SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+
+	while ((ret = sqlite3_step(seed)) == SQLITE_ROW) {
+		i = closure_find(&g, sqlite3_column_text(seed, 0));
+		if (i == -1 || seen[i])
+			continue;
+		seen[i] = 1;
+		queue[tail++] = i;
+	}
+	if (ret != SQLITE_DONE) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+
+	while (head < tail) {
+		n = queue[head++];
+		for (e = g.first[n]; e < g.first[n + 1]; e++) {
+			if (seen[g.to[e]])
+				continue;
+			seen[g.to[e]] = 1;
+
+			sqlite3_bind_text(insert, 1, g.origins[g.to[e]], -1,
+			    SQLITE_STATIC);
+			if (sqlite3_step(insert) != SQLITE_DONE) {
+				ERROR_SQLITE(db->sqlite);
+				goto cleanup;
+			}
+			sqlite3_reset(insert);
+
+			if (sqlite3_changes(db->sqlite) > 0) {
+				queue[tail++] = g.to[e];
+				nadded++;
+			}
+		}
+	}
+
+	retcode = EPKG_OK;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pkg_emit_debug(1, "pkgdb: dependency closure added %d packages, "
+	    "%zu edges, in %.3fs", nadded, g.norigins > 0 ?
+	    g.first[g.norigins] : 0, (end.tv_sec - begin.tv_sec) +
+	    (end.tv_nsec - begin.tv_nsec) / 1e9);
+
+	cleanup:
+	sqlite3_finalize(seed);
+	sqlite3_finalize(insert);
+	free(queue);
+	free(seen);
+	closure_graph_free(&g);
+
+	return (retcode);
+}
+
+/* Add the dependencies of the pkgjobs from reponame with insert_sql */
+static int
+pkgdb_query_deps_closure(struct pkgdb *db, const char *reponame,
+    struct sbuf *sql, const char *insert_sql)
+{
+	char *edges;
+	int ret;
+
+	sbuf_reset(sql);
+	sbuf_printf(sql, "SELECT p.origin, d.origin FROM '%s'.deps AS d, "
+	    "'%s'.packages AS p WHERE p.id = d.package_id;", reponame,
+	    reponame);
+	sbuf_finish(sql);
+	if ((edges = strdup(sbuf_data(sql))) == NULL) {
+		pkg_emit_errno("strdup", "pkgdb_closure");
+		return (EPKG_FATAL);
+	}
+
+	sbuf_reset(sql);
+	sbuf_printf(sql, insert_sql, reponame);
+	sbuf_finish(sql);
+
+	ret = pkgdb_closure(db, edges, "SELECT origin FROM pkgjobs;",
+	    sbuf_data(sql));
+	free(edges);
+
+	return (ret);
+}
+
 static int
 create_temporary_pkgjobs(sqlite3 *s)
 {
@@ -2371,8 +3181,8 @@ pkgdb_query_installs(struct pkgdb *db, match_t match, int nbpkgs, char **pkgs, c
 	const char finalsql[] = "SELECT pkgid AS id, origin, name, version, "
 		"comment, desc, message, arch, maintainer, "
 		"www, prefix, flatsize, newversion, newflatsize, pkgsize, "
-		"cksum, repopath, automatic, weight, "
-		"'%s' AS dbname FROM pkgjobs ORDER BY weight DESC;";
+		"cksum, repopath, automatic, "
+		"'%s' AS dbname FROM pkgjobs;";
 
 	const char main_sql[] = "INSERT OR IGNORE INTO pkgjobs (pkgid, origin, name, version, comment, desc, arch, "
 			"maintainer, www, prefix, flatsize, pkgsize, "
@@ -2384,20 +3194,12 @@ pkgdb_query_installs(struct pkgdb *db, match_t match, int nbpkgs, char **pkgs, c
 	const char deps_sql[] = "INSERT OR IGNORE INTO pkgjobs (pkgid, origin, name, version, comment, desc, arch, "
 				"maintainer, www, prefix, flatsize, pkgsize, "
 				"cksum, repopath, automatic) "
-				"SELECT DISTINCT r.id, r.origin, r.name, r.version, r.comment, r.desc, "
+				"SELECT r.id, r.origin, r.name, r.version, r.comment, r.desc, "
 				"r.arch, r.maintainer, r.www, r.prefix, r.flatsize, r.pkgsize, "
 				"r.cksum, r.path, 1 "
-				"FROM '%s'.packages AS r where r.origin IN "
-				"(SELECT d.origin FROM '%s'.deps AS d, pkgjobs AS j WHERE d.package_id = j.pkgid) "
+				"FROM '%s'.packages AS r where r.origin = ?1 "
 				"AND (SELECT origin FROM main.packages WHERE origin=r.origin AND version=r.version) IS NULL;";
 
-	const char weight_sql[] = "UPDATE pkgjobs SET weight=("
-		"SELECT COUNT(*) FROM '%s'.deps AS d, '%s'.packages AS p, pkgjobs AS j "
-			"WHERE d.origin = pkgjobs.origin "
-				"AND d.package_id = p.id "
-				"AND p.origin = j.origin"
-		");";
-
 	assert(db != NULL);
 	assert(db->type == PKGDB_REMOTE);
 
@@ -2441,13 +3243,10 @@ pkgdb_query_installs(struct pkgdb *db, match_t match, int nbpkgs, char **pkgs, c
 		sql_exec(db->sqlite, "DELETE from pkgjobs where (select p.origin from main.packages as p where p.origin=pkgjobs.origin and p.version=pkgjobs.version and p.name = pkgjobs.name) IS NOT NULL;");
 
 	/* Append dependencies */
-	sbuf_reset(sql);
-	sbuf_printf(sql, deps_sql, reponame, reponame);
-	sbuf_finish(sql);
-
-	do {
-		sql_exec(db->sqlite, sbuf_get(sql));
-	} while (sqlite3_changes(db->sqlite) != 0);
+	if (pkgdb_query_deps_closure(db, reponame, sql, deps_sql) != EPKG_OK) {
+		sbuf_delete(sql);
+		return (NULL);
+	}
 
 
 	/* Determine if there is an upgrade needed */
@@ -2459,14 +3258,6 @@ pkgdb_query_installs(struct pkgdb *db, match_t match, int nbpkgs, char **pkgs, c
 			"r.flatsize AS newflatsize, r.pkgsize, r.cksum, r.repopath, l.automatic "
 			"FROM main.packages AS l, pkgjobs AS r WHERE l.origin = r.origin ");
 
-	sbuf_reset(sql);
-	sbuf_printf(sql, weight_sql, reponame, reponame);
-	sbuf_finish(sql);
-
-	sql_exec(db->sqlite, sbuf_get(sql));
-
-	sql_exec(db->sqlite, "UPDATE pkgjobs set weight=100000 where origin=\"ports-mgmt/pkg\"");
-
 	sbuf_reset(sql);
 	sbuf_printf(sql, finalsql, reponame);
 	sbuf_finish(sql);
@@ -2502,8 +3293,8 @@ pkgdb_query_upgrades(struct pkgdb *db, const char *repo, bool all)
 	const char finalsql[] = "select pkgid as id, origin, name, version, "
 		"comment, desc, message, arch, maintainer, "
 		"www, prefix, flatsize, newversion, newflatsize, pkgsize, "
-		"cksum, repopath, automatic, weight, "
-		"'%s' AS dbname FROM pkgjobs order by weight DESC;";
+		"cksum, repopath, automatic, "
+		"'%s' AS dbname FROM pkgjobs;";
 
 	const char pkgjobs_sql_1[] = "INSERT OR IGNORE INTO pkgjobs (pkgid, origin, name, version, comment, desc, arch, "
 			"maintainer, www, prefix, flatsize, pkgsize, "
@@ -2515,11 +3306,10 @@ pkgdb_query_upgrades(struct pkgdb *db, const char *repo, bool all)
 	const char pkgjobs_sql_2[] = "INSERT OR IGNORE INTO pkgjobs (pkgid, origin, name, version, comment, desc, arch, "
 				"maintainer, www, prefix, flatsize, pkgsize, "
 				"cksum, repopath, automatic) "
-				"SELECT DISTINCT r.id, r.origin, r.name, r.version, r.comment, r.desc, "
+				"SELECT r.id, r.origin, r.name, r.version, r.comment, r.desc, "
 				"r.arch, r.maintainer, r.www, r.prefix, r.flatsize, r.pkgsize, "
 				"r.cksum, r.path, 1 "
-				"FROM '%s'.packages AS r where r.origin IN "
-				"(SELECT d.origin from '%s'.deps AS d, pkgjobs as j WHERE d.package_id = j.pkgid) "
+				"FROM '%s'.packages AS r where r.origin = ?1 "
 				"AND (SELECT p.origin from main.packages as p WHERE p.origin=r.origin AND version=r.version) IS NULL;";
 
 	const char *pkgjobs_sql_3;
@@ -2542,13 +3332,6 @@ pkgdb_query_upgrades(struct pkgdb *db, const char *repo, bool all)
 			"FROM main.packages AS l, pkgjobs AS r WHERE l.origin = r.origin";
 	}
 
-	const char weight_sql[] = "UPDATE pkgjobs SET weight=("
-		"SELECT COUNT(*) FROM '%s'.deps AS d, '%s'.packages AS p, pkgjobs AS j "
-			"WHERE d.origin = pkgjobs.origin "
-				"AND d.package_id = p.id "
-				"AND p.origin = j.origin"
-		");";
-
 	if ((reponame = pkgdb_get_reponame(db, repo)) == NULL)
 		return (NULL);
 
@@ -2563,25 +3346,15 @@ pkgdb_query_upgrades(struct pkgdb *db, const char *repo, bool all)
 	if (!all)
 		sql_exec(db->sqlite, "DELETE from pkgjobs where (select p.origin from main.packages as p where p.origin=pkgjobs.origin and PKGLE(p.version,pkgjobs.version) and p.name = pkgjobs.name) IS NOT NULL;");
 
-	sbuf_reset(sql);
-	sbuf_printf(sql, pkgjobs_sql_2, reponame, reponame);
-	sbuf_finish(sql);
-
-	do {
-		sql_exec(db->sqlite, sbuf_get(sql));
-	} while (sqlite3_changes(db->sqlite) != 0);
+	if (pkgdb_query_deps_closure(db, reponame, sql, pkgjobs_sql_2) !=
+	    EPKG_OK) {
+		sbuf_delete(sql);
+		return (NULL);
+	}
 
 	/* Determine if there is an upgrade needed */
 	sql_exec(db->sqlite, pkgjobs_sql_3);
 
-	sbuf_reset(sql);
-	sbuf_printf(sql, weight_sql, reponame, reponame);
-	sbuf_finish(sql);
-
-	sql_exec(db->sqlite, sbuf_get(sql));
-
-	sql_exec(db->sqlite, "UPDATE pkgjobs set weight=100000 where origin=\"ports-mgmt/pkg\"");
-
 	sbuf_reset(sql);
 	sbuf_printf(sql, finalsql, reponame);
 	sbuf_finish(sql);
@@ -2634,31 +3407,170 @@ pkgdb_query_downgrades(struct pkgdb *db, const char *repo)
 	return (pkgdb_it_new(db, stmt, PKG_REMOTE));
 }
 
+/*
+ * Fill the autoremove table: the automatic packages no longer reachable
+ * through the deps from a package installed on purpose.  The weight is the
+ * level of the package in the reverse topological order: a package never
+ * comes before one depending on it, and the packages of one level can be
+ * deleted together.  Orphaned dependency cycles end up in the last level.
+ */
+static int
+pkgdb_autoremove_fill(struct pkgdb *db)
+{
+	struct closure_graph g;
+	sqlite3_stmt *stmt = NULL, *insert = NULL;
+	size_t *queue = NULL, *nrdeps = NULL;
+	int *level = NULL;
+	char *kept = NULL;
+	size_t head = 0, tail = 0;
+	size_t e, n, nremove = 0;
+	ssize_t i;
+	int maxlevel = 0, nlevels = 0;
+	int ret;
+	int retcode = EPKG_FATAL;
+
+	if (closure_graph_load(db, "SELECT p.origin, d.origin FROM deps AS d, "
+	    "packages AS p WHERE p.id = d.package_id;", &g) != EPKG_OK)
+		return (EPKG_FATAL);
+
+	n = MAX(g.norigins, 1);
+	if ((queue = calloc(n, sizeof(size_t))) == NULL ||
+	    (nrdeps = calloc(n, sizeof(size_t))) == NULL ||
+	    (level = calloc(n, sizeof(int))) == NULL ||
+	    (kept = calloc(n, 1)) == NULL) {
+		pkg_emit_errno("calloc", "pkgdb_query_autoremove");
+		goto cleanup;
+	}
+
+	if (sqlite3_prepare_v2(db->sqlite, "SELECT origin FROM packages "
+	    "WHERE automatic = 0;", -1, &stmt, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(db->sqlite, "INSERT OR IGNORE INTO "
+	    "autoremove(origin, pkgid, weight) SELECT origin, id, ?2 "
+	    "FROM packages WHERE origin = ?1;", -1, &insert, NULL) !=
+	    SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+
+	/* everything reachable from the packages installed on purpose stays */
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		i = closure_find(&g, sqlite3_column_text(stmt, 0));
+		if (i == -1 || kept[i])
+			continue;
+		kept[i] = 1;
+		queue[tail++] = i;
+	}
+	if (ret != SQLITE_DONE) {
+		ERROR_SQLITE(db->sqlite);
+		goto cleanup;
+	}
+	while (head < tail) {
+		n = queue[head++];
+		for (e = g.first[n]; e < g.first[n + 1]; e++) {
+			if (kept[g.to[e]])
+				continue;
+			kept[g.to[e]] = 1;
+			queue[tail++] = g.to[e];
+		}
+	}
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	/* the origins left are only needed by packages removed as well */
+	for (n = 0; n < g.norigins; n++) {
+		if (kept[n])
+			continue;
+		for (e = g.first[n]; e < g.first[n + 1]; e++) {
+			if (!kept[g.to[e]])
+				nrdeps[g.to[e]]++;
+		}
+	}
+	head = tail = 0;
+	for (n = 0; n < g.norigins; n++) {
+		if (!kept[n] && nrdeps[n] == 0)
+			queue[tail++] = n;
+	}
+	while (head < tail) {
+		n = queue[head++];
+		maxlevel = MAX(maxlevel, level[n]);
+		for (e = g.first[n]; e < g.first[n + 1]; e++) {
+			if (kept[g.to[e]])
+				continue;
+			level[g.to[e]] = MAX(level[g.to[e]], level[n] + 1);
+			if (--nrdeps[g.to[e]] == 0)
+				queue[tail++] = g.to[e];
+		}
+	}
+	nlevels = maxlevel + 1;
+	for (n = 0; n < g.norigins; n++) {
+		if (!kept[n] && nrdeps[n] > 0) {
+			level[n] = maxlevel + 1;
+			nlevels = maxlevel + 2;
+		}
+	}
+
+	/*
+	 * Only the origins of installed packages are inserted, the packages
+	 * without any deps are not part of the graph, they are added below.
+	 */
+	for (n = 0; n < g.norigins; n++) {
+		if (kept[n])
+			continue;
+		sqlite3_bind_text(insert, 1, g.origins[n], -1, SQLITE_STATIC);
+		sqlite3_bind_int(insert, 2, level[n]);
+		if (sqlite3_step(insert) != SQLITE_DONE) {
+			ERROR_SQLITE(db->sqlite);
+			goto cleanup;
+		}
+		sqlite3_reset(insert);
+		nremove += sqlite3_changes(db->sqlite);
+	}
+
+	if (sql_exec(db->sqlite, "INSERT OR IGNORE INTO "
+	    "autoremove(origin, pkgid, weight) SELECT origin, id, 0 "
+	    "FROM packages AS p WHERE automatic = 1 AND "
+	    "NOT EXISTS (SELECT 1 FROM deps WHERE deps.origin = p.origin) AND "
+	    "NOT EXISTS (SELECT 1 FROM deps WHERE deps.package_id = p.id);") !=
+	    EPKG_OK)
+		goto cleanup;
+	nremove += sqlite3_changes(db->sqlite);
+
+	pkg_emit_debug(1, "pkgdb: %zu packages to autoremove in %d levels",
+	    nremove, nremove > 0 ? nlevels : 0);
+
+	retcode = EPKG_OK;
+
+	cleanup:
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(insert);
+	free(queue);
+	free(nrdeps);
+	free(level);
+	free(kept);
+	closure_graph_free(&g);
+
+	return (retcode);
+}
+
 struct pkgdb_it *
 pkgdb_query_autoremove(struct pkgdb *db)
 {
 	sqlite3_stmt *stmt = NULL;
-	int weight = 0;
 
 	assert(db != NULL);
 
 	const char sql[] = ""
 		"SELECT id, p.origin, name, version, comment, desc, "
 		"message, arch, maintainer, www, prefix, "
-		"flatsize FROM packages as p, autoremove where id = pkgid ORDER BY weight ASC;";
+		"flatsize FROM packages as p, autoremove where id = pkgid "
+		"ORDER BY weight ASC, p.origin;";
 
 	sql_exec(db->sqlite, "DROP TABLE IF EXISTS autoremove; "
 			"CREATE TEMPORARY TABLE IF NOT EXISTS autoremove ("
 			"origin TEXT UNIQUE NOT NULL, pkgid INTEGER, weight INTEGER);");
 
-	do {
-		sql_exec(db->sqlite, "INSERT OR IGNORE into autoremove(origin, pkgid, weight) "
-				"SELECT distinct origin, id, %d FROM packages WHERE automatic=1 AND "
-				"origin NOT IN (SELECT DISTINCT deps.origin FROM deps WHERE "
-				" deps.origin = packages.origin AND package_id NOT IN "
-				" (select pkgid from autoremove));"
-				, weight);
-	} while (sqlite3_changes(db->sqlite) != 0);
+	if (pkgdb_autoremove_fill(db) != EPKG_OK)
+		return (NULL);
 
 	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
 		ERROR_SQLITE(db->sqlite);
@@ -2726,12 +3638,15 @@ pkgdb_query_delete(struct pkgdb *db, match_t match, int nbpkgs, char **pkgs, int
 
 	sqlite3_finalize(stmt);
 
-	if (recursive) {
-		do {
-			sql_exec(db->sqlite, "INSERT OR IGNORE INTO delete_job(origin, pkgid) "
-					"SELECT p.origin, p.id FROM deps AS d, packages AS p, delete_job AS del WHERE "
-					"d.origin=del.origin AND p.id = d.package_id");
-		} while (sqlite3_changes(db->sqlite) != 0);
+	/* the packages depending on the ones deleted go too */
+	if (recursive && pkgdb_closure(db,
+	    "SELECT d.origin, p.origin FROM deps AS d, packages AS p "
+	    "WHERE p.id = d.package_id;",
+	    "SELECT origin FROM delete_job;",
+	    "INSERT OR IGNORE INTO delete_job(origin, pkgid) "
+	    "SELECT origin, id FROM packages WHERE origin = ?1;") != EPKG_OK) {
+		sbuf_delete(sql);
+		return (NULL);
 	}
 
 	if (sqlite3_prepare_v2(db->sqlite, sqlsel, -1, &stmt, NULL) != SQLITE_OK) {
@@ -2918,19 +3833,55 @@ pkgdb_search(struct pkgdb *db, const char *pattern, match_t match, unsigned int
 	return (pkgdb_it_new(db, stmt, PKG_REMOTE));
 }
 
+/* A package being checked, owner of the paths it brings */
+struct integrity_pkg {
+	char *name;
+	char *origin;
+	char *version;
+};
+
+static void
+pkgdb_integrity_free(struct pkgdb *db)
+{
+	struct integrity_pkg *ipkg;
+	size_t i;
+
+	for (i = 0; i < db->ipaths.len; i++)
+		free((char *)db->ipaths.entries[i].key);
+	for (i = 0; i < db->iorigins.len; i++) {
+		ipkg = db->iorigins.entries[i].data;
+		free(ipkg->name);
+		free(ipkg->origin);
+		free(ipkg->version);
+		free(ipkg);
+	}
+	strset_free(&db->ipaths);
+	strset_free(&db->iorigins);
+}
+
+/*
+ * The paths are kept in memory, conflicts between the packages being
+ * checked are found there while they are appended.
+ */
 int
 pkgdb_integrity_append(struct pkgdb *db, struct pkg *p)
 {
 	int ret = EPKG_OK;
 
 	sqlite3_stmt *stmt = NULL;
-	sqlite3_stmt *stmt_conflicts = NULL;
 	struct pkg_file *file = NULL;
-	struct sbuf *conflictmsg = NULL;
+	struct pkg_shlib *shlib = NULL;
+	struct integrity_pkg *ipkg, *owner;
+	struct strset_entry *e;
+	const char *name, *origin, *version, *path;
+	char *key;
 
 	const char sql[] = "INSERT INTO integritycheck (name, origin, version, path)"
 		"values (?1, ?2, ?3, ?4);";
-	const char sql_conflicts[] = "SELECT name, version from integritycheck where path=?1;";
+	const char sql_origin[] = "INSERT OR IGNORE INTO integrity_origins "
+		"(origin, shlibs) values (?1, ?2);";
+	const char sql_shlib[] = "INSERT OR IGNORE INTO integrity_shlibs (name) "
+		"values (?1);";
 
 	assert(db != NULL && p != NULL);
 
@@ -2939,127 +3890,218 @@ pkgdb_integrity_append(struct pkgdb *db, struct pkg *p)
 			"origin TEXT, "
 			"version TEXT, "
 			"path TEXT UNIQUE);"
+		"CREATE TEMP TABLE IF NOT EXISTS integrity_origins ( "
+			"origin TEXT PRIMARY KEY, "
+			"shlibs INTEGER);"
+		"CREATE TEMP TABLE IF NOT EXISTS integrity_shlibs ( "
+			"name TEXT PRIMARY KEY);"
 		);
 
-	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
+	pkg_get(p, PKG_NAME, &name, PKG_ORIGIN, &origin, PKG_VERSION, &version);
+
+	if ((e = strset_get(&db->iorigins, origin)) != NULL) {
+		ipkg = e->data;
+	} else {
+		if ((ipkg = calloc(1, sizeof(struct integrity_pkg))) == NULL) {
+			pkg_emit_errno("calloc", "integrity_pkg");
+			return (EPKG_FATAL);
+		}
+		ipkg->name = strdup(name);
+		ipkg->origin = strdup(origin);
+		ipkg->version = strdup(version);
+		if (ipkg->name == NULL || ipkg->origin == NULL ||
+		    ipkg->version == NULL ||
+		    strset_add(&db->iorigins, ipkg->origin, ipkg, NULL) !=
+		    EPKG_OK) {
+			free(ipkg->name);
+			free(ipkg->origin);
+			free(ipkg->version);
+			free(ipkg);
+			return (EPKG_FATAL);
+		}
+	}
+
+	/* What the package provides, for the shared libraries check */
+	if ((stmt = pkgdb_stmt_get(db, sql_origin)) == NULL)
+		return (EPKG_FATAL);
+	sqlite3_bind_text(stmt, 1, origin, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, !pkg_list_is_empty(p, PKG_SHLIBS_PROVIDED));
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
 		ERROR_SQLITE(db->sqlite);
+		ret = EPKG_FATAL;
+	}
+	pkgdb_stmt_release(db, stmt);
+
+	if ((stmt = pkgdb_stmt_get(db, sql_shlib)) == NULL)
 		return (EPKG_FATAL);
+	while (ret == EPKG_OK && pkg_shlibs_provided(p, &shlib) == EPKG_OK) {
+		sqlite3_bind_text(stmt, 1, pkg_shlib_name(shlib), -1,
+		    SQLITE_STATIC);
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			ERROR_SQLITE(db->sqlite);
+			ret = EPKG_FATAL;
+		}
+		sqlite3_reset(stmt);
 	}
+	pkgdb_stmt_release(db, stmt);
 
-	conflictmsg = sbuf_new_auto();
+	if ((stmt = pkgdb_stmt_get(db, sql)) == NULL)
+		return (EPKG_FATAL);
 
 	while (pkg_files(p, &file) == EPKG_OK) {
-		const char *name, *origin, *version;
+		path = pkg_file_get(file, PKG_FILE_PATH);
+
+		if ((e = strset_get(&db->ipaths, path)) != NULL) {
+			owner = e->data;
+			pkg_emit_error("WARNING: %s-%s conflict on %s with: \n"
+			    "\t- %s-%s\n", name, version, path, owner->name,
+			    owner->version);
+			ret = EPKG_FATAL;
+			continue;
+		}
+
+		if ((key = strdup(path)) == NULL) {
+			pkg_emit_errno("strdup", path);
+			ret = EPKG_FATAL;
+			break;
+		}
+		if (strset_add(&db->ipaths, key, ipkg, NULL) != EPKG_OK) {
+			free(key);
+			ret = EPKG_FATAL;
+			break;
+		}
 
-		pkg_get(p, PKG_NAME, &name, PKG_ORIGIN, &origin, PKG_VERSION, &version);
 		sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
 		sqlite3_bind_text(stmt, 2, origin, -1, SQLITE_STATIC);
 		sqlite3_bind_text(stmt, 3, version, -1, SQLITE_STATIC);
-		sqlite3_bind_text(stmt, 4, pkg_file_get(file, PKG_FILE_PATH), -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, key, -1, SQLITE_STATIC);
 
 		if (sqlite3_step(stmt) != SQLITE_DONE) {
-			sbuf_clear(conflictmsg);
-			sbuf_printf(conflictmsg, "WARNING: %s-%s conflict on %s with: \n",
-			    name, version,
-			    pkg_file_get(file, PKG_FILE_PATH));
-
-			if (sqlite3_prepare_v2(db->sqlite, sql_conflicts, -1, &stmt_conflicts, NULL) != SQLITE_OK) {
-				ERROR_SQLITE(db->sqlite);
-				sqlite3_finalize(stmt);
-				sbuf_delete(conflictmsg);
-				return (EPKG_FATAL);
-			}
-
-			sqlite3_bind_text(stmt_conflicts, 1, pkg_file_get(file, PKG_FILE_PATH), -1, SQLITE_STATIC);
-
-			while (sqlite3_step(stmt_conflicts) != SQLITE_DONE) {
-				sbuf_printf(conflictmsg, "\t- %s-%s\n",
-						sqlite3_column_text(stmt_conflicts, 0),
-						sqlite3_column_text(stmt_conflicts, 1));
-			}
-			sqlite3_finalize(stmt_conflicts);
-			sbuf_finish(conflictmsg);
-			pkg_emit_error("%s", sbuf_get(conflictmsg));
+			ERROR_SQLITE(db->sqlite);
 			ret = EPKG_FATAL;
+			break;
 		}
 		sqlite3_reset(stmt);
 	}
-	sqlite3_finalize(stmt);
-	sbuf_delete(conflictmsg);
+	pkgdb_stmt_release(db, stmt);
 
 	return (ret);
 }
 
-int
-pkgdb_integrity_check(struct pkgdb *db)
+/*
+ * Warn about the installed packages, not part of the job, which require a
+ * shared library that an installed package being replaced provides and
+ * that nothing provides anymore once the job is done.  The replaced
+ * packages are only checked if their new version records the shared
+ * libraries it provides: older packages do not, and all their libraries
+ * would seem to disappear.  This is a warning, the requirers may be fixed
+ * by a later upgrade.  The joins start from the packages of the job, so
+ * only their libraries are looked up, with the shlib_id indexes.
+ */
+static int
+pkgdb_integrity_shlibs(struct pkgdb *db)
 {
 	int ret = EPKG_OK;
+	int sret;
 	sqlite3_stmt *stmt;
-	sqlite3_stmt *stmt_conflicts;
-	struct sbuf *conflictmsg = NULL;
-	assert (db != NULL);
-
-	const char sql_local_conflict[] = "SELECT p.name, p.version FROM packages AS p, files AS f "
-		"WHERE p.id = f.package_id AND f.path = ?1;";
 
-	const char sql_conflicts[] = "SELECT name, version from integritycheck where path=?1;";
+	const char sql_shlibs_removed[] = ""
+		"SELECT DISTINCT r.name, r.version, s.name, p.name, p.version "
+		"FROM temp.integrity_origins AS i CROSS JOIN main.packages AS p "
+		"CROSS JOIN main.pkg_shlibs_provided AS pp "
+		"CROSS JOIN main.shlibs AS s CROSS JOIN main.pkg_shlibs AS ps "
+		"CROSS JOIN main.packages AS r "
+		"WHERE i.shlibs = 1 AND p.origin = i.origin "
+		"AND pp.package_id = p.id AND s.id = pp.shlib_id "
+		"AND s.name NOT IN (SELECT name FROM temp.integrity_shlibs) "
+		"AND ps.shlib_id = pp.shlib_id AND r.id = ps.package_id "
+		"AND r.origin NOT IN (SELECT origin FROM temp.integrity_origins) "
+		"AND NOT EXISTS (SELECT 1 "
+			"FROM main.pkg_shlibs_provided AS o, main.packages AS op "
+			"WHERE o.shlib_id = pp.shlib_id AND op.id = o.package_id "
+			"AND op.origin NOT IN "
+			"(SELECT origin FROM temp.integrity_origins)) "
+		"ORDER BY r.name, s.name;";
+
+	if ((stmt = pkgdb_stmt_get(db, sql_shlibs_removed)) == NULL)
+		return (EPKG_FATAL);
 
-	if (sqlite3_prepare_v2(db->sqlite,
-		"SELECT path, COUNT(path) from ("
-		"SELECT path from integritycheck UNION ALL "
-		"SELECT path from files, main.packages AS p where p.id=package_id and p.origin NOT IN (SELECT origin from integritycheck)"
-		") GROUP BY path HAVING (COUNT(path) > 1 );",
-		-1, &stmt, NULL) != SQLITE_OK) {
+	while ((sret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		pkg_emit_error("WARNING: locally installed %s-%s requires %s, "
+		    "which will no longer be provided by %s-%s\n",
+		    sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1),
+		    sqlite3_column_text(stmt, 2), sqlite3_column_text(stmt, 3),
+		    sqlite3_column_text(stmt, 4));
+	}
+	if (sret != SQLITE_DONE) {
 		ERROR_SQLITE(db->sqlite);
-		return (EPKG_FATAL);
+		ret = EPKG_FATAL;
 	}
+	pkgdb_stmt_release(db, stmt);
 
-	conflictmsg = sbuf_new_auto();
-
-	while (sqlite3_step(stmt) != SQLITE_DONE) {
-		sbuf_clear(conflictmsg);
+	sql_exec(db->sqlite, "DELETE FROM temp.integrity_origins;"
+	    "DELETE FROM temp.integrity_shlibs;");
 
-		if (sqlite3_prepare_v2(db->sqlite, sql_local_conflict, -1, &stmt_conflicts, NULL) != SQLITE_OK) {
-			ERROR_SQLITE(db->sqlite);
-			sqlite3_finalize(stmt);
-			sbuf_delete(conflictmsg);
-			return (EPKG_FATAL);
-		}
+	return (ret);
+}
 
-		sqlite3_bind_text(stmt_conflicts, 1, sqlite3_column_text(stmt, 0), -1, SQLITE_STATIC);
+/*
+ * Only the appended paths are looked up in the files of the installed
+ * packages, using the primary key, so the cost does not depend on how
+ * many files are installed.  The files of the installed packages being
+ * replaced do not conflict.
+ */
+int
+pkgdb_integrity_check(struct pkgdb *db)
+{
+	int ret = EPKG_OK;
+	int sret;
+	sqlite3_stmt *stmt;
+	struct integrity_pkg *owner;
+	const char *origin;
+	size_t i;
+	assert (db != NULL);
 
-		sqlite3_step(stmt_conflicts);
+	const char sql_local_conflict[] = "SELECT p.name, p.version, p.origin "
+		"FROM main.files AS f, main.packages AS p "
+		"WHERE f.path = ?1 AND p.id = f.package_id;";
 
-		sbuf_printf(conflictmsg, "WARNING: locally installed %s-%s conflicts on %s with:\n",
-				sqlite3_column_text(stmt_conflicts, 0),
-				sqlite3_column_text(stmt_conflicts, 1),
-				sqlite3_column_text(stmt, 0)
-				);
+	if (db->iorigins.len > 0 && pkgdb_integrity_shlibs(db) != EPKG_OK) {
+		pkgdb_integrity_free(db);
+		return (EPKG_FATAL);
+	}
 
-		sqlite3_finalize(stmt_conflicts);
+	if ((stmt = pkgdb_stmt_get(db, sql_local_conflict)) == NULL) {
+		pkgdb_integrity_free(db);
+		return (EPKG_FATAL);
+	}
 
-		if (sqlite3_prepare_v2(db->sqlite, sql_conflicts, -1, &stmt_conflicts, NULL) != SQLITE_OK) {
+	for (i = 0; i < db->ipaths.len; i++) {
+		sqlite3_bind_text(stmt, 1, db->ipaths.entries[i].key, -1,
+		    SQLITE_STATIC);
+
+		if ((sret = sqlite3_step(stmt)) == SQLITE_ROW) {
+			origin = sqlite3_column_text(stmt, 2);
+			if (strset_get(&db->iorigins, origin) == NULL) {
+				owner = db->ipaths.entries[i].data;
+				pkg_emit_error("WARNING: locally installed "
+				    "%s-%s conflicts on %s with:\n\t- %s-%s\n",
+				    sqlite3_column_text(stmt, 0),
+				    sqlite3_column_text(stmt, 1),
+				    db->ipaths.entries[i].key, owner->name,
+				    owner->version);
+				ret = EPKG_FATAL;
+			}
+		} else if (sret != SQLITE_DONE) {
 			ERROR_SQLITE(db->sqlite);
-			sqlite3_finalize(stmt);
-			sbuf_delete(conflictmsg);
-			return (EPKG_FATAL);
-		}
-
-		sqlite3_bind_text(stmt_conflicts, 1, sqlite3_column_text(stmt, 0), -1, SQLITE_STATIC);
-
-		while (sqlite3_step(stmt_conflicts) != SQLITE_DONE) {
-			sbuf_printf(conflictmsg, "\t- %s-%s\n",
-					sqlite3_column_text(stmt_conflicts, 0),
-					sqlite3_column_text(stmt_conflicts, 1));
+			ret = EPKG_FATAL;
+			break;
 		}
-		sqlite3_finalize(stmt_conflicts);
-		sbuf_finish(conflictmsg);
-		pkg_emit_error("%s", sbuf_get(conflictmsg));
-		ret = EPKG_FATAL;
+		sqlite3_reset(stmt);
 	}
 
-	sqlite3_finalize(stmt);
-	sbuf_delete(conflictmsg);
+	pkgdb_stmt_release(db, stmt);
+	pkgdb_integrity_free(db);
 
 /*	sql_exec(db->sqlite, "DROP TABLE IF EXISTS integritycheck");*/
 
@@ -3194,10 +4236,9 @@ pkgdb_query_fetch(struct pkgdb *db, match_t match, int nbpkgs, char **pkgs, cons
 
 	const char deps_sql[] = "INSERT OR IGNORE INTO pkgjobs (pkgid, origin, name, version, "
 				"flatsize, pkgsize, cksum, repopath) "
-				"SELECT DISTINCT r.id, r.origin, r.name, r.version, "
+				"SELECT r.id, r.origin, r.name, r.version, "
 				"r.flatsize, r.pkgsize, r.cksum, r.path "
-				"FROM '%s'.packages AS r where r.origin IN "
-				"(SELECT d.origin FROM '%s'.deps AS d, pkgjobs AS j WHERE d.package_id = j.pkgid) "
+				"FROM '%s'.packages AS r where r.origin = ?1 "
 				"AND (SELECT origin FROM main.packages WHERE origin=r.origin AND version=r.version) IS NULL;";
 
 	const char weight_sql[] = "UPDATE pkgjobs SET weight=(SELECT count(*) FROM '%s'.deps AS d WHERE d.origin=pkgjobs.origin)";
@@ -3252,14 +4293,10 @@ pkgdb_query_fetch(struct pkgdb *db, match_t match, int nbpkgs, char **pkgs, cons
 	sbuf_clear(sql);
 
 	/* Append dependencies */
-	if (flags & PKG_LOAD_DEPS) {
-		sbuf_reset(sql);
-		sbuf_printf(sql, deps_sql, reponame, reponame);
-		sbuf_finish(sql);
-
-		do {
-			sql_exec(db->sqlite, sbuf_get(sql));
-		} while (sqlite3_changes(db->sqlite) != 0);
+	if ((flags & PKG_LOAD_DEPS) &&
+	    pkgdb_query_deps_closure(db, reponame, sql, deps_sql) != EPKG_OK) {
+		sbuf_delete(sql);
+		return (NULL);
 	}
 
 	sbuf_reset(sql);
@@ -3334,12 +4371,53 @@ pkgshell_open(const char **reponame)
 	*reponame = strdup(localpath);
 }
 
+/*
+ * In WAL mode the database is not locked exclusively, which would keep the
+ * readers out as well: the writers are serialized with a lock on
+ * local.sqlite.lock and the readers keep seeing the last committed
+ * transaction.  The database itself is never opened outside of SQLite:
+ * closing another descriptor on it would drop the POSIX locks SQLite holds.
+ */
 int
 pkgdb_lock(struct pkgdb *db)
 {
+	char localpath[MAXPATHLEN + 1];
+	const char *dbdir;
+	int tries;
+
 	assert(db != NULL);
 
-	return sql_exec(db->sqlite, "PRAGMA main.locking_mode=EXCLUSIVE;BEGIN IMMEDIATE;COMMIT;");
+	if (!db->wal)
+		return sql_exec(db->sqlite, "PRAGMA main.locking_mode=EXCLUSIVE;BEGIN IMMEDIATE;COMMIT;");
+
+	if (db->lockfd != -1)
+		return (EPKG_OK);
+
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK)
+		return (EPKG_FATAL);
+	snprintf(localpath, sizeof(localpath), "%s/local.sqlite.lock", dbdir);
+
+	if ((db->lockfd = open(localpath, O_RDONLY|O_CREAT, 0644)) == -1) {
+		pkg_emit_errno("open", localpath);
+		return (EPKG_FATAL);
+	}
+
+	/* Wait up to 5 seconds, as for a busy database */
+	for (tries = 0; flock(db->lockfd, LOCK_EX|LOCK_NB) == -1; tries++) {
+		if (errno != EWOULDBLOCK || tries == 50) {
+			if (errno == EWOULDBLOCK)
+				pkg_emit_error("%s: database is locked by "
+				    "another process", localpath);
+			else
+				pkg_emit_errno("flock", localpath);
+			close(db->lockfd);
+			db->lockfd = -1;
+			return (EPKG_FATAL);
+		}
+		usleep(100000);
+	}
+
+	return (EPKG_OK);
 }
 
 int
@@ -3347,7 +4425,98 @@ pkgdb_unlock(struct pkgdb *db)
 {
 	assert(db != NULL);
 
-	return sql_exec(db->sqlite, "PRAGMA main.locking_mode=NORMAL;BEGIN IMMEDIATE;COMMIT;");
+	if (!db->wal)
+		return sql_exec(db->sqlite, "PRAGMA main.locking_mode=NORMAL;BEGIN IMMEDIATE;COMMIT;");
+
+	pkgdb_checkpoint(db);
+
+	if (db->lockfd != -1) {
+		close(db->lockfd);
+		db->lockfd = -1;
+	}
+
+	return (EPKG_OK);
+}
+
+/*
+ * Switch local.sqlite to the journal mode asked for, when the database can
+ * be written.  The mode is persistent, readers only find out which one is
+ * in use.  In WAL mode the automatic checkpoints are disabled, the writer
+ * runs them with pkgdb_checkpoint() once its transactions are committed.
+ */
+static int
+pkgdb_journal_mode(struct pkgdb *db, const char *sql, bool *wal)
+{
+	sqlite3_stmt *stmt;
+	int ret;
+
+	if (sqlite3_prepare_v2(db->sqlite, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		return (SQLITE_ERROR);
+	}
+
+	if ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+		*wal = (strcasecmp(sqlite3_column_text(stmt, 0), "wal") == 0);
+	sqlite3_finalize(stmt);
+
+	return (ret);
+}
+
+static int
+pkgdb_journal(struct pkgdb *db, bool wal, bool writable)
+{
+	int ret;
+
+	if (pkgdb_journal_mode(db, "PRAGMA main.journal_mode;", &db->wal) !=
+	    SQLITE_ROW) {
+		ERROR_SQLITE(db->sqlite);
+		return (EPKG_FATAL);
+	}
+
+	if (writable && db->wal != wal) {
+		ret = pkgdb_journal_mode(db, wal ?
+		    "PRAGMA main.journal_mode=WAL;" :
+		    "PRAGMA main.journal_mode=DELETE;", &db->wal);
+		/*
+		 * leaving WAL fails while another process has the database
+		 * opened, it stays in WAL until the next time
+		 */
+		if (ret != SQLITE_ROW && !(ret == SQLITE_BUSY && !wal)) {
+			ERROR_SQLITE(db->sqlite);
+			return (EPKG_FATAL);
+		}
+	}
+
+	if (db->wal && writable)
+		return (sql_exec(db->sqlite, "PRAGMA main.wal_autocheckpoint=0;"));
+
+	return (EPKG_OK);
+}
+
+/*
+ * Copy the committed transactions from the write-ahead log back to the
+ * database.  The checkpoint is passive: the pages still read by another
+ * process are left in the log for the next one.
+ */
+int
+pkgdb_checkpoint(struct pkgdb *db)
+{
+	int nlog, nckpt;
+
+	assert(db != NULL);
+
+	if (!db->wal)
+		return (EPKG_OK);
+
+	if (sqlite3_wal_checkpoint_v2(db->sqlite, "main",
+	    SQLITE_CHECKPOINT_PASSIVE, &nlog, &nckpt) != SQLITE_OK) {
+		ERROR_SQLITE(db->sqlite);
+		return (EPKG_FATAL);
+	}
+
+	pkg_emit_debug(2, "pkgdb: checkpoint %d/%d frames", nckpt, nlog);
+
+	return (EPKG_OK);
 }
 
 int64_t
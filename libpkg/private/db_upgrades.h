@@ -232,6 +232,17 @@ static struct db_upgrades {
 	"CREATE INDEX pkg_shlibs_package_id ON pkg_shlibs (package_id);"
 	"CREATE INDEX pkg_directories_directory_id ON pkg_directories (directory_id);"
 	},
+	{13,
+	"CREATE TABLE pkg_shlibs_provided ("
+		"package_id INTEGER REFERENCES packages(id) ON DELETE CASCADE"
+		" ON UPDATE CASCADE,"
+		"shlib_id INTEGER REFERENCES shlibs(id) ON DELETE RESTRICT"
+		" ON UPDATE RESTRICT,"
+		"PRIMARY KEY (package_id, shlib_id)"
+	");"
+	"CREATE INDEX pkg_shlibs_shlib_id ON pkg_shlibs (shlib_id);"
+	"CREATE INDEX pkg_shlibs_provided_shlib_id ON pkg_shlibs_provided (shlib_id);"
+	},
 
 	/* Mark the end of the array */
 	{ -1, NULL },
@@ -34,6 +34,7 @@
 #include <sys/types.h>
 
 #include <archive.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <openssl/sha.h>
 #include <stdbool.h>
@@ -71,6 +72,7 @@ struct pkg {
 	STAILQ_HEAD(users, pkg_user) users;
 	STAILQ_HEAD(groups, pkg_group) groups;
 	STAILQ_HEAD(shlibs, pkg_shlib) shlibs;
+	STAILQ_HEAD(shlibs_provided, pkg_shlib) shlibs_provided;
 	int flags;
 	int64_t rowid;
 	int64_t time;
@@ -132,15 +134,22 @@ struct pkg_jobs {
 	STAILQ_HEAD(jobs, pkg) jobs;
 	struct pkgdb *db;
 	pkg_jobs_t type;
+	struct pkg_jobs_node *nodes;	/* dependency graph of the jobs */
+	size_t nnodes;
+	int nlevels;
+	size_t *level_size;		/* number of jobs of each level */
+	bool resolved;			/* jobs in dependency order */
+	int64_t nskipped;		/* unchanged files not written again */
+	int64_t skipped;		/* and their size */
 };
 
 struct pkg_jobs_node {
 	struct pkg *pkg;
-	size_t nrefs;
+	size_t nrefs;			/* deps not scheduled yet */
 	struct pkg_jobs_node **parents; /* rdeps */
 	size_t parents_len;
 	size_t parents_cap;
-	LIST_ENTRY(pkg_jobs_node) entries;
+	int level;			/* 0 when no dep is part of the jobs */
 };
 
 struct pkg_user {
@@ -180,7 +189,30 @@ int pkg_delete(struct pkg *pkg, struct pkgdb *db, int flags);
 #define PKG_DELETE_FORCE (1<<0)
 #define PKG_DELETE_UPGRADE (1<<1)
 
-int pkg_repo_fetch(struct pkg *pkg);
+/*
+ * Progress of concurrent downloads, reported to the frontend as one
+ * transfer of total bytes.
+ */
+struct fetch_progress {
+	pthread_mutex_t lock;
+	const char *label;
+	off_t total;
+	off_t done;
+	time_t begin;
+	time_t last;
+};
+
+#define PKG_FETCH_RESUME	(1U << 0)	/* continue a partial download */
+#define PKG_FETCH_MISSING	(1U << 1)	/* a missing file is no error */
+
+int pkg_fetch_file2(const char *url, const char *dest, time_t t,
+    unsigned flags, struct fetch_progress *progress,
+    struct pkg_digest *digest);
+
+int pkg_repo_fetch(struct pkg *pkg, struct fetch_progress *progress,
+    struct sbuf **manifest);
+int pkg_repo_fetch_manifest(struct pkg *pkg, struct fetch_progress *progress,
+    struct sbuf **manifest);
 
 int pkg_start_stop_rc_scripts(struct pkg *, pkg_rc_attr attr);
 
@@ -189,7 +221,9 @@ int pkg_script_run(struct pkg *, pkg_script_t type);
 int pkg_add_user_group(struct pkg *pkg);
 int pkg_delete_user_group(struct pkgdb *db, struct pkg *pkg);
 
-int pkg_open2(struct pkg **p, struct archive **a, struct archive_entry **ae, const char *path, struct sbuf *mbuf);
+int ports_parse_plist2(struct pkg *pkg, char *plist, const char *stage, bool checksum);
+
+int pkg_open2(struct pkg **p, struct archive **a, struct archive_entry **ae, const char *path, struct sbuf *mbuf, int flags);
 
 void pkg_list_free(struct pkg *, pkg_list);
 
@@ -222,19 +256,57 @@ void pkg_group_free(struct pkg_group *);
 
 int pkg_jobs_resolv(struct pkg_jobs *jobs);
 
+/* files and directories of a package, indexed by path */
+struct pkg_jobs_paths {
+	struct strset files;
+	struct strset dirs;
+};
+
+int pkg_jobs_paths_index(struct pkg_jobs_paths *paths, struct pkg *pkg);
+void pkg_jobs_paths_free(struct pkg_jobs_paths *paths);
+int pkg_jobs_keep_files_to_del(struct pkg *p1, struct pkg_jobs_paths *paths);
+
+/* a package being installed by pkg_add_begin()/pkg_add_extract()/pkg_add_end() */
+struct pkg_add_job {
+	struct pkg *pkg;
+	struct archive *a;
+	struct archive_entry *ae;
+	int flags;
+	bool extract;
+	int retcode;		/* result of the extraction */
+	char *error;		/* and its error, emitted by pkg_add_end() */
+	struct strset unchanged; /* paths left on disk by an upgrade */
+	int64_t nskipped;	/* unchanged files not written */
+	int64_t skipped;	/* and their size */
+};
+
+int pkg_add_begin(struct pkgdb *db, const char *path, int flags,
+    struct pkg_add_job *job);
+int pkg_add_unchanged(struct pkg_add_job *job, struct pkg *old);
+int pkg_add_extract(struct pkg_add_job *job);
+int pkg_add_end(struct pkgdb *db, struct pkg_add_job *job);
+
 int pkg_shlib_new(struct pkg_shlib **);
 void pkg_shlib_free(struct pkg_shlib *);
 
 struct packing;
 
 int packing_init(struct packing **pack, const char *path, pkg_formats format);
+int packing_init_fd(struct packing **pack, int fd, pkg_formats format);
 int packing_append_file(struct packing *pack, const char *filepath, const char *newpath);
 int packing_append_file_attr(struct packing *pack, const char *filepath, const char *newpath, const char *uname, const char *gname, mode_t perm);
+int packing_append_file_sum(struct packing *pack, const char *filepath, const char *newpath, const char *uname, const char *gname, mode_t perm, char sum[SHA256_DIGEST_LENGTH * 2 + 1]);
+int packing_append_archive(struct packing *pack, int fd);
 int packing_append_buffer(struct packing *pack, const char *buffer, const char *path, int size);
+int packing_append_entry(struct packing *pack, const char *path, int64_t size);
+int packing_append_data(struct packing *pack, const void *buf, size_t len);
 int packing_append_tree(struct packing *pack, const char *treepath, const char *newroot);
 int packing_finish(struct packing *pack);
 pkg_formats packing_format_from_string(const char *str);
 
+int pkg_emit_manifest_packing(struct pkg *pkg, struct packing *pack, const char *path, const char *compact);
+int pkg_parse_compact_manifest(struct pkg *pkg, const char *buf, size_t len, int64_t *files_offset);
+
 int pkg_delete_files(struct pkg *pkg, int force);
 int pkg_delete_dirs(struct pkgdb *db, struct pkg *pkg, int force);
 
@@ -248,6 +320,7 @@ int pkg_set_mtree(struct pkg *, const char *mtree);
 
 /* pkgdb commands */
 int sql_exec(sqlite3 *, const char *, ...);
+int get_pragma(sqlite3 *, const char *, int64_t *);
 
 int pkgdb_load_deps(struct pkgdb *db, struct pkg *pkg);
 int pkgdb_load_rdeps(struct pkgdb *db, struct pkg *pkg);
@@ -261,6 +334,7 @@ int pkgdb_load_license(struct pkgdb *db, struct pkg *pkg);
 int pkgdb_load_user(struct pkgdb *db, struct pkg *pkg);
 int pkgdb_load_group(struct pkgdb *db, struct pkg *pkg);
 int pkgdb_load_shlib(struct pkgdb *db, struct pkg *pkg);
+int pkgdb_load_shlib_provided(struct pkgdb *db, struct pkg *pkg);
 
 int pkgdb_register_pkg(struct pkgdb *db, struct pkg *pkg, int complete);
 int pkgdb_register_finale(struct pkgdb *db, int retcode);
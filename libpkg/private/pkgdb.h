@@ -28,23 +28,57 @@
 #ifndef _PKGDB_H
 #define _PKGDB_H
 
+#include <sys/queue.h>
+
+#include <stdbool.h>
+
 #include "pkg.h"
+#include "private/utils.h"
 
 #include "sqlite3.h"
 
+/* A prepared statement kept around to be reset and reused */
+struct pkgdb_stmt {
+	char *sql;
+	sqlite3_stmt *stmt;
+	bool busy;
+	LIST_ENTRY(pkgdb_stmt) next;
+};
+
 struct pkgdb {
 	sqlite3 *sqlite;
 	pkgdb_t type;
+	LIST_HEAD(, pkgdb_stmt) stmts;
+	int64_t stmt_prepared;
+	int64_t stmt_reused;
+	bool wal;		/* local.sqlite uses a write-ahead log */
+	int lockfd;		/* held by pkgdb_lock() in WAL mode */
+	struct strset ipaths;	/* files checked by pkgdb_integrity_check() */
+	struct strset iorigins;	/* and the packages they come from */
 };
 
+/* Number of installed packages read ahead to load their relations at once */
+#define PKGDB_IT_WINDOW 64
+
 struct pkgdb_it {
 	struct pkgdb *db;
 	sqlite3_stmt *stmt;
 	int type;
+	int *colmap;		/* entry of columns[] for each column */
+	int ncols;
+	struct pkg *window[PKGDB_IT_WINDOW];
+	int nwindow;
+	int wflags;		/* relations loaded for the whole window */
+	int next;		/* next package of the window to hand out */
 };
 
+sqlite3_stmt *pkgdb_stmt_get(struct pkgdb *db, const char *sql);
+void pkgdb_stmt_release(struct pkgdb *db, sqlite3_stmt *stmt);
+void pkgdb_stmt_flush(struct pkgdb *db);
+
 int pkgdb_lock(struct pkgdb *db);
 int pkgdb_unlock(struct pkgdb *db);
+int pkgdb_checkpoint(struct pkgdb *db);
 
 void pkgshell_open(const char **r);
 #endif
@@ -33,18 +33,52 @@
 #include <sys/param.h>
 
 #include <openssl/sha.h>
+#include <stdbool.h>
 
 #define STARTS_WITH(string, needle) (strncasecmp(string, needle, strlen(needle)) == 0)
 
 #define ERROR_SQLITE(db) \
 	pkg_emit_error("sqlite: %s (%s:%d)", sqlite3_errmsg(db), __FILE__, __LINE__)
 
+/*
+ * SHA256 of an archive computed while its bytes go by.  The leading bytes
+ * are kept aside until the +MANIFEST can be extracted from them, so that
+ * neither the checksum nor the manifest need the archive to be read again.
+ */
+struct pkg_digest {
+	SHA256_CTX sha256;
+	struct sbuf *head;	/* leading bytes of the archive */
+	size_t next_try;	/* head length of the next extraction attempt */
+	struct sbuf *manifest;	/* the +MANIFEST, once extracted */
+	bool done;		/* manifest extracted or given up */
+	bool head_only;		/* only the +MANIFEST is wanted */
+};
+
 struct hardlinks {
 	ino_t *inodes;
 	size_t len;
 	size_t cap;
 };
 
+/*
+ * Open addressing hash set of strings, the strings are not copied.  The
+ * entries are kept in insertion order and slots holds their index + 1,
+ * 0 for an empty slot.
+ */
+struct strset_entry {
+	const char *key;
+	size_t hash;
+	void *data;
+};
+
+struct strset {
+	struct strset_entry *entries;
+	size_t len;
+	size_t cap;
+	size_t *slots;
+	size_t nslots;		/* a power of two */
+};
+
 void sbuf_init(struct sbuf **);
 int sbuf_set(struct sbuf **, const char *);
 char * sbuf_get(struct sbuf *);
@@ -60,12 +94,23 @@ int is_dir(const char *);
 int is_conf_file(const char *path, char *newpath, size_t len);
 
 int sha256_file(const char *, char[SHA256_DIGEST_LENGTH * 2 +1]);
+void sha256_hash(unsigned char[SHA256_DIGEST_LENGTH], char[SHA256_DIGEST_LENGTH * 2 +1]);
 void sha256_str(const char *, char[SHA256_DIGEST_LENGTH * 2 +1]);
 
+void pkg_digest_init(struct pkg_digest *);
+void pkg_digest_update(struct pkg_digest *, const void *, size_t);
+void pkg_digest_final(struct pkg_digest *, char[SHA256_DIGEST_LENGTH * 2 +1]);
+void pkg_digest_free(struct pkg_digest *);
+int pkg_digest_file(struct pkg_digest *, const char *, off_t);
+
 int rsa_sign(char *path, pem_password_cb *password_cb, char *rsa_key_path,
 		 unsigned char **sigret, unsigned int *siglen);
 int rsa_verify(const char *path, const char *key,
 		unsigned char *sig, unsigned int sig_len);
 
 bool is_hardlink(struct hardlinks *hl, struct stat *st);
+
+struct strset_entry *strset_get(struct strset *, const char *);
+int strset_add(struct strset *, const char *, void *, struct strset_entry **);
+void strset_free(struct strset *);
 #endif
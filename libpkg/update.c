@@ -27,6 +27,7 @@
 #include <sys/stat.h>
 #include <sys/param.h>
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,12 +35,73 @@
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <sqlite3.h>
 
 #include "pkg.h"
 #include "private/event.h"
+#include "private/pkg.h"
 #include "private/utils.h"
 
-#define EXTRACT_ARCHIVE_FLAGS  (ARCHIVE_EXTRACT_OWNER |ARCHIVE_EXTRACT_PERM)
+/* do not restore the mtime, it is used to check for newer repositories */
+#define REPO_EXTRACT_FLAGS  (ARCHIVE_EXTRACT_OWNER |ARCHIVE_EXTRACT_PERM)
+
+/*
+ * How a delta published by pkg repo is applied to the local copy of the
+ * repository: every row returned by select is bound, column by column, to
+ * each of the apply statements.
+ */
+static const struct {
+	const char *select;
+	const char *apply[8];
+} delta_steps[] = {
+	{ "SELECT id FROM removed;", {
+		"DELETE FROM deps WHERE package_id = ?1;",
+		"DELETE FROM options WHERE package_id = ?1;",
+		"DELETE FROM pkg_categories WHERE package_id = ?1;",
+		"DELETE FROM pkg_licenses WHERE package_id = ?1;",
+		"DELETE FROM pkg_shlibs WHERE package_id = ?1;",
+		"DELETE FROM pkg_shlibs_provided WHERE package_id = ?1;",
+		"DELETE FROM packages WHERE id = ?1;",
+		NULL } },
+	{ "SELECT id, origin, name, version, comment, desc, osversion, arch, "
+	  "maintainer, www, prefix, pkgsize, flatsize, licenselogic, cksum, "
+	  "path, pkg_format_version, mtime, inode FROM packages;", {
+		"INSERT OR REPLACE INTO packages (id, origin, name, version, "
+		"comment, desc, osversion, arch, maintainer, www, prefix, pkgsize, "
+		"flatsize, licenselogic, cksum, path, pkg_format_version, mtime, "
+		"inode) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, "
+		"?13, ?14, ?15, ?16, ?17, ?18, ?19);",
+		NULL } },
+	{ "SELECT origin, name, version, package_id FROM deps;", {
+		"INSERT INTO deps (origin, name, version, package_id) "
+		"VALUES (?1, ?2, ?3, ?4);",
+		NULL } },
+	{ "SELECT package_id, option, value FROM options;", {
+		"INSERT INTO options (package_id, option, value) "
+		"VALUES (?1, ?2, ?3);",
+		NULL } },
+	{ "SELECT package_id, name FROM pkg_categories;", {
+		"INSERT OR IGNORE INTO categories(name) VALUES(?2);",
+		"INSERT INTO pkg_categories(package_id, category_id) "
+		"VALUES (?1, (SELECT id FROM categories WHERE name = ?2));",
+		NULL } },
+	{ "SELECT package_id, name FROM pkg_licenses;", {
+		"INSERT OR IGNORE INTO licenses(name) VALUES(?2);",
+		"INSERT INTO pkg_licenses(package_id, license_id) "
+		"VALUES (?1, (SELECT id FROM licenses WHERE name = ?2));",
+		NULL } },
+	{ "SELECT package_id, name FROM pkg_shlibs;", {
+		"INSERT OR IGNORE INTO shlibs(name) VALUES(?2);",
+		"INSERT INTO pkg_shlibs(package_id, shlib_id) "
+		"VALUES (?1, (SELECT id FROM shlibs WHERE name = ?2));",
+		NULL } },
+	{ "SELECT package_id, name FROM pkg_shlibs_provided;", {
+		"INSERT OR IGNORE INTO shlibs(name) VALUES(?2);",
+		"INSERT INTO pkg_shlibs_provided(package_id, shlib_id) "
+		"VALUES (?1, (SELECT id FROM shlibs WHERE name = ?2));",
+		NULL } },
+	{ NULL, { NULL } }
+};
 
 /* Add indexes to the repo */
 static int
@@ -63,24 +125,22 @@ remote_add_indexes(const char *reponame)
 	return (ret);
 }
 
-int
-pkg_update(const char *name, const char *packagesite)
+/*
+ * Fetch url, extract the database called name it contains to dest and
+ * check its signature against the repository key, if any.  flags are the
+ * ones of pkg_fetch_file2().
+ */
+static int
+repo_fetch_db(const char *url, const char *name, const char *dest, time_t t,
+    unsigned flags)
 {
-	char url[MAXPATHLEN];
 	struct archive *a = NULL;
 	struct archive_entry *ae = NULL;
-	char repofile[MAXPATHLEN];
-	char repofile_unchecked[MAXPATHLEN];
 	char tmp[21];
-	const char *dbdir = NULL;
 	const char *repokey;
 	unsigned char *sig = NULL;
 	int siglen = 0;
 	int rc = EPKG_FATAL;
-	struct stat st;
-	time_t t = 0;
-
-	snprintf(url, MAXPATHLEN, "%s/repo.txz", packagesite);
 
 	(void)strlcpy(tmp, "/tmp/repo.txz.XXXXXX", sizeof(tmp));
 	if (mktemp(tmp) == NULL) {
@@ -88,24 +148,10 @@ pkg_update(const char *name, const char *packagesite)
 		return (EPKG_FATAL);
 	}
 
-	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK) {
-		pkg_emit_error("Cant get dbdir config entry");
-		return (EPKG_FATAL);
-	}
-
-	snprintf(repofile, sizeof(repofile), "%s/%s.sqlite", dbdir, name);
-	if (stat(repofile, &st) != -1) {
-		t = st.st_mtime;
-		/* add 10 minutes to the timestap because repo.sqlite is
-		 * always newer than repo.txz, 10 minutes should be enough
-		 */
-		t += 600;
-	}
-
-	if ((rc = pkg_fetch_file(url, tmp, t)) != EPKG_OK) {
+	if ((rc = pkg_fetch_file2(url, tmp, t, flags, NULL, NULL)) != EPKG_OK) {
 		/*
 		 * No need to unlink(tmp) here as it is already
-		 * done in pkg_fetch_file() in case fetch failed.
+		 * done in pkg_fetch_file2() in case fetch failed.
 		 */
 		return (rc);
 	}
@@ -117,9 +163,8 @@ pkg_update(const char *name, const char *packagesite)
 	archive_read_open_filename(a, tmp, 4096);
 
 	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
-		if (strcmp(archive_entry_pathname(ae), "repo.sqlite") == 0) {
-			snprintf(repofile_unchecked, sizeof(repofile_unchecked), "%s.unchecked", repofile);
-			archive_entry_set_pathname(ae, repofile_unchecked);
+		if (strcmp(archive_entry_pathname(ae), name) == 0) {
+			archive_entry_set_pathname(ae, dest);
 
 			/*
 			 * The repo should be owned by root and not writable
@@ -128,7 +173,7 @@ pkg_update(const char *name, const char *packagesite)
 			archive_entry_set_gid(ae, 0);
 			archive_entry_set_perm(ae, 0644);
 
-			archive_read_extract(a, ae, EXTRACT_ARCHIVE_FLAGS);
+			archive_read_extract(a, ae, REPO_EXTRACT_FLAGS);
 		}
 		if (strcmp(archive_entry_pathname(ae), "signature") == 0) {
 			siglen = archive_entry_size(ae);
@@ -137,15 +182,16 @@ pkg_update(const char *name, const char *packagesite)
 		}
 	}
 
-	if (pkg_config_string(PKG_CONFIG_REPOKEY, &repokey) != EPKG_OK)
-		return (EPKG_FATAL);
+	if (pkg_config_string(PKG_CONFIG_REPOKEY, &repokey) != EPKG_OK) {
+		rc = EPKG_FATAL;
+		goto cleanup;
+	}
 
 	if (repokey != NULL) {
 		if (sig != NULL) {
-			if (rsa_verify(repofile_unchecked, repokey, sig, siglen - 1) != EPKG_OK) {
+			if (rsa_verify(dest, repokey, sig, siglen - 1) != EPKG_OK) {
 				pkg_emit_error("Invalid signature, removing repository.\n");
-				unlink(repofile_unchecked);
-				free(sig);
+				unlink(dest);
 				rc = EPKG_FATAL;
 				goto cleanup;
 			}
@@ -153,26 +199,297 @@ pkg_update(const char *name, const char *packagesite)
 			pkg_emit_error("No signature found in the repository."
 						   "Can not validate against %s key.", repokey);
 			rc = EPKG_FATAL;
-			unlink(repofile_unchecked);
+			unlink(dest);
 			goto cleanup;
 		}
 	}
 
-	if (rename(repofile_unchecked, repofile) != 0) {
-		pkg_emit_errno("rename", "");
+	rc = EPKG_OK;
+
+	cleanup:
+	if (a != NULL)
+		archive_read_finish(a);
+
+	free(sig);
+	(void)unlink(tmp);
+
+	return (rc);
+}
+
+static int
+delta_apply(sqlite3 *sqlite, const char *deltafile, int64_t epoch,
+    int64_t generation)
+{
+	sqlite3 *delta = NULL;
+	sqlite3_stmt *from = NULL;
+	sqlite3_stmt *to[8];
+	int64_t delta_epoch, delta_generation;
+	int i, j, k, ncols;
+	int ret;
+	int rc = EPKG_FATAL;
+
+	memset(to, 0, sizeof(to));
+
+	if (sqlite3_open_v2(deltafile, &delta, SQLITE_OPEN_READONLY, NULL) !=
+	    SQLITE_OK) {
+		ERROR_SQLITE(delta);
 		goto cleanup;
 	}
 
-	if ((rc = remote_add_indexes(name)) != EPKG_OK)
+	if (get_pragma(delta, "SELECT epoch FROM info;", &delta_epoch) != EPKG_OK ||
+	    get_pragma(delta, "SELECT generation FROM info;", &delta_generation) != EPKG_OK)
 		goto cleanup;
 
+	if (delta_epoch != epoch || delta_generation != generation) {
+		pkg_emit_error("%s does not apply to this repository", deltafile);
+		goto cleanup;
+	}
+
+	for (i = 0; delta_steps[i].select != NULL; i++) {
+		if (sqlite3_prepare_v2(delta, delta_steps[i].select, -1, &from,
+		    NULL) != SQLITE_OK) {
+			ERROR_SQLITE(delta);
+			goto cleanup;
+		}
+
+		for (j = 0; delta_steps[i].apply[j] != NULL; j++) {
+			if (sqlite3_prepare_v2(sqlite, delta_steps[i].apply[j],
+			    -1, &to[j], NULL) != SQLITE_OK) {
+				ERROR_SQLITE(sqlite);
+				goto cleanup;
+			}
+		}
+
+		ncols = sqlite3_column_count(from);
+		while ((ret = sqlite3_step(from)) == SQLITE_ROW) {
+			for (j = 0; to[j] != NULL; j++) {
+				for (k = 0; k < ncols; k++)
+					sqlite3_bind_value(to[j], k + 1,
+					    sqlite3_column_value(from, k));
+
+				if (sqlite3_step(to[j]) != SQLITE_DONE) {
+					ERROR_SQLITE(sqlite);
+					goto cleanup;
+				}
+				sqlite3_reset(to[j]);
+			}
+		}
+
+		if (ret != SQLITE_DONE) {
+			ERROR_SQLITE(delta);
+			goto cleanup;
+		}
+
+		sqlite3_finalize(from);
+		from = NULL;
+		for (j = 0; to[j] != NULL; j++) {
+			sqlite3_finalize(to[j]);
+			to[j] = NULL;
+		}
+	}
+
 	rc = EPKG_OK;
 
 	cleanup:
-	if (a != NULL)
-		archive_read_finish(a);
+	if (from != NULL)
+		sqlite3_finalize(from);
+
+	for (j = 0; to[j] != NULL; j++)
+		sqlite3_finalize(to[j]);
+
+	if (delta != NULL)
+		sqlite3_close(delta);
+
+	return (rc);
+}
+
+/*
+ * Bring the local copy of the repository to the generation announced by
+ * the repository by applying the deltas in between, in one transaction.
+ * Returns EPKG_FATAL when a full download is needed, in which case *t is
+ * reset if the local copy is known to be outdated.  A repository without
+ * generations or deltas, or whose deltas were pruned, is no error.
+ */
+static int
+pkg_update_delta(const char *packagesite, const char *repofile, time_t *t)
+{
+	char url[MAXPATHLEN];
+	char deltafile[MAXPATHLEN];
+	char tmp[MAXPATHLEN];
+	sqlite3 *sqlite = NULL;
+	int64_t epoch = 0, generation = 0, g;
+	int64_t remote_epoch, remote_generation = 0;
+	int64_t fetched = 0;
+	int64_t ntables = 0;
+	char *buf = NULL;
+	off_t size;
+	bool transaction = false;
+	int rc = EPKG_FATAL;
+
+	if (access(repofile, F_OK) != 0)
+		return (EPKG_FATAL);
 
+	if (sqlite3_open(repofile, &sqlite) != SQLITE_OK) {
+		ERROR_SQLITE(sqlite);
+		goto cleanup;
+	}
+
+	/* the repository was not created with generations */
+	if (get_pragma(sqlite, "SELECT count(*) FROM sqlite_master "
+	    "WHERE type = 'table' AND name = 'repo_generation';", &ntables) !=
+	    EPKG_OK || ntables == 0)
+		goto cleanup;
+
+	if (get_pragma(sqlite, "SELECT epoch FROM repo_generation;", &epoch) != EPKG_OK ||
+	    get_pragma(sqlite, "SELECT generation FROM repo_generation;", &generation) != EPKG_OK)
+		goto cleanup;
+
+	(void)strlcpy(tmp, "/tmp/repo.generation.XXXXXX", sizeof(tmp));
+	if (mktemp(tmp) == NULL) {
+		pkg_emit_error("Could not create temporary file %s, aborting update.\n", tmp);
+		goto cleanup;
+	}
+
+	snprintf(url, sizeof(url), "%s/generation", packagesite);
+	if ((rc = pkg_fetch_file2(url, tmp, *t, PKG_FETCH_MISSING, NULL,
+	    NULL)) != EPKG_OK) {
+		if (rc == EPKG_ENOENT)
+			rc = EPKG_FATAL;
+		goto cleanup;
+	}
+	rc = EPKG_FATAL;
+
+	if (file_to_buffer(tmp, &buf, &size) != EPKG_OK) {
+		(void)unlink(tmp);
+		goto cleanup;
+	}
 	(void)unlink(tmp);
 
+	if (sscanf(buf, "%" SCNd64 " %" SCNd64, &remote_epoch,
+	    &remote_generation) != 2)
+		goto cleanup;
+
+	if (remote_epoch != epoch || remote_generation < generation) {
+		*t = 0;
+		goto cleanup;
+	}
+
+	if (remote_generation == generation) {
+		rc = EPKG_UPTODATE;
+		goto cleanup;
+	}
+
+	/*
+	 * Fetch and check all the deltas before touching the database.  The
+	 * oldest ones are pruned by pkg repo, the whole catalog is then
+	 * fetched instead.
+	 */
+	for (g = generation + 1; g <= remote_generation; g++) {
+		snprintf(url, sizeof(url), "%s/delta/%" PRId64 ".txz",
+		    packagesite, g);
+		snprintf(deltafile, sizeof(deltafile), "%s.delta.%" PRId64,
+		    repofile, g);
+		/* a failed fetch may leave a part of its delta behind */
+		fetched = g;
+		if ((rc = repo_fetch_db(url, "delta.sqlite", deltafile, 0,
+		    PKG_FETCH_MISSING)) != EPKG_OK) {
+			if (rc == EPKG_ENOENT)
+				pkg_emit_debug(1, "update: no delta for "
+				    "generation %" PRId64 ", fetching the "
+				    "whole repository", g);
+			rc = EPKG_FATAL;
+			*t = 0;
+			goto cleanup;
+		}
+	}
+
+	if (sql_exec(sqlite, "BEGIN;") != EPKG_OK)
+		goto cleanup;
+	transaction = true;
+
+	for (g = generation + 1; g <= remote_generation; g++) {
+		snprintf(deltafile, sizeof(deltafile), "%s.delta.%" PRId64,
+		    repofile, g);
+		if (delta_apply(sqlite, deltafile, epoch, g) != EPKG_OK) {
+			*t = 0;
+			goto cleanup;
+		}
+	}
+
+	if (sql_exec(sqlite, ""
+	    "DELETE FROM categories WHERE id NOT IN (SELECT category_id FROM pkg_categories);"
+	    "DELETE FROM licenses WHERE id NOT IN (SELECT license_id FROM pkg_licenses);"
+	    "DELETE FROM shlibs WHERE id NOT IN "
+		"(SELECT shlib_id FROM pkg_shlibs UNION "
+		"SELECT shlib_id FROM pkg_shlibs_provided);"
+	    "UPDATE repo_generation SET generation = %" PRId64 ";"
+	    "COMMIT;", remote_generation) != EPKG_OK)
+		goto cleanup;
+	transaction = false;
+
+	rc = EPKG_OK;
+
+	cleanup:
+	if (transaction)
+		sql_exec(sqlite, "ROLLBACK;");
+
+	for (g = generation + 1; g <= fetched; g++) {
+		snprintf(deltafile, sizeof(deltafile), "%s.delta.%" PRId64,
+		    repofile, g);
+		(void)unlink(deltafile);
+	}
+
+	if (sqlite != NULL)
+		sqlite3_close(sqlite);
+
+	free(buf);
+
 	return (rc);
 }
+
+int
+pkg_update(const char *name, const char *packagesite)
+{
+	char url[MAXPATHLEN];
+	char repofile[MAXPATHLEN];
+	char repofile_unchecked[MAXPATHLEN];
+	const char *dbdir = NULL;
+	int rc = EPKG_FATAL;
+	struct stat st;
+	time_t t = 0;
+
+	if (pkg_config_string(PKG_CONFIG_DBDIR, &dbdir) != EPKG_OK) {
+		pkg_emit_error("Cant get dbdir config entry");
+		return (EPKG_FATAL);
+	}
+
+	snprintf(repofile, sizeof(repofile), "%s/%s.sqlite", dbdir, name);
+	if (stat(repofile, &st) != -1) {
+		t = st.st_mtime;
+		/* add 10 minutes to the timestap because repo.sqlite is
+		 * always newer than repo.txz, 10 minutes should be enough
+		 */
+		t += 600;
+	}
+
+	/* only download what changed since the last update if possible */
+	rc = pkg_update_delta(packagesite, repofile, &t);
+	if (rc == EPKG_OK || rc == EPKG_UPTODATE)
+		return (rc);
+
+	snprintf(url, MAXPATHLEN, "%s/repo.txz", packagesite);
+	snprintf(repofile_unchecked, sizeof(repofile_unchecked), "%s.unchecked", repofile);
+
+	if ((rc = repo_fetch_db(url, "repo.sqlite", repofile_unchecked, t, 0)) != EPKG_OK)
+		return (rc);
+
+	if (rename(repofile_unchecked, repofile) != 0) {
+		pkg_emit_errno("rename", "");
+		return (EPKG_FATAL);
+	}
+
+	if ((rc = remote_add_indexes(name)) != EPKG_OK)
+		return (rc);
+
+	return (EPKG_OK);
+}
@@ -29,6 +29,8 @@
 #include <sys/param.h>
 #include <stdio.h>
 
+#include <archive.h>
+#include <archive_entry.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -286,7 +288,7 @@ is_dir(const char *path)
 	return (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
 }
 
-static void
+void
 sha256_hash(unsigned char hash[SHA256_DIGEST_LENGTH], char out[SHA256_DIGEST_LENGTH * 2 + 1])
 {
 	int i;
@@ -343,6 +345,165 @@ sha256_file(const char *path, char out[SHA256_DIGEST_LENGTH * 2 + 1])
 	return (EPKG_OK);
 }
 
+/* The +MANIFEST is looked for in at most that many leading bytes */
+#define DIGEST_HEAD_MAX (16 * 1024 * 1024)
+
+/*
+ * Try to extract the +MANIFEST from the bytes received so far.  A truncated
+ * archive only means more data is needed, unless it is the last attempt.
+ */
+static void
+pkg_digest_extract(struct pkg_digest *d, bool last)
+{
+	struct archive *a;
+	struct archive_entry *ae;
+	struct sbuf *manifest;
+	const char *fpath;
+	char buf[BUFSIZ];
+	ssize_t size;
+	int64_t len = 0;
+	int ret;
+
+	a = archive_read_new();
+	archive_read_support_compression_all(a);
+	archive_read_support_format_tar(a);
+
+	if (archive_read_open_memory(a, sbuf_data(d->head),
+	    sbuf_len(d->head)) != ARCHIVE_OK)
+		goto cleanup;
+
+	while ((ret = archive_read_next_header(a, &ae)) == ARCHIVE_OK) {
+		fpath = archive_entry_pathname(ae);
+		/* the metadata comes first, there is no +MANIFEST */
+		if (fpath[0] != '+') {
+			d->done = true;
+			break;
+		}
+
+		if (strcmp(fpath, "+MANIFEST") != 0)
+			continue;
+
+		manifest = sbuf_new_auto();
+		while ((size = archive_read_data(a, buf, sizeof(buf))) > 0) {
+			sbuf_bcat(manifest, buf, size);
+			len += size;
+		}
+
+		if (size == 0 && len > 0 && len == archive_entry_size(ae)) {
+			sbuf_finish(manifest);
+			d->manifest = manifest;
+			d->done = true;
+		} else {
+			sbuf_delete(manifest);
+		}
+		break;
+	}
+
+	if (ret == ARCHIVE_EOF)
+		d->done = true;
+
+	cleanup:
+	archive_read_finish(a);
+
+	if (last)
+		d->done = true;
+
+	if (d->done) {
+		sbuf_delete(d->head);
+		d->head = NULL;
+	}
+}
+
+void
+pkg_digest_init(struct pkg_digest *d)
+{
+	SHA256_Init(&d->sha256);
+	d->head = sbuf_new_auto();
+	d->next_try = 64 * 1024;
+	d->manifest = NULL;
+	d->done = false;
+	d->head_only = false;
+}
+
+void
+pkg_digest_update(struct pkg_digest *d, const void *buf, size_t len)
+{
+	SHA256_Update(&d->sha256, buf, len);
+
+	if (d->done)
+		return;
+
+	sbuf_bcat(d->head, buf, len);
+	if ((size_t)sbuf_len(d->head) >= d->next_try) {
+		pkg_digest_extract(d, sbuf_len(d->head) >= DIGEST_HEAD_MAX);
+		d->next_try *= 2;
+	}
+}
+
+/*
+ * Once the checksum is computed, d->manifest is the +MANIFEST of the
+ * archive, or NULL if it could not be found in its leading bytes.
+ */
+void
+pkg_digest_final(struct pkg_digest *d, char out[SHA256_DIGEST_LENGTH * 2 + 1])
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+
+	if (!d->done)
+		pkg_digest_extract(d, true);
+
+	SHA256_Final(hash, &d->sha256);
+	sha256_hash(hash, out);
+}
+
+void
+pkg_digest_free(struct pkg_digest *d)
+{
+	if (d->head != NULL)
+		sbuf_delete(d->head);
+	if (d->manifest != NULL)
+		sbuf_delete(d->manifest);
+	d->head = NULL;
+	d->manifest = NULL;
+}
+
+/* Feed the first len bytes of path, or all of it if len is negative */
+int
+pkg_digest_file(struct pkg_digest *d, const char *path, off_t len)
+{
+	FILE *fp;
+	char buffer[BUFSIZ];
+	size_t r;
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		pkg_emit_errno("fopen", path);
+		return (EPKG_FATAL);
+	}
+
+	while (len != 0) {
+		r = sizeof(buffer);
+		if (len > 0 && (off_t)r > len)
+			r = len;
+		if ((r = fread(buffer, 1, r, fp)) == 0)
+			break;
+		pkg_digest_update(d, buffer, r);
+		if (d->head_only && d->done)
+			break;
+		if (len > 0)
+			len -= r;
+	}
+
+	if (ferror(fp) != 0) {
+		fclose(fp);
+		pkg_emit_errno("fread", path);
+		return (EPKG_FATAL);
+	}
+
+	fclose(fp);
+
+	return (EPKG_OK);
+}
+
 int
 is_conf_file(const char *path, char *newpath, size_t len)
 {
@@ -383,3 +544,117 @@ bool is_hardlink(struct hardlinks *hl, struct stat *st)
 
 	return (true);
 }
+
+static size_t
+strset_hash(const char *key)
+{
+	size_t h = 2166136261U;
+
+	/* FNV-1a */
+	while (*key != '\0') {
+		h ^= (unsigned char)*key++;
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+static size_t *
+strset_slot(struct strset *set, const char *key, size_t hash)
+{
+	size_t mask = set->nslots - 1;
+	size_t i = hash & mask;
+	struct strset_entry *e;
+
+	for (;;) {
+		if (set->slots[i] == 0)
+			return (&set->slots[i]);
+		e = &set->entries[set->slots[i] - 1];
+		if (e->hash == hash && strcmp(e->key, key) == 0)
+			return (&set->slots[i]);
+		i = (i + 1) & mask;
+	}
+}
+
+struct strset_entry *
+strset_get(struct strset *set, const char *key)
+{
+	size_t *slot;
+
+	if (set->len == 0)
+		return (NULL);
+
+	slot = strset_slot(set, key, strset_hash(key));
+	if (*slot == 0)
+		return (NULL);
+
+	return (&set->entries[*slot - 1]);
+}
+
+/*
+ * Returns EPKG_END if key is already in the set, entry then points to
+ * the existing one.  On EPKG_FATAL the set is left unchanged.
+ */
+int
+strset_add(struct strset *set, const char *key, void *data,
+    struct strset_entry **entry)
+{
+	struct strset_entry *e, *entries;
+	size_t hash = strset_hash(key);
+	size_t *slot, *slots;
+	size_t nslots, cap;
+	size_t i;
+
+	/* keep the load factor under one half */
+	if (set->nslots < 2 * (set->len + 1)) {
+		nslots = set->nslots == 0 ? 64 : set->nslots * 2;
+		if ((slots = calloc(nslots, sizeof(size_t))) == NULL) {
+			pkg_emit_errno("calloc", "strset");
+			return (EPKG_FATAL);
+		}
+		free(set->slots);
+		set->slots = slots;
+		set->nslots = nslots;
+		for (i = 0; i < set->len; i++) {
+			e = &set->entries[i];
+			*strset_slot(set, e->key, e->hash) = i + 1;
+		}
+	}
+
+	slot = strset_slot(set, key, hash);
+	if (*slot != 0) {
+		if (entry != NULL)
+			*entry = &set->entries[*slot - 1];
+		return (EPKG_END);
+	}
+
+	if (set->cap <= set->len) {
+		cap = (set->cap | 1) * 2;
+		entries = realloc(set->entries,
+		    cap * sizeof(struct strset_entry));
+		if (entries == NULL) {
+			pkg_emit_errno("realloc", "strset");
+			return (EPKG_FATAL);
+		}
+		set->entries = entries;
+		set->cap = cap;
+	}
+
+	e = &set->entries[set->len++];
+	e->key = key;
+	e->hash = hash;
+	e->data = data;
+	*slot = set->len;
+	if (entry != NULL)
+		*entry = e;
+
+	return (EPKG_OK);
+}
+
+void
+strset_free(struct strset *set)
+{
+	free(set->entries);
+	free(set->slots);
+	memset(set, 0, sizeof(struct strset));
+}
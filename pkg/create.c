@@ -68,7 +68,7 @@ pkg_create_matches(int argc, char **argv, match_t match, pkg_formats fmt, const
 	int query_flags = PKG_LOAD_DEPS | PKG_LOAD_FILES | PKG_LOAD_CATEGORIES |
 	    PKG_LOAD_DIRS | PKG_LOAD_SCRIPTS | PKG_LOAD_OPTIONS |
 	    PKG_LOAD_MTREE | PKG_LOAD_LICENSES | PKG_LOAD_USERS |
-	    PKG_LOAD_GROUPS | PKG_LOAD_SHLIBS;
+	    PKG_LOAD_GROUPS | PKG_LOAD_SHLIBS | PKG_LOAD_SHLIBS_PROVIDED;
 	const char *format;
 
 	if (pkgdb_open(&db, PKGDB_DEFAULT) != EPKG_OK) {
@@ -48,7 +48,6 @@ event_callback(void *data, struct pkg_event *ev)
 	struct pkg_dep *dep = NULL;
 	const char *message;
 	int *debug = data;
-	(void) debug;
 	const char *name, *version, *newversion;
 	const char *filename;
 
@@ -59,6 +58,11 @@ event_callback(void *data, struct pkg_event *ev)
 	case PKG_EVENT_ERROR:
 		warnx("%s", ev->e_pkg_error.msg);
 		break;
+	case PKG_EVENT_DEBUG:
+		if (*debug >= ev->e_debug.level)
+			fprintf(stderr, "DBG(%d)> %s\n", ev->e_debug.level,
+			    ev->e_debug.msg);
+		break;
 	case PKG_EVENT_FETCHING:
 		if (quiet)
 			break;
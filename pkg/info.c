@@ -167,7 +167,7 @@ exec_info(int argc, char **argv)
 	}
 
 	if (file != NULL) {
-		if (pkg_open(&pkg, file, NULL) != EPKG_OK) {
+		if (pkg_open(&pkg, file, NULL, 0) != EPKG_OK) {
 			return (1);
 		}
 		print_info(pkg, opt);
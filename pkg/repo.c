@@ -24,10 +24,15 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <err.h>
+#include <getopt.h>
+#include <stdbool.h>
 #include <sysexits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <readpassphrase.h>
+#include <unistd.h>
 
 #include <pkg.h>
 
@@ -36,7 +41,7 @@
 void
 usage_repo(void)
 {
-	fprintf(stderr, "usage: pkg repo <repo-path> <rsa-key>\n\n");
+	fprintf(stderr, "usage: pkg repo [-j jobs] [--verify] <repo-path> <rsa-key>\n\n");
 	fprintf(stderr, "For more information see 'pkg help repo'.\n");
 }
 
@@ -86,15 +91,42 @@ exec_repo(int argc, char **argv)
 {
 	int retcode = EPKG_OK;
 	int pos = 0;
+	int ch;
+	int nthreads = 1;
+	bool verify = false;
+	const char *errstr;
 	char *rsa_key;
 
-	if (argc < 2 || argc > 3) {
+	struct option longopts[] = {
+		{ "verify", no_argument, NULL, 'V' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((ch = getopt_long(argc, argv, "j:", longopts, NULL)) != -1) {
+		switch (ch) {
+		case 'j':
+			nthreads = strtonum(optarg, 1, 1024, &errstr);
+			if (errstr)
+				errx(EX_USAGE, "Wrong value for -j: %s (%s)", optarg, errstr);
+			break;
+		case 'V':
+			verify = true;
+			break;
+		default:
+			usage_repo();
+			return (EX_USAGE);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1 || argc > 2) {
 		usage_repo();
 		return (EX_USAGE);
 	}
 
-	printf("Generating repo.sqlite in %s:  ", argv[1]);
-	retcode = pkg_create_repo(argv[1], progress, &pos);
+	printf("Generating repo.sqlite in %s:  ", argv[0]);
+	retcode = pkg_create_repo(argv[0], nthreads, verify, progress, &pos);
 
 	if (retcode != EPKG_OK) {
 		printf("cannot create repository\n");
@@ -103,8 +135,8 @@ exec_repo(int argc, char **argv)
 		printf("\bdone!\n");
 	}
 	
-	rsa_key = (argc == 3) ? argv[2] : NULL;
-	pkg_finish_repo(argv[1], password_cb, rsa_key);
+	rsa_key = (argc == 2) ? argv[1] : NULL;
+	pkg_finish_repo(argv[0], password_cb, rsa_key);
 
 	return (retcode);
 }
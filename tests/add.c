@@ -0,0 +1,118 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <check.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pkg.h>
+#include <private/pkg.h>
+
+#include "tests.h"
+
+static char tmpdir[MAXPATHLEN];
+
+static void
+write_content(const char *path, const char *content)
+{
+	int fd;
+
+	fail_unless((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) != -1);
+	fail_unless(write(fd, content, strlen(content)) ==
+	    (ssize_t)strlen(content));
+	close(fd);
+}
+
+/* Upgrade the file at path from the archive, return the files skipped */
+static int64_t
+add_upgrade(const char *archive, const char *path, const char *sum)
+{
+	struct pkg_add_job job;
+	struct pkg *old = NULL;
+	int64_t nskipped;
+
+	memset(&job, 0, sizeof(job));
+	fail_unless(pkg_new(&old, PKG_INSTALLED) == EPKG_OK);
+	fail_unless(pkg_addfile(old, path, sum, false) == EPKG_OK);
+	fail_unless(pkg_new(&job.pkg, PKG_FILE) == EPKG_OK);
+	fail_unless(pkg_addfile(job.pkg, path, sum, false) == EPKG_OK);
+	fail_unless(pkg_add_unchanged(&job, old) == EPKG_OK);
+
+	job.a = archive_read_new();
+	archive_read_support_compression_all(job.a);
+	archive_read_support_format_tar(job.a);
+	fail_unless(archive_read_open_filename(job.a, archive, 4096) ==
+	    ARCHIVE_OK);
+	fail_unless(archive_read_next_header(job.a, &job.ae) == ARCHIVE_OK);
+	job.extract = true;
+	fail_unless(pkg_add_extract(&job) == EPKG_OK);
+	fail_unless(job.error == NULL);
+	nskipped = job.nskipped;
+
+	archive_read_finish(job.a);
+	strset_free(&job.unchanged);
+	pkg_free(job.pkg);
+	pkg_free(old);
+
+	return (nskipped);
+}
+
+START_TEST(add_unchanged)
+{
+	struct packing *pack;
+	char sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char src[MAXPATHLEN];
+	char path[MAXPATHLEN];
+	char archive[MAXPATHLEN];
+	char buf[64];
+	ssize_t r;
+	int fd;
+
+	strlcpy(tmpdir, "/tmp/pkg_add.XXXXXX", sizeof(tmpdir));
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	snprintf(src, sizeof(src), "%s/src", tmpdir);
+	snprintf(path, sizeof(path), "%s/file", tmpdir);
+	write_content(src, "unchanged\n");
+
+	snprintf(archive, sizeof(archive), "%s/pkg", tmpdir);
+	fail_unless(packing_init(&pack, archive, TAR) == EPKG_OK);
+	fail_unless(packing_append_file_sum(pack, src, path, NULL, NULL, 0,
+	    sum) == EPKG_OK);
+	packing_finish(pack);
+	snprintf(archive, sizeof(archive), "%s/pkg.tar", tmpdir);
+
+	/* the same content on disk is not written again */
+	write_content(path, "unchanged\n");
+	fail_unless(add_upgrade(archive, path, sum) == 1);
+
+	/* modified locally with the same size, the file is restored */
+	write_content(path, "modified!\n");
+	fail_unless(add_upgrade(archive, path, sum) == 0);
+	fail_unless((fd = open(path, O_RDONLY)) != -1);
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	fail_unless(r >= 0);
+	buf[r] = '\0';
+	fail_unless(strcmp(buf, "unchanged\n") == 0);
+
+	unlink(path);
+	unlink(src);
+	unlink(archive);
+	rmdir(tmpdir);
+}
+END_TEST
+
+TCase *
+tcase_add(void)
+{
+	TCase *tc = tcase_create("Add");
+
+	tcase_add_test(tc, add_unchanged);
+
+	return (tc);
+}
@@ -0,0 +1,648 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include <pkg.h>
+#include <private/pkg.h>
+
+#include "tests.h"
+
+/*
+ * Micro-benchmarks of the hot paths of libpkg, run with make bench from
+ * the tests directory.  They check the results are correct and print the
+ * time spent, they are not meant to fail on slow machines.  The small
+ * checks of the same code belong to the test suite.
+ */
+
+#define BENCH_NPKGS 100000
+#define BENCH_REPO_NPKGS 30000
+#define BENCH_NFILES 200000
+#define BENCH_NDIRS 1000
+#define BENCH_NARCHIVES 10000
+#define BENCH_ARCHIVE_NFILES 100
+#define BENCH_ELF_NOBJECTS 5000
+#define BENCH_ELF_NLIBS 50
+#define BENCH_ELF_MACHINE 62	/* EM_X86_64 */
+
+static char dbdir[MAXPATHLEN];
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+bench_report(const char *what, int n, double elapsed)
+{
+	printf("%s: %d in %.3fs (%.0f/s)\n", what, n, elapsed,
+	    elapsed > 0 ? n / elapsed : 0);
+}
+
+/* A connection of our own to the local database, next to the one of libpkg */
+static sqlite3 *
+bench_sqlite(bool remote)
+{
+	sqlite3 *s;
+	char path[MAXPATHLEN];
+	char *sql;
+
+	snprintf(path, sizeof(path), "%s/local.sqlite", dbdir);
+	fail_unless(sqlite3_open(path, &s) == SQLITE_OK);
+	if (remote) {
+		sql = sqlite3_mprintf("ATTACH '%q/repo.sqlite' AS remote;",
+		    dbdir);
+		fail_unless(sqlite3_exec(s, sql, NULL, NULL, NULL) ==
+		    SQLITE_OK);
+		sqlite3_free(sql);
+	}
+
+	return (s);
+}
+
+/* Create a local database in a temporary directory filled with npkgs */
+static struct pkgdb *
+bench_db(int npkgs)
+{
+	struct pkgdb *db = NULL;
+	sqlite3 *s;
+	sqlite3_stmt *stmt;
+	char origin[64];
+	char name[32];
+	int i;
+
+	strlcpy(dbdir, "/tmp/pkg_bench.XXXXXX", sizeof(dbdir));
+	fail_unless(mkdtemp(dbdir) != NULL);
+	setenv("PKG_DBDIR", dbdir, 1);
+	fail_unless(pkg_init("/nonexistent") == EPKG_OK);
+	fail_unless(pkgdb_open(&db, PKGDB_DEFAULT) == EPKG_OK);
+	if (npkgs == 0)
+		return (db);
+
+	s = bench_sqlite(false);
+	fail_unless(sqlite3_exec(s, "BEGIN", NULL, NULL, NULL) == SQLITE_OK);
+	fail_unless(sqlite3_prepare_v2(s,
+	    "INSERT INTO packages (origin, name, version, comment, desc, "
+	    "arch, maintainer, www, prefix, flatsize, automatic, "
+	    "licenselogic, time) "
+	    "VALUES (?1, ?2, '1.0', 'comment', 'description', "
+	    "'freebsd:9:x86:64', 'ports@FreeBSD.org', 'http://www.FreeBSD.org', "
+	    "'/usr/local', 1024, 0, 1, 0)", -1, &stmt, NULL) == SQLITE_OK);
+	for (i = 0; i < npkgs; i++) {
+		snprintf(name, sizeof(name), "pkg%d", i);
+		snprintf(origin, sizeof(origin), "bench/%s", name);
+		sqlite3_bind_text(stmt, 1, origin, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(stmt, 2, name, -1, SQLITE_TRANSIENT);
+		fail_unless(sqlite3_step(stmt) == SQLITE_DONE);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+	fail_unless(sqlite3_exec(s, "COMMIT", NULL, NULL, NULL) == SQLITE_OK);
+	sqlite3_close(s);
+
+	return (db);
+}
+
+static void
+bench_db_free(struct pkgdb *db)
+{
+	pkgdb_close(db);
+	jobs_remove_db(dbdir);
+}
+
+START_TEST(bench_pkgdb_it)
+{
+	static const char *names[] = { "origin", "name", "version", "comment",
+	    "desc", "message", "arch", "maintainer", "www", "prefix", "cksum",
+	    "repopath", "dbname", "newversion", "flatsize", "newflatsize",
+	    "pkgsize", "licenselogic", "automatic", "time", "infos", "rowid",
+	    "id", "weight", NULL };
+	struct pkgdb *db;
+	struct pkgdb_it *it;
+	struct pkg *pkg = NULL;
+	sqlite3 *s;
+	sqlite3_stmt *stmt;
+	const char *colname;
+	double begin;
+	int icol, i, n;
+
+	db = bench_db(BENCH_NPKGS);
+
+	/* rows populated through the column map of the iterator */
+	begin = bench_now();
+	fail_unless((it = pkgdb_query(db, NULL, MATCH_ALL)) != NULL);
+	n = 0;
+	while (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC) == EPKG_OK)
+		n++;
+	pkgdb_it_free(it);
+	bench_report("pkgdb_it_next", n, bench_now() - begin);
+	fail_unless(n == BENCH_NPKGS);
+	pkg_free(pkg);
+
+	/* the same query, with the column names looked up for each row */
+	s = bench_sqlite(false);
+	fail_unless(sqlite3_prepare_v2(s, "SELECT id, origin, name, version, "
+	    "comment, desc, message, arch, maintainer, www, prefix, flatsize, "
+	    "licenselogic, automatic, time, infos FROM packages AS p", -1,
+	    &stmt, NULL) == SQLITE_OK);
+	begin = bench_now();
+	n = 0;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		for (icol = 0; icol < sqlite3_column_count(stmt); icol++) {
+			colname = sqlite3_column_name(stmt, icol);
+			for (i = 0; names[i] != NULL; i++)
+				if (!strcmp(names[i], colname))
+					break;
+			fail_unless(names[i] != NULL);
+		}
+		n++;
+	}
+	bench_report("column name lookups", n, bench_now() - begin);
+	fail_unless(n == BENCH_NPKGS);
+	sqlite3_finalize(stmt);
+	sqlite3_close(s);
+
+	bench_db_free(db);
+}
+END_TEST
+
+/* Order every step-th package of the repository with pkg_jobs_resolv() */
+static void
+bench_jobs_resolv(struct pkgdb *db, int step)
+{
+	struct pkg_jobs *jobs;
+	struct pkg *pkg = NULL;
+	const char *origin;
+	char buf[64];
+	double begin;
+	int *pos;
+	int deps[3];
+	int i, k, n;
+
+	fail_unless(pkg_jobs_new(&jobs, PKG_JOBS_INSTALL, db) == EPKG_OK);
+	for (i = 0; i < BENCH_REPO_NPKGS; i += step) {
+		pkg = NULL;
+		fail_unless(pkg_new(&pkg, PKG_REMOTE) == EPKG_OK);
+		snprintf(buf, sizeof(buf), "test/pkg%d", i);
+		pkg_set(pkg, PKG_ORIGIN, buf, PKG_REPONAME, "remote");
+		pkg_jobs_add(jobs, pkg);
+	}
+
+	begin = bench_now();
+	fail_unless(pkg_jobs_resolv(jobs) == EPKG_OK);
+	snprintf(buf, sizeof(buf), "pkg_jobs_resolv (1/%d)", step);
+	bench_report(buf, BENCH_REPO_NPKGS / step, bench_now() - begin);
+
+	/* every dependency in the jobs comes first */
+	fail_unless((pos = calloc(BENCH_REPO_NPKGS, sizeof(int))) != NULL);
+	pkg = NULL;
+	n = 0;
+	while (pkg_jobs(jobs, &pkg) == EPKG_OK) {
+		pkg_get(pkg, PKG_ORIGIN, &origin);
+		pos[strtol(origin + strlen("test/pkg"), NULL, 10)] = ++n;
+	}
+	fail_unless(n == BENCH_REPO_NPKGS / step);
+	for (i = 0; i < BENCH_REPO_NPKGS; i += step) {
+		n = jobs_repo_deps(i, deps);
+		for (k = 0; k < n; k++) {
+			if (deps[k] % step == 0)
+				fail_unless(pos[deps[k]] < pos[i]);
+		}
+	}
+	free(pos);
+
+	pkg_jobs_free(jobs);
+}
+
+/* The weight column formerly computed by pkgdb_query_installs() */
+static void
+bench_jobs_weight(int step)
+{
+	sqlite3 *s;
+	sqlite3_stmt *stmt;
+	char origin[64];
+	char what[64];
+	double begin;
+	int i, n;
+
+	s = bench_sqlite(true);
+	fail_unless(sqlite3_exec(s, "CREATE TEMPORARY TABLE "
+	    "bench_jobs (origin TEXT UNIQUE NOT NULL, weight INTEGER);",
+	    NULL, NULL, NULL) == SQLITE_OK);
+	fail_unless(sqlite3_prepare_v2(s, "INSERT INTO bench_jobs "
+	    "(origin) VALUES (?1)", -1, &stmt, NULL) == SQLITE_OK);
+	for (i = 0; i < BENCH_REPO_NPKGS; i += step) {
+		snprintf(origin, sizeof(origin), "test/pkg%d", i);
+		sqlite3_bind_text(stmt, 1, origin, -1, SQLITE_TRANSIENT);
+		fail_unless(sqlite3_step(stmt) == SQLITE_DONE);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+
+	begin = bench_now();
+	fail_unless(sqlite3_exec(s, "UPDATE bench_jobs SET weight=("
+	    "SELECT COUNT(*) FROM remote.deps AS d, remote.packages AS p, "
+	    "bench_jobs AS j WHERE d.origin = bench_jobs.origin "
+	    "AND d.package_id = p.id AND p.origin = j.origin);", NULL, NULL,
+	    NULL) == SQLITE_OK);
+	fail_unless(sqlite3_prepare_v2(s, "SELECT origin FROM "
+	    "bench_jobs ORDER BY weight DESC", -1, &stmt, NULL) == SQLITE_OK);
+	n = 0;
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+		n++;
+	sqlite3_finalize(stmt);
+	snprintf(what, sizeof(what), "SQL weight (1/%d)", step);
+	bench_report(what, n, bench_now() - begin);
+	fail_unless(n == BENCH_REPO_NPKGS / step);
+
+	sqlite3_close(s);
+}
+
+START_TEST(bench_jobs)
+{
+	struct pkgdb *db;
+
+	db = bench_db(0);
+	pkgdb_close(db);
+	jobs_write_repo(dbdir, BENCH_REPO_NPKGS);
+	fail_unless(pkgdb_open(&db, PKGDB_REMOTE) == EPKG_OK);
+
+	/* the weight subquery scans the deps for each job */
+	bench_jobs_weight(10);
+	bench_jobs_resolv(db, 10);
+	bench_jobs_resolv(db, 1);
+
+	bench_db_free(db);
+}
+END_TEST
+
+/* Files first to first + nfiles - 1, spread over BENCH_NDIRS directories */
+static struct pkg *
+bench_pkg_files(int first, int nfiles)
+{
+	struct pkg *pkg = NULL;
+	char path[MAXPATHLEN];
+	int i;
+
+	fail_unless(pkg_new(&pkg, PKG_FILE) == EPKG_OK);
+	for (i = first; i < first + nfiles; i++) {
+		snprintf(path, sizeof(path), "/usr/local/share/bench/%d/file%d",
+		    i % BENCH_NDIRS, i);
+		fail_unless(pkg_addfile(pkg, path, NULL, false) == EPKG_OK);
+	}
+	for (i = 0; i < BENCH_NDIRS; i++) {
+		snprintf(path, sizeof(path), "/usr/local/share/bench/%d", i);
+		fail_unless(pkg_adddir(pkg, path, false) == EPKG_OK);
+	}
+
+	return (pkg);
+}
+
+static void
+bench_keep_count(struct pkg *pkg, int *nfiles, int *ndirs)
+{
+	struct pkg_file *f = NULL;
+	struct pkg_dir *d = NULL;
+
+	*nfiles = *ndirs = 0;
+	while (pkg_files(pkg, &f) == EPKG_OK) {
+		if (f->keep == 1)
+			(*nfiles)++;
+		f->keep = 0;
+	}
+	while (pkg_dirs(pkg, &d) == EPKG_OK) {
+		if (d->keep == 1)
+			(*ndirs)++;
+		d->keep = 0;
+	}
+}
+
+START_TEST(bench_keep_files)
+{
+	struct pkg_jobs_paths paths;
+	struct pkg *oldpkg, *newpkg;
+	struct pkg_file *f1 = NULL, *f2 = NULL;
+	double begin;
+	int nfiles, ndirs, n;
+
+	/* half of the files and all the directories are in both versions */
+	oldpkg = bench_pkg_files(0, BENCH_NFILES);
+	newpkg = bench_pkg_files(BENCH_NFILES / 2, BENCH_NFILES);
+
+	memset(&paths, 0, sizeof(paths));
+	begin = bench_now();
+	fail_unless(pkg_jobs_paths_index(&paths, newpkg) == EPKG_OK);
+	fail_unless(pkg_jobs_keep_files_to_del(oldpkg, &paths) == EPKG_OK);
+	bench_report("pkg_jobs_keep_files_to_del", BENCH_NFILES,
+	    bench_now() - begin);
+	pkg_jobs_paths_free(&paths);
+	bench_keep_count(oldpkg, &nfiles, &ndirs);
+	fail_unless(nfiles == BENCH_NFILES / 2);
+	fail_unless(ndirs == BENCH_NDIRS);
+
+	/* the nested loops formerly used, on a tenth of the files */
+	pkg_free(oldpkg);
+	pkg_free(newpkg);
+	oldpkg = bench_pkg_files(0, BENCH_NFILES / 10);
+	newpkg = bench_pkg_files(BENCH_NFILES / 20, BENCH_NFILES / 10);
+	begin = bench_now();
+	n = 0;
+	while (pkg_files(oldpkg, &f1) == EPKG_OK) {
+		f2 = NULL;
+		while (pkg_files(newpkg, &f2) == EPKG_OK) {
+			if (strcmp(pkg_file_get(f1, PKG_FILE_PATH),
+			    pkg_file_get(f2, PKG_FILE_PATH)) == 0) {
+				n++;
+				break;
+			}
+		}
+	}
+	bench_report("nested file lookups", BENCH_NFILES / 10,
+	    bench_now() - begin);
+	fail_unless(n == BENCH_NFILES / 20);
+
+	pkg_free(oldpkg);
+	pkg_free(newpkg);
+}
+END_TEST
+
+/* Write npkgs packages depending on each other like the repository ones */
+static void
+bench_archives(char *dir, size_t len, int npkgs)
+{
+	struct packing *pack;
+	struct pkg *pkg;
+	char path[MAXPATHLEN];
+	char origin[64];
+	char name[32];
+	int deps[3];
+	int i, k, n;
+
+	strlcpy(dir, "/tmp/pkg_bench.XXXXXX", len);
+	fail_unless(mkdtemp(dir) != NULL);
+
+	for (i = 0; i < npkgs; i++) {
+		fail_unless(pkg_new(&pkg, PKG_FILE) == EPKG_OK);
+		snprintf(name, sizeof(name), "pkg%d", i);
+		snprintf(origin, sizeof(origin), "bench/%s", name);
+		pkg_set(pkg, PKG_NAME, name, PKG_ORIGIN, origin, PKG_VERSION,
+		    "1.0", PKG_COMMENT, "comment", PKG_DESC, "description",
+		    PKG_ARCH, "freebsd:9:x86:64", PKG_MAINTAINER,
+		    "ports@FreeBSD.org", PKG_WWW, "http://www.FreeBSD.org",
+		    PKG_PREFIX, "/usr/local");
+		n = jobs_repo_deps(i, deps);
+		for (k = 0; k < n; k++) {
+			snprintf(name, sizeof(name), "pkg%d", deps[k]);
+			snprintf(origin, sizeof(origin), "bench/%s", name);
+			pkg_adddep(pkg, name, origin, "1.0");
+		}
+		for (k = 0; k < BENCH_ARCHIVE_NFILES; k++) {
+			snprintf(path, sizeof(path),
+			    "/usr/local/share/bench/pkg%d/file%d", i, k);
+			pkg_addfile(pkg, path,
+			    "01ba4719c80b6fe911b091a7c05124b64eeece964e09c058ef8f9805daca546b",
+			    false);
+		}
+
+		snprintf(path, sizeof(path), "%s/pkg%d-1.0", dir, i);
+		fail_unless(packing_init(&pack, path, TGZ) == EPKG_OK);
+		fail_unless(pkg_emit_manifest_packing(pkg, pack, "+MANIFEST",
+		    "+COMPACT_MANIFEST") == EPKG_OK);
+		packing_append_buffer(pack, path, "usr/local/share/bench/data",
+		    strlen(path));
+		packing_finish(pack);
+		pkg_free(pkg);
+	}
+}
+
+/* Open every package of dir, return the number of dependencies seen */
+static int
+bench_open_all(const char *dir, int npkgs, int flags)
+{
+	struct pkg *pkg = NULL;
+	struct pkg_dep *dep;
+	char path[MAXPATHLEN];
+	char name[32];
+	const char *pkgname;
+	int ndeps = 0;
+	int i;
+
+	for (i = 0; i < npkgs; i++) {
+		snprintf(path, sizeof(path), "%s/pkg%d-1.0.tgz", dir, i);
+		fail_unless(pkg_open(&pkg, path, NULL, flags) == EPKG_OK);
+		snprintf(name, sizeof(name), "pkg%d", i);
+		pkg_get(pkg, PKG_NAME, &pkgname);
+		fail_unless(strcmp(pkgname, name) == 0);
+		fail_unless(pkg_list_is_empty(pkg, PKG_FILES) ==
+		    ((flags & PKG_OPEN_MANIFEST_COMPACT) != 0));
+		dep = NULL;
+		while (pkg_deps(pkg, &dep) == EPKG_OK)
+			ndeps++;
+	}
+	pkg_free(pkg);
+
+	return (ndeps);
+}
+
+START_TEST(bench_open)
+{
+	char dir[MAXPATHLEN];
+	char path[MAXPATHLEN];
+	double begin;
+	int deps[3];
+	int ndeps = 0;
+	int i;
+
+	bench_archives(dir, sizeof(dir), BENCH_NARCHIVES);
+	for (i = 0; i < BENCH_NARCHIVES; i++)
+		ndeps += jobs_repo_deps(i, deps);
+
+	begin = bench_now();
+	fail_unless(bench_open_all(dir, BENCH_NARCHIVES, 0) == ndeps);
+	bench_report("pkg_open", BENCH_NARCHIVES, bench_now() - begin);
+
+	begin = bench_now();
+	fail_unless(bench_open_all(dir, BENCH_NARCHIVES,
+	    PKG_OPEN_MANIFEST_COMPACT) == ndeps);
+	bench_report("pkg_open compact", BENCH_NARCHIVES, bench_now() - begin);
+
+	for (i = 0; i < BENCH_NARCHIVES; i++) {
+		snprintf(path, sizeof(path), "%s/pkg%d-1.0.tgz", dir, i);
+		unlink(path);
+	}
+	rmdir(dir);
+}
+END_TEST
+
+/* The libraries needed by the object i of bench_elf_tree() */
+static void
+bench_elf_needed(int i, int libs[3])
+{
+	libs[0] = i % BENCH_ELF_NLIBS;
+	libs[1] = (i * 7 + 3) % BENCH_ELF_NLIBS;
+	libs[2] = (i / 10) % BENCH_ELF_NLIBS;
+}
+
+/*
+ * A tree of small ELF objects in bin, each needing three of the libraries
+ * of lib through its RUNPATH, with a text file every ten objects.  The
+ * package returned has all the files of bin.
+ */
+static struct pkg *
+bench_elf_tree(char *dir, size_t len)
+{
+	struct pkg *pkg;
+	char path[MAXPATHLEN];
+	char names[3][32];
+	const char *needed[4] = { names[0], names[1], names[2], NULL };
+	int libs[3];
+	int i, k;
+	FILE *fp;
+
+	strlcpy(dir, "/tmp/pkg_bench.XXXXXX", len);
+	fail_unless(mkdtemp(dir) != NULL);
+	snprintf(path, sizeof(path), "%s/bin", dir);
+	fail_unless(mkdir(path, 0755) == 0);
+	snprintf(path, sizeof(path), "%s/lib", dir);
+	fail_unless(mkdir(path, 0755) == 0);
+
+	for (i = 0; i < BENCH_ELF_NLIBS; i++) {
+		snprintf(names[0], sizeof(names[0]), "lib%d.so.1", i);
+		snprintf(path, sizeof(path), "%s/lib/%s", dir, names[0]);
+		elf_write_object(path, BENCH_ELF_MACHINE, names[0], NULL, NULL,
+		    NULL);
+	}
+
+	fail_unless(pkg_new(&pkg, PKG_FILE) == EPKG_OK);
+	for (i = 0; i < BENCH_ELF_NOBJECTS; i++) {
+		bench_elf_needed(i, libs);
+		for (k = 0; k < 3; k++)
+			snprintf(names[k], sizeof(names[k]), "lib%d.so.1",
+			    libs[k]);
+		snprintf(path, sizeof(path), "%s/bin/obj%d", dir, i);
+		elf_write_object(path, BENCH_ELF_MACHINE, NULL, NULL,
+		    "$ORIGIN/../lib", needed);
+		pkg_addfile(pkg, path, NULL, false);
+
+		if (i % 10 != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/bin/obj%d.txt", dir, i);
+		fail_unless((fp = fopen(path, "w")) != NULL);
+		fprintf(fp, "object %d\n", i);
+		fclose(fp);
+		pkg_addfile(pkg, path, NULL, false);
+	}
+
+	return (pkg);
+}
+
+static void
+bench_analyse(int nthreads)
+{
+	struct pkg *pkg;
+	struct pkg_shlib *shlib = NULL;
+	struct pkg_file *file = NULL;
+	char dir[MAXPATHLEN];
+	char name[32];
+	char what[64];
+	bool seen[BENCH_ELF_NLIBS];
+	int order[BENCH_ELF_NLIBS];
+	int libs[3];
+	int nlibs = 0;
+	double begin;
+	int i, k;
+
+	snprintf(name, sizeof(name), "%d", nthreads);
+	setenv("ANALYSE_CONCURRENCY", name, 1);
+	setenv("SHLIBS", "yes", 1);
+	setenv("DEVELOPER_MODE", "yes", 1);
+	fail_unless(pkg_init("/nonexistent") == EPKG_OK);
+
+	pkg = bench_elf_tree(dir, sizeof(dir));
+
+	begin = bench_now();
+	fail_unless(pkg_analyse_files(NULL, pkg) == EPKG_OK);
+	snprintf(what, sizeof(what), "pkg_analyse_files %d threads", nthreads);
+	bench_report(what, BENCH_ELF_NOBJECTS, bench_now() - begin);
+
+	/* whatever the number of threads, the order of the files is kept */
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < BENCH_ELF_NOBJECTS; i++) {
+		bench_elf_needed(i, libs);
+		for (k = 0; k < 3; k++) {
+			if (seen[libs[k]])
+				continue;
+			seen[libs[k]] = true;
+			order[nlibs++] = libs[k];
+		}
+	}
+	i = 0;
+	while (pkg_shlibs(pkg, &shlib) == EPKG_OK) {
+		fail_unless(i < nlibs);
+		snprintf(name, sizeof(name), "lib%d.so.1", order[i++]);
+		fail_unless(strcmp(pkg_shlib_name(shlib), name) == 0);
+	}
+	fail_unless(i == nlibs);
+	fail_unless((pkg->flags & PKG_CONTAINS_ELF_OBJECTS) != 0);
+
+	while (pkg_files(pkg, &file) == EPKG_OK)
+		unlink(pkg_file_get(file, PKG_FILE_PATH));
+	for (i = 0; i < BENCH_ELF_NLIBS; i++) {
+		snprintf(what, sizeof(what), "%s/lib/lib%d.so.1", dir, i);
+		unlink(what);
+	}
+	snprintf(what, sizeof(what), "%s/bin", dir);
+	rmdir(what);
+	snprintf(what, sizeof(what), "%s/lib", dir);
+	rmdir(what);
+	rmdir(dir);
+	pkg_free(pkg);
+}
+
+START_TEST(bench_analyse_serial)
+{
+	bench_analyse(1);
+}
+END_TEST
+
+START_TEST(bench_analyse_parallel)
+{
+	bench_analyse(sysconf(_SC_NPROCESSORS_ONLN));
+}
+END_TEST
+
+int
+main()
+{
+	int nfailed = 0;
+	Suite *s = suite_create("pkgng benchmarks");
+	TCase *tc = tcase_create("Benchmark");
+
+	tcase_set_timeout(tc, 600);
+	tcase_add_test(tc, bench_pkgdb_it);
+	tcase_add_test(tc, bench_jobs);
+	tcase_add_test(tc, bench_keep_files);
+	tcase_add_test(tc, bench_open);
+	tcase_add_test(tc, bench_analyse_serial);
+	tcase_add_test(tc, bench_analyse_parallel);
+	suite_add_tcase(s, tc);
+
+	SRunner *sr = srunner_create(s);
+	srunner_set_log(sr, "bench.log");
+	srunner_run_all(sr, CK_NORMAL);
+	nfailed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (nfailed == 0 ? 0 : 1);
+}
@@ -0,0 +1,378 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <check.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include <pkg.h>
+#include <private/pkg.h>
+#include <private/pkgdb.h>
+
+#include "tests.h"
+
+#define ELF_MACHINE 62		/* EM_X86_64 */
+#define ELF_OTHER_MACHINE 183	/* EM_AARCH64 */
+
+static char tmpdir[MAXPATHLEN];
+
+static size_t
+elf_addstr(char *strtab, size_t *len, const char *s)
+{
+	size_t off = *len;
+
+	strcpy(strtab + off, s);
+	*len += strlen(s) + 1;
+
+	return (off);
+}
+
+/*
+ * Write a FreeBSD 64 bits shared object made of its dynamic section and the
+ * string table of it, which is all pkg_analyse_files() reads.  needed is
+ * NULL terminated, soname, rpath and runpath may be NULL.
+ */
+void
+elf_write_object(const char *path, int machine, const char *soname,
+    const char *rpath, const char *runpath, const char **needed)
+{
+	static const char shstrtab[] = "\0.dynstr\0.dynamic\0.shstrtab";
+	Elf64_Ehdr ehdr;
+	Elf64_Shdr shdr[4];
+	Elf64_Dyn dyn[64];
+	char dynstr[8192];
+	size_t strsz = 1, ndyn = 0;
+	size_t dynoff, shstroff, shoff;
+	FILE *fp;
+	int i;
+
+	memset(dynstr, 0, sizeof(dynstr));
+	memset(dyn, 0, sizeof(dyn));
+	for (i = 0; needed != NULL && needed[i] != NULL; i++) {
+		dyn[ndyn].d_tag = DT_NEEDED;
+		dyn[ndyn++].d_un.d_val = elf_addstr(dynstr, &strsz, needed[i]);
+	}
+	if (soname != NULL) {
+		dyn[ndyn].d_tag = DT_SONAME;
+		dyn[ndyn++].d_un.d_val = elf_addstr(dynstr, &strsz, soname);
+	}
+	if (rpath != NULL) {
+		dyn[ndyn].d_tag = DT_RPATH;
+		dyn[ndyn++].d_un.d_val = elf_addstr(dynstr, &strsz, rpath);
+	}
+	if (runpath != NULL) {
+		dyn[ndyn].d_tag = DT_RUNPATH;
+		dyn[ndyn++].d_un.d_val = elf_addstr(dynstr, &strsz, runpath);
+	}
+	dyn[ndyn++].d_tag = DT_NULL;
+
+	dynoff = roundup2(sizeof(ehdr) + strsz, 8);
+	shstroff = dynoff + ndyn * sizeof(Elf64_Dyn);
+	shoff = roundup2(shstroff + sizeof(shstrtab), 8);
+
+	memset(&ehdr, 0, sizeof(ehdr));
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+#if BYTE_ORDER == LITTLE_ENDIAN
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+#else
+	ehdr.e_ident[EI_DATA] = ELFDATA2MSB;
+#endif
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_ident[EI_OSABI] = ELFOSABI_FREEBSD;
+	ehdr.e_type = ET_DYN;
+	ehdr.e_machine = machine;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_ehsize = sizeof(ehdr);
+	ehdr.e_shoff = shoff;
+	ehdr.e_shentsize = sizeof(Elf64_Shdr);
+	ehdr.e_shnum = 4;
+	ehdr.e_shstrndx = 3;
+
+	memset(shdr, 0, sizeof(shdr));
+	shdr[1].sh_name = 1;
+	shdr[1].sh_type = SHT_STRTAB;
+	shdr[1].sh_offset = sizeof(ehdr);
+	shdr[1].sh_size = strsz;
+	shdr[1].sh_addralign = 1;
+	shdr[2].sh_name = 9;
+	shdr[2].sh_type = SHT_DYNAMIC;
+	shdr[2].sh_offset = dynoff;
+	shdr[2].sh_size = ndyn * sizeof(Elf64_Dyn);
+	shdr[2].sh_link = 1;
+	shdr[2].sh_addralign = 8;
+	shdr[2].sh_entsize = sizeof(Elf64_Dyn);
+	shdr[3].sh_name = 18;
+	shdr[3].sh_type = SHT_STRTAB;
+	shdr[3].sh_offset = shstroff;
+	shdr[3].sh_size = sizeof(shstrtab);
+	shdr[3].sh_addralign = 1;
+
+	fail_unless((fp = fopen(path, "w")) != NULL);
+	fwrite(&ehdr, sizeof(ehdr), 1, fp);
+	fwrite(dynstr, strsz, 1, fp);
+	fseek(fp, dynoff, SEEK_SET);
+	fwrite(dyn, sizeof(Elf64_Dyn), ndyn, fp);
+	fwrite(shstrtab, sizeof(shstrtab), 1, fp);
+	fseek(fp, shoff, SEEK_SET);
+	fwrite(shdr, sizeof(shdr), 1, fp);
+	fail_unless(fclose(fp) == 0);
+}
+
+/* A tree with bin, lib and lib2, libfoo.so.1 being in lib and in lib2 */
+static void
+setup(bool autodeps)
+{
+	char path[MAXPATHLEN];
+	const char *needed[] = { "libbar.so.1", NULL };
+
+	strlcpy(tmpdir, "/tmp/pkg_elf.XXXXXX", sizeof(tmpdir));
+	fail_unless(mkdtemp(tmpdir) != NULL);
+
+	snprintf(path, sizeof(path), "%s/bin", tmpdir);
+	fail_unless(mkdir(path, 0755) == 0);
+	snprintf(path, sizeof(path), "%s/lib", tmpdir);
+	fail_unless(mkdir(path, 0755) == 0);
+	snprintf(path, sizeof(path), "%s/lib2", tmpdir);
+	fail_unless(mkdir(path, 0755) == 0);
+
+	snprintf(path, sizeof(path), "%s/lib/libfoo.so.1", tmpdir);
+	elf_write_object(path, ELF_MACHINE, "libfoo.so.1", "$ORIGIN", NULL,
+	    needed);
+	snprintf(path, sizeof(path), "%s/lib/libbar.so.1", tmpdir);
+	elf_write_object(path, ELF_MACHINE, "libbar.so.1", NULL, NULL, NULL);
+	snprintf(path, sizeof(path), "%s/lib/libarm.so.1", tmpdir);
+	elf_write_object(path, ELF_OTHER_MACHINE, "libarm.so.1", NULL, NULL,
+	    NULL);
+	snprintf(path, sizeof(path), "%s/lib2/libfoo.so.1", tmpdir);
+	elf_write_object(path, ELF_MACHINE, "libfoo.so.1", NULL, NULL, NULL);
+
+	setenv("SHLIBS", "yes", 1);
+	setenv("AUTODEPS", autodeps ? "yes" : "no", 1);
+	setenv("PKG_DBDIR", tmpdir, 1);
+	unsetenv("LD_LIBRARY_PATH");
+	fail_unless(pkg_init("/nonexistent") == EPKG_OK);
+}
+
+static int
+teardown_remove(const char *path, __unused const struct stat *st,
+    __unused int flag, __unused struct FTW *ftw)
+{
+	remove(path);
+
+	return (0);
+}
+
+/* Remove the tree of setup() with the database it may hold */
+static void
+teardown(void)
+{
+	if (tmpdir[0] == '\0')
+		return;
+
+	nftw(tmpdir, teardown_remove, 16, FTW_DEPTH | FTW_PHYS);
+	tmpdir[0] = '\0';
+}
+
+/*
+ * Analyse bin/prog needing the given libraries with the given search path,
+ * check the shlibs are the expected ones in order.
+ */
+static struct pkg *
+analyse(struct pkgdb *db, const char *rpath, const char *runpath,
+    const char **needed, const char **expected)
+{
+	struct pkg *pkg = NULL;
+	struct pkg_shlib *shlib = NULL;
+	char path[MAXPATHLEN];
+	int i = 0;
+
+	snprintf(path, sizeof(path), "%s/bin/prog", tmpdir);
+	elf_write_object(path, ELF_MACHINE, NULL, rpath, runpath, needed);
+
+	fail_unless(pkg_new(&pkg, PKG_FILE) == EPKG_OK);
+	fail_unless(pkg_addfile(pkg, path, NULL, false) == EPKG_OK);
+	fail_unless(pkg_analyse_files(db, pkg) == EPKG_OK);
+
+	while (pkg_shlibs(pkg, &shlib) == EPKG_OK) {
+		fail_unless(expected[i] != NULL);
+		fail_unless(strcmp(pkg_shlib_name(shlib), expected[i]) == 0);
+		i++;
+	}
+	fail_unless(expected[i] == NULL);
+
+	return (pkg);
+}
+
+START_TEST(elf_rpath)
+{
+	const char *needed[] = { "libfoo.so.1", "libnone.so.1", NULL };
+	const char *expected[] = { "libfoo.so.1", NULL };
+
+	setup(false);
+	pkg_free(analyse(NULL, "$ORIGIN/../lib", NULL, needed, expected));
+	pkg_free(analyse(NULL, "/nonexistent:${ORIGIN}/../lib2", NULL, needed,
+	    expected));
+}
+END_TEST
+
+START_TEST(elf_runpath)
+{
+	const char *needed[] = { "libfoo.so.1", "libbar.so.1", NULL };
+	const char *expected[] = { "libfoo.so.1", "libbar.so.1", NULL };
+	const char *none[] = { NULL };
+
+	setup(false);
+	pkg_free(analyse(NULL, NULL, "$ORIGIN/../lib", needed, expected));
+
+	/* the RPATH is ignored when there is a RUNPATH */
+	pkg_free(analyse(NULL, "$ORIGIN/../lib", "$ORIGIN/../lib2", needed,
+	    (const char *[]){ "libfoo.so.1", NULL }));
+	pkg_free(analyse(NULL, "$ORIGIN/../lib", "/nonexistent", needed,
+	    none));
+}
+END_TEST
+
+START_TEST(elf_ld_library_path)
+{
+	char path[MAXPATHLEN];
+	const char *needed[] = { "libbar.so.1", NULL };
+	const char *expected[] = { "libbar.so.1", NULL };
+	const char *none[] = { NULL };
+
+	setup(false);
+	pkg_free(analyse(NULL, NULL, NULL, needed, none));
+
+	/* LD_LIBRARY_PATH is looked in even when there is a RUNPATH */
+	snprintf(path, sizeof(path), "%s/lib", tmpdir);
+	setenv("LD_LIBRARY_PATH", path, 1);
+	pkg_free(analyse(NULL, NULL, NULL, needed, expected));
+	pkg_free(analyse(NULL, NULL, "/nonexistent", needed, expected));
+	unsetenv("LD_LIBRARY_PATH");
+}
+END_TEST
+
+START_TEST(elf_machine)
+{
+	char path[MAXPATHLEN];
+	const char *needed[] = { "libarm.so.1", "libfoo.so.1", NULL };
+	const char *expected[] = { "libfoo.so.1", NULL };
+	const char *none[] = { NULL };
+
+	setup(false);
+
+	/* libraries of another machine are not loadable */
+	pkg_free(analyse(NULL, "$ORIGIN/../lib", NULL, needed, expected));
+
+	/* nor are the files which are not ELF objects */
+	snprintf(path, sizeof(path), "%s/lib2/libfoo.so.1", tmpdir);
+	fail_unless(truncate(path, 3) == 0);
+	pkg_free(analyse(NULL, "$ORIGIN/../lib2", NULL, needed, none));
+
+	/* a name with a slash is a path */
+	snprintf(path, sizeof(path), "%s/lib/libfoo.so.1", tmpdir);
+	pkg_free(analyse(NULL, NULL, NULL, (const char *[]){ path, NULL },
+	    (const char *[]){ path, NULL }));
+}
+END_TEST
+
+START_TEST(elf_autodeps)
+{
+	struct pkgdb *db = NULL;
+	struct pkg *pkg;
+	struct pkg_dep *dep = NULL;
+	char sql[BUFSIZ];
+	const char *needed[] = { "libfoo.so.1", "libbar.so.1", NULL };
+	int ndeps = 0;
+
+	setup(true);
+	fail_unless(pkgdb_open(&db, PKGDB_DEFAULT) == EPKG_OK);
+
+	/* lib/libfoo.so.1 is installed by foo, nothing owns lib/libbar.so.1 */
+	snprintf(sql, sizeof(sql),
+	    "INSERT INTO packages (origin, name, version, comment, desc, "
+	    "arch, maintainer, www, prefix, flatsize, automatic, "
+	    "licenselogic, time) "
+	    "VALUES ('devel/foo', 'foo', '1.0', 'comment', 'description', "
+	    "'freebsd:9:x86:64', 'ports@FreeBSD.org', 'http://www.FreeBSD.org', "
+	    "'/usr/local', 1024, 0, 1, 0);"
+	    "INSERT INTO files (path, sha256, package_id) "
+	    "VALUES ('%s/lib/libfoo.so.1', '-', 1);", tmpdir);
+	fail_unless(sqlite3_exec(db->sqlite, sql, NULL, NULL, NULL) ==
+	    SQLITE_OK);
+
+	pkg = analyse(db, NULL, "$ORIGIN/../lib", needed, needed);
+	while (pkg_deps(pkg, &dep) == EPKG_OK) {
+		fail_unless(strcmp(pkg_dep_get(dep, PKG_DEP_ORIGIN),
+		    "devel/foo") == 0);
+		fail_unless(strcmp(pkg_dep_get(dep, PKG_DEP_NAME), "foo") == 0);
+		fail_unless(strcmp(pkg_dep_get(dep, PKG_DEP_VERSION),
+		    "1.0") == 0);
+		ndeps++;
+	}
+	fail_unless(ndeps == 1);
+	pkg_free(pkg);
+
+	pkgdb_close(db);
+}
+END_TEST
+
+START_TEST(elf_soname)
+{
+	struct pkg *pkg = NULL;
+	struct pkg_shlib *shlib = NULL;
+	char path[MAXPATHLEN];
+	const char *provided[] = { "libfoo.so.1", "libbar.so.1", NULL };
+	int i = 0;
+
+	setup(false);
+	fail_unless(pkg_new(&pkg, PKG_FILE) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/lib/libfoo.so.1", tmpdir);
+	fail_unless(pkg_addfile(pkg, path, NULL, false) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/lib/libbar.so.1", tmpdir);
+	fail_unless(pkg_addfile(pkg, path, NULL, false) == EPKG_OK);
+	snprintf(path, sizeof(path), "%s/bin/prog", tmpdir);
+	elf_write_object(path, ELF_MACHINE, NULL, NULL, NULL, NULL);
+	fail_unless(pkg_addfile(pkg, path, NULL, false) == EPKG_OK);
+	fail_unless(pkg_analyse_files(NULL, pkg) == EPKG_OK);
+
+	/* the DT_SONAME of the objects, in the order of the files */
+	while (pkg_shlibs_provided(pkg, &shlib) == EPKG_OK) {
+		fail_unless(provided[i] != NULL);
+		fail_unless(strcmp(pkg_shlib_name(shlib), provided[i]) == 0);
+		i++;
+	}
+	fail_unless(provided[i] == NULL);
+
+	/* libfoo.so.1 requires libbar.so.1, found with its RPATH */
+	fail_unless(pkg_shlibs(pkg, &shlib) == EPKG_OK);
+	fail_unless(strcmp(pkg_shlib_name(shlib), "libbar.so.1") == 0);
+	fail_unless(pkg_shlibs(pkg, &shlib) == EPKG_END);
+
+	pkg_free(pkg);
+}
+END_TEST
+
+TCase *
+tcase_elf(void)
+{
+	TCase *tc = tcase_create("ELF");
+
+	tcase_add_checked_fixture(tc, NULL, teardown);
+
+	tcase_add_test(tc, elf_rpath);
+	tcase_add_test(tc, elf_runpath);
+	tcase_add_test(tc, elf_ld_library_path);
+	tcase_add_test(tc, elf_machine);
+	tcase_add_test(tc, elf_autodeps);
+	tcase_add_test(tc, elf_soname);
+
+	return (tc);
+}
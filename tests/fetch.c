@@ -0,0 +1,242 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <check.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pkg.h>
+#include <private/pkg.h>
+
+#include "tests.h"
+
+#define PAYLOAD_SIZE (3 * 65536)
+
+static char payload[PAYLOAD_SIZE];
+
+/*
+ * Minimal HTTP server answering nconn requests with the payload.  The first
+ * answer is cut after cut bytes to simulate a dropped connection, range
+ * requests get a 206.  The exit status is the number of range requests seen.
+ */
+static pid_t
+http_server(int *port, int nconn, off_t cut)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	char req[4096];
+	char hdr[256];
+	char *p;
+	off_t start, end;
+	ssize_t r;
+	size_t reqlen;
+	int s, c, i;
+	int nrange = 0;
+	pid_t pid;
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	fail_unless(s != -1);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = 0;
+	fail_unless(bind(s, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+	fail_unless(getsockname(s, (struct sockaddr *)&sin, &len) == 0);
+	fail_unless(listen(s, 5) == 0);
+	*port = ntohs(sin.sin_port);
+
+	if ((pid = fork()) != 0) {
+		close(s);
+		return (pid);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < nconn; i++) {
+		if ((c = accept(s, NULL, NULL)) == -1)
+			_exit(255);
+
+		reqlen = 0;
+		req[0] = '\0';
+		while (strstr(req, "\r\n\r\n") == NULL &&
+		    reqlen < sizeof(req) - 1) {
+			if ((r = read(c, req + reqlen,
+			    sizeof(req) - 1 - reqlen)) <= 0)
+				break;
+			reqlen += r;
+			req[reqlen] = '\0';
+		}
+
+		start = 0;
+		if ((p = strstr(req, "Range: bytes=")) != NULL) {
+			start = strtoll(p + strlen("Range: bytes="), NULL, 10);
+			nrange++;
+		}
+		end = PAYLOAD_SIZE;
+		if (i == 0 && cut > 0)
+			end = cut;
+
+		if (start > 0)
+			snprintf(hdr, sizeof(hdr), "HTTP/1.1 206 Partial Content\r\n"
+			    "Content-Length: %jd\r\n"
+			    "Content-Range: bytes %jd-%jd/%jd\r\n"
+			    "Connection: close\r\n\r\n",
+			    (intmax_t)(PAYLOAD_SIZE - start), (intmax_t)start,
+			    (intmax_t)(PAYLOAD_SIZE - 1), (intmax_t)PAYLOAD_SIZE);
+		else
+			snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+			    "Content-Length: %jd\r\n"
+			    "Connection: close\r\n\r\n", (intmax_t)PAYLOAD_SIZE);
+
+		write(c, hdr, strlen(hdr));
+		if (end > start)
+			write(c, payload + start, end - start);
+		close(c);
+	}
+	close(s);
+	_exit(nrange);
+}
+
+static int
+server_wait(pid_t pid)
+{
+	int status;
+
+	fail_unless(waitpid(pid, &status, 0) == pid);
+	fail_unless(WIFEXITED(status));
+
+	return (WEXITSTATUS(status));
+}
+
+static void
+check_payload(const char *path)
+{
+	char buf[PAYLOAD_SIZE];
+	struct stat st;
+	int fd;
+
+	fail_unless(stat(path, &st) == 0);
+	fail_unless(st.st_size == PAYLOAD_SIZE);
+	fail_unless((fd = open(path, O_RDONLY)) != -1);
+	fail_unless(read(fd, buf, sizeof(buf)) == PAYLOAD_SIZE);
+	close(fd);
+	fail_unless(memcmp(buf, payload, PAYLOAD_SIZE) == 0);
+}
+
+static void
+setup(char *path, size_t len)
+{
+	int fd;
+	int i;
+
+	for (i = 0; i < PAYLOAD_SIZE; i++)
+		payload[i] = (i * 7) % 251;
+
+	strlcpy(path, "/tmp/pkg_fetch.XXXXXX", len);
+	fail_unless((fd = mkstemp(path)) != -1);
+	close(fd);
+	unlink(path);
+}
+
+START_TEST(fetch_resume_dropped)
+{
+	char path[MAXPATHLEN];
+	char url[MAXPATHLEN];
+	int port;
+	pid_t pid;
+
+	setup(path, sizeof(path));
+
+	/* the connection drops midway, the fetch reconnects with a range */
+	pid = http_server(&port, 2, PAYLOAD_SIZE / 2);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/foo.txz", port);
+	fail_unless(pkg_fetch_file2(url, path, 0, true, NULL, NULL) == EPKG_OK);
+	fail_unless(server_wait(pid) == 1);
+	check_payload(path);
+
+	unlink(path);
+}
+END_TEST
+
+START_TEST(fetch_resume_partial)
+{
+	char path[MAXPATHLEN];
+	char url[MAXPATHLEN];
+	char cksum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char expected[SHA256_DIGEST_LENGTH * 2 + 1];
+	struct pkg_digest digest;
+	struct stat st;
+	int port;
+	pid_t pid;
+
+	setup(path, sizeof(path));
+
+	/* the server goes away midway, what was received is kept */
+	pid = http_server(&port, 1, PAYLOAD_SIZE / 3);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/foo.txz", port);
+	fail_unless(pkg_fetch_file2(url, path, 0, true, NULL, NULL) == EPKG_FATAL);
+	fail_unless(server_wait(pid) == 0);
+	fail_unless(stat(path, &st) == 0);
+	fail_unless(st.st_size == PAYLOAD_SIZE / 3);
+
+	/*
+	 * a later fetch only asks for the missing bytes, the digest still
+	 * covers the whole file
+	 */
+	pkg_digest_init(&digest);
+	pid = http_server(&port, 1, 0);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/foo.txz", port);
+	fail_unless(pkg_fetch_file2(url, path, 0, true, NULL, &digest) ==
+	    EPKG_OK);
+	fail_unless(server_wait(pid) == 1);
+	check_payload(path);
+	pkg_digest_final(&digest, cksum);
+	fail_unless(digest.manifest == NULL);
+	pkg_digest_free(&digest);
+	fail_unless(sha256_file(path, expected) == EPKG_OK);
+	fail_unless(strcmp(cksum, expected) == 0);
+
+	unlink(path);
+}
+END_TEST
+
+START_TEST(fetch_no_resume)
+{
+	char path[MAXPATHLEN];
+	char url[MAXPATHLEN];
+	int port;
+	pid_t pid;
+
+	setup(path, sizeof(path));
+
+	/* without resume a truncated download is removed */
+	pid = http_server(&port, 1, PAYLOAD_SIZE / 2);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/foo.txz", port);
+	fail_unless(pkg_fetch_file2(url, path, 0, false, NULL, NULL) == EPKG_FATAL);
+	fail_unless(server_wait(pid) == 0);
+	fail_unless(access(path, F_OK) == -1);
+}
+END_TEST
+
+TCase *
+tcase_fetch(void)
+{
+	TCase *tc = tcase_create("Fetch");
+
+	/* each failed connection attempt sleeps for a second */
+	tcase_set_timeout(tc, 30);
+	tcase_add_test(tc, fetch_resume_dropped);
+	tcase_add_test(tc, fetch_resume_partial);
+	tcase_add_test(tc, fetch_no_resume);
+
+	return (tc);
+}
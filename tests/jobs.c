@@ -0,0 +1,223 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <check.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include <pkg.h>
+#include <private/pkg.h>
+
+#include "tests.h"
+
+#define JOBS_NPKGS 50
+#define JOBS_NFILES 20
+
+static char tmpdir[MAXPATHLEN];
+
+/*
+ * Package i of the repositories written by jobs_write_repo() depends on
+ * i - 1, i / 2 and i / 3.
+ */
+int
+jobs_repo_deps(int i, int deps[3])
+{
+	int n = 0;
+
+	if (i >= 1)
+		deps[n++] = i - 1;
+	if (i / 2 != i - 1 && i / 2 != i)
+		deps[n++] = i / 2;
+	if (i / 3 != i - 1 && i / 3 != i / 2 && i / 3 != i)
+		deps[n++] = i / 3;
+
+	return (n);
+}
+
+/*
+ * Write the repository dir/repo.sqlite of the packages test/pkg0 to
+ * test/pkg<npkgs - 1>, opened by pkgdb_open(PKGDB_REMOTE) with dir as
+ * PKG_DBDIR.
+ */
+void
+jobs_write_repo(const char *dir, int npkgs)
+{
+	sqlite3 *repo;
+	sqlite3_stmt *pkgstmt, *depstmt;
+	char path[MAXPATHLEN];
+	char origin[64];
+	int deps[3];
+	int i, k, n;
+
+	snprintf(path, sizeof(path), "%s/repo.sqlite", dir);
+	fail_unless(sqlite3_open(path, &repo) == SQLITE_OK);
+	fail_unless(sqlite3_exec(repo, "BEGIN;"
+	    "CREATE TABLE packages (id INTEGER PRIMARY KEY, "
+	    "origin TEXT UNIQUE, name TEXT, version TEXT);"
+	    "CREATE TABLE deps (origin TEXT, name TEXT, version TEXT, "
+	    "package_id INTEGER REFERENCES packages(id), "
+	    "UNIQUE(package_id, origin));", NULL, NULL, NULL) == SQLITE_OK);
+	fail_unless(sqlite3_prepare_v2(repo, "INSERT INTO packages "
+	    "(id, origin, name, version) VALUES (?1, ?2, ?2, '1.0')", -1,
+	    &pkgstmt, NULL) == SQLITE_OK);
+	fail_unless(sqlite3_prepare_v2(repo, "INSERT INTO deps "
+	    "(origin, name, version, package_id) VALUES (?1, ?1, '1.0', ?2)",
+	    -1, &depstmt, NULL) == SQLITE_OK);
+	for (i = 0; i < npkgs; i++) {
+		snprintf(origin, sizeof(origin), "test/pkg%d", i);
+		sqlite3_bind_int(pkgstmt, 1, i + 1);
+		sqlite3_bind_text(pkgstmt, 2, origin, -1, SQLITE_TRANSIENT);
+		fail_unless(sqlite3_step(pkgstmt) == SQLITE_DONE);
+		sqlite3_reset(pkgstmt);
+
+		n = jobs_repo_deps(i, deps);
+		for (k = 0; k < n; k++) {
+			snprintf(origin, sizeof(origin), "test/pkg%d", deps[k]);
+			sqlite3_bind_text(depstmt, 1, origin, -1,
+			    SQLITE_TRANSIENT);
+			sqlite3_bind_int(depstmt, 2, i + 1);
+			fail_unless(sqlite3_step(depstmt) == SQLITE_DONE);
+			sqlite3_reset(depstmt);
+		}
+	}
+	sqlite3_finalize(pkgstmt);
+	sqlite3_finalize(depstmt);
+	fail_unless(sqlite3_exec(repo, "COMMIT", NULL, NULL, NULL) ==
+	    SQLITE_OK);
+	sqlite3_close(repo);
+}
+
+/* Remove the databases of dir, closed by the caller, and dir itself */
+void
+jobs_remove_db(const char *dir)
+{
+	const char *files[] = { "local.sqlite", "local.sqlite-wal",
+	    "local.sqlite-shm", "local.sqlite.lock", "repo.sqlite", NULL };
+	char path[MAXPATHLEN];
+	int i;
+
+	for (i = 0; files[i] != NULL; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+		unlink(path);
+	}
+	rmdir(dir);
+}
+
+START_TEST(jobs_resolv)
+{
+	struct pkgdb *db = NULL;
+	struct pkg_jobs *jobs;
+	struct pkg *pkg;
+	const char *origin;
+	char buf[64];
+	int pos[JOBS_NPKGS];
+	int deps[3];
+	int i, k, n;
+
+	strlcpy(tmpdir, "/tmp/pkg_jobs.XXXXXX", sizeof(tmpdir));
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	setenv("PKG_DBDIR", tmpdir, 1);
+	fail_unless(pkg_init("/nonexistent") == EPKG_OK);
+	jobs_write_repo(tmpdir, JOBS_NPKGS);
+	fail_unless(pkgdb_open(&db, PKGDB_REMOTE) == EPKG_OK);
+
+	/* added in the reverse order of the dependencies */
+	fail_unless(pkg_jobs_new(&jobs, PKG_JOBS_INSTALL, db) == EPKG_OK);
+	for (i = JOBS_NPKGS - 1; i >= 0; i--) {
+		pkg = NULL;
+		fail_unless(pkg_new(&pkg, PKG_REMOTE) == EPKG_OK);
+		snprintf(buf, sizeof(buf), "test/pkg%d", i);
+		pkg_set(pkg, PKG_ORIGIN, buf, PKG_REPONAME, "remote");
+		pkg_jobs_add(jobs, pkg);
+	}
+
+	/* already ordered when listed, before being applied */
+	memset(pos, 0, sizeof(pos));
+	pkg = NULL;
+	n = 0;
+	while (pkg_jobs(jobs, &pkg) == EPKG_OK) {
+		pkg_get(pkg, PKG_ORIGIN, &origin);
+		pos[strtol(origin + strlen("test/pkg"), NULL, 10)] = ++n;
+	}
+	fail_unless(n == JOBS_NPKGS);
+	for (i = 0; i < JOBS_NPKGS; i++) {
+		n = jobs_repo_deps(i, deps);
+		for (k = 0; k < n; k++)
+			fail_unless(pos[deps[k]] < pos[i]);
+	}
+
+	pkg_jobs_free(jobs);
+	pkgdb_close(db);
+	jobs_remove_db(tmpdir);
+}
+END_TEST
+
+/* Files first to first + nfiles - 1 of tmpdir, created when create is set */
+static struct pkg *
+jobs_pkg_files(int first, int nfiles, bool create)
+{
+	struct pkg *pkg = NULL;
+	char path[MAXPATHLEN];
+	int fd, i;
+
+	fail_unless(pkg_new(&pkg, PKG_FILE) == EPKG_OK);
+	for (i = first; i < first + nfiles; i++) {
+		snprintf(path, sizeof(path), "%s/file%d", tmpdir, i);
+		fail_unless(pkg_addfile(pkg, path, NULL, false) == EPKG_OK);
+		if (!create)
+			continue;
+		fail_unless((fd = open(path, O_WRONLY|O_CREAT, 0644)) != -1);
+		close(fd);
+	}
+
+	return (pkg);
+}
+
+START_TEST(jobs_keep_files)
+{
+	struct pkg_jobs_paths paths;
+	struct pkg *oldpkg, *newpkg;
+	char path[MAXPATHLEN];
+	int i;
+
+	strlcpy(tmpdir, "/tmp/pkg_jobs.XXXXXX", sizeof(tmpdir));
+	fail_unless(mkdtemp(tmpdir) != NULL);
+
+	/* the second half of the old files is also in the new version */
+	oldpkg = jobs_pkg_files(0, JOBS_NFILES, true);
+	newpkg = jobs_pkg_files(JOBS_NFILES / 2, JOBS_NFILES, false);
+
+	memset(&paths, 0, sizeof(paths));
+	fail_unless(pkg_jobs_paths_index(&paths, newpkg) == EPKG_OK);
+	fail_unless(pkg_jobs_keep_files_to_del(oldpkg, &paths) == EPKG_OK);
+	pkg_jobs_paths_free(&paths);
+
+	/* only the files the new version does not have are removed */
+	pkg_delete_files(oldpkg, 1);
+	for (i = 0; i < JOBS_NFILES; i++) {
+		snprintf(path, sizeof(path), "%s/file%d", tmpdir, i);
+		fail_unless((access(path, F_OK) == 0) == (i >= JOBS_NFILES / 2));
+		unlink(path);
+	}
+	rmdir(tmpdir);
+
+	pkg_free(oldpkg);
+	pkg_free(newpkg);
+}
+END_TEST
+
+TCase *
+tcase_jobs(void)
+{
+	TCase *tc = tcase_create("Jobs");
+
+	tcase_add_test(tc, jobs_resolv);
+	tcase_add_test(tc, jobs_keep_files);
+
+	return (tc);
+}
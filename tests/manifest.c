@@ -25,6 +25,17 @@ char manifest[] = ""
 	"files:\n"
 	"  /usr/local/bin/foo: 01ba4719c80b6fe911b091a7c05124b64eeece964e09c058ef8f9805daca546b\n";
 
+char files_manifest[] = ""
+	"name: foobar\n"
+	"version: 0.3\n"
+	"origin: foo/bar\n"
+	"files:\n"
+	"  /usr/local/bin/foo: 01ba4719c80b6fe911b091a7c05124b64eeece964e09c058ef8f9805daca546b\n"
+	"  /usr/local/etc/foo.conf: {uname: root, gname: wheel, perm: 0644}\n"
+	"  /usr/local/bin/foo: '-'\n" /* duplicates are ignored */
+	"directories:\n"
+	"  /usr/local/etc/foo/: y\n";
+
 /* Name empty */
 char wrong_manifest1[] = ""
 	"name:\n"
@@ -184,6 +195,37 @@ START_TEST(parse_manifest)
 }
 END_TEST
 
+START_TEST(parse_manifest_files)
+{
+	struct pkg *p = NULL;
+	struct pkg_file *file = NULL;
+	struct pkg_dir *dir = NULL;
+
+	fail_unless(pkg_new(&p, PKG_FILE) == EPKG_OK);
+	fail_unless(pkg_parse_manifest(p, files_manifest) == EPKG_OK);
+
+	fail_unless(pkg_files(p, &file) == EPKG_OK);
+	fail_unless(strcmp(pkg_file_get(file, PKG_FILE_PATH),
+	    "/usr/local/bin/foo") == 0);
+	fail_unless(strcmp(pkg_file_get(file, PKG_FILE_SUM),
+				"01ba4719c80b6fe911b091a7c05124b64eeece964e09c058ef8f9805daca546b")
+				== 0);
+	fail_unless(pkg_files(p, &file) == EPKG_OK);
+	fail_unless(strcmp(pkg_file_get(file, PKG_FILE_PATH),
+	    "/usr/local/etc/foo.conf") == 0);
+	fail_unless(strcmp(pkg_file_get(file, PKG_FILE_UNAME), "root") == 0);
+	fail_unless(strcmp(pkg_file_get(file, PKG_FILE_GNAME), "wheel") == 0);
+	fail_unless(pkg_files(p, &file) == EPKG_END);
+
+	fail_unless(pkg_dirs(p, &dir) == EPKG_OK);
+	fail_unless(strcmp(pkg_dir_path(dir), "/usr/local/etc/foo/") == 0);
+	fail_unless(pkg_dir_try(dir));
+	fail_unless(pkg_dirs(p, &dir) == EPKG_END);
+
+	pkg_free(p);
+}
+END_TEST
+
 START_TEST(parse_wrong_manifest1)
 {
 	struct pkg *p = NULL;
@@ -225,6 +267,7 @@ tcase_manifest(void)
 {
 	TCase *tc = tcase_create("Manifest");
 	tcase_add_test(tc, parse_manifest);
+	tcase_add_test(tc, parse_manifest_files);
 #if 0
 	tcase_add_test(tc, parse_wrong_manifest1);
 	tcase_add_test(tc, parse_wrong_manifest2);
@@ -0,0 +1,209 @@
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <check.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pkg.h>
+#include <private/pkg.h>
+
+#include "tests.h"
+
+static char tmpdir[MAXPATHLEN];
+
+static void
+write_file(const char *name, size_t size)
+{
+	char path[MAXPATHLEN];
+	char buf[BUFSIZ];
+	size_t i;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", tmpdir, name);
+	fail_unless((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) != -1);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = (i * 13) % 251;
+	for (; size > sizeof(buf); size -= sizeof(buf))
+		fail_unless(write(fd, buf, sizeof(buf)) == sizeof(buf));
+	fail_unless(write(fd, buf, size) == (ssize_t)size);
+	close(fd);
+}
+
+START_TEST(packing_sum)
+{
+	const char *names[] = { "big", "empty", "small", "hard", "link", NULL };
+	const char *order[] = { "+MANIFEST", "big", "empty", "small", "hard",
+	    "link", NULL };
+	char sum[SHA256_DIGEST_LENGTH * 2 + 1];
+	char expected[SHA256_DIGEST_LENGTH * 2 + 1];
+	char path[MAXPATHLEN];
+	char src[MAXPATHLEN];
+	struct packing *spool, *pack;
+	struct archive *a;
+	struct archive_entry *ae;
+	int fd, i;
+
+	strlcpy(tmpdir, "/tmp/pkg_packing.XXXXXX", sizeof(tmpdir));
+	fail_unless(mkdtemp(tmpdir) != NULL);
+	write_file("big", 3 * BUFSIZ + 7);
+	write_file("empty", 0);
+	write_file("small", 10);
+	snprintf(src, sizeof(src), "%s/small", tmpdir);
+	snprintf(path, sizeof(path), "%s/hard", tmpdir);
+	fail_unless(link(src, path) == 0);
+	snprintf(path, sizeof(path), "%s/link", tmpdir);
+	fail_unless(symlink("small", path) == 0);
+
+	/* the sums come from the bytes archived, none for the symlink */
+	snprintf(path, sizeof(path), "%s/spool.XXXXXX", tmpdir);
+	fail_unless((fd = mkstemp(path)) != -1);
+	unlink(path);
+	fail_unless(packing_init_fd(&spool, fd, TAR) == EPKG_OK);
+	for (i = 0; names[i] != NULL; i++) {
+		snprintf(src, sizeof(src), "%s/%s", tmpdir, names[i]);
+		sum[0] = '\0';
+		fail_unless(packing_append_file_sum(spool, src, names[i],
+		    NULL, NULL, 0, sum) == EPKG_OK);
+		if (strcmp(names[i], "link") == 0) {
+			fail_unless(sum[0] == '\0');
+			continue;
+		}
+		fail_unless(sha256_file(src, expected) == EPKG_OK);
+		fail_unless(strcmp(sum, expected) == 0);
+	}
+	packing_finish(spool);
+
+	/* the spool is copied after the metadata */
+	snprintf(path, sizeof(path), "%s/pkg", tmpdir);
+	fail_unless(packing_init(&pack, path, TXZ) == EPKG_OK);
+	fail_unless(packing_append_buffer(pack, "name: foo\n", "+MANIFEST",
+	    10) == EPKG_OK);
+	fail_unless(packing_append_archive(pack, fd) == EPKG_OK);
+	packing_finish(pack);
+	close(fd);
+
+	a = archive_read_new();
+	archive_read_support_compression_all(a);
+	archive_read_support_format_tar(a);
+	snprintf(path, sizeof(path), "%s/pkg.txz", tmpdir);
+	fail_unless(archive_read_open_filename(a, path, 4096) == ARCHIVE_OK);
+	for (i = 0; archive_read_next_header(a, &ae) == ARCHIVE_OK; i++) {
+		fail_unless(order[i] != NULL);
+		fail_unless(strcmp(archive_entry_pathname(ae), order[i]) == 0);
+		if (strcmp(order[i], "big") == 0)
+			fail_unless(archive_entry_size(ae) == 3 * BUFSIZ + 7);
+	}
+	fail_unless(order[i] == NULL);
+	archive_read_finish(a);
+}
+END_TEST
+
+/* The content of the entry name of the archive at path, NUL terminated */
+static size_t
+read_entry(const char *path, const char *name, char *buf, size_t len)
+{
+	struct archive *a;
+	struct archive_entry *ae;
+	ssize_t r = -1;
+
+	a = archive_read_new();
+	archive_read_support_compression_all(a);
+	archive_read_support_format_tar(a);
+	fail_unless(archive_read_open_filename(a, path, 4096) == ARCHIVE_OK);
+	while (archive_read_next_header(a, &ae) == ARCHIVE_OK) {
+		if (strcmp(archive_entry_pathname(ae), name) == 0) {
+			r = archive_read_data(a, buf, len - 1);
+			break;
+		}
+	}
+	archive_read_finish(a);
+	fail_unless(r >= 0);
+	buf[r] = '\0';
+
+	return (r);
+}
+
+/* Archive the manifests of pkg, return the files offset of the compact one */
+static int64_t
+compact_files_offset(struct pkg *pkg, char *manifest, size_t len)
+{
+	struct packing *pack;
+	struct pkg *p = NULL;
+	char compact[BUFSIZ];
+	char path[MAXPATHLEN];
+	int64_t offset;
+	size_t clen;
+
+	snprintf(path, sizeof(path), "%s/pkg", tmpdir);
+	fail_unless(packing_init(&pack, path, TAR) == EPKG_OK);
+	fail_unless(pkg_emit_manifest_packing(pkg, pack, "+MANIFEST",
+	    "+COMPACT_MANIFEST") == EPKG_OK);
+	packing_finish(pack);
+
+	snprintf(path, sizeof(path), "%s/pkg.tar", tmpdir);
+	read_entry(path, "+MANIFEST", manifest, len);
+	clen = read_entry(path, "+COMPACT_MANIFEST", compact, sizeof(compact));
+	unlink(path);
+
+	fail_unless(pkg_new(&p, PKG_FILE) == EPKG_OK);
+	fail_unless(pkg_parse_compact_manifest(p, compact, clen, &offset) ==
+	    EPKG_OK);
+	pkg_free(p);
+
+	return (offset);
+}
+
+START_TEST(packing_compact_files)
+{
+	struct pkg *pkg = NULL;
+	char manifest[BUFSIZ];
+	const char *files;
+	int64_t offset;
+
+	strlcpy(tmpdir, "/tmp/pkg_packing.XXXXXX", sizeof(tmpdir));
+	fail_unless(mkdtemp(tmpdir) != NULL);
+
+	fail_unless(pkg_new(&pkg, PKG_FILE) == EPKG_OK);
+	pkg_set(pkg, PKG_NAME, "foo", PKG_ORIGIN, "test/foo", PKG_VERSION,
+	    "1.0", PKG_COMMENT, "comment", PKG_DESC, "description",
+	    PKG_ARCH, "freebsd:9:x86:64", PKG_MAINTAINER, "test@pkgng.lan",
+	    PKG_WWW, "http://www.FreeBSD.org", PKG_PREFIX, "/usr/local");
+	fail_unless(pkg_adddir(pkg, "/usr/local/share/foo", false) == EPKG_OK);
+
+	/* no files section at all */
+	offset = compact_files_offset(pkg, manifest, sizeof(manifest));
+	fail_unless(offset == -1);
+	fail_unless(strstr(manifest, "files:") == NULL);
+
+	/* the offset is where the files section starts */
+	fail_unless(pkg_addfile(pkg, "/usr/local/share/foo/bar",
+	    "01ba4719c80b6fe911b091a7c05124b64eeece964e09c058ef8f9805daca546b",
+	    false) == EPKG_OK);
+	offset = compact_files_offset(pkg, manifest, sizeof(manifest));
+	fail_unless(offset > 0 && (size_t)offset < strlen(manifest));
+	files = strstr(manifest, "files:");
+	fail_unless(files != NULL);
+	fail_unless(files == manifest + offset + strspn(manifest + offset,
+	    "\n"));
+
+	pkg_free(pkg);
+	rmdir(tmpdir);
+}
+END_TEST
+
+TCase *
+tcase_packing(void)
+{
+	TCase *tc = tcase_create("Packing");
+
+	tcase_add_test(tc, packing_sum);
+	tcase_add_test(tc, packing_compact_files);
+
+	return (tc);
+}
@@ -8,8 +8,14 @@ main()
 	int nfailed = 0;
 	Suite *s = suite_create("pkgng");
 
+	suite_add_tcase(s, tcase_add());
+	suite_add_tcase(s, tcase_elf());
+	suite_add_tcase(s, tcase_fetch());
+	suite_add_tcase(s, tcase_jobs());
 	suite_add_tcase(s, tcase_manifest());
+	suite_add_tcase(s, tcase_packing());
 	suite_add_tcase(s, tcase_pkg());
+	suite_add_tcase(s, tcase_utils());
 
 	/* Run the tests ...*/
 	SRunner *sr = srunner_create(s);
@@ -1,4 +1,16 @@
 #include <check.h>
 
+TCase * tcase_add(void);
+TCase * tcase_elf(void);
+TCase * tcase_fetch(void);
+TCase * tcase_jobs(void);
 TCase * tcase_manifest(void);
+TCase * tcase_packing(void);
 TCase * tcase_pkg(void);
+TCase * tcase_utils(void);
+
+void elf_write_object(const char *, int, const char *, const char *,
+    const char *, const char **);
+int jobs_repo_deps(int, int[3]);
+void jobs_write_repo(const char *, int);
+void jobs_remove_db(const char *);
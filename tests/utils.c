@@ -0,0 +1,94 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <pkg.h>
+#include <private/utils.h>
+
+#include "tests.h"
+
+#define STRSET_NKEYS 1000
+
+static char keys[STRSET_NKEYS][16];
+
+START_TEST(strset_grow)
+{
+	struct strset set;
+	struct strset_entry *e;
+	int i;
+
+	memset(&set, 0, sizeof(set));
+	fail_unless(strset_get(&set, "missing") == NULL);
+
+	/* well past the load factor of the first tables */
+	for (i = 0; i < STRSET_NKEYS; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+		fail_unless(strset_add(&set, keys[i], &keys[i], &e) ==
+		    EPKG_OK);
+		fail_unless(e->data == &keys[i]);
+	}
+	fail_unless(set.len == STRSET_NKEYS);
+	fail_unless(set.nslots >= 2 * STRSET_NKEYS);
+
+	for (i = 0; i < STRSET_NKEYS; i++) {
+		fail_unless((e = strset_get(&set, keys[i])) != NULL);
+		fail_unless(strcmp(e->key, keys[i]) == 0);
+		fail_unless(e->data == &keys[i]);
+	}
+
+	strset_free(&set);
+}
+END_TEST
+
+START_TEST(strset_duplicate)
+{
+	struct strset set;
+	struct strset_entry *e;
+	char dup[16];
+	int data1, data2;
+
+	memset(&set, 0, sizeof(set));
+	fail_unless(strset_add(&set, "foo", &data1, NULL) == EPKG_OK);
+
+	/* the existing entry is kept, compared by content */
+	strlcpy(dup, "foo", sizeof(dup));
+	fail_unless(strset_add(&set, dup, &data2, &e) == EPKG_END);
+	fail_unless(e->data == &data1);
+	fail_unless(set.len == 1);
+	fail_unless(strset_get(&set, "foo")->data == &data1);
+
+	strset_free(&set);
+}
+END_TEST
+
+START_TEST(strset_missing)
+{
+	struct strset set;
+	int i;
+
+	memset(&set, 0, sizeof(set));
+	for (i = 0; i < STRSET_NKEYS; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+		fail_unless(strset_add(&set, keys[i], NULL, NULL) == EPKG_OK);
+	}
+
+	fail_unless(strset_get(&set, "") == NULL);
+	fail_unless(strset_get(&set, "key") == NULL);
+	fail_unless(strset_get(&set, "key1000") == NULL);
+	fail_unless(strset_get(&set, "key-1") == NULL);
+
+	strset_free(&set);
+}
+END_TEST
+
+TCase *
+tcase_utils(void)
+{
+	TCase *tc = tcase_create("Utils");
+
+	tcase_add_test(tc, strset_grow);
+	tcase_add_test(tc, strset_duplicate);
+	tcase_add_test(tc, strset_missing);
+
+	return (tc);
+}